@@ -1,10 +1,20 @@
 #ifndef DARTS_H_
 #define DARTS_H_
 
+#include <algorithm>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <exception>
 #include <new>
 
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif  // !defined(_WIN32)
+
 #define DARTS_VERSION "0.32"
 
 // DARTS_THROW() throws a <Darts::Exception> whose message starts with the
@@ -18,6 +28,38 @@
 #define DARTS_THROW(msg) throw Darts::Details::Exception( \
   __FILE__ ":" DARTS_LINE_STR ": exception: " msg)
 
+// DARTS_PREFETCH() asks the processor to load the cache line that contains
+// the given address. It is used to overlap cache misses of independent
+// searches, and it is just ignored if the compiler does not support it.
+#if defined(__GNUC__)
+#define DARTS_PREFETCH(ptr) __builtin_prefetch(ptr)
+#elif defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+#include <xmmintrin.h>
+#define DARTS_PREFETCH(ptr) _mm_prefetch( \
+  reinterpret_cast<const char *>(ptr), _MM_HINT_T0)
+#else
+#define DARTS_PREFETCH(ptr)
+#endif
+
+// DARTS_X86_SIMD is defined if the compiler can generate SSE4.1 and AVX2
+// instructions for selected functions. Such functions are called only if the
+// processor supports the instructions.
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    ((defined(__GNUC__) && (__GNUC__ >= 5)) || defined(__clang__))
+#define DARTS_X86_SIMD
+#include <immintrin.h>
+#endif
+
+// DARTS_HAS_THREADS is defined if <thread> is available. Otherwise, build()
+// ignores `num_threads' and always builds a dictionary in a single thread,
+// and <SharedDoubleArrayImpl> is not available.
+#if (__cplusplus >= 201103L) || (defined(_MSC_VER) && (_MSC_VER >= 1900))
+#define DARTS_HAS_THREADS
+#include <atomic>
+#include <mutex>
+#include <thread>
+#endif
+
 namespace Darts {
 
 // The following namespace hides the internal types and classes.
@@ -45,11 +87,17 @@ typedef unsigned int id_type;
 // percentage, 100.0 * (the 1st argument) / (the 2nd argument).
 typedef int (*progress_func_type)(std::size_t, std::size_t);
 
-// <DoubleArrayUnit> is the type of double-array units and it is a wrapper of
-// <id_type> in practice.
-class DoubleArrayUnit {
+// <DoubleArrayUnitImpl> is the type of double-array units and it is a wrapper
+// of <id_type> in practice. An offset is kept as it is if it is less than
+// 2^21, and otherwise it must be a multiple of 2^EXTENSION_SHIFT, and then it
+// is kept without the lower bits and with the extension flag. The unit types
+// differ only in EXTENSION_SHIFT.
+template <int SHIFT>
+class DoubleArrayUnitImpl {
  public:
-  DoubleArrayUnit() : unit_() {}
+  enum { EXTENSION_SHIFT = SHIFT };
+
+  DoubleArrayUnitImpl() : unit_() {}
 
   // has_leaf() returns whether a leaf unit is immediately derived from the
   // unit (true) or not (false).
@@ -70,7 +118,7 @@ class DoubleArrayUnit {
   }
   // offset() returns the offset from the unit to its derived units.
   id_type offset() const {
-    return (unit_ >> 10) << ((unit_ & (1U << 9)) >> 6);
+    return (unit_ >> 10) << (((unit_ >> 9) & 1) * EXTENSION_SHIFT);
   }
 
  private:
@@ -79,6 +127,17 @@ class DoubleArrayUnit {
   // Copyable.
 };
 
+// <DoubleArrayUnit> keeps a large offset as a multiple of 2^8, and so an
+// offset must be less than 2^29. Because the offsets of the children of the
+// root are less than 2^29, an array of <DoubleArrayUnit>s has at most 2^29
+// units.
+typedef DoubleArrayUnitImpl<8> DoubleArrayUnit;
+
+// <LargeDoubleArrayUnit> keeps a large offset as a multiple of 2^11, and then
+// an offset can be up to 2^32 - 2^11, so an array of <LargeDoubleArrayUnit>s
+// can use all the values of <id_type>.
+typedef DoubleArrayUnitImpl<11> LargeDoubleArrayUnit;
+
 // Darts-clone throws an <Exception> for memory allocation failure, invalid
 // arguments or a too large offset. The last case means that there are too many
 // keys in the given set of keys. Note that the `msg' of <Exception> must be a
@@ -102,6 +161,357 @@ class Exception : public std::exception {
   Exception &operator=(const Exception &);
 };
 
+//
+// Checksum of dictionary files.
+//
+
+// <Checksum> computes a 32-bit hash of an array of 32-bit words in the style
+// of xxHash32. The words are split into 16 lanes which are mixed separately,
+// so the main loop can use SIMD instructions. SSE4.1 or AVX2 is used if the
+// processor supports it, and all the paths return the same hash value.
+class Checksum {
+ public:
+  enum { NUM_LANES = 16 };
+  enum { BLOCK_SIZE = sizeof(id_type) * NUM_LANES };
+
+  // compute() returns the hash value of `size' bytes starting at `ptr'.
+  // `size' must be a multiple of 4.
+  static id_type compute(const void *ptr, std::size_t size);
+
+  // init(), update() and finish() compute the same hash value as compute()
+  // piece by piece, so that a file can be hashed without reading it at once.
+  // Each piece given to update() must be a multiple of BLOCK_SIZE bytes, and
+  // the rest, which is shorter than BLOCK_SIZE bytes, is given to finish()
+  // with the total size.
+  static void init(id_type *lanes);
+  static void update(id_type *lanes, const void *ptr, std::size_t size);
+  static id_type finish(const id_type *lanes, const void *rest,
+      std::size_t total_size);
+
+ private:
+
+  static id_type prime(int id) {
+    static const id_type primes[] = {
+      2654435761U, 2246822519U, 3266489917U, 668265263U, 374761393U
+    };
+    return primes[id - 1];
+  }
+  static id_type rotate(id_type value, int shift) {
+    return (value << shift) | (value >> (32 - shift));
+  }
+
+  static void mix(id_type *lanes, const id_type *words,
+      std::size_t num_blocks);
+#ifdef DARTS_X86_SIMD
+  __attribute__((target("sse4.1")))
+  static void mix_sse41(id_type *lanes, const id_type *words,
+      std::size_t num_blocks);
+  __attribute__((target("avx2")))
+  static void mix_avx2(id_type *lanes, const id_type *words,
+      std::size_t num_blocks);
+#endif  // DARTS_X86_SIMD
+
+  // Disallows instantiation.
+  Checksum();
+};
+
+inline id_type Checksum::compute(const void *ptr, std::size_t size) {
+  std::size_t body_size = size - (size % BLOCK_SIZE);
+  id_type lanes[NUM_LANES];
+  init(lanes);
+  update(lanes, ptr, body_size);
+  return finish(lanes, static_cast<const char *>(ptr) + body_size, size);
+}
+
+inline void Checksum::init(id_type *lanes) {
+  for (int i = 0; i < NUM_LANES; ++i) {
+    lanes[i] = prime(1) + (prime(2) * i);
+  }
+}
+
+inline void Checksum::update(id_type *lanes, const void *ptr,
+    std::size_t size) {
+  const id_type *words = static_cast<const id_type *>(ptr);
+  std::size_t num_blocks = size / BLOCK_SIZE;
+
+#ifdef DARTS_X86_SIMD
+  if (__builtin_cpu_supports("avx2")) {
+    mix_avx2(lanes, words, num_blocks);
+  } else if (__builtin_cpu_supports("sse4.1")) {
+    mix_sse41(lanes, words, num_blocks);
+  } else {
+    mix(lanes, words, num_blocks);
+  }
+#else  // DARTS_X86_SIMD
+  mix(lanes, words, num_blocks);
+#endif  // DARTS_X86_SIMD
+}
+
+inline id_type Checksum::finish(const id_type *lanes, const void *rest,
+    std::size_t total_size) {
+  const id_type *words = static_cast<const id_type *>(rest);
+  std::size_t num_words = (total_size % BLOCK_SIZE) / sizeof(id_type);
+
+  id_type hash_value = prime(5) + static_cast<id_type>(total_size);
+  for (int i = 0; i < NUM_LANES; ++i) {
+    hash_value = rotate(hash_value + (lanes[i] * prime(3)), 17) * prime(4);
+  }
+  for (std::size_t i = 0; i < num_words; ++i) {
+    hash_value = rotate(hash_value + (words[i] * prime(3)), 17) * prime(4);
+  }
+
+  hash_value ^= hash_value >> 15;
+  hash_value *= prime(2);
+  hash_value ^= hash_value >> 13;
+  hash_value *= prime(3);
+  hash_value ^= hash_value >> 16;
+  return hash_value;
+}
+
+inline void Checksum::mix(id_type *lanes, const id_type *words,
+    std::size_t num_blocks) {
+  for (std::size_t i = 0; i < num_blocks; ++i, words += NUM_LANES) {
+    for (int j = 0; j < NUM_LANES; ++j) {
+      lanes[j] = rotate(lanes[j] + (words[j] * prime(2)), 13) * prime(1);
+    }
+  }
+}
+
+#ifdef DARTS_X86_SIMD
+__attribute__((target("sse4.1")))
+inline void Checksum::mix_sse41(id_type *lanes, const id_type *words,
+    std::size_t num_blocks) {
+  const __m128i prime1 = _mm_set1_epi32(static_cast<int>(prime(1)));
+  const __m128i prime2 = _mm_set1_epi32(static_cast<int>(prime(2)));
+
+  __m128i values[4];
+  for (int i = 0; i < 4; ++i) {
+    values[i] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(lanes) + i);
+  }
+  for (std::size_t i = 0; i < num_blocks; ++i, words += NUM_LANES) {
+    for (int j = 0; j < 4; ++j) {
+      __m128i value = _mm_add_epi32(values[j], _mm_mullo_epi32(
+          _mm_loadu_si128(reinterpret_cast<const __m128i *>(words) + j),
+          prime2));
+      value = _mm_or_si128(_mm_slli_epi32(value, 13),
+          _mm_srli_epi32(value, 19));
+      values[j] = _mm_mullo_epi32(value, prime1);
+    }
+  }
+  for (int i = 0; i < 4; ++i) {
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(lanes) + i, values[i]);
+  }
+}
+
+__attribute__((target("avx2")))
+inline void Checksum::mix_avx2(id_type *lanes, const id_type *words,
+    std::size_t num_blocks) {
+  const __m256i prime1 = _mm256_set1_epi32(static_cast<int>(prime(1)));
+  const __m256i prime2 = _mm256_set1_epi32(static_cast<int>(prime(2)));
+
+  __m256i values[2];
+  for (int i = 0; i < 2; ++i) {
+    values[i] = _mm256_loadu_si256(
+        reinterpret_cast<const __m256i *>(lanes) + i);
+  }
+  for (std::size_t i = 0; i < num_blocks; ++i, words += NUM_LANES) {
+    for (int j = 0; j < 2; ++j) {
+      __m256i value = _mm256_add_epi32(values[j], _mm256_mullo_epi32(
+          _mm256_loadu_si256(reinterpret_cast<const __m256i *>(words) + j),
+          prime2));
+      value = _mm256_or_si256(_mm256_slli_epi32(value, 13),
+          _mm256_srli_epi32(value, 19));
+      values[j] = _mm256_mullo_epi32(value, prime1);
+    }
+  }
+  for (int i = 0; i < 2; ++i) {
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(lanes) + i, values[i]);
+  }
+}
+#endif  // DARTS_X86_SIMD
+
+//
+// Header of dictionary files.
+//
+
+// <DoubleArrayHeader> is an optional header of dictionary files. It starts
+// with a magic string, which is compared byte by byte, and so open() can tell
+// whether a file has a header or not. A raw array of units never starts with
+// the magic string in either byte order because the label of the root, the
+// lowest byte of the first unit, is always 0. It is the 1st byte on a
+// little-endian host and the 4th byte on a big-endian host, while none of
+// the first 4 bytes of the magic string is 0. The header consists of the
+// following 32-bit words:
+//
+//  0-1:   magic string "DARTSCL\0"
+//  2:     byte order mark (0x01020304 in the byte order of the writer)
+//  3:     format version
+//  4:     header size in bytes
+//  5:     unit size in bytes
+//  6:     value size in bytes
+//  7:     flags (a combination of HAS_VALUE_TABLE and HAS_LARGE_UNITS)
+//  8-9:   number of units (lower and upper 32 bits)
+//  10-11: number of keys (lower and upper 32 bits)
+//  12:    checksum of the body (see <Checksum>)
+//  13:    checksum of the value table, or 0 if there is no value table
+//  14-15: reserved, must be 0
+//
+// The body, an array of units, follows the header. If HAS_VALUE_TABLE is
+// set, the body is followed by a value table, which has a value per key, and
+// word 6 gives the size of each value in the table. HAS_LARGE_UNITS means
+// that the units are <LargeDoubleArrayUnit>s.
+class DoubleArrayHeader {
+ public:
+  enum { NUM_WORDS = 16 };
+  enum { FORMAT_VERSION = 1 };
+  enum { HAS_VALUE_TABLE = 1 };
+  enum { HAS_LARGE_UNITS = 2 };
+
+  DoubleArrayHeader() {
+    for (int i = 0; i < NUM_WORDS; ++i) {
+      words_[i] = 0;
+    }
+  }
+
+  // init() sets the fields. `value_size' is the size of each value in the
+  // value table, and it is used only if `flags' has HAS_VALUE_TABLE.
+  void init(std::size_t num_units, std::size_t num_keys, id_type checksum,
+      id_type flags = 0, std::size_t value_size = 0,
+      id_type value_checksum = 0) {
+    std::memcpy(words_, magic(), 8);
+    words_[2] = 0x01020304;
+    words_[3] = FORMAT_VERSION;
+    words_[4] = static_cast<id_type>(size());
+    words_[5] = sizeof(DoubleArrayUnit);
+    words_[6] = static_cast<id_type>(
+        (flags & HAS_VALUE_TABLE) ? value_size : sizeof(value_type));
+    words_[7] = flags;
+    set_size_pair(8, num_units);
+    set_size_pair(10, num_keys);
+    words_[12] = checksum;
+    words_[13] = (flags & HAS_VALUE_TABLE) ? value_checksum : 0;
+    for (int i = 14; i < NUM_WORDS; ++i) {
+      words_[i] = 0;
+    }
+  }
+
+  // has_magic() returns true iff `ptr' starts with the magic string. `ptr'
+  // must point to at least size() bytes.
+  static bool has_magic(const void *ptr) {
+    return std::memcmp(ptr, magic(), 8) == 0;
+  }
+
+  // is_valid() tests the fields except the checksums. `flags' and
+  // `value_size' work as well as in init(), so a file is valid only for a
+  // dictionary of the same format.
+  bool is_valid(id_type flags = 0, std::size_t value_size = 0) const {
+    if (!has_magic(words_) || words_[2] != 0x01020304 ||
+        words_[3] != FORMAT_VERSION || words_[4] != size() ||
+        words_[5] != sizeof(DoubleArrayUnit) || words_[7] != flags) {
+      return false;
+    }
+    if (flags & HAS_VALUE_TABLE) {
+      if (words_[6] != value_size) {
+        return false;
+      }
+    } else if (words_[6] != sizeof(value_type) || words_[13] != 0) {
+      return false;
+    }
+    if (sizeof(std::size_t) < 8 && (words_[9] != 0 || words_[11] != 0)) {
+      return false;
+    }
+    for (int i = 14; i < NUM_WORDS; ++i) {
+      if (words_[i] != 0) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  std::size_t num_units() const {
+    return get_size_pair(8);
+  }
+  std::size_t num_keys() const {
+    return get_size_pair(10);
+  }
+  id_type checksum() const {
+    return words_[12];
+  }
+  id_type value_checksum() const {
+    return words_[13];
+  }
+
+  void *data() {
+    return words_;
+  }
+  const void *data() const {
+    return words_;
+  }
+  static std::size_t size() {
+    return sizeof(id_type) * NUM_WORDS;
+  }
+
+ private:
+  id_type words_[NUM_WORDS];
+
+  // Copyable.
+
+  static const char *magic() {
+    return "DARTSCL";
+  }
+
+  void set_size_pair(int id, std::size_t value) {
+    words_[id] = static_cast<id_type>(value);
+    words_[id + 1] = static_cast<id_type>((value >> 16) >> 16);
+  }
+  std::size_t get_size_pair(int id) const {
+    std::size_t upper = words_[id + 1];
+    return words_[id] | ((upper << 16) << 16);
+  }
+};
+
+}  // namespace Details
+
+// <LargeUnits> is given to <DoubleArrayImpl> as the 2nd template argument in
+// order to use <LargeDoubleArrayUnit>s for dictionaries of more than 2^29
+// units.
+class LargeUnits {};
+
+// <WideValues> is given to <DoubleArrayImpl> as the 4th template argument in
+// order to keep values of the 3rd template argument as they are.
+class WideValues {};
+
+namespace Details {
+
+// <ValueTraits> tells whether a dictionary keeps its values in a value table
+// instead of its leaf units.
+template <typename C>
+class ValueTraits {
+ public:
+  enum { HAS_VALUE_TABLE = 0 };
+};
+
+template <>
+class ValueTraits<WideValues> {
+ public:
+  enum { HAS_VALUE_TABLE = 1 };
+};
+
+// <UnitTraits> gives the type of units.
+template <typename B>
+class UnitTraits {
+ public:
+  typedef DoubleArrayUnit unit_type;
+  enum { HAS_LARGE_UNITS = 0 };
+};
+
+template <>
+class UnitTraits<LargeUnits> {
+ public:
+  typedef LargeDoubleArrayUnit unit_type;
+  enum { HAS_LARGE_UNITS = 1 };
+};
+
 }  // namespace Details
 
 // <DoubleArrayImpl> is the interface of Darts-clone. Note that other
@@ -113,12 +523,25 @@ class Exception : public std::exception {
 // In build(), given values are casted from <T> to <Darts::Details::value_type>
 // by using static_cast. On the other hand, values are casted from
 // <Darts::Details::value_type> to <T> in searching dictionaries.
-template <typename, typename, typename T, typename>
+//
+// If the 4th template argument is <WideValues>, values are kept as <T>s in a
+// value table which follows the array of units, and each leaf unit keeps the
+// ID of its key, that is the index of the key in build(), instead of a value.
+// So, <T> can be a 64-bit integer type, and a search reads the value table
+// only once per matched key. Traversals are not changed. Such a dictionary
+// is always built as a trie, not a DAWG, because leaf units cannot be shared.
+//
+// If the 2nd template argument is <LargeUnits>, large offsets are kept in a
+// coarser unit, so that a dictionary can have up to 2^32 units instead of
+// 2^29 units. Such a dictionary is a little larger because some offsets are
+// harder to find, and it must be saved with a header.
+template <typename, typename B, typename T, typename C>
 class DoubleArrayImpl {
  public:
   // Even if this <value_type> is changed, the internal value type is still
   // <Darts::Details::value_type>. Other types, such as 64-bit integer types
-  // and floating-point number types, should not be used.
+  // and floating-point number types, should not be used unless the 4th
+  // template argument is <WideValues>.
   typedef T value_type;
   // A key is reprenseted by a sequence of <key_type>s. For example,
   // exactMatchSearch() takes a <const key_type *>.
@@ -134,8 +557,25 @@ class DoubleArrayImpl {
     std::size_t length;
   };
 
+  // mmap() takes a combination of the following hints. MMAP_SEQUENTIAL
+  // prefaults the whole array by reading it in order, MMAP_RANDOM and
+  // MMAP_WILLNEED are passed to madvise() as MADV_RANDOM and MADV_WILLNEED
+  // respectively, and MMAP_POPULATE is passed to mmap() as MAP_POPULATE.
+  // Hints which are not supported by the system are ignored. MMAP_VERIFY
+  // tests the checksum in the file header, which requires reading the whole
+  // array.
+  enum {
+    MMAP_SEQUENTIAL = 1 << 0,
+    MMAP_RANDOM = 1 << 1,
+    MMAP_WILLNEED = 1 << 2,
+    MMAP_POPULATE = 1 << 3,
+    MMAP_VERIFY = 1 << 4
+  };
+
   // The constructor initializes member variables with 0 and NULLs.
-  DoubleArrayImpl() : size_(0), array_(NULL), buf_(NULL) {}
+  DoubleArrayImpl() : size_(0), array_(NULL), buf_(NULL),
+      map_(NULL), map_size_(0), num_keys_(0), values_(NULL),
+      values_buf_(NULL) {}
   // The destructor frees memory allocated for units and then initializes
   // member variables with 0 and NULLs.
   virtual ~DoubleArrayImpl() {
@@ -162,36 +602,62 @@ class DoubleArrayImpl {
   }
 
   // set_array() calls clear() in order to free memory allocated to the old
-  // array and then sets a new array. This function is useful to set a memory-
-  // mapped array. Note that the array set by set_array() is not freed in
-  // clear() and the destructor of <DoubleArrayImpl>.
+  // array and then sets a new array. This function is useful to set an array
+  // managed by the application. Note that the array set by set_array() is not
+  // freed in clear() and the destructor of <DoubleArrayImpl>. To map a file
+  // into memory, mmap() is more convenient.
   // set_array() can also set the size of the new array but the size is not
   // used in search methods. So it works well even if the 2nd argument is 0 or
   // omitted. Remember that size() and total_size() returns 0 in such a case.
-  void set_array(const void *ptr, std::size_t size = 0) {
+  // A dictionary with <WideValues> also needs its value table `values', which
+  // is not freed either, and `num_keys', the number of its values, which is
+  // needed only by save().
+  void set_array(const void *ptr, std::size_t size = 0,
+      const value_type *values = NULL, std::size_t num_keys = 0) {
     clear();
     array_ = static_cast<const unit_type *>(ptr);
     size_ = size;
+    num_keys_ = num_keys;
+    values_ = values;
   }
   // array() returns a pointer to the array of units.
   const void *array() const {
     return array_;
   }
+  // value_table() returns a pointer to the value table, which has num_keys()
+  // values, or NULL if the 4th template argument is not <WideValues>.
+  const value_type *value_table() const {
+    return values_;
+  }
 
-  // clear() frees memory allocated to units and then initializes member
-  // variables with 0 and NULLs. Note that clear() does not free memory if the
-  // array of units was set by set_array(). In such a case, `array_' is not
-  // NULL and `buf_' is NULL.
+  // clear() frees memory allocated to units, unmaps a file mapped by mmap()
+  // and then initializes member variables with 0 and NULLs. Note that clear()
+  // does not free memory if the array of units was set by set_array(). In
+  // such a case, `array_' is not NULL and both `buf_' and `map_' are NULL.
   void clear() {
     size_ = 0;
     array_ = NULL;
+    num_keys_ = 0;
+    values_ = NULL;
     if (buf_ != NULL) {
       delete[] buf_;
       buf_ = NULL;
     }
+    if (values_buf_ != NULL) {
+      delete[] values_buf_;
+      values_buf_ = NULL;
+    }
+    if (map_ != NULL) {
+#if !defined(_WIN32)
+      ::munmap(map_, map_size_);
+#endif  // !defined(_WIN32)
+      map_ = NULL;
+      map_size_ = 0;
+    }
   }
 
-  // unit_size() returns the size of each unit. The size must be 4 bytes.
+  // unit_size() returns the size of each unit. The size must be 4 bytes even
+  // if the 2nd template argument is <LargeUnits>.
   std::size_t unit_size() const {
     return sizeof(unit_type);
   }
@@ -199,16 +665,22 @@ class DoubleArrayImpl {
   std::size_t size() const {
     return size_;
   }
-  // total_size() returns the number of bytes allocated to the array of units.
-  // It can be 0 if set_array() is used.
+  // total_size() returns the number of bytes allocated to the array of units
+  // and the value table. It can be 0 if set_array() is used.
   std::size_t total_size() const {
-    return unit_size() * size();
+    return (unit_size() * size()) + value_table_size();
   }
   // nonzero_size() exists for compatibility. It always returns the number of
   // units because it takes long time to count the number of non-zero units.
   std::size_t nonzero_size() const {
     return size();
   }
+  // num_keys() returns the number of keys given to build(). A dictionary
+  // opened from a file keeps the number only if the file has a header, and
+  // otherwise num_keys() returns 0.
+  std::size_t num_keys() const {
+    return num_keys_;
+  }
 
   // build() constructs a dictionary from given key-value pairs. If `lengths'
   // is NULL, `keys' is handled as an array of zero-terminated strings. If
@@ -216,7 +688,8 @@ class DoubleArrayImpl {
   // the ith key has (i - 1) as its value.
   // Note that the key-value pairs must be arranged in key order and the values
   // must not be negative. Also, if there are duplicate keys, only the first
-  // pair will be stored in the resultant dictionary.
+  // pair will be stored in the resultant dictionary. A dictionary with
+  // <WideValues> keeps the values of all the keys in its value table.
   // `progress_func' is a pointer to a callback function. If it is not NULL,
   // it will be called in build() so that the caller can check the progress of
   // dictionary construction. For details, please see the definition of
@@ -227,26 +700,79 @@ class DoubleArrayImpl {
   // build() uses another construction algorithm if `values' is not NULL. In
   // this case, Darts-clone uses a Directed Acyclic Word Graph (DAWG) instead
   // of a trie because a DAWG is likely to be more compact than a trie.
+  // `num_threads' specifies the number of threads. If it is greater than 1,
+  // keys are split by their first bytes and a DAWG is built for each part
+  // concurrently, which gives the same DAWG as a single thread. Moreover, if
+  // there are at least 2^18 keys per thread, the subtrees of the root's
+  // children are arranged concurrently in separate regions of the array.
+  // Then, the array differs from that of a single thread and it is a little
+  // larger because of padding between the regions and because a DAWG cannot
+  // share subtrees across the regions.
   int build(std::size_t num_keys, const key_type * const *keys,
       const std::size_t *lengths = NULL, const value_type *values = NULL,
-      Details::progress_func_type progress_func = NULL);
+      Details::progress_func_type progress_func = NULL,
+      std::size_t num_threads = 1);
+
+  // <StreamBuilder> builds a dictionary from keys given one by one and writes
+  // it into a file, so neither the keys nor the whole array have to be kept
+  // in memory. Only a bounded number of buffered keys and the last units of
+  // the array, which are not fixed yet, are kept, and the other units are
+  // written into the file as soon as they are fixed. The keys must be given
+  // in order, and the file can be opened by open() or mmap() afterwards.
+  //
+  //   DoubleArray::StreamBuilder builder;
+  //   builder.open("dic");
+  //   while (read_key_value(&key, &value)) {
+  //     builder.insert(key, 0, value);
+  //   }
+  //   builder.close();
+  //
+  // The result is a trie as built by build() without values, so it may be
+  // larger than a DAWG built by build() with values. Also, a node which has
+  // more keys than half the buffer below it gets a whole block of units for
+  // its children, because it is arranged before all its children are known.
+  // If all the keys fit in the buffer, the array is the same as that of
+  // build(). <StreamBuilder> does not support <WideValues>.
+  class StreamBuilder;
 
   // open() reads an array of units from the specified file. And if it goes
   // well, the old array will be freed and replaced with the new array read
   // from the file. `offset' specifies the number of bytes to be skipped before
   // reading an array. `size' specifies the number of bytes to be read from the
   // file. If the `size' is 0, the whole file will be read.
+  // If the file starts with a header written by save(), open() validates the
+  // header and the checksum of the array, and then `size' may be larger than
+  // the header and the array.
   // open() returns 0 iff the operation succeeds. Otherwise, it returns a
   // non-zero value or throws a <Darts::Exception>. The exception is thrown
   // when and only when a memory allocation fails.
   int open(const char *file_name, const char *mode = "rb",
       std::size_t offset = 0, std::size_t size = 0);
+  // mmap() maps an array of units in the specified file into memory instead
+  // of reading it. `offset' and `size' work as well as in open(), but
+  // `offset' must be a multiple of unit_size(). The mapping is read-only and
+  // shared, so processes that map the same file share one copy of the array
+  // in the page cache. The mapping is owned by <DoubleArrayImpl> and it is
+  // unmapped in clear() and the destructor. `hints' is a combination of
+  // MMAP_* flags, which control how pages are loaded. If the system does not
+  // support memory-mapped files, mmap() falls back to open().
+  // mmap() returns 0 iff the operation succeeds. Otherwise, it returns a
+  // non-zero value.
+  int mmap(const char *file_name, std::size_t offset = 0,
+      std::size_t size = 0, int hints = 0);
   // save() writes the array of units into the specified file. `offset'
   // specifies the number of bytes to be skipped before writing the array.
-  // open() returns 0 iff the operation succeeds. Otherwise, it returns a
+  // If `with_header' is true, the array is preceded by a header which keeps
+  // the format version, the number of units and keys, and the checksum of
+  // the array. open() and mmap() detect and validate the header. The value
+  // table of a dictionary with <WideValues> follows the array, and such a
+  // dictionary is always saved with a header, without which open() and
+  // mmap() cannot find the value table. So is a dictionary with <LargeUnits>.
+  // A value table given to set_array() without `num_keys' cannot be saved.
+  // save() returns 0 iff the operation succeeds. Otherwise, it returns a
   // non-zero value.
   int save(const char *file_name, const char *mode = "wb",
-      std::size_t offset = 0) const;
+      std::size_t offset = 0, bool with_header = false) const;
 
   // The 1st exactMatchSearch() tests whether the given key exists or not, and
   // if it exists, its value and length are set to `result'. Otherwise, the
@@ -270,6 +796,21 @@ class DoubleArrayImpl {
   inline U exactMatchSearch(const key_type *key, std::size_t length = 0,
       std::size_t node_pos = 0) const;
 
+  // exactMatchSearchBatch() tests `num_keys' keys at once and stores the
+  // results into `results', which must have space for `num_keys' results.
+  // Each result is the same as that of exactMatchSearch(). If `lengths' is
+  // NULL, `keys' is handled as an array of zero-terminated strings, and a key
+  // whose length is 0 is also handled as a zero-terminated string.
+  // exactMatchSearchBatch() moves a group of keys through the dictionary in
+  // lockstep and prefetches the unit for the next transition of each key, so
+  // that cache misses of different keys overlap. This is much faster than
+  // calling exactMatchSearch() for each key if the dictionary is too large to
+  // stay in the cache.
+  template <class U>
+  inline void exactMatchSearchBatch(std::size_t num_keys,
+      const key_type * const *keys, U *results,
+      const std::size_t *lengths = NULL) const;
+
   // commonPrefixSearch() searches for keys which match a prefix of the given
   // string. If `length' is 0, `key' is handled as a zero-terminated string.
   // The values and the lengths of at most `max_num_results' matched keys are
@@ -283,6 +824,42 @@ class DoubleArrayImpl {
       std::size_t max_num_results, std::size_t length = 0,
       std::size_t node_pos = 0) const;
 
+  // commonPrefixSearch() with `callback' calls `callback(value, length,
+  // node_pos)' for each key which matches a prefix of the given string, from
+  // the shortest to the longest, instead of storing the results in a buffer.
+  // `node_pos' is the node reached by the matched key, which can be given to
+  // the other search functions to continue the search from there. `callback'
+  // is a function or a function object which returns a value convertible to
+  // bool, and commonPrefixSearch() stops if it returns false. This version
+  // returns the number of keys given to `callback'. `length' and `node_pos'
+  // work as well as in exactMatchSearch().
+  template <class F>
+  inline std::size_t commonPrefixSearch(const key_type *key, F callback,
+      std::size_t length = 0, std::size_t node_pos = 0) const;
+
+  // longestPrefixSearch() finds the longest key which matches a prefix of the
+  // given string, which is the last result of commonPrefixSearch(). Its value
+  // and length are set to `result', or -1 and 0 if there is no such key.
+  // longestPrefixSearch() remembers only the last leaf while following the
+  // string and reads its value at the end, and so it is faster than
+  // commonPrefixSearch() with a buffer for the results. `length' and
+  // `node_pos' work as well as in exactMatchSearch().
+  template <class U>
+  void longestPrefixSearch(const key_type *key, U &result,
+      std::size_t length = 0, std::size_t node_pos = 0) const {
+    result = longestPrefixSearch<U>(key, length, node_pos);
+  }
+  template <class U>
+  inline U longestPrefixSearch(const key_type *key, std::size_t length = 0,
+      std::size_t node_pos = 0) const;
+  // longestPrefixSearchBatch() runs longestPrefixSearch() for `num_keys'
+  // strings at once in the same way as exactMatchSearchBatch(), and so a
+  // string whose length is 0 is handled as a zero-terminated string.
+  template <class U>
+  inline void longestPrefixSearchBatch(std::size_t num_keys,
+      const key_type * const *keys, U *results,
+      const std::size_t *lengths = NULL) const;
+
   // In Darts-clone, a dictionary is a deterministic finite-state automaton
   // (DFA) and traverse() tests transitions on the DFA. The initial state is
   // `node_pos' and traverse() chooses transitions labeled key[key_pos],
@@ -297,24 +874,188 @@ class DoubleArrayImpl {
   inline value_type traverse(const key_type *key, std::size_t &node_pos,
       std::size_t &key_pos, std::size_t length = 0) const;
 
+  // relayout() rearranges units so that searching the given sample queries
+  // touches as few cache lines and pages as possible. Nodes are counted each
+  // time they are visited by the queries, and the children of the nodes with
+  // larger counts are placed earlier, so that the frequently used part of the
+  // dictionary is packed into a small contiguous region at the beginning of
+  // the array. `frequencies' gives the number of times each query occurs, and
+  // if it is NULL, each query counts once. If `lengths' is NULL, `queries' is
+  // handled as an array of zero-terminated strings. The keys and values are
+  // not changed, but the new array may be a little larger.
+  // relayout() works on a dictionary opened by open() or mmap() as well, and
+  // then the new array is allocated in memory. It returns 0 iff it succeeds,
+  // and it returns a non-zero value if size() is 0. It throws a
+  // <Darts::Exception> if a memory allocation fails.
+  int relayout(std::size_t num_queries, const key_type * const *queries,
+      const std::size_t *lengths = NULL,
+      const std::size_t *frequencies = NULL);
+
+  // <PredictiveCursor> enumerates keys which start with a given prefix, one
+  // key per call of next(), so an application can fetch a bounded number of
+  // keys and resume the enumeration later by calling next() again. Keys are
+  // enumerated in ascending order, and each key is given as the prefix
+  // followed by the rest of the key. A cursor refers to the dictionary, so
+  // the dictionary must not be modified or freed while the cursor is used.
+  //
+  //   DoubleArray::PredictiveCursor cursor(dic, "abc");
+  //   for (std::size_t i = 0; i < 10 && cursor.next(); ++i) {
+  //     use(cursor.key(), cursor.length(), cursor.value());
+  //   }
+  //
+  // The constructor and reset() take `length' and `node_pos' which work as
+  // well as in exactMatchSearch().
+  class PredictiveCursor;
+
+  // predictiveSearch() calls `callback(key, length, value)' for each key
+  // which starts with the given key in the same order as <PredictiveCursor>.
+  // `callback' is a function or a function object which returns a value
+  // convertible to bool, and predictiveSearch() stops if it returns false.
+  // predictiveSearch() returns the number of keys given to `callback'.
+  // `length' and `node_pos' work as well as in exactMatchSearch().
+  template <class F>
+  inline std::size_t predictiveSearch(const key_type *key, F callback,
+      std::size_t length = 0, std::size_t node_pos = 0) const;
+
  private:
   typedef Details::uchar_type uchar_type;
   typedef Details::id_type id_type;
-  typedef Details::DoubleArrayUnit unit_type;
+  typedef typename Details::UnitTraits<B>::unit_type unit_type;
 
   std::size_t size_;
   const unit_type *array_;
   unit_type *buf_;
+  void *map_;
+  std::size_t map_size_;
+  std::size_t num_keys_;
+  const value_type *values_;
+  value_type *values_buf_;
 
   // Disallows copy and assignment.
   DoubleArrayImpl(const DoubleArrayImpl &);
   DoubleArrayImpl &operator=(const DoubleArrayImpl &);
+
+  static bool has_value_table() {
+    return Details::ValueTraits<C>::HAS_VALUE_TABLE != 0;
+  }
+  // format_flags() and value_size() give the format to <DoubleArrayHeader>.
+  // value_size() returns 0 if there is no value table.
+  static id_type format_flags() {
+    return (has_value_table() ? Details::DoubleArrayHeader::HAS_VALUE_TABLE :
+        0) | (Details::UnitTraits<B>::HAS_LARGE_UNITS ?
+        Details::DoubleArrayHeader::HAS_LARGE_UNITS : 0);
+  }
+  static std::size_t value_size() {
+    return has_value_table() ? sizeof(value_type) : 0;
+  }
+  // value_table_size() returns the number of bytes of the value table.
+  std::size_t value_table_size() const {
+    return (values_ != NULL) ? (sizeof(value_type) * num_keys_) : 0;
+  }
+  // leaf_value() returns the value associated with a leaf unit. If there is a
+  // value table, the leaf unit keeps the ID of its key.
+  value_type leaf_value(const unit_type &unit) const {
+    if (has_value_table()) {
+      return values_[unit.value()];
+    }
+    return static_cast<value_type>(unit.value());
+  }
+
+  static bool is_valid_header(const Details::DoubleArrayHeader &header,
+      std::size_t size);
+  static id_type value_table_checksum(const value_type *values,
+      std::size_t num_values);
+  static bool is_valid_array(const unit_type *units, std::size_t size);
 };
 
 // <DoubleArray> is the typical instance of <DoubleArrayImpl>. It uses <int>
 // as the type of values and it is suitable for most cases.
 typedef DoubleArrayImpl<void, void, int, void> DoubleArray;
 
+// <WideDoubleArray> keeps 64-bit values in a value table. The values must not
+// be negative as well as those of <DoubleArray>.
+typedef DoubleArrayImpl<void, void, long long, WideValues> WideDoubleArray;
+
+// <LargeDoubleArray> can have up to 2^32 units.
+typedef DoubleArrayImpl<void, LargeUnits, int, void> LargeDoubleArray;
+
+// <AhoCorasickImpl> finds all the occurrences of the keys of a dictionary in
+// a text in a single pass, and the text can be given in chunks. See the
+// definition of <AhoCorasickImpl> for details.
+template <typename, typename, typename, typename>
+class AhoCorasickImpl;
+
+// <AhoCorasick> is the instance of <AhoCorasickImpl> for <DoubleArray>.
+typedef AhoCorasickImpl<void, void, int, void> AhoCorasick;
+
+// <KeyIndexImpl> restores the keys of a dictionary from their nodes or key
+// IDs. See the definition of <KeyIndexImpl> for details.
+template <typename, typename, typename, typename>
+class KeyIndexImpl;
+
+// <KeyIndex> is the instance of <KeyIndexImpl> for <DoubleArray>.
+typedef KeyIndexImpl<void, void, int, void> KeyIndex;
+
+// <TailDoubleArrayImpl> keeps the unique suffixes of keys in a pool of tails
+// instead of units. See the definition of <TailDoubleArrayImpl> for details.
+template <typename, typename, typename, typename>
+class TailDoubleArrayImpl;
+
+// <TailDoubleArray> is the instance of <TailDoubleArrayImpl> for
+// <DoubleArray>.
+typedef TailDoubleArrayImpl<void, void, int, void> TailDoubleArray;
+
+// <PathDoubleArrayImpl> merges chains of nodes which have a single child into
+// units of up to 4 labels. See the definition of <PathDoubleArrayImpl> for
+// details.
+template <typename, typename, typename, typename>
+class PathDoubleArrayImpl;
+
+// <PathDoubleArray> is the instance of <PathDoubleArrayImpl> for
+// <DoubleArray>.
+typedef PathDoubleArrayImpl<void, void, int, void> PathDoubleArray;
+
+// <LoudsTrieImpl> keeps the keys of a dictionary in a succinct trie, which is
+// much smaller but slower than a double-array. See the definition of
+// <LoudsTrieImpl> for details.
+template <typename, typename, typename, typename>
+class LoudsTrieImpl;
+
+// <LoudsTrie> is the instance of <LoudsTrieImpl> for <DoubleArray>.
+typedef LoudsTrieImpl<void, void, int, void> LoudsTrie;
+
+// <MutableDoubleArrayImpl> inserts keys into a double-array one by one
+// without rebuilding it. See the definition of <MutableDoubleArrayImpl> for
+// details.
+template <typename, typename, typename, typename>
+class MutableDoubleArrayImpl;
+
+// <MutableDoubleArray> is the instance of <MutableDoubleArrayImpl> for
+// <DoubleArray>.
+typedef MutableDoubleArrayImpl<void, void, int, void> MutableDoubleArray;
+
+// <OverlayDoubleArrayImpl> merges updates kept in small overlays with an
+// immutable dictionary in searching. See the definition of
+// <OverlayDoubleArrayImpl> for details.
+template <typename, typename, typename, typename>
+class OverlayDoubleArrayImpl;
+
+// <OverlayDoubleArray> is the instance of <OverlayDoubleArrayImpl> for
+// <DoubleArray>.
+typedef OverlayDoubleArrayImpl<void, void, int, void> OverlayDoubleArray;
+
+#ifdef DARTS_HAS_THREADS
+// <SharedDoubleArrayImpl> lets readers in other threads search the current
+// version of a dictionary while a writer replaces it. See the definition of
+// <SharedDoubleArrayImpl> for details.
+template <typename, typename, typename, typename>
+class SharedDoubleArrayImpl;
+
+// <SharedDoubleArray> is the instance of <SharedDoubleArrayImpl> for
+// <DoubleArray>.
+typedef SharedDoubleArrayImpl<void, void, int, void> SharedDoubleArray;
+#endif  // DARTS_HAS_THREADS
+
 // The interface section ends here. For using Darts-clone, there is no need
 // to read the remaining section, which gives the implementation of
 // Darts-clone.
@@ -346,13 +1087,37 @@ int DoubleArrayImpl<A, B, T, C>::open(const char *file_name,
     size = std::ftell(file) - offset;
   }
 
-  size /= unit_size();
-  if (size < 256 || (size & 0xFF) != 0) {
+  if (std::fseek(file, offset, SEEK_SET) != 0) {
     std::fclose(file);
     return -1;
   }
 
-  if (std::fseek(file, offset, SEEK_SET) != 0) {
+  Details::DoubleArrayHeader header;
+  bool has_header = false;
+  if (size >= header.size()) {
+    if (std::fread(header.data(), 1, header.size(), file) != header.size()) {
+      std::fclose(file);
+      return -1;
+    }
+    if (Details::DoubleArrayHeader::has_magic(header.data())) {
+      if (!is_valid_header(header, size)) {
+        std::fclose(file);
+        return -1;
+      }
+      has_header = true;
+      size = header.num_units() * unit_size();
+    } else if (std::fseek(file, offset, SEEK_SET) != 0) {
+      std::fclose(file);
+      return -1;
+    }
+  }
+  if (format_flags() != 0 && !has_header) {
+    std::fclose(file);
+    return -1;
+  }
+
+  size /= unit_size();
+  if (size < 256 || (size & 0xFF) != 0) {
     std::fclose(file);
     return -1;
   }
@@ -363,17 +1128,10 @@ int DoubleArrayImpl<A, B, T, C>::open(const char *file_name,
     return -1;
   }
 
-  if (units[0].label() != '\0' || units[0].has_leaf() ||
-      units[0].offset() == 0 || units[0].offset() >= 512) {
+  if (!is_valid_array(units, size)) {
     std::fclose(file);
     return -1;
   }
-  for (id_type i = 1; i < 256; ++i) {
-    if (units[i].label() <= 0xFF && units[i].offset() >= size) {
-      std::fclose(file);
-      return -1;
-    }
-  }
 
   unit_type *buf;
   try {
@@ -393,20 +1151,181 @@ int DoubleArrayImpl<A, B, T, C>::open(const char *file_name,
       return -1;
     }
   }
+
+  value_type *values = NULL;
+  if (has_value_table()) {
+    std::size_t num_values = header.num_keys();
+    try {
+      values = new value_type[num_values];
+    } catch (const std::bad_alloc &) {
+      std::fclose(file);
+      delete[] buf;
+      DARTS_THROW("failed to open double-array: std::bad_alloc");
+    }
+    if (std::fread(values, sizeof(value_type), num_values, file) !=
+        num_values) {
+      std::fclose(file);
+      delete[] buf;
+      delete[] values;
+      return -1;
+    }
+  }
   std::fclose(file);
 
+  if (has_header && (Details::Checksum::compute(buf, unit_size() * size) !=
+      header.checksum() || value_table_checksum(values, header.num_keys()) !=
+      header.value_checksum())) {
+    delete[] buf;
+    delete[] values;
+    return -1;
+  }
+
   clear();
 
   size_ = size;
   array_ = buf;
   buf_ = buf;
+  num_keys_ = has_header ? header.num_keys() : 0;
+  values_ = values;
+  values_buf_ = values;
+  return 0;
+}
+
+template <typename A, typename B, typename T, typename C>
+int DoubleArrayImpl<A, B, T, C>::mmap(const char *file_name,
+    std::size_t offset, std::size_t size, int hints) {
+#if defined(_WIN32)
+  (void)hints;
+  return open(file_name, "rb", offset, size);
+#else  // defined(_WIN32)
+  if ((offset % unit_size()) != 0 ||
+      (has_value_table() && (offset % sizeof(value_type)) != 0)) {
+    return -1;
+  }
+
+  int fd = ::open(file_name, O_RDONLY);
+  if (fd == -1) {
+    return -1;
+  }
+
+  struct stat st;
+  if (::fstat(fd, &st) != 0 || offset > static_cast<std::size_t>(st.st_size)) {
+    ::close(fd);
+    return -1;
+  }
+  if (size == 0) {
+    size = static_cast<std::size_t>(st.st_size) - offset;
+  } else if (size > static_cast<std::size_t>(st.st_size) - offset) {
+    ::close(fd);
+    return -1;
+  }
+
+  if (size < 256 * unit_size()) {
+    ::close(fd);
+    return -1;
+  }
+
+  // The offset of a mapping must be a multiple of the page size.
+  std::size_t page_size = static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+  std::size_t map_offset = offset - (offset % page_size);
+  std::size_t map_size = (offset - map_offset) + size;
+
+  int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+  if (hints & MMAP_POPULATE) {
+    flags |= MAP_POPULATE;
+  }
+#endif  // MAP_POPULATE
+
+  void *map = ::mmap(NULL, map_size, PROT_READ, flags, fd,
+      static_cast<off_t>(map_offset));
+  ::close(fd);
+  if (map == MAP_FAILED) {
+    return -1;
+  }
+
+  const char *ptr = static_cast<const char *>(map) + (offset - map_offset);
+
+  Details::DoubleArrayHeader header;
+  bool has_header = false;
+  std::size_t num_units = size / unit_size();
+  if (Details::DoubleArrayHeader::has_magic(ptr)) {
+    std::memcpy(header.data(), ptr, header.size());
+    if (!is_valid_header(header, size)) {
+      ::munmap(map, map_size);
+      return -1;
+    }
+    has_header = true;
+    ptr += header.size();
+    num_units = header.num_units();
+  }
+
+  const unit_type *units = reinterpret_cast<const unit_type *>(ptr);
+  if (num_units < 256 || (num_units & 0xFF) != 0 ||
+      !is_valid_array(units, num_units) ||
+      (format_flags() != 0 && !has_header)) {
+    ::munmap(map, map_size);
+    return -1;
+  }
+  const value_type *values = NULL;
+  if (has_value_table()) {
+    values = reinterpret_cast<const value_type *>(
+        ptr + (unit_size() * num_units));
+  }
+
+#ifdef MADV_SEQUENTIAL
+  if (hints & MMAP_SEQUENTIAL) {
+    ::madvise(map, map_size, MADV_SEQUENTIAL);
+  }
+#endif  // MADV_SEQUENTIAL
+  if (hints & MMAP_SEQUENTIAL) {
+    // Reads one byte per page so that all the pages are loaded in order.
+    const volatile char *bytes = static_cast<const volatile char *>(map);
+    char sum = 0;
+    for (std::size_t i = 0; i < map_size; i += page_size) {
+      sum ^= bytes[i];
+    }
+    (void)sum;
+#ifdef MADV_NORMAL
+    ::madvise(map, map_size, MADV_NORMAL);
+#endif  // MADV_NORMAL
+  }
+#ifdef MADV_RANDOM
+  if (hints & MMAP_RANDOM) {
+    ::madvise(map, map_size, MADV_RANDOM);
+  }
+#endif  // MADV_RANDOM
+#ifdef MADV_WILLNEED
+  if (hints & MMAP_WILLNEED) {
+    ::madvise(map, map_size, MADV_WILLNEED);
+  }
+#endif  // MADV_WILLNEED
+
+  if (has_header && (hints & MMAP_VERIFY) && (Details::Checksum::compute(
+      units, unit_size() * num_units) != header.checksum() ||
+      value_table_checksum(values, header.num_keys()) !=
+      header.value_checksum())) {
+    ::munmap(map, map_size);
+    return -1;
+  }
+
+  clear();
+
+  size_ = num_units;
+  array_ = units;
+  map_ = map;
+  map_size_ = map_size;
+  num_keys_ = has_header ? header.num_keys() : 0;
+  values_ = values;
   return 0;
+#endif  // defined(_WIN32)
 }
 
 template <typename A, typename B, typename T, typename C>
 int DoubleArrayImpl<A, B, T, C>::save(const char *file_name,
-    const char *mode, std::size_t offset) const {
-  if (size() == 0) {
+    const char *mode, std::size_t offset, bool with_header) const {
+  // The values cannot be saved if set_array() was not given their number.
+  if (size() == 0 || (has_value_table() && num_keys() == 0)) {
     return -1;
   }
 
@@ -427,25 +1346,91 @@ int DoubleArrayImpl<A, B, T, C>::save(const char *file_name,
     return -1;
   }
 
+  if (with_header || format_flags() != 0) {
+    Details::DoubleArrayHeader header;
+    header.init(size(), num_keys(),
+        Details::Checksum::compute(array_, unit_size() * size()),
+        format_flags(), value_size(),
+        value_table_checksum(values_, num_keys()));
+    if (std::fwrite(header.data(), 1, header.size(), file) !=
+        header.size()) {
+      std::fclose(file);
+      return -1;
+    }
+  }
+
   if (std::fwrite(array_, unit_size(), size(), file) != size()) {
     std::fclose(file);
     return -1;
   }
+  if (has_value_table() && std::fwrite(values_, sizeof(value_type),
+      num_keys(), file) != num_keys()) {
+    std::fclose(file);
+    return -1;
+  }
   std::fclose(file);
   return 0;
 }
 
+// is_valid_header() tests the fields of `header' and whether the file of
+// `size' bytes, including the header, is large enough for the units and the
+// value table.
 template <typename A, typename B, typename T, typename C>
-template <typename U>
-inline U DoubleArrayImpl<A, B, T, C>::exactMatchSearch(const key_type *key,
-    std::size_t length, std::size_t node_pos) const {
-  U result;
-  set_result(&result, static_cast<value_type>(-1), 0);
+bool DoubleArrayImpl<A, B, T, C>::is_valid_header(
+    const Details::DoubleArrayHeader &header, std::size_t size) {
+  if (!header.is_valid(format_flags(), value_size()) ||
+      header.num_units() > (size - header.size()) / sizeof(unit_type)) {
+    return false;
+  }
+  if (has_value_table()) {
+    size -= header.size() + (sizeof(unit_type) * header.num_units());
+    if (header.num_keys() > size / sizeof(value_type)) {
+      return false;
+    }
+  }
+  return true;
+}
 
-  unit_type unit = array_[node_pos];
-  if (length != 0) {
-    for (std::size_t i = 0; i < length; ++i) {
-      node_pos ^= unit.offset() ^ static_cast<uchar_type>(key[i]);
+// value_table_checksum() returns the checksum of a value table, or 0 if there
+// is no value table. Trailing bytes which do not make a 32-bit word are not
+// used.
+template <typename A, typename B, typename T, typename C>
+Details::id_type DoubleArrayImpl<A, B, T, C>::value_table_checksum(
+    const value_type *values, std::size_t num_values) {
+  if (!has_value_table()) {
+    return 0;
+  }
+  std::size_t size = sizeof(value_type) * num_values;
+  return Details::Checksum::compute(values,
+      size - (size % sizeof(id_type)));
+}
+
+template <typename A, typename B, typename T, typename C>
+bool DoubleArrayImpl<A, B, T, C>::is_valid_array(const unit_type *units,
+    std::size_t size) {
+  if (units[0].label() != '\0' || units[0].has_leaf() ||
+      units[0].offset() == 0 || units[0].offset() >= 512) {
+    return false;
+  }
+  for (id_type i = 1; i < 256; ++i) {
+    if (units[i].label() <= 0xFF && units[i].offset() >= size) {
+      return false;
+    }
+  }
+  return true;
+}
+
+template <typename A, typename B, typename T, typename C>
+template <typename U>
+inline U DoubleArrayImpl<A, B, T, C>::exactMatchSearch(const key_type *key,
+    std::size_t length, std::size_t node_pos) const {
+  U result;
+  set_result(&result, static_cast<value_type>(-1), 0);
+
+  unit_type unit = array_[node_pos];
+  if (length != 0) {
+    for (std::size_t i = 0; i < length; ++i) {
+      node_pos ^= unit.offset() ^ static_cast<uchar_type>(key[i]);
       unit = array_[node_pos];
       if (unit.label() != static_cast<uchar_type>(key[i])) {
         return result;
@@ -464,11 +1449,93 @@ inline U DoubleArrayImpl<A, B, T, C>::exactMatchSearch(const key_type *key,
   if (!unit.has_leaf()) {
     return result;
   }
-  unit = array_[node_pos ^ unit.offset()];
-  set_result(&result, static_cast<value_type>(unit.value()), length);
+  set_result(&result, leaf_value(array_[node_pos ^ unit.offset()]), length);
   return result;
 }
 
+template <typename A, typename B, typename T, typename C>
+template <typename U>
+inline void DoubleArrayImpl<A, B, T, C>::exactMatchSearchBatch(
+    std::size_t num_keys, const key_type * const *keys, U *results,
+    const std::size_t *lengths) const {
+  // A group of keys is moved through the dictionary in lockstep. Each key
+  // uses one lane and a lane is closed when its search finishes.
+  enum { NUM_LANES = 16 };
+
+  id_type ids[NUM_LANES];
+  unit_type units[NUM_LANES];
+  std::size_t key_pos[NUM_LANES];
+  std::size_t key_lengths[NUM_LANES];
+  std::size_t lanes[NUM_LANES];
+
+  for (std::size_t begin = 0; begin < num_keys; begin += NUM_LANES) {
+    std::size_t num_lanes = num_keys - begin;
+    if (num_lanes > NUM_LANES) {
+      num_lanes = NUM_LANES;
+    }
+
+    const key_type * const *group_keys = keys + begin;
+    const std::size_t *group_lengths = (lengths != NULL) ?
+        (lengths + begin) : NULL;
+    U *group_results = results + begin;
+
+    unit_type root = array_[0];
+    for (std::size_t i = 0; i < num_lanes; ++i) {
+      ids[i] = 0;
+      units[i] = root;
+      key_pos[i] = 0;
+      key_lengths[i] = (group_lengths != NULL) ? group_lengths[i] : 0;
+      lanes[i] = i;
+      DARTS_PREFETCH(&array_[root.offset() ^
+          static_cast<uchar_type>(group_keys[i][0])]);
+    }
+
+    while (num_lanes > 0) {
+      std::size_t num_active_lanes = 0;
+      for (std::size_t i = 0; i < num_lanes; ++i) {
+        std::size_t lane = lanes[i];
+        const key_type *key = group_keys[lane];
+        std::size_t pos = key_pos[lane];
+
+        bool is_end = (key_lengths[lane] != 0) ?
+            (pos == key_lengths[lane]) : (key[pos] == '\0');
+        if (is_end) {
+          if (units[lane].has_leaf()) {
+            set_result(&group_results[lane],
+                leaf_value(array_[ids[lane] ^ units[lane].offset()]), pos);
+          } else {
+            set_result(&group_results[lane], static_cast<value_type>(-1), 0);
+          }
+          continue;
+        }
+
+        uchar_type label = static_cast<uchar_type>(key[pos]);
+        id_type id = ids[lane] ^ units[lane].offset() ^ label;
+        unit_type unit = array_[id];
+        if (unit.label() != label) {
+          set_result(&group_results[lane], static_cast<value_type>(-1), 0);
+          continue;
+        }
+
+        // The unit for the next transition is prefetched. If the key ends,
+        // the next unit is the leaf unit, which is derived with label 0.
+        ++pos;
+        uchar_type next_label = 0;
+        if ((key_lengths[lane] == 0) || (pos < key_lengths[lane])) {
+          next_label = static_cast<uchar_type>(key[pos]);
+        }
+        DARTS_PREFETCH(&array_[id ^ unit.offset() ^ next_label]);
+
+        ids[lane] = id;
+        units[lane] = unit;
+        key_pos[lane] = pos;
+        lanes[num_active_lanes++] = lane;
+      }
+      num_lanes = num_active_lanes;
+    }
+  }
+}
+
 template <typename A, typename B, typename T, typename C>
 template <typename U>
 inline std::size_t DoubleArrayImpl<A, B, T, C>::commonPrefixSearch(
@@ -489,8 +1556,8 @@ inline std::size_t DoubleArrayImpl<A, B, T, C>::commonPrefixSearch(
       node_pos ^= unit.offset();
       if (unit.has_leaf()) {
         if (num_results < max_num_results) {
-          set_result(&results[num_results], static_cast<value_type>(
-              array_[node_pos].value()), i + 1);
+          set_result(&results[num_results], leaf_value(array_[node_pos]),
+              i + 1);
         }
         ++num_results;
       }
@@ -506,10 +1573,56 @@ inline std::size_t DoubleArrayImpl<A, B, T, C>::commonPrefixSearch(
       node_pos ^= unit.offset();
       if (unit.has_leaf()) {
         if (num_results < max_num_results) {
-          set_result(&results[num_results], static_cast<value_type>(
-              array_[node_pos].value()), length + 1);
+          set_result(&results[num_results], leaf_value(array_[node_pos]),
+              length + 1);
+        }
+        ++num_results;
+      }
+    }
+  }
+
+  return num_results;
+}
+
+template <typename A, typename B, typename T, typename C>
+template <typename F>
+inline std::size_t DoubleArrayImpl<A, B, T, C>::commonPrefixSearch(
+    const key_type *key, F callback, std::size_t length,
+    std::size_t node_pos) const {
+  std::size_t num_results = 0;
+
+  unit_type unit = array_[node_pos];
+  std::size_t offset = node_pos ^ unit.offset();
+  if (length != 0) {
+    for (std::size_t i = 0; i < length; ++i) {
+      node_pos = offset ^ static_cast<uchar_type>(key[i]);
+      unit = array_[node_pos];
+      if (unit.label() != static_cast<uchar_type>(key[i])) {
+        return num_results;
+      }
+
+      offset = node_pos ^ unit.offset();
+      if (unit.has_leaf()) {
+        ++num_results;
+        if (!callback(leaf_value(array_[offset]), i + 1, node_pos)) {
+          return num_results;
         }
+      }
+    }
+  } else {
+    for ( ; key[length] != '\0'; ++length) {
+      node_pos = offset ^ static_cast<uchar_type>(key[length]);
+      unit = array_[node_pos];
+      if (unit.label() != static_cast<uchar_type>(key[length])) {
+        return num_results;
+      }
+
+      offset = node_pos ^ unit.offset();
+      if (unit.has_leaf()) {
         ++num_results;
+        if (!callback(leaf_value(array_[offset]), length + 1, node_pos)) {
+          return num_results;
+        }
       }
     }
   }
@@ -517,6 +1630,141 @@ inline std::size_t DoubleArrayImpl<A, B, T, C>::commonPrefixSearch(
   return num_results;
 }
 
+template <typename A, typename B, typename T, typename C>
+template <typename U>
+inline U DoubleArrayImpl<A, B, T, C>::longestPrefixSearch(const key_type *key,
+    std::size_t length, std::size_t node_pos) const {
+  // `leaf_id' is the leaf of the longest key found so far, and the leaf is
+  // not read until the end of the search.
+  id_type leaf_id = 0;
+  std::size_t leaf_length = 0;
+
+  unit_type unit = array_[node_pos];
+  node_pos ^= unit.offset();
+  if (length != 0) {
+    for (std::size_t i = 0; i < length; ++i) {
+      node_pos ^= static_cast<uchar_type>(key[i]);
+      unit = array_[node_pos];
+      if (unit.label() != static_cast<uchar_type>(key[i])) {
+        break;
+      }
+
+      node_pos ^= unit.offset();
+      if (unit.has_leaf()) {
+        leaf_id = static_cast<id_type>(node_pos);
+        leaf_length = i + 1;
+      }
+    }
+  } else {
+    for ( ; key[length] != '\0'; ++length) {
+      node_pos ^= static_cast<uchar_type>(key[length]);
+      unit = array_[node_pos];
+      if (unit.label() != static_cast<uchar_type>(key[length])) {
+        break;
+      }
+
+      node_pos ^= unit.offset();
+      if (unit.has_leaf()) {
+        leaf_id = static_cast<id_type>(node_pos);
+        leaf_length = length + 1;
+      }
+    }
+  }
+
+  U result;
+  if (leaf_length == 0) {
+    set_result(&result, static_cast<value_type>(-1), 0);
+  } else {
+    set_result(&result, leaf_value(array_[leaf_id]), leaf_length);
+  }
+  return result;
+}
+
+template <typename A, typename B, typename T, typename C>
+template <typename U>
+inline void DoubleArrayImpl<A, B, T, C>::longestPrefixSearchBatch(
+    std::size_t num_keys, const key_type * const *keys, U *results,
+    const std::size_t *lengths) const {
+  enum { NUM_LANES = 16 };
+
+  id_type ids[NUM_LANES];
+  unit_type units[NUM_LANES];
+  std::size_t key_pos[NUM_LANES];
+  std::size_t key_lengths[NUM_LANES];
+  std::size_t lanes[NUM_LANES];
+  id_type leaf_ids[NUM_LANES];
+  std::size_t leaf_lengths[NUM_LANES];
+
+  for (std::size_t begin = 0; begin < num_keys; begin += NUM_LANES) {
+    std::size_t num_lanes = num_keys - begin;
+    if (num_lanes > NUM_LANES) {
+      num_lanes = NUM_LANES;
+    }
+
+    const key_type * const *group_keys = keys + begin;
+    const std::size_t *group_lengths = (lengths != NULL) ?
+        (lengths + begin) : NULL;
+    U *group_results = results + begin;
+
+    unit_type root = array_[0];
+    for (std::size_t i = 0; i < num_lanes; ++i) {
+      ids[i] = 0;
+      units[i] = root;
+      key_pos[i] = 0;
+      key_lengths[i] = (group_lengths != NULL) ? group_lengths[i] : 0;
+      lanes[i] = i;
+      leaf_lengths[i] = 0;
+      DARTS_PREFETCH(&array_[root.offset() ^
+          static_cast<uchar_type>(group_keys[i][0])]);
+    }
+
+    while (num_lanes > 0) {
+      std::size_t num_active_lanes = 0;
+      for (std::size_t i = 0; i < num_lanes; ++i) {
+        std::size_t lane = lanes[i];
+        const key_type *key = group_keys[lane];
+        std::size_t pos = key_pos[lane];
+
+        bool is_end = (key_lengths[lane] != 0) ?
+            (pos == key_lengths[lane]) : (key[pos] == '\0');
+        id_type id = 0;
+        unit_type unit;
+        uchar_type label = 0;
+        if (!is_end) {
+          label = static_cast<uchar_type>(key[pos]);
+          id = ids[lane] ^ units[lane].offset() ^ label;
+          unit = array_[id];
+        }
+        if (is_end || unit.label() != label) {
+          if (leaf_lengths[lane] == 0) {
+            set_result(&group_results[lane], static_cast<value_type>(-1), 0);
+          } else {
+            set_result(&group_results[lane],
+                leaf_value(array_[leaf_ids[lane]]), leaf_lengths[lane]);
+          }
+          continue;
+        }
+
+        ++pos;
+        if (unit.has_leaf()) {
+          leaf_ids[lane] = id ^ unit.offset();
+          leaf_lengths[lane] = pos;
+        }
+        if ((key_lengths[lane] == 0) || (pos < key_lengths[lane])) {
+          DARTS_PREFETCH(&array_[id ^ unit.offset() ^
+              static_cast<uchar_type>(key[pos])]);
+        }
+
+        ids[lane] = id;
+        units[lane] = unit;
+        key_pos[lane] = pos;
+        lanes[num_active_lanes++] = lane;
+      }
+      num_lanes = num_active_lanes;
+    }
+  }
+}
+
 template <typename A, typename B, typename T, typename C>
 inline typename DoubleArrayImpl<A, B, T, C>::value_type
 DoubleArrayImpl<A, B, T, C>::traverse(const key_type *key,
@@ -547,8 +1795,7 @@ DoubleArrayImpl<A, B, T, C>::traverse(const key_type *key,
   if (!unit.has_leaf()) {
     return static_cast<value_type>(-1);
   }
-  unit = array_[id ^ unit.offset()];
-  return static_cast<value_type>(unit.value());
+  return leaf_value(array_[id ^ unit.offset()]);
 }
 
 namespace Details {
@@ -599,21 +1846,59 @@ class AutoArray {
   AutoArray &operator=(const AutoArray &);
 };
 
+//
+// Types that can be moved by memcpy().
+//
+
+// IsTriviallyCopyable<T>::value is true if objects of `T' can be moved by
+// realloc(). It is specialized for built-in types, pointers and the units of
+// builders, which hold only integers.
+template <typename T>
+struct IsTriviallyCopyable {
+  enum { value = false };
+};
+
+template <typename T>
+struct IsTriviallyCopyable<T *> {
+  enum { value = true };
+};
+
+#define DARTS_TRIVIALLY_COPYABLE(type) \
+template <> \
+struct IsTriviallyCopyable<type> { \
+  enum { value = true }; \
+}
+
+DARTS_TRIVIALLY_COPYABLE(char);
+DARTS_TRIVIALLY_COPYABLE(signed char);
+DARTS_TRIVIALLY_COPYABLE(unsigned char);
+DARTS_TRIVIALLY_COPYABLE(short);
+DARTS_TRIVIALLY_COPYABLE(unsigned short);
+DARTS_TRIVIALLY_COPYABLE(int);
+DARTS_TRIVIALLY_COPYABLE(unsigned int);
+DARTS_TRIVIALLY_COPYABLE(long);
+DARTS_TRIVIALLY_COPYABLE(unsigned long);
+DARTS_TRIVIALLY_COPYABLE(long long);
+DARTS_TRIVIALLY_COPYABLE(unsigned long long);
+
 //
 // Memory management of resizable array.
 //
 
+// <AutoPool> keeps its elements in a buffer from std::malloc(). The buffer of
+// trivially copyable elements is resized by std::realloc(), which lets glibc
+// move a large buffer by mremap() instead of copying it into a new buffer.
 template <typename T>
 class AutoPool {
  public:
-  AutoPool() : buf_(), size_(0), capacity_(0) {}
+  AutoPool() : buf_(NULL), size_(0), capacity_(0) {}
   ~AutoPool() { clear(); }
 
   const T &operator[](std::size_t id) const {
-    return *(reinterpret_cast<const T *>(&buf_[0]) + id);
+    return *(reinterpret_cast<const T *>(buf_) + id);
   }
   T &operator[](std::size_t id) {
-    return *(reinterpret_cast<T *>(&buf_[0]) + id);
+    return *(reinterpret_cast<T *>(buf_) + id);
   }
 
   bool empty() const {
@@ -625,7 +1910,8 @@ class AutoPool {
 
   void clear() {
     resize(0);
-    buf_.clear();
+    std::free(buf_);
+    buf_ = NULL;
     size_ = 0;
     capacity_ = 0;
   }
@@ -677,8 +1963,14 @@ class AutoPool {
     }
   }
 
+  void swap(AutoPool *pool) {
+    std::swap(buf_, pool->buf_);
+    std::swap(size_, pool->size_);
+    std::swap(capacity_, pool->capacity_);
+  }
+
  private:
-  AutoArray<char> buf_;
+  char *buf_;
   std::size_t size_;
   std::size_t capacity_;
 
@@ -701,26 +1993,140 @@ void AutoPool<T>::resize_buf(std::size_t size) {
     }
   }
 
-  AutoArray<char> buf;
-  try {
-    buf.reset(new char[sizeof(T) * capacity]);
-  } catch (const std::bad_alloc &) {
-    DARTS_THROW("failed to resize pool: std::bad_alloc");
+  if (IsTriviallyCopyable<T>::value) {
+    void *buf = std::realloc(buf_, sizeof(T) * capacity);
+    if (buf == NULL) {
+      DARTS_THROW("failed to resize pool: realloc() failed");
+    }
+    buf_ = static_cast<char *>(buf);
+    capacity_ = capacity;
+    return;
+  }
+
+  char *buf = static_cast<char *>(std::malloc(sizeof(T) * capacity));
+  if (buf == NULL) {
+    DARTS_THROW("failed to resize pool: malloc() failed");
   }
 
   if (size_ > 0) {
-    T *src = reinterpret_cast<T *>(&buf_[0]);
-    T *dest = reinterpret_cast<T *>(&buf[0]);
+    T *src = reinterpret_cast<T *>(buf_);
+    T *dest = reinterpret_cast<T *>(buf);
     for (std::size_t i = 0; i < size_; ++i) {
       new(&dest[i]) T(src[i]);
       src[i].~T();
     }
   }
 
-  buf_.swap(&buf);
+  std::free(buf_);
+  buf_ = buf;
   capacity_ = capacity;
 }
 
+//
+// Memory management of chunked array.
+//
+
+// FloorLog2<N>::value is the position of the highest 1 in `N'.
+template <std::size_t N>
+struct FloorLog2 {
+  enum { value = FloorLog2<N / 2>::value + 1 };
+};
+
+template <>
+struct FloorLog2<1> {
+  enum { value = 0 };
+};
+
+// <AutoChunkPool> is a resizable array of fixed-size chunks. Elements never
+// move, so growing the pool neither copies them nor holds two buffers at
+// once. If DARTS_USE_HUGE_PAGES is defined, the chunks are aligned to the
+// 2MB huge pages and passed to madvise(MADV_HUGEPAGE) where supported.
+template <typename T>
+class AutoChunkPool {
+ public:
+  AutoChunkPool() : chunks_(), size_(0) {}
+  ~AutoChunkPool() {
+    clear();
+  }
+
+  const T &operator[](std::size_t id) const {
+    return chunks_[id >> CHUNK_SHIFT][id & CHUNK_MASK];
+  }
+  T &operator[](std::size_t id) {
+    return chunks_[id >> CHUNK_SHIFT][id & CHUNK_MASK];
+  }
+
+  bool empty() const {
+    return size_ == 0;
+  }
+  std::size_t size() const {
+    return size_;
+  }
+
+  void clear();
+
+  void append() {
+    if (size_ == (chunks_.size() << CHUNK_SHIFT)) {
+      append_chunk();
+    }
+    new(&(*this)[size_++]) T;
+  }
+  void append(const T &value) {
+    if (size_ == (chunks_.size() << CHUNK_SHIFT)) {
+      append_chunk();
+    }
+    new(&(*this)[size_++]) T(value);
+  }
+
+ private:
+  enum { CHUNK_BYTES = 1 << 21 };
+  enum { CHUNK_SHIFT = FloorLog2<CHUNK_BYTES / sizeof(T)>::value };
+  enum { CHUNK_SIZE = 1 << CHUNK_SHIFT };
+  enum { CHUNK_MASK = CHUNK_SIZE - 1 };
+
+  AutoPool<T *> chunks_;
+  std::size_t size_;
+
+  // Disallows copy and assignment.
+  AutoChunkPool(const AutoChunkPool &);
+  AutoChunkPool &operator=(const AutoChunkPool &);
+
+  void append_chunk();
+};
+
+template <typename T>
+void AutoChunkPool<T>::clear() {
+  while (size_ > 0) {
+    (*this)[--size_].~T();
+  }
+  for (std::size_t i = 0; i < chunks_.size(); ++i) {
+    std::free(chunks_[i]);
+  }
+  chunks_.clear();
+}
+
+template <typename T>
+void AutoChunkPool<T>::append_chunk() {
+  // chunks_ is extended first so that a new chunk is never leaked.
+  chunks_.reserve(chunks_.size() + 1);
+
+  void *chunk = NULL;
+#if defined(DARTS_USE_HUGE_PAGES) && !defined(_WIN32) && \
+    defined(MADV_HUGEPAGE)
+  if (::posix_memalign(&chunk, CHUNK_BYTES, CHUNK_BYTES) == 0) {
+    ::madvise(chunk, CHUNK_BYTES, MADV_HUGEPAGE);
+  } else {
+    chunk = NULL;
+  }
+#else  // defined(DARTS_USE_HUGE_PAGES) && ...
+  chunk = std::malloc(CHUNK_BYTES);
+#endif  // defined(DARTS_USE_HUGE_PAGES) && ...
+  if (chunk == NULL) {
+    DARTS_THROW("failed to append chunk: out of memory");
+  }
+  chunks_.append(static_cast<T *>(chunk));
+}
+
 //
 // Memory management of stack.
 //
@@ -770,33 +2176,52 @@ class AutoStack {
 // Succinct bit vector.
 //
 
+// <BitVector> keeps bits in 64-bit words with a two-level rank index. An
+// upper rank is the number of ones before each 2^16 bits, and a lower rank is
+// the number of ones from the upper block to each 256 bits, so the index
+// takes 16 bits per 256 bits, about 6%. rank() adds up to 4 popcounts to
+// them. select() starts at a block sampled every SELECT_INTERVAL ones, 32 bits
+// per 1024 ones, searches the blocks to the next sample, and then finds the
+// bit by the prefix sums of the bytes of a word.
 class BitVector {
  public:
-  BitVector() : units_(), ranks_(), num_ones_(0), size_(0) {}
+  BitVector() : words_(), upper_ranks_(), lower_ranks_(), selects_(),
+      num_ones_(0), size_(0) {}
   ~BitVector() {
     clear();
   }
 
   bool operator[](std::size_t id) const {
-    return (units_[id / UNIT_SIZE] >> (id % UNIT_SIZE) & 1) == 1;
+    return (words_[id / WORD_SIZE] >> (id % WORD_SIZE) & 1) == 1;
   }
 
+  // rank() returns the number of ones in [0, id].
   id_type rank(std::size_t id) const {
-    std::size_t unit_id = id / UNIT_SIZE;
-    return ranks_[unit_id] + pop_count(units_[unit_id]
-        & (~0U >> (UNIT_SIZE - (id % UNIT_SIZE) - 1)));
+    std::size_t word_id = id / WORD_SIZE;
+    std::size_t block_id = id / BLOCK_SIZE;
+    id_type rank = upper_ranks_[id / UPPER_BLOCK_SIZE] +
+        lower_ranks_[block_id];
+    for (std::size_t i = block_id * WORDS_PER_BLOCK; i < word_id; ++i) {
+      rank += pop_count(words_[i]);
+    }
+    return rank + pop_count(words_[word_id] &
+        (~static_cast<word_type>(0) >> (WORD_SIZE - (id % WORD_SIZE) - 1)));
   }
+  // select() returns the position of the `count'-th one, whose rank() is
+  // `count'. `count' must be in [1, num_ones()].
+  inline std::size_t select(id_type count) const;
 
   void set(std::size_t id, bool bit) {
     if (bit) {
-      units_[id / UNIT_SIZE] |= 1U << (id % UNIT_SIZE);
+      words_[id / WORD_SIZE] |= static_cast<word_type>(1) << (id % WORD_SIZE);
     } else {
-      units_[id / UNIT_SIZE] &= ~(1U << (id % UNIT_SIZE));
+      words_[id / WORD_SIZE] &=
+          ~(static_cast<word_type>(1) << (id % WORD_SIZE));
     }
   }
 
   bool empty() const {
-    return units_.empty();
+    return words_.empty();
   }
   std::size_t num_ones() const {
     return num_ones_;
@@ -804,25 +2229,50 @@ class BitVector {
   std::size_t size() const {
     return size_;
   }
+  // total_size() returns the number of bytes allocated to the bits and the
+  // indexes.
+  std::size_t total_size() const {
+    if (lower_ranks_.empty()) {
+      return sizeof(word_type) * words_.size();
+    }
+    return (sizeof(word_type) * words_.size()) +
+        (sizeof(id_type) * num_upper_blocks()) +
+        (sizeof(lower_rank_type) * num_blocks()) +
+        (sizeof(id_type) * num_selects());
+  }
 
   void append() {
-    if ((size_ % UNIT_SIZE) == 0) {
-      units_.append(0);
+    if ((size_ % WORD_SIZE) == 0) {
+      words_.append(0);
     }
     ++size_;
   }
   void build();
 
   void clear() {
-    units_.clear();
-    ranks_.clear();
+    words_.clear();
+    upper_ranks_.clear();
+    lower_ranks_.clear();
+    selects_.clear();
+    num_ones_ = 0;
+    size_ = 0;
   }
 
  private:
-  enum { UNIT_SIZE = sizeof(id_type) * 8 };
-
-  AutoPool<id_type> units_;
-  AutoArray<id_type> ranks_;
+  typedef unsigned long long word_type;
+  typedef unsigned short lower_rank_type;
+
+  enum { WORD_SIZE = sizeof(word_type) * 8 };
+  enum { WORDS_PER_BLOCK = 4 };
+  enum { BLOCK_SIZE = WORD_SIZE * WORDS_PER_BLOCK };
+  enum { UPPER_BLOCK_SIZE = 1 << 16 };
+  enum { BLOCKS_PER_UPPER_BLOCK = UPPER_BLOCK_SIZE / BLOCK_SIZE };
+  enum { SELECT_INTERVAL = 1 << 10 };
+
+  AutoPool<word_type> words_;
+  AutoArray<id_type> upper_ranks_;
+  AutoArray<lower_rank_type> lower_ranks_;
+  AutoArray<id_type> selects_;
   std::size_t num_ones_;
   std::size_t size_;
 
@@ -830,28 +2280,139 @@ class BitVector {
   BitVector(const BitVector &);
   BitVector &operator=(const BitVector &);
 
-  static id_type pop_count(id_type unit) {
-    unit = ((unit & 0xAAAAAAAA) >> 1) + (unit & 0x55555555);
-    unit = ((unit & 0xCCCCCCCC) >> 2) + (unit & 0x33333333);
-    unit = ((unit >> 4) + unit) & 0x0F0F0F0F;
-    unit += unit >> 8;
-    unit += unit >> 16;
-    return unit & 0xFF;
+  std::size_t num_blocks() const {
+    return (words_.size() + WORDS_PER_BLOCK - 1) / WORDS_PER_BLOCK;
+  }
+  std::size_t num_upper_blocks() const {
+    return (num_blocks() + BLOCKS_PER_UPPER_BLOCK - 1) /
+        BLOCKS_PER_UPPER_BLOCK;
+  }
+  std::size_t num_selects() const {
+    return (num_ones_ + SELECT_INTERVAL - 1) / SELECT_INTERVAL;
+  }
+  // block_rank() returns the number of ones before a block.
+  id_type block_rank(std::size_t block_id) const {
+    return upper_ranks_[block_id / BLOCKS_PER_UPPER_BLOCK] +
+        lower_ranks_[block_id];
+  }
+
+  // pop_count() is a single instruction if the compiler is allowed to use
+  // POPCNT, for example with -mpopcnt or -march=native.
+  static id_type pop_count(word_type word) {
+#if defined(__GNUC__) || defined(__clang__)
+    return static_cast<id_type>(__builtin_popcountll(word));
+#else  // defined(__GNUC__) || defined(__clang__)
+    word -= (word >> 1) & 0x5555555555555555ULL;
+    word = (word & 0x3333333333333333ULL) +
+        ((word >> 2) & 0x3333333333333333ULL);
+    word = (word + (word >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    return static_cast<id_type>((word * 0x0101010101010101ULL) >> 56);
+#endif  // defined(__GNUC__) || defined(__clang__)
+  }
+  static id_type select_in_word(word_type word, id_type count);
+
+  // lowest_bit() returns the position of the lowest 1 in `word', which must
+  // not be 0.
+  static id_type lowest_bit(word_type word) {
+#if defined(__GNUC__) || defined(__clang__)
+    return static_cast<id_type>(__builtin_ctzll(word));
+#else  // defined(__GNUC__) || defined(__clang__)
+    id_type id = 0;
+    for ( ; (word & 1) == 0; word >>= 1) {
+      ++id;
+    }
+    return id;
+#endif  // defined(__GNUC__) || defined(__clang__)
   }
 };
 
 inline void BitVector::build() {
+  std::size_t num_blocks = this->num_blocks();
   try {
-    ranks_.reset(new id_type[units_.size()]);
+    upper_ranks_.reset(new id_type[num_upper_blocks()]);
+    lower_ranks_.reset(new lower_rank_type[num_blocks]);
   } catch (const std::bad_alloc &) {
     DARTS_THROW("failed to build rank index: std::bad_alloc");
   }
 
   num_ones_ = 0;
-  for (std::size_t i = 0; i < units_.size(); ++i) {
-    ranks_[i] = num_ones_;
-    num_ones_ += pop_count(units_[i]);
+  for (std::size_t i = 0; i < num_blocks; ++i) {
+    if ((i % BLOCKS_PER_UPPER_BLOCK) == 0) {
+      upper_ranks_[i / BLOCKS_PER_UPPER_BLOCK] =
+          static_cast<id_type>(num_ones_);
+    }
+    lower_ranks_[i] = static_cast<lower_rank_type>(
+        num_ones_ - upper_ranks_[i / BLOCKS_PER_UPPER_BLOCK]);
+    std::size_t end = (i + 1) * WORDS_PER_BLOCK;
+    for (std::size_t j = i * WORDS_PER_BLOCK; j < end && j < words_.size();
+        ++j) {
+      num_ones_ += pop_count(words_[j]);
+    }
+  }
+
+  // selects_[i] is the block of the (SELECT_INTERVAL * i + 1)-th one.
+  try {
+    selects_.reset(new id_type[num_selects()]);
+  } catch (const std::bad_alloc &) {
+    DARTS_THROW("failed to build select index: std::bad_alloc");
+  }
+  std::size_t num_selects = 0;
+  for (std::size_t i = 0; i < num_blocks; ++i) {
+    std::size_t end = (i + 1 < num_blocks) ? block_rank(i + 1) : num_ones_;
+    while ((SELECT_INTERVAL * num_selects) < end) {
+      selects_[num_selects++] = static_cast<id_type>(i);
+    }
+  }
+}
+
+inline std::size_t BitVector::select(id_type count) const {
+  std::size_t sample_id = (count - 1) / SELECT_INTERVAL;
+  std::size_t begin = selects_[sample_id];
+  std::size_t end = (sample_id + 1 < num_selects()) ?
+      (selects_[sample_id + 1] + 1) : num_blocks();
+  while (begin + 1 < end) {
+    std::size_t middle = (begin + end) / 2;
+    if (block_rank(middle) < count) {
+      begin = middle;
+    } else {
+      end = middle;
+    }
+  }
+
+  count -= block_rank(begin);
+  std::size_t word_id = begin * WORDS_PER_BLOCK;
+  for ( ; ; ++word_id) {
+    id_type num_ones = pop_count(words_[word_id]);
+    if (count <= num_ones) {
+      break;
+    }
+    count -= num_ones;
+  }
+  return (word_id * WORD_SIZE) + select_in_word(words_[word_id], count);
+}
+
+// select_in_word() returns the position of the `count'-th one in `word'. The
+// prefix sums of the popcounts of the bytes are compared with `count' at once
+// to find the byte of the one, and then the lower ones of the byte are
+// removed.
+inline id_type BitVector::select_in_word(word_type word, id_type count) {
+  static const word_type ONES = 0x0101010101010101ULL;
+  static const word_type MSBS = 0x8080808080808080ULL;
+
+  word_type sums = word - ((word >> 1) & 0x5555555555555555ULL);
+  sums = (sums & 0x3333333333333333ULL) +
+      ((sums >> 2) & 0x3333333333333333ULL);
+  sums = ((sums + (sums >> 4)) & 0x0F0F0F0F0F0F0F0FULL) * ONES;
+
+  // A byte has its MSB set iff its prefix sum is not less than `count'.
+  id_type shift = lowest_bit(((sums | MSBS) - (count * ONES)) & MSBS) & ~7U;
+  count -= static_cast<id_type>(((sums << 8) >> shift) & 0xFF);
+
+  word_type byte = (word >> shift) & 0xFF;
+  for ( ; count > 1; --count) {
+    byte &= byte - 1;
   }
+  return shift + lowest_bit(byte);
 }
 
 //
@@ -976,6 +2537,8 @@ class DawgNode {
   // Copyable.
 };
 
+DARTS_TRIVIALLY_COPYABLE(DawgNode);
+
 //
 // Fixed unit of Directed Acyclic Word Graph (DAWG).
 //
@@ -985,6 +2548,10 @@ class DawgUnit {
   explicit DawgUnit(id_type unit = 0) : unit_(unit) {}
   DawgUnit(const DawgUnit &unit) : unit_(unit.unit_) {}
 
+  DawgUnit &operator=(const DawgUnit &unit) {
+    unit_ = unit.unit_;
+    return *this;
+  }
   DawgUnit &operator=(id_type unit) {
     unit_ = unit;
     return *this;
@@ -1013,6 +2580,8 @@ class DawgUnit {
   // Copyable.
 };
 
+DARTS_TRIVIALLY_COPYABLE(DawgUnit);
+
 //
 // Directed Acyclic Word Graph (DAWG) builder.
 //
@@ -1066,14 +2635,20 @@ class DawgBuilder {
 
   void insert(const char *key, std::size_t length, value_type value);
 
+  // merge() appends a DAWG that has been built from keys starting with the
+  // same byte. Equivalent states are shared as insert() does, so merging the
+  // DAWGs of all the first bytes in order and calling finish() results in the
+  // same DAWG as inserting all the keys.
+  void merge(const DawgBuilder &dawg);
+
   void clear();
 
  private:
   enum { INITIAL_TABLE_SIZE = 1 << 10 };
 
   AutoPool<DawgNode> nodes_;
-  AutoPool<DawgUnit> units_;
-  AutoPool<uchar_type> labels_;
+  AutoChunkPool<DawgUnit> units_;
+  AutoChunkPool<uchar_type> labels_;
   BitVector is_intersections_;
   AutoPool<id_type> table_;
   AutoStack<id_type> node_stack_;
@@ -1090,6 +2665,8 @@ class DawgBuilder {
 
   id_type find_unit(id_type id, id_type *hash_id) const;
   id_type find_node(id_type node_id, id_type *hash_id) const;
+  id_type find_units(const DawgUnit *units, const uchar_type *labels,
+      id_type num_units, id_type *hash_id) const;
 
   bool are_equal(id_type node_id, id_type unit_id) const;
 
@@ -1195,16 +2772,87 @@ inline void DawgBuilder::insert(const char *key, std::size_t length,
   nodes_[id].set_value(value);
 }
 
-inline void DawgBuilder::clear() {
-  nodes_.clear();
-  units_.clear();
-  labels_.clear();
-  is_intersections_.clear();
-  table_.clear();
-  node_stack_.clear();
-  recycle_bin_.clear();
-  num_states_ = 0;
-}
+inline void DawgBuilder::merge(const DawgBuilder &dawg) {
+  AutoArray<id_type> ids;
+  try {
+    ids.reset(new id_type[dawg.size()]);
+  } catch (const std::bad_alloc &) {
+    DARTS_THROW("failed to merge DAWG: std::bad_alloc");
+  }
+
+  // Units of a DAWG are arranged so that every group of siblings follows
+  // the groups of its children, and the last group is the child of the root.
+  AutoPool<DawgUnit> units;
+  AutoPool<uchar_type> labels;
+  id_type last_id = dawg.child(dawg.root());
+  for (id_type begin = 1; begin < last_id; ) {
+    units.resize(0);
+    labels.resize(0);
+    id_type end = begin;
+    do {
+      DawgUnit unit = dawg.units_[end];
+      if (dawg.labels_[end] != '\0') {
+        unit = (ids[unit.child()] << 2) | (unit.unit() & 3);
+      }
+      units.append(unit);
+      labels.append(dawg.labels_[end]);
+    } while (dawg.units_[end++].has_sibling());
+
+    if (num_states_ >= table_.size() - (table_.size() >> 2)) {
+      expand_table();
+    }
+
+    id_type num_units = end - begin;
+    id_type hash_id;
+    id_type match_id = find_units(&units[0], &labels[0], num_units,
+        &hash_id);
+    if (match_id != 0) {
+      is_intersections_.set(match_id, true);
+    } else {
+      match_id = static_cast<id_type>(units_.size());
+      for (id_type i = 0; i < num_units; ++i) {
+        append_unit();
+        units_[match_id + i] = units[i];
+        labels_[match_id + i] = labels[i];
+      }
+      is_intersections_.set(match_id, dawg.is_intersection(begin));
+      table_[hash_id] = match_id;
+      ++num_states_;
+    }
+    ids[begin] = match_id;
+    begin = end;
+  }
+
+  // The child of the root is added to the siblings of the root's child in
+  // the same way as insert(), and finish() flushes them.
+  id_type prev_id = nodes_[0].child();
+  if (prev_id != 0) {
+    nodes_[prev_id].set_has_sibling(true);
+    node_stack_.pop();
+  }
+  id_type node_id = append_node();
+  if (prev_id == 0) {
+    nodes_[node_id].set_is_state(true);
+  } else if (dawg.label(last_id) <= nodes_[prev_id].label()) {
+    DARTS_THROW("failed to merge DAWG: wrong key order");
+  }
+  nodes_[node_id].set_sibling(prev_id);
+  nodes_[node_id].set_label(dawg.label(last_id));
+  nodes_[node_id].set_child(ids[dawg.child(last_id)]);
+  nodes_[0].set_child(node_id);
+  node_stack_.push(node_id);
+}
+
+inline void DawgBuilder::clear() {
+  nodes_.clear();
+  units_.clear();
+  labels_.clear();
+  is_intersections_.clear();
+  table_.clear();
+  node_stack_.clear();
+  recycle_bin_.clear();
+  num_states_ = 0;
+}
 
 inline void DawgBuilder::flush(id_type id) {
   while (node_stack_.top() != id) {
@@ -1293,6 +2941,32 @@ inline id_type DawgBuilder::find_node(id_type node_id,
   return 0;
 }
 
+inline id_type DawgBuilder::find_units(const DawgUnit *units,
+    const uchar_type *labels, id_type num_units, id_type *hash_id) const {
+  id_type hash_value = 0;
+  for (id_type i = 0; i < num_units; ++i) {
+    hash_value ^= hash((labels[i] << 24) ^ units[i].unit());
+  }
+
+  *hash_id = hash_value % table_.size();
+  for ( ; ; *hash_id = (*hash_id + 1) % table_.size()) {
+    id_type unit_id = table_[*hash_id];
+    if (unit_id == 0) {
+      break;
+    }
+
+    id_type i = 0;
+    while (i < num_units && units_[unit_id + i].unit() == units[i].unit() &&
+        labels_[unit_id + i] == labels[i]) {
+      ++i;
+    }
+    if (i == num_units) {
+      return unit_id;
+    }
+  }
+  return 0;
+}
+
 inline bool DawgBuilder::are_equal(id_type node_id, id_type unit_id) const {
   for (id_type i = nodes_[node_id].sibling(); i != 0;
       i = nodes_[i].sibling()) {
@@ -1380,32 +3054,51 @@ class DoubleArrayBuilderUnit {
   void set_label(uchar_type label) {
     unit_ = (unit_ & ~0xFFU) | label;
   }
-  void set_offset(id_type offset) {
-    if (offset >= 1U << 29) {
+  // set_offset() and offset() take the EXTENSION_SHIFT of the unit type, see
+  // <DoubleArrayUnit> and <LargeDoubleArrayUnit>.
+  void set_offset(id_type offset, id_type extension_shift) {
+    if ((offset >> extension_shift) >= 1U << 21) {
       DARTS_THROW("failed to modify unit: too large offset");
     }
     unit_ &= (1U << 31) | (1U << 8) | 0xFF;
     if (offset < 1U << 21) {
       unit_ |= (offset << 10);
     } else {
-      unit_ |= (offset << 2) | (1U << 9);
+      unit_ |= ((offset >> extension_shift) << 10) | (1U << 9);
     }
   }
 
+  bool is_leaf() const {
+    return (unit_ >> 31) == 1;
+  }
+  bool has_leaf() const {
+    return ((unit_ >> 8) & 1) == 1;
+  }
+  value_type value() const {
+    return static_cast<value_type>(unit_ & ((1U << 31) - 1));
+  }
+  id_type label() const {
+    return unit_ & ((1U << 31) | 0xFF);
+  }
+  id_type offset(id_type extension_shift) const {
+    return (unit_ >> 10) << (((unit_ >> 9) & 1) * extension_shift);
+  }
+
  private:
   id_type unit_;
 
   // Copyable.
 };
 
+DARTS_TRIVIALLY_COPYABLE(DoubleArrayBuilderUnit);
+
 //
 // Extra unit of double-array builder.
 //
 
 class DoubleArrayBuilderExtraUnit {
  public:
-  DoubleArrayBuilderExtraUnit() : prev_(0), next_(0),
-      is_fixed_(false), is_used_(false) {}
+  DoubleArrayBuilderExtraUnit() : prev_(0), next_(0) {}
 
   void set_prev(id_type prev) {
     prev_ = prev;
@@ -1413,12 +3106,6 @@ class DoubleArrayBuilderExtraUnit {
   void set_next(id_type next) {
     next_ = next;
   }
-  void set_is_fixed(bool is_fixed) {
-    is_fixed_ = is_fixed;
-  }
-  void set_is_used(bool is_used) {
-    is_used_ = is_used;
-  }
 
   id_type prev() const {
     return prev_;
@@ -1426,38 +3113,301 @@ class DoubleArrayBuilderExtraUnit {
   id_type next() const {
     return next_;
   }
-  bool is_fixed() const {
-    return is_fixed_;
-  }
-  bool is_used() const {
-    return is_used_;
-  }
 
  private:
   id_type prev_;
   id_type next_;
-  bool is_fixed_;
-  bool is_used_;
 
   // Copyable.
 };
 
+//
+// Extra block of double-array builder.
+//
+
+// <DoubleArrayBuilderExtraBlock> keeps bitmaps of fixed units and used
+// offsets in a block of 256 units. A bit of the i-th word corresponds to the
+// unit whose lower 8 bits are (32 * i + (the bit position)).
+class DoubleArrayBuilderExtraBlock {
+ public:
+  enum { NUM_WORDS = 256 / 32 };
+
+  DoubleArrayBuilderExtraBlock() : fixed_(), used_(), num_fixed_(0),
+      unfixed_words_((1U << NUM_WORDS) - 1) {}
+
+  void set_is_fixed(id_type id) {
+    id_type word_id = (id & 0xFF) / 32;
+    fixed_[word_id] |= 1U << (id % 32);
+    if (fixed_[word_id] == ~0U) {
+      unfixed_words_ &= ~(1U << word_id);
+    }
+    ++num_fixed_;
+  }
+  void set_is_used(id_type id) {
+    used_[(id & 0xFF) / 32] |= 1U << (id % 32);
+  }
+  void clear_is_fixed(id_type id) {
+    id_type word_id = (id & 0xFF) / 32;
+    fixed_[word_id] &= ~(1U << (id % 32));
+    unfixed_words_ |= 1U << word_id;
+    --num_fixed_;
+  }
+  void clear_is_used(id_type id) {
+    used_[(id & 0xFF) / 32] &= ~(1U << (id % 32));
+  }
+
+  bool is_fixed(id_type id) const {
+    return ((fixed_[(id & 0xFF) / 32] >> (id % 32)) & 1) == 1;
+  }
+  bool is_used(id_type id) const {
+    return ((used_[(id & 0xFF) / 32] >> (id % 32)) & 1) == 1;
+  }
+
+  id_type num_fixed() const {
+    return num_fixed_;
+  }
+  // unfixed_words() returns a bitmap of words which have unfixed units.
+  id_type unfixed_words() const {
+    return unfixed_words_;
+  }
+
+  // unfixed_bits() returns the `word_id'-th word of the bitmap of unfixed
+  // units.
+  id_type unfixed_bits(id_type word_id) const {
+    return ~fixed_[word_id];
+  }
+
+  // are_fixed() tests whether any of the units (offset ^ label) is fixed or
+  // not, where the labels are given as a list of the nonzero words of their
+  // bitmap. The bitmap of the units is permuted so that each bit corresponds
+  // to a label, and then it is compared with the labels word by word.
+  bool are_fixed(id_type offset, const id_type *label_word_ids,
+      const id_type *label_words, std::size_t num_label_words) const {
+    id_type word_offset = (offset & 0xFF) / 32;
+    id_type bit_offset = offset % 32;
+    for (std::size_t i = 0; i < num_label_words; ++i) {
+      id_type bits = permute(fixed_[label_word_ids[i] ^ word_offset],
+          bit_offset);
+      if ((bits & label_words[i]) != 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void clear() {
+    for (id_type i = 0; i < NUM_WORDS; ++i) {
+      fixed_[i] = 0;
+      used_[i] = 0;
+    }
+    num_fixed_ = 0;
+    unfixed_words_ = (1U << NUM_WORDS) - 1;
+  }
+
+  // permute() returns a word whose i-th bit is the (i ^ `bit_offset')-th bit
+  // of `bits'.
+  static id_type permute(id_type bits, id_type bit_offset) {
+    if (bit_offset & 1) {
+      bits = ((bits >> 1) & 0x55555555U) | ((bits & 0x55555555U) << 1);
+    }
+    if (bit_offset & 2) {
+      bits = ((bits >> 2) & 0x33333333U) | ((bits & 0x33333333U) << 2);
+    }
+    if (bit_offset & 4) {
+      bits = ((bits >> 4) & 0x0F0F0F0FU) | ((bits & 0x0F0F0F0FU) << 4);
+    }
+    if (bit_offset & 8) {
+      bits = ((bits >> 8) & 0x00FF00FFU) | ((bits & 0x00FF00FFU) << 8);
+    }
+    if (bit_offset & 16) {
+      bits = (bits >> 16) | (bits << 16);
+    }
+    return bits;
+  }
+
+  // lowest_bit() returns the position of the lowest 1 in `bits', which must
+  // not be 0.
+  static id_type lowest_bit(id_type bits) {
+#if defined(__GNUC__) || defined(__clang__)
+    return static_cast<id_type>(__builtin_ctz(bits));
+#else  // defined(__GNUC__) || defined(__clang__)
+    static const id_type TABLE[32] = {
+      0, 1, 28, 2, 29, 14, 24, 3, 30, 22, 20, 15, 25, 17, 4, 8,
+      31, 27, 13, 23, 21, 19, 16, 7, 26, 12, 18, 6, 11, 5, 10, 9
+    };
+    return TABLE[((bits & (0U - bits)) * 0x077CB531U) >> 27];
+#endif  // defined(__GNUC__) || defined(__clang__)
+  }
+
+ private:
+  id_type fixed_[NUM_WORDS];
+  id_type used_[NUM_WORDS];
+  id_type num_fixed_;
+  id_type unfixed_words_;
+
+  // Copyable.
+};
+
+#ifdef DARTS_HAS_THREADS
+
+//
+// Pool of threads.
+//
+
+// run_tasks() calls (*task)(id) for each id in [0, `num_tasks') on at most
+// `num_threads' threads. The tasks are started in the order of `order', so
+// larger tasks should come first. If tasks throw exceptions, the exception of
+// the task with the smallest id is rethrown after all the threads finish. If
+// a thread fails to start, the calling thread takes its share of the tasks.
+template <typename T>
+void run_tasks(T *task, std::size_t num_tasks, const std::size_t *order,
+    std::size_t num_threads) {
+  if (num_threads > num_tasks) {
+    num_threads = num_tasks;
+  }
+  AutoArray<std::exception_ptr> errors;
+  AutoArray<std::thread> threads;
+  try {
+    errors.reset(new std::exception_ptr[num_tasks]);
+    threads.reset(new std::thread[num_threads]);
+  } catch (const std::bad_alloc &) {
+    DARTS_THROW("failed to run tasks: std::bad_alloc");
+  }
+  std::atomic<std::size_t> next_task(0);
+
+  struct Worker {
+    static void run(T *task, std::size_t num_tasks, const std::size_t *order,
+        AutoArray<std::exception_ptr> *errors,
+        std::atomic<std::size_t> *next_task) {
+      for (std::size_t i; (i = (*next_task)++) < num_tasks; ) {
+        try {
+          (*task)(order[i]);
+        } catch (...) {
+          (*errors)[order[i]] = std::current_exception();
+        }
+      }
+    }
+  };
+
+  // std::thread throws std::system_error if it cannot start a thread, and
+  // the threads already started must be joined before they are destroyed.
+  std::size_t num_started = 0;
+  try {
+    for ( ; num_started < num_threads; ++num_started) {
+      threads[num_started] = std::thread(&Worker::run, task, num_tasks, order,
+          &errors, &next_task);
+    }
+  } catch (const std::exception &) {
+    Worker::run(task, num_tasks, order, &errors, &next_task);
+  }
+  for (std::size_t i = 0; i < num_started; ++i) {
+    threads[i].join();
+  }
+
+  for (std::size_t i = 0; i < num_tasks; ++i) {
+    if (errors[i]) {
+      std::rethrow_exception(errors[i]);
+    }
+  }
+}
+
+// sort_by_size() stores the ids of ranges [begins[i], begins[i + 1]) into
+// `order' in descending order of their sizes.
+inline void sort_by_size(const std::size_t *begins, std::size_t num_ranges,
+    std::size_t *order) {
+  for (std::size_t i = 0; i < num_ranges; ++i) {
+    std::size_t j = i;
+    for ( ; j > 0; --j) {
+      std::size_t size = begins[order[j - 1] + 1] - begins[order[j - 1]];
+      if (size >= begins[i + 1] - begins[i]) {
+        break;
+      }
+      order[j] = order[j - 1];
+    }
+    order[j] = i;
+  }
+}
+
+#endif  // DARTS_HAS_THREADS
+
+//
+// Hot node of double-array builder.
+//
+
+// <DoubleArrayBuilderHotNode> is a node waiting for its children to be
+// arranged in build_from_array(). operator<() gives the order of a max-heap,
+// in which nodes with larger counts come first and ties are broken by the
+// source ids so that the result does not depend on the heap.
+class DoubleArrayBuilderHotNode {
+ public:
+  DoubleArrayBuilderHotNode() : count_(0), src_id_(0), dic_id_(0) {}
+  DoubleArrayBuilderHotNode(id_type count, id_type src_id, id_type dic_id)
+      : count_(count), src_id_(src_id), dic_id_(dic_id) {}
+
+  id_type count() const {
+    return count_;
+  }
+  id_type src_id() const {
+    return src_id_;
+  }
+  id_type dic_id() const {
+    return dic_id_;
+  }
+
+  bool operator<(const DoubleArrayBuilderHotNode &node) const {
+    if (count_ != node.count_) {
+      return count_ < node.count_;
+    }
+    return src_id_ > node.src_id_;
+  }
+
+ private:
+  id_type count_;
+  id_type src_id_;
+  id_type dic_id_;
+
+  // Copyable.
+};
+
+DARTS_TRIVIALLY_COPYABLE(DoubleArrayBuilderHotNode);
+
 //
 // DAWG -> double-array converter.
 //
 
 class DoubleArrayBuilder {
  public:
-  explicit DoubleArrayBuilder(progress_func_type progress_func)
-      : progress_func_(progress_func), units_(), extras_(), labels_(),
-        table_(), extras_head_(0) {}
+  // `extension_shift' is the EXTENSION_SHIFT of the unit type to be built.
+  explicit DoubleArrayBuilder(progress_func_type progress_func = NULL,
+      std::size_t num_threads = 1,
+      id_type extension_shift = DoubleArrayUnit::EXTENSION_SHIFT)
+      : progress_func_(progress_func), num_threads_(num_threads), units_(),
+        extras_(), extra_blocks_(), labels_(), table_(), extras_head_(0),
+        extension_shift_(extension_shift), is_part_(false), file_(NULL),
+        file_offset_(0), num_spilled_units_(0), units_begin_(0),
+        spilled_id_(NO_ID),
+        spilled_unit_(), stream_keys_(), stream_ends_(), stream_values_(),
+        stream_offsets_(), max_num_stream_keys_(0) {}
   ~DoubleArrayBuilder() {
     clear();
   }
 
   template <typename T>
   void build(const Keyset<T> &keyset);
-  void copy(std::size_t *size_ptr, DoubleArrayUnit **buf_ptr) const;
+  template <typename U>
+  void build_from_array(const U *units, std::size_t num_units,
+      const id_type *counts, bool shares_blocks,
+      AutoPool<id_type> *runs = NULL);
+  template <typename U>
+  void copy(std::size_t *size_ptr, U **buf_ptr) const;
+
+  // open_stream(), insert_into_stream() and close_stream() build a trie from
+  // sorted keys given one by one, and write units into `file' as soon as
+  // they leave the extras window. See <DoubleArrayImpl::StreamBuilder>.
+  void open_stream(std::FILE *file, std::size_t max_num_buffered_keys);
+  void insert_into_stream(const char_type *key, std::size_t length,
+      value_type value);
+  std::size_t close_stream();
 
   void clear();
 
@@ -1466,25 +3416,86 @@ class DoubleArrayBuilder {
   enum { NUM_EXTRA_BLOCKS = 16 };
   enum { NUM_EXTRAS = BLOCK_SIZE * NUM_EXTRA_BLOCKS };
 
-  enum { UPPER_MASK = 0xFF << 21 };
+  // A smaller buffer than MIN_NUM_STREAM_KEYS opens so many nodes, each of
+  // which takes a whole block, that the array becomes much larger.
+  enum { MIN_NUM_STREAM_KEYS = 1 << 10 };
+
   enum { LOWER_MASK = 0xFF };
 
+  // find_valid_offset() tests labels one by one if there are at most
+  // MAX_NUM_SCANNED_LABELS labels, and otherwise tests them word by word.
+  enum { MAX_NUM_SCANNED_LABELS = 8 };
+
+  // A part, which is built in a thread, is moved by a multiple of
+  // part_alignment(), and so its relative offsets must not cross the
+  // boundary. MIN_PART_SIZE is the minimum number of keys per part, which
+  // keeps the padding between parts small.
+  enum { MIN_PART_SIZE = 1 << 18 };
+
+  // NO_ID is never a unit ID because the number of units is less than 2^32.
+  enum { NO_ID = 0xFFFFFFFFU };
+
   typedef DoubleArrayBuilderUnit unit_type;
   typedef DoubleArrayBuilderExtraUnit extra_type;
+  typedef DoubleArrayBuilderExtraBlock extra_block_type;
+  typedef DoubleArrayBuilderHotNode hot_node_type;
 
   progress_func_type progress_func_;
+  std::size_t num_threads_;
   AutoPool<unit_type> units_;
   AutoArray<extra_type> extras_;
+  AutoArray<extra_block_type> extra_blocks_;
   AutoPool<uchar_type> labels_;
   AutoArray<id_type> table_;
   id_type extras_head_;
+  id_type extension_shift_;
+  bool is_part_;
+
+  // If `file_' is not NULL, units_ keeps only the units after the first
+  // `num_spilled_units_' units, which have been written into `file_' at
+  // `file_offset_'. A spilled unit is modified through `spilled_unit_'.
+  // The units kept in units_ start at `units_begin_', so that spilling a
+  // block does not move the other units.
+  // `file_offset_' is a long long because a long, which std::fseek() takes,
+  // has only 32 bits on LLP64 systems and the file may be larger than 2GB.
+  std::FILE *file_;
+  long long file_offset_;
+  id_type num_spilled_units_;
+  std::size_t units_begin_;
+  id_type spilled_id_;
+  unit_type spilled_unit_;
+
+  // Keys given to insert_into_stream() are buffered in `stream_keys_', and
+  // the i-th key ends at stream_ends_[i]. stream_offsets_[d] is the offset of
+  // the children of the node at depth `d' on the path of the buffered keys.
+  AutoPool<char_type> stream_keys_;
+  AutoPool<std::size_t> stream_ends_;
+  AutoPool<value_type> stream_values_;
+  AutoPool<id_type> stream_offsets_;
+  std::size_t max_num_stream_keys_;
 
   // Disallows copy and assignment.
   DoubleArrayBuilder(const DoubleArrayBuilder &);
   DoubleArrayBuilder &operator=(const DoubleArrayBuilder &);
 
+  std::size_t num_units() const {
+    return num_spilled_units_ + (units_.size() - units_begin_);
+  }
   std::size_t num_blocks() const {
-    return units_.size() / BLOCK_SIZE;
+    return num_units() / BLOCK_SIZE;
+  }
+  unit_type &units(id_type id) {
+    if (id < num_spilled_units_) {
+      return spilled_unit(id);
+    }
+    return units_[units_begin_ + (id - num_spilled_units_)];
+  }
+  // part_alignment() is 2^16 for <DoubleArrayUnit> and 2^19 for
+  // <LargeDoubleArrayUnit>. A relative offset which crosses the boundary must
+  // be a multiple of 2^extension_shift_, and a larger alignment makes such
+  // offsets rare.
+  id_type part_alignment() const {
+    return 1U << (extension_shift_ + 8);
   }
 
   const extra_type &extras(id_type id) const {
@@ -1493,15 +3504,44 @@ class DoubleArrayBuilder {
   extra_type &extras(id_type id) {
     return extras_[id % NUM_EXTRAS];
   }
+  const extra_block_type &extra_blocks(id_type id) const {
+    return extra_blocks_[(id / BLOCK_SIZE) % NUM_EXTRA_BLOCKS];
+  }
+  extra_block_type &extra_blocks(id_type id) {
+    return extra_blocks_[(id / BLOCK_SIZE) % NUM_EXTRA_BLOCKS];
+  }
 
   template <typename T>
   void build_dawg(const Keyset<T> &keyset, DawgBuilder *dawg_builder);
+  template <typename T>
+  void build_dawg_in_parallel(const Keyset<T> &keyset,
+      DawgBuilder *dawg_builder);
+  template <typename T>
+  bool build_in_parallel(const Keyset<T> &keyset, const DawgBuilder *dawg);
+  template <typename T>
+  void build_part(const Keyset<T> &keyset, const DawgBuilder *dawg,
+      const std::size_t *begins, const uchar_type *labels,
+      const id_type *dawg_ids, std::size_t first, std::size_t last,
+      id_type root_offset);
+  template <typename T>
+  static void split_keyset(const Keyset<T> &keyset,
+      AutoPool<std::size_t> *begins, AutoPool<uchar_type> *labels);
   void build_from_dawg(const DawgBuilder &dawg);
   void build_from_dawg(const DawgBuilder &dawg,
       id_type dawg_id, id_type dic_id);
   id_type arrange_from_dawg(const DawgBuilder &dawg,
       id_type dawg_id, id_type dic_id);
 
+  template <typename U>
+  void build_from_array(const U *units, const id_type *counts,
+      id_type src_id, id_type dic_id, AutoPool<hot_node_type> *hot_nodes,
+      AutoPool<hot_node_type> *cold_nodes, AutoPool<id_type> *runs);
+  template <typename U>
+  id_type arrange_from_array(const U *units, id_type src_id, id_type dic_id);
+  template <typename U>
+  static id_type skip_run(const U *units, id_type src_id, uchar_type label,
+      id_type dic_id, AutoPool<id_type> *runs);
+
   template <typename T>
   void build_from_keyset(const Keyset<T> &keyset);
   template <typename T>
@@ -1512,13 +3552,34 @@ class DoubleArrayBuilder {
       std::size_t end, std::size_t depth, id_type dic_id);
 
   id_type find_valid_offset(id_type id) const;
-  bool is_valid_offset(id_type id, id_type offset) const;
+  id_type find_new_offset(id_type id) const;
+  bool is_valid_rel_offset(id_type id, id_type rel_offset) const;
 
   void reserve_id(id_type id);
   void expand_units();
 
   void fix_all_blocks();
   void fix_block(id_type block_id);
+
+  unit_type &spilled_unit(id_type id);
+  void write_spilled_unit();
+  void spill_block();
+  void seek_unit(id_type id);
+
+  const char_type *stream_key(std::size_t id) const {
+    return &stream_keys_[(id == 0) ? 0 : stream_ends_[id - 1]];
+  }
+  std::size_t stream_length(std::size_t id) const {
+    return stream_ends_[id] - ((id == 0) ? 0 : stream_ends_[id - 1]);
+  }
+  uchar_type stream_label(std::size_t id, std::size_t depth) const {
+    return (depth < stream_length(id)) ?
+        static_cast<uchar_type>(stream_key(id)[depth]) : '\0';
+  }
+  void flush_stream();
+  void build_stream(std::size_t num_keys);
+  void open_stream_node(id_type id);
+  void remove_stream_keys(std::size_t num_keys);
 };
 
 template <typename T>
@@ -1526,20 +3587,22 @@ void DoubleArrayBuilder::build(const Keyset<T> &keyset) {
   if (keyset.has_values()) {
     Details::DawgBuilder dawg_builder;
     build_dawg(keyset, &dawg_builder);
-    build_from_dawg(dawg_builder);
+    if (!build_in_parallel(keyset, &dawg_builder)) {
+      build_from_dawg(dawg_builder);
+    }
     dawg_builder.clear();
-  } else {
+  } else if (!build_in_parallel(keyset, NULL)) {
     build_from_keyset(keyset);
   }
 }
 
-inline void DoubleArrayBuilder::copy(std::size_t *size_ptr,
-    DoubleArrayUnit **buf_ptr) const {
+template <typename U>
+void DoubleArrayBuilder::copy(std::size_t *size_ptr, U **buf_ptr) const {
   if (size_ptr != NULL) {
     *size_ptr = units_.size();
   }
   if (buf_ptr != NULL) {
-    *buf_ptr = new DoubleArrayUnit[units_.size()];
+    *buf_ptr = new U[units_.size()];
     unit_type *units = reinterpret_cast<unit_type *>(*buf_ptr);
     for (std::size_t i = 0; i < units_.size(); ++i) {
       units[i] = units_[i];
@@ -1550,14 +3613,32 @@ inline void DoubleArrayBuilder::copy(std::size_t *size_ptr,
 inline void DoubleArrayBuilder::clear() {
   units_.clear();
   extras_.clear();
+  extra_blocks_.clear();
   labels_.clear();
   table_.clear();
   extras_head_ = 0;
+  file_ = NULL;
+  file_offset_ = 0;
+  num_spilled_units_ = 0;
+  units_begin_ = 0;
+  spilled_id_ = NO_ID;
+  stream_keys_.clear();
+  stream_ends_.clear();
+  stream_values_.clear();
+  stream_offsets_.clear();
+  max_num_stream_keys_ = 0;
 }
 
 template <typename T>
 void DoubleArrayBuilder::build_dawg(const Keyset<T> &keyset,
     DawgBuilder *dawg_builder) {
+#ifdef DARTS_HAS_THREADS
+  if (num_threads_ > 1) {
+    build_dawg_in_parallel(keyset, dawg_builder);
+    return;
+  }
+#endif  // DARTS_HAS_THREADS
+
   dawg_builder->init();
   for (std::size_t i = 0; i < keyset.num_keys(); ++i) {
     dawg_builder->insert(keyset.keys(i), keyset.lengths(i), keyset.values(i));
@@ -1568,101 +3649,585 @@ void DoubleArrayBuilder::build_dawg(const Keyset<T> &keyset,
   dawg_builder->finish();
 }
 
-inline void DoubleArrayBuilder::build_from_dawg(const DawgBuilder &dawg) {
-  std::size_t num_units = 1;
-  while (num_units < dawg.size()) {
-    num_units <<= 1;
-  }
-  units_.reserve(num_units);
+// build_dawg_in_parallel() splits keys by their first bytes, builds a DAWG
+// for each part in a pool of threads, and then merges the DAWGs in order.
+template <typename T>
+void DoubleArrayBuilder::build_dawg_in_parallel(const Keyset<T> &keyset,
+    DawgBuilder *dawg_builder) {
+#ifdef DARTS_HAS_THREADS
+  AutoPool<std::size_t> begins;
+  AutoPool<uchar_type> labels;
+  split_keyset(keyset, &begins, &labels);
+  std::size_t num_parts = labels.size();
+
+  AutoArray<std::size_t> order(new std::size_t[num_parts]);
+  sort_by_size(&begins[0], num_parts, &order[0]);
+
+  AutoArray<DawgBuilder> dawgs(new DawgBuilder[num_parts]);
+
+  class Task {
+   public:
+    Task(const Keyset<T> &keyset, const AutoPool<std::size_t> &begins,
+        AutoArray<DawgBuilder> &dawgs)
+        : keyset_(keyset), begins_(begins), dawgs_(dawgs) {}
+
+    void operator()(std::size_t part_id) {
+      DawgBuilder &dawg = dawgs_[part_id];
+      dawg.init();
+      for (std::size_t i = begins_[part_id]; i < begins_[part_id + 1]; ++i) {
+        dawg.insert(keyset_.keys(i), keyset_.lengths(i), keyset_.values(i));
+      }
+      dawg.finish();
+    }
 
-  table_.reset(new id_type[dawg.num_intersections()]);
-  for (std::size_t i = 0; i < dawg.num_intersections(); ++i) {
-    table_[i] = 0;
-  }
+   private:
+    const Keyset<T> &keyset_;
+    const AutoPool<std::size_t> &begins_;
+    AutoArray<DawgBuilder> &dawgs_;
 
-  extras_.reset(new extra_type[NUM_EXTRAS]);
+    // Disallows copy and assignment.
+    Task(const Task &);
+    Task &operator=(const Task &);
+  } task(keyset, begins, dawgs);
 
-  reserve_id(0);
-  extras(0).set_is_used(true);
-  units_[0].set_offset(1);
-  units_[0].set_label('\0');
+  run_tasks(&task, num_parts, &order[0], num_threads_);
 
-  if (dawg.child(dawg.root()) != 0) {
-    build_from_dawg(dawg, dawg.root(), 0);
+  dawg_builder->init();
+  for (std::size_t i = 0; i < num_parts; ++i) {
+    dawg_builder->merge(dawgs[i]);
+    dawgs[i].clear();
+    if (progress_func_ != NULL) {
+      progress_func_(begins[i + 1], keyset.num_keys() + 1);
+    }
   }
+  dawg_builder->finish();
+#else  // DARTS_HAS_THREADS
+  num_threads_ = 1;
+  build_dawg(keyset, dawg_builder);
+#endif  // DARTS_HAS_THREADS
+}
 
-  fix_all_blocks();
+// build_in_parallel() splits the children of the root into parts, builds each
+// part in a thread by build_part(), and then concatenates the parts. The root
+// and its children are put in the first block, and each part follows the
+// previous part with padding so that it starts at a multiple of
+// part_alignment() (plus the first block). build_in_parallel() returns false
+// and does nothing if the keys are too few to be split.
+template <typename T>
+bool DoubleArrayBuilder::build_in_parallel(const Keyset<T> &keyset,
+    const DawgBuilder *dawg) {
+#ifdef DARTS_HAS_THREADS
+  std::size_t num_parts = keyset.num_keys() / MIN_PART_SIZE;
+  if (num_parts > num_threads_) {
+    num_parts = num_threads_;
+  }
+  if (num_parts < 2) {
+    return false;
+  }
 
-  extras_.clear();
-  labels_.clear();
-  table_.clear();
-}
+  AutoPool<std::size_t> begins;
+  AutoPool<uchar_type> labels;
+  split_keyset(keyset, &begins, &labels);
+  if (labels.size() < 2 || labels[0] == '\0') {
+    return false;
+  }
 
-inline void DoubleArrayBuilder::build_from_dawg(const DawgBuilder &dawg,
-    id_type dawg_id, id_type dic_id) {
-  id_type dawg_child_id = dawg.child(dawg_id);
-  if (dawg.is_intersection(dawg_child_id)) {
-    id_type intersection_id = dawg.intersection_id(dawg_child_id);
-    id_type offset = table_[intersection_id];
-    if (offset != 0) {
-      offset ^= dic_id;
-      if (!(offset & UPPER_MASK) || !(offset & LOWER_MASK)) {
-        if (dawg.is_leaf(dawg_child_id)) {
-          units_[dic_id].set_has_leaf(true);
-        }
-        units_[dic_id].set_offset(offset);
-        return;
-      }
+  // The children of the root are placed at (root_offset ^ label), and
+  // root_offset must not be a label so as not to overwrite the root.
+  id_type root_offset = 1;
+  for (std::size_t i = 0; i < labels.size(); ++i) {
+    if (labels[i] == root_offset) {
+      ++root_offset;
     }
   }
+  if (root_offset >= BLOCK_SIZE) {
+    return false;
+  }
 
-  id_type offset = arrange_from_dawg(dawg, dawg_id, dic_id);
-  if (dawg.is_intersection(dawg_child_id)) {
-    table_[dawg.intersection_id(dawg_child_id)] = offset;
+  // Each part consists of consecutive labels and the parts have about the
+  // same number of keys.
+  AutoArray<std::size_t> part_labels(new std::size_t[num_parts + 1]);
+  AutoArray<std::size_t> part_begins(new std::size_t[num_parts + 1]);
+  std::size_t part_id = 0;
+  for (std::size_t i = 0; i < labels.size() && part_id < num_parts; ++i) {
+    if (begins[i] >= (keyset.num_keys() / num_parts) * part_id) {
+      part_labels[part_id] = i;
+      part_begins[part_id] = begins[i];
+      ++part_id;
+    }
+  }
+  num_parts = part_id;
+  part_labels[num_parts] = labels.size();
+  part_begins[num_parts] = keyset.num_keys();
+  if (num_parts < 2) {
+    return false;
   }
 
-  do {
-    uchar_type child_label = dawg.label(dawg_child_id);
-    id_type dic_child_id = offset ^ child_label;
-    if (child_label != '\0') {
-      build_from_dawg(dawg, dawg_child_id, dic_child_id);
+  AutoPool<id_type> dawg_ids;
+  if (dawg != NULL) {
+    for (id_type id = dawg->child(dawg->root()); id != 0;
+        id = dawg->sibling(id)) {
+      dawg_ids.append(id);
     }
-    dawg_child_id = dawg.sibling(dawg_child_id);
-  } while (dawg_child_id != 0);
-}
+  }
 
-inline id_type DoubleArrayBuilder::arrange_from_dawg(const DawgBuilder &dawg,
-    id_type dawg_id, id_type dic_id) {
-  labels_.resize(0);
+  AutoArray<std::size_t> order(new std::size_t[num_parts]);
+  sort_by_size(&part_begins[0], num_parts, &order[0]);
 
-  id_type dawg_child_id = dawg.child(dawg_id);
-  while (dawg_child_id != 0) {
-    labels_.append(dawg.label(dawg_child_id));
-    dawg_child_id = dawg.sibling(dawg_child_id);
+  AutoArray<DoubleArrayBuilder> parts(new DoubleArrayBuilder[num_parts]);
+  for (std::size_t i = 0; i < num_parts; ++i) {
+    parts[i].extension_shift_ = extension_shift_;
   }
 
-  id_type offset = find_valid_offset(dic_id);
-  units_[dic_id].set_offset(dic_id ^ offset);
+  class Task {
+   public:
+    Task(const Keyset<T> &keyset, const DawgBuilder *dawg,
+        const AutoPool<std::size_t> &begins,
+        const AutoPool<uchar_type> &labels,
+        const AutoPool<id_type> &dawg_ids,
+        const AutoArray<std::size_t> &part_labels, id_type root_offset,
+        AutoArray<DoubleArrayBuilder> &parts)
+        : keyset_(keyset), dawg_(dawg), begins_(begins), labels_(labels),
+          dawg_ids_(dawg_ids), part_labels_(part_labels),
+          root_offset_(root_offset), parts_(parts) {}
 
-  dawg_child_id = dawg.child(dawg_id);
-  for (std::size_t i = 0; i < labels_.size(); ++i) {
-    id_type dic_child_id = offset ^ labels_[i];
-    reserve_id(dic_child_id);
+    void operator()(std::size_t part_id) {
+      parts_[part_id].build_part(keyset_, dawg_, &begins_[0], &labels_[0],
+          dawg_ids_.empty() ? NULL : &dawg_ids_[0], part_labels_[part_id],
+          part_labels_[part_id + 1], root_offset_);
+    }
+
+   private:
+    const Keyset<T> &keyset_;
+    const DawgBuilder *dawg_;
+    const AutoPool<std::size_t> &begins_;
+    const AutoPool<uchar_type> &labels_;
+    const AutoPool<id_type> &dawg_ids_;
+    const AutoArray<std::size_t> &part_labels_;
+    id_type root_offset_;
+    AutoArray<DoubleArrayBuilder> &parts_;
+
+    // Disallows copy and assignment.
+    Task(const Task &);
+    Task &operator=(const Task &);
+  } task(keyset, dawg, begins, labels, dawg_ids, part_labels, root_offset,
+      parts);
+
+  run_tasks(&task, num_parts, &order[0], num_threads_);
+
+  AutoArray<id_type> bases(new id_type[num_parts]);
+  std::size_t num_units = BLOCK_SIZE;
+  for (std::size_t i = 0; i < num_parts; ++i) {
+    std::size_t base = (num_units - BLOCK_SIZE + part_alignment() - 1) &
+        ~static_cast<std::size_t>(part_alignment() - 1);
+    if ((base >> extension_shift_) >= 1U << 21) {
+      DARTS_THROW("failed to build double-array: too large offset");
+    }
+    bases[i] = static_cast<id_type>(base);
+    num_units = base + parts[i].units_.size();
+  }
+
+  // Units which are not used by any part are filled in the same way as
+  // fix_block(), and then the parts are moved into place.
+  units_.resize(num_units);
+  for (std::size_t id = 1; id < num_units; ++id) {
+    units_[id].set_label(static_cast<uchar_type>(id));
+  }
+  units_[0].set_offset(root_offset, extension_shift_);
+  units_[0].set_label('\0');
+
+  for (std::size_t i = 0; i < num_parts; ++i) {
+    DoubleArrayBuilder &part = parts[i];
+    id_type base = bases[i];
+    for (std::size_t j = part_labels[i]; j < part_labels[i + 1]; ++j) {
+      id_type id = root_offset ^ labels[j];
+      unit_type unit = part.units_[id];
+      unit.set_offset(id ^ (base + (id ^ unit.offset(extension_shift_))),
+          extension_shift_);
+      units_[id] = unit;
+    }
+    for (id_type id = BLOCK_SIZE; id < part.units_.size(); ++id) {
+      unit_type unit = part.units_[id];
+      if (!unit.is_leaf()) {
+        unit.set_offset((base + id) ^
+            (base + (id ^ unit.offset(extension_shift_))), extension_shift_);
+      }
+      units_[base + id] = unit;
+    }
+    part.clear();
+  }
+
+  if (progress_func_ != NULL) {
+    progress_func_(keyset.num_keys(), keyset.num_keys() + 1);
+  }
+  return true;
+#else  // DARTS_HAS_THREADS
+  return false;
+#endif  // DARTS_HAS_THREADS
+}
+
+// build_part() builds the subtrees of the root's children labels[first],
+// labels[first + 1], ..., labels[last - 1]. The first block is reserved for
+// the root and its children, and the relative offsets of the other units are
+// restricted by part_alignment() so that the part can be moved.
+template <typename T>
+void DoubleArrayBuilder::build_part(const Keyset<T> &keyset,
+    const DawgBuilder *dawg, const std::size_t *begins,
+    const uchar_type *labels, const id_type *dawg_ids, std::size_t first,
+    std::size_t last, id_type root_offset) {
+  is_part_ = true;
+
+  extras_.reset(new extra_type[NUM_EXTRAS]);
+  extra_blocks_.reset(new extra_block_type[NUM_EXTRA_BLOCKS]);
+  if (dawg != NULL) {
+    table_.reset(new id_type[dawg->num_intersections()]);
+    for (std::size_t i = 0; i < dawg->num_intersections(); ++i) {
+      table_[i] = 0;
+    }
+  }
+
+  for (id_type id = 0; id < BLOCK_SIZE; ++id) {
+    reserve_id(id);
+  }
+
+  for (std::size_t i = first; i < last; ++i) {
+    id_type dic_id = root_offset ^ labels[i];
+    units_[dic_id].set_label(labels[i]);
+    if (dawg != NULL) {
+      build_from_dawg(*dawg, dawg_ids[i], dic_id);
+    } else {
+      build_from_keyset(keyset, begins[i], begins[i + 1], 1, dic_id);
+    }
+  }
+
+  fix_all_blocks();
+
+  extras_.clear();
+  extra_blocks_.clear();
+  labels_.clear();
+  table_.clear();
+}
+
+// split_keyset() splits keys by their first bytes. The keys starting with
+// labels[i] are in [begins[i], begins[i + 1]).
+template <typename T>
+void DoubleArrayBuilder::split_keyset(const Keyset<T> &keyset,
+    AutoPool<std::size_t> *begins, AutoPool<uchar_type> *labels) {
+  for (std::size_t i = 0; i < keyset.num_keys(); ++i) {
+    uchar_type label = keyset.keys(i, 0);
+    if (labels->empty() || label != (*labels)[labels->size() - 1]) {
+      if (!labels->empty() && label < (*labels)[labels->size() - 1]) {
+        DARTS_THROW("failed to build double-array: wrong key order");
+      }
+      begins->append(i);
+      labels->append(label);
+    }
+  }
+  begins->append(keyset.num_keys());
+}
+
+inline void DoubleArrayBuilder::build_from_dawg(const DawgBuilder &dawg) {
+  std::size_t num_units = 1;
+  while (num_units < dawg.size()) {
+    num_units <<= 1;
+  }
+  units_.reserve(num_units);
+
+  table_.reset(new id_type[dawg.num_intersections()]);
+  for (std::size_t i = 0; i < dawg.num_intersections(); ++i) {
+    table_[i] = 0;
+  }
+
+  extras_.reset(new extra_type[NUM_EXTRAS]);
+  extra_blocks_.reset(new extra_block_type[NUM_EXTRA_BLOCKS]);
+
+  reserve_id(0);
+  extra_blocks(0).set_is_used(0);
+  units(0).set_offset(1, extension_shift_);
+  units(0).set_label('\0');
+
+  if (dawg.child(dawg.root()) != 0) {
+    build_from_dawg(dawg, dawg.root(), 0);
+  }
+
+  fix_all_blocks();
+
+  extras_.clear();
+  extra_blocks_.clear();
+  labels_.clear();
+  table_.clear();
+}
+
+inline void DoubleArrayBuilder::build_from_dawg(const DawgBuilder &dawg,
+    id_type dawg_id, id_type dic_id) {
+  id_type dawg_child_id = dawg.child(dawg_id);
+  if (dawg.is_intersection(dawg_child_id)) {
+    id_type intersection_id = dawg.intersection_id(dawg_child_id);
+    id_type offset = table_[intersection_id];
+    if (offset != 0) {
+      offset ^= dic_id;
+      if (is_valid_rel_offset(dic_id, offset)) {
+        if (dawg.is_leaf(dawg_child_id)) {
+          units(dic_id).set_has_leaf(true);
+        }
+        units(dic_id).set_offset(offset, extension_shift_);
+        return;
+      }
+    }
+  }
+
+  id_type offset = arrange_from_dawg(dawg, dawg_id, dic_id);
+  if (dawg.is_intersection(dawg_child_id)) {
+    table_[dawg.intersection_id(dawg_child_id)] = offset;
+  }
+
+  do {
+    uchar_type child_label = dawg.label(dawg_child_id);
+    id_type dic_child_id = offset ^ child_label;
+    if (child_label != '\0') {
+      build_from_dawg(dawg, dawg_child_id, dic_child_id);
+    }
+    dawg_child_id = dawg.sibling(dawg_child_id);
+  } while (dawg_child_id != 0);
+}
+
+inline id_type DoubleArrayBuilder::arrange_from_dawg(const DawgBuilder &dawg,
+    id_type dawg_id, id_type dic_id) {
+  labels_.resize(0);
+
+  id_type dawg_child_id = dawg.child(dawg_id);
+  while (dawg_child_id != 0) {
+    labels_.append(dawg.label(dawg_child_id));
+    dawg_child_id = dawg.sibling(dawg_child_id);
+  }
+
+  id_type offset = find_valid_offset(dic_id);
+  units(dic_id).set_offset(dic_id ^ offset, extension_shift_);
+
+  dawg_child_id = dawg.child(dawg_id);
+  for (std::size_t i = 0; i < labels_.size(); ++i) {
+    id_type dic_child_id = offset ^ labels_[i];
+    reserve_id(dic_child_id);
 
     if (dawg.is_leaf(dawg_child_id)) {
-      units_[dic_id].set_has_leaf(true);
-      units_[dic_child_id].set_value(dawg.value(dawg_child_id));
+      units(dic_id).set_has_leaf(true);
+      units(dic_child_id).set_value(dawg.value(dawg_child_id));
     } else {
-      units_[dic_child_id].set_label(labels_[i]);
+      units(dic_child_id).set_label(labels_[i]);
     }
 
     dawg_child_id = dawg.sibling(dawg_child_id);
   }
-  extras(offset).set_is_used(true);
+  extra_blocks(offset).set_is_used(offset);
+
+  return offset;
+}
+
+// build_from_array() rearranges an existing double-array. Nodes with nonzero
+// `counts' are taken from a max-heap, so the children of the most frequently
+// visited nodes are arranged first and packed into the beginning of the new
+// array. Then, the subtrees of the other nodes are arranged in depth-first
+// order as in build_from_dawg(). If `counts' is NULL, all the nodes are
+// arranged in depth-first order. If `shares_blocks' is true, a block of
+// children shared by nodes, which comes from a DAWG, is shared again if its
+// relative offset is valid. Otherwise, the result is a trie.
+// If `runs' is not NULL, a chain of nodes which have a single child and no
+// leaf is merged into the unit of its first label, and the labels of the
+// chain are kept in `runs', see skip_run().
+template <typename U>
+void DoubleArrayBuilder::build_from_array(const U *units,
+    std::size_t num_units, const id_type *counts, bool shares_blocks,
+    AutoPool<id_type> *runs) {
+  std::size_t num_dic_units = 1;
+  while (num_dic_units < num_units) {
+    num_dic_units <<= 1;
+  }
+  units_.reserve(num_dic_units);
+
+  // table_ maps the offsets in the source array to the new offsets.
+  if (shares_blocks) {
+    table_.reset(new id_type[num_units]);
+    for (std::size_t i = 0; i < num_units; ++i) {
+      table_[i] = 0;
+    }
+  }
+
+  extras_.reset(new extra_type[NUM_EXTRAS]);
+  extra_blocks_.reset(new extra_block_type[NUM_EXTRA_BLOCKS]);
+
+  reserve_id(0);
+  extra_blocks(0).set_is_used(0);
+  units_[0].set_offset(1, extension_shift_);
+  units_[0].set_label('\0');
+
+  AutoPool<hot_node_type> hot_nodes;
+  AutoPool<hot_node_type> cold_nodes;
+  if (counts != NULL) {
+    hot_nodes.append(hot_node_type(counts[0], 0, 0));
+  } else {
+    cold_nodes.append(hot_node_type(0, 0, 0));
+  }
+  while (!hot_nodes.empty()) {
+    std::pop_heap(&hot_nodes[0], &hot_nodes[0] + hot_nodes.size());
+    hot_node_type node = hot_nodes[hot_nodes.size() - 1];
+    hot_nodes.pop_back();
+    build_from_array(units, counts, node.src_id(), node.dic_id(),
+        &hot_nodes, &cold_nodes, runs);
+  }
+  for (std::size_t i = 0; i < cold_nodes.size(); ++i) {
+    build_from_array(units, counts, cold_nodes[i].src_id(),
+        cold_nodes[i].dic_id(), NULL, NULL, runs);
+  }
+
+  fix_all_blocks();
+
+  extras_.clear();
+  extra_blocks_.clear();
+  labels_.clear();
+  table_.clear();
+}
+
+// build_from_array() arranges the children of a node. If `hot_nodes' is not
+// NULL, the children are pushed into `hot_nodes' or appended to `cold_nodes'
+// according to their counts. Otherwise, their subtrees are arranged at once.
+template <typename U>
+void DoubleArrayBuilder::build_from_array(const U *units,
+    const id_type *counts, id_type src_id, id_type dic_id,
+    AutoPool<hot_node_type> *hot_nodes, AutoPool<hot_node_type> *cold_nodes,
+    AutoPool<id_type> *runs) {
+  const U &unit = units[src_id];
+  id_type src_offset = src_id ^ unit.offset();
+
+  id_type offset = table_.empty() ? 0 : table_[src_offset];
+  if (offset != 0) {
+    offset ^= dic_id;
+    if (is_valid_rel_offset(dic_id, offset)) {
+      if (unit.has_leaf()) {
+        units_[dic_id].set_has_leaf(true);
+      }
+      units_[dic_id].set_offset(offset, extension_shift_);
+      return;
+    }
+  }
+
+  offset = arrange_from_array(units, src_id, dic_id);
+  if (!table_.empty()) {
+    table_[src_offset] = offset;
+  }
+
+  // labels_ is overwritten by the following recursive calls.
+  uchar_type labels[256];
+  std::size_t num_labels = labels_.size();
+  for (std::size_t i = 0; i < num_labels; ++i) {
+    labels[i] = labels_[i];
+  }
+
+  for (std::size_t i = 0; i < num_labels; ++i) {
+    if (labels[i] == '\0') {
+      continue;
+    }
+    id_type src_child_id = src_offset ^ labels[i];
+    id_type dic_child_id = offset ^ labels[i];
+    if (runs != NULL) {
+      src_child_id = skip_run(units, src_child_id, labels[i], dic_child_id,
+          runs);
+    }
+    if (hot_nodes == NULL) {
+      build_from_array(units, counts, src_child_id, dic_child_id, NULL, NULL,
+          runs);
+    } else if (counts[src_child_id] != 0) {
+      hot_nodes->append(hot_node_type(counts[src_child_id], src_child_id,
+          dic_child_id));
+      std::push_heap(&(*hot_nodes)[0], &(*hot_nodes)[0] + hot_nodes->size());
+    } else {
+      cold_nodes->append(hot_node_type(0, src_child_id, dic_child_id));
+    }
+  }
+}
+
+template <typename U>
+id_type DoubleArrayBuilder::arrange_from_array(const U *units,
+    id_type src_id, id_type dic_id) {
+  const U &unit = units[src_id];
+  id_type src_offset = src_id ^ unit.offset();
+
+  labels_.resize(0);
+  if (unit.has_leaf()) {
+    labels_.append('\0');
+  }
+  for (id_type label = 1; label < 256; ++label) {
+    if (units[src_offset ^ label].label() == label) {
+      labels_.append(static_cast<uchar_type>(label));
+    }
+  }
+  // Only the root of an empty dictionary has no children.
+  if (labels_.empty()) {
+    return 0;
+  }
+
+  id_type offset = find_valid_offset(dic_id);
+  units_[dic_id].set_offset(dic_id ^ offset, extension_shift_);
+
+  for (std::size_t i = 0; i < labels_.size(); ++i) {
+    id_type dic_child_id = offset ^ labels_[i];
+    reserve_id(dic_child_id);
+
+    if (labels_[i] == '\0') {
+      units_[dic_id].set_has_leaf(true);
+      units_[dic_child_id].set_value(units[src_offset].value());
+    } else {
+      units_[dic_child_id].set_label(labels_[i]);
+    }
+  }
+  extra_blocks(offset).set_is_used(offset);
 
   return offset;
 }
 
+// skip_run() follows the chain from `src_id', which is the child labeled
+// `label', while the node has a single child and no leaf, and returns the
+// last node of the chain, whose children are given to the unit `dic_id'.
+// A chain has at most 4 labels, and if it has 2 or more, the labels are
+// stored in runs[dic_id] in the order of memory and padded with 0s.
+// Because the chain depends only on the subtree of `src_id', a block shared
+// by nodes of a DAWG gets the same runs.
+template <typename U>
+id_type DoubleArrayBuilder::skip_run(const U *units, id_type src_id,
+    uchar_type label, id_type dic_id, AutoPool<id_type> *runs) {
+  uchar_type run[4] = { label, 0, 0, 0 };
+  std::size_t run_length = 1;
+  for ( ; run_length < 4; ++run_length) {
+    const U &unit = units[src_id];
+    if (unit.has_leaf()) {
+      break;
+    }
+    id_type src_offset = src_id ^ unit.offset();
+    id_type child_label = 0;
+    for (id_type i = 1; i < 256; ++i) {
+      if (units[src_offset ^ i].label() == i) {
+        if (child_label != 0) {
+          child_label = 0;
+          break;
+        }
+        child_label = i;
+      }
+    }
+    if (child_label == 0) {
+      break;
+    }
+    run[run_length] = static_cast<uchar_type>(child_label);
+    src_id = src_offset ^ child_label;
+  }
+
+  if (run_length > 1) {
+    if (runs->size() <= dic_id) {
+      runs->resize(dic_id + 1, 0);
+    }
+    std::memcpy(&(*runs)[dic_id], run, sizeof(id_type));
+  }
+  return src_id;
+}
+
 template <typename T>
 void DoubleArrayBuilder::build_from_keyset(const Keyset<T> &keyset) {
   std::size_t num_units = 1;
@@ -1672,11 +4237,12 @@ void DoubleArrayBuilder::build_from_keyset(const Keyset<T> &keyset) {
   units_.reserve(num_units);
 
   extras_.reset(new extra_type[NUM_EXTRAS]);
+  extra_blocks_.reset(new extra_block_type[NUM_EXTRA_BLOCKS]);
 
   reserve_id(0);
-  extras(0).set_is_used(true);
-  units_[0].set_offset(1);
-  units_[0].set_label('\0');
+  extra_blocks(0).set_is_used(0);
+  units(0).set_offset(1, extension_shift_);
+  units(0).set_label('\0');
 
   if (keyset.num_keys() > 0) {
     build_from_keyset(keyset, 0, keyset.num_keys(), 0, 0);
@@ -1685,6 +4251,7 @@ void DoubleArrayBuilder::build_from_keyset(const Keyset<T> &keyset) {
   fix_all_blocks();
 
   extras_.clear();
+  extra_blocks_.clear();
   labels_.clear();
 }
 
@@ -1752,94 +4319,163 @@ id_type DoubleArrayBuilder::arrange_from_keyset(const Keyset<T> &keyset,
   }
 
   id_type offset = find_valid_offset(dic_id);
-  units_[dic_id].set_offset(dic_id ^ offset);
+  units(dic_id).set_offset(dic_id ^ offset, extension_shift_);
 
   for (std::size_t i = 0; i < labels_.size(); ++i) {
     id_type dic_child_id = offset ^ labels_[i];
     reserve_id(dic_child_id);
     if (labels_[i] == '\0') {
-      units_[dic_id].set_has_leaf(true);
-      units_[dic_child_id].set_value(value);
+      units(dic_id).set_has_leaf(true);
+      units(dic_child_id).set_value(value);
     } else {
-      units_[dic_child_id].set_label(labels_[i]);
+      units(dic_child_id).set_label(labels_[i]);
     }
   }
-  extras(offset).set_is_used(true);
+  extra_blocks(offset).set_is_used(offset);
 
   return offset;
 }
 
+// find_valid_offset() returns the first offset in the extras window that
+// accepts all the labels. Candidates are the offsets which put labels_[0] on
+// unfixed units, and they are enumerated from the bitmaps of blocks. Blocks
+// which have fewer unfixed units than labels are skipped. If there are many
+// labels, they are tested at once by are_fixed().
 inline id_type DoubleArrayBuilder::find_valid_offset(id_type id) const {
-  if (extras_head_ >= units_.size()) {
-    return units_.size() | (id & LOWER_MASK);
+  if (extras_head_ >= num_units()) {
+    return find_new_offset(id);
   }
 
-  id_type unfixed_id = extras_head_;
-  do {
-    id_type offset = unfixed_id ^ labels_[0];
-    if (is_valid_offset(id, offset)) {
-      return offset;
+  id_type label_word_ids[extra_block_type::NUM_WORDS];
+  id_type label_words[extra_block_type::NUM_WORDS];
+  std::size_t num_label_words = 0;
+  if (labels_.size() > MAX_NUM_SCANNED_LABELS) {
+    id_type label_bits[extra_block_type::NUM_WORDS] = { 0 };
+    for (std::size_t i = 1; i < labels_.size(); ++i) {
+      label_bits[labels_[i] / 32] |= 1U << (labels_[i] % 32);
+    }
+    for (id_type i = 0; i < extra_block_type::NUM_WORDS; ++i) {
+      if (label_bits[i] != 0) {
+        label_word_ids[num_label_words] = i;
+        label_words[num_label_words] = label_bits[i];
+        ++num_label_words;
+      }
     }
-    unfixed_id = extras(unfixed_id).next();
-  } while (unfixed_id != extras_head_);
+  }
 
-  return units_.size() | (id & LOWER_MASK);
-}
+  for (id_type block_id = extras_head_ / BLOCK_SIZE;
+      block_id < num_blocks(); ++block_id) {
+    id_type begin = block_id * BLOCK_SIZE;
+    const extra_block_type &block = extra_blocks(begin);
+    if (BLOCK_SIZE - block.num_fixed() < labels_.size()) {
+      continue;
+    }
 
-inline bool DoubleArrayBuilder::is_valid_offset(id_type id,
-    id_type offset) const {
-  if (extras(offset).is_used()) {
-    return false;
-  }
+    for (id_type words = block.unfixed_words(); words != 0;
+        words &= words - 1) {
+      id_type i = extra_block_type::lowest_bit(words);
+      for (id_type bits = block.unfixed_bits(i); bits != 0;
+          bits &= bits - 1) {
+        id_type offset = (begin + (32 * i) +
+            extra_block_type::lowest_bit(bits)) ^ labels_[0];
+        if (block.is_used(offset) || !is_valid_rel_offset(id, id ^ offset)) {
+          continue;
+        }
 
-  id_type rel_offset = id ^ offset;
-  if ((rel_offset & LOWER_MASK) && (rel_offset & UPPER_MASK)) {
-    return false;
+        if (num_label_words != 0) {
+          if (!block.are_fixed(offset, label_word_ids, label_words,
+              num_label_words)) {
+            return offset;
+          }
+          continue;
+        }
+
+        std::size_t j = 1;
+        while (j < labels_.size() && !block.is_fixed(offset ^ labels_[j])) {
+          ++j;
+        }
+        if (j == labels_.size()) {
+          return offset;
+        }
+      }
+    }
   }
 
-  for (std::size_t i = 1; i < labels_.size(); ++i) {
-    if (extras(offset ^ labels_[i]).is_fixed()) {
-      return false;
+  return find_new_offset(id);
+}
+
+// find_new_offset() returns an offset in a new block after the last block.
+// The offset has the same lower bits as `id', and so the relative offset is a
+// multiple of 256. If it is not a multiple of 2^extension_shift_ but 2^21 or
+// more, the offset skips some blocks to have more lower bits in common.
+inline id_type DoubleArrayBuilder::find_new_offset(id_type id) const {
+  std::size_t offset = num_units() | (id & LOWER_MASK);
+  if (!is_valid_rel_offset(id, id ^ static_cast<id_type>(offset))) {
+    id_type mask = (1U << extension_shift_) - 1;
+    offset = (num_units() & ~static_cast<std::size_t>(mask)) | (id & mask);
+    if (offset < num_units()) {
+      offset += mask + 1;
     }
   }
+  if (static_cast<id_type>(offset) != offset) {
+    DARTS_THROW("failed to build double-array: too many units");
+  }
+  return static_cast<id_type>(offset);
+}
 
-  return true;
+// A relative offset must be less than 2^21 or a multiple of
+// 2^extension_shift_ to fit into a unit. In a part, the first block stays at
+// the head of the whole array and the other blocks are moved, so their
+// relative offsets are restricted more.
+inline bool DoubleArrayBuilder::is_valid_rel_offset(id_type id,
+    id_type rel_offset) const {
+  if (!(rel_offset & ((1U << extension_shift_) - 1))) {
+    return true;
+  } else if (is_part_) {
+    return id >= BLOCK_SIZE && rel_offset < part_alignment();
+  }
+  return rel_offset < 1U << 21;
 }
 
+// reserve_id() appends blocks until `id' is in the array, and so more than one
+// block is appended if find_new_offset() skips blocks.
 inline void DoubleArrayBuilder::reserve_id(id_type id) {
-  if (id >= units_.size()) {
+  while (id >= num_units()) {
     expand_units();
   }
 
   if (id == extras_head_) {
     extras_head_ = extras(id).next();
     if (extras_head_ == id) {
-      extras_head_ = units_.size();
+      extras_head_ = num_units();
     }
   }
   extras(extras(id).prev()).set_next(extras(id).next());
   extras(extras(id).next()).set_prev(extras(id).prev());
-  extras(id).set_is_fixed(true);
+  extra_blocks(id).set_is_fixed(id);
 }
 
 inline void DoubleArrayBuilder::expand_units() {
-  id_type src_num_units = units_.size();
+  id_type src_num_units = num_units();
   id_type src_num_blocks = num_blocks();
 
   id_type dest_num_units = src_num_units + BLOCK_SIZE;
   id_type dest_num_blocks = src_num_blocks + 1;
+  if (dest_num_units < src_num_units) {
+    DARTS_THROW("failed to build double-array: too many units");
+  }
 
   if (dest_num_blocks > NUM_EXTRA_BLOCKS) {
     fix_block(src_num_blocks - NUM_EXTRA_BLOCKS);
+    if (file_ != NULL) {
+      spill_block();
+    }
   }
 
-  units_.resize(dest_num_units);
+  units_.resize(units_begin_ + (dest_num_units - num_spilled_units_));
 
   if (dest_num_blocks > NUM_EXTRA_BLOCKS) {
-    for (std::size_t id = src_num_units; id < dest_num_units; ++id) {
-      extras(id).set_is_used(false);
-      extras(id).set_is_fixed(false);
-    }
+    extra_blocks(src_num_units).clear();
   }
 
   for (id_type i = src_num_units + 1; i < dest_num_units; ++i) {
@@ -1875,57 +4511,4057 @@ inline void DoubleArrayBuilder::fix_block(id_type block_id) {
 
   id_type unused_offset = 0;
   for (id_type offset = begin; offset != end; ++offset) {
-    if (!extras(offset).is_used()) {
+    if (!extra_blocks(offset).is_used(offset)) {
       unused_offset = offset;
       break;
     }
   }
 
   for (id_type id = begin; id != end; ++id) {
-    if (!extras(id).is_fixed()) {
+    if (!extra_blocks(id).is_fixed(id)) {
       reserve_id(id);
-      units_[id].set_label(static_cast<uchar_type>(id ^ unused_offset));
+      units(id).set_label(static_cast<uchar_type>(id ^ unused_offset));
     }
   }
 }
 
-}  // namespace Details
-
-//
-// Member function build() of DoubleArrayImpl.
-//
+// spilled_unit() returns a unit which has been written into the file. A
+// spilled unit is rarely modified, only if it is a node whose children are
+// arranged late, so it is read and written one by one.
+inline DoubleArrayBuilderUnit &DoubleArrayBuilder::spilled_unit(id_type id) {
+  if (id != spilled_id_) {
+    write_spilled_unit();
+    seek_unit(id);
+    if (std::fread(&spilled_unit_, sizeof(unit_type), 1, file_) != 1) {
+      DARTS_THROW("failed to build double-array: failed to read unit");
+    }
+    spilled_id_ = id;
+  }
+  return spilled_unit_;
+}
 
-template <typename A, typename B, typename T, typename C>
-int DoubleArrayImpl<A, B, T, C>::build(std::size_t num_keys,
-    const key_type * const *keys, const std::size_t *lengths,
-    const value_type *values, Details::progress_func_type progress_func) {
-  Details::Keyset<value_type> keyset(num_keys, keys, lengths, values);
+inline void DoubleArrayBuilder::write_spilled_unit() {
+  if (spilled_id_ == NO_ID) {
+    return;
+  }
+  seek_unit(spilled_id_);
+  if (std::fwrite(&spilled_unit_, sizeof(unit_type), 1, file_) != 1) {
+    DARTS_THROW("failed to build double-array: failed to write unit");
+  }
+  spilled_id_ = NO_ID;
+}
 
-  Details::DoubleArrayBuilder builder(progress_func);
-  builder.build(keyset);
+// spill_block() writes the first block of units_, which has just been fixed,
+// into the file and skips it by moving `units_begin_'. The kept units are
+// moved to the front only when the skipped units outnumber them, so each unit
+// is moved at most once on average.
+inline void DoubleArrayBuilder::spill_block() {
+  seek_unit(num_spilled_units_);
+  if (std::fwrite(&units_[units_begin_], sizeof(unit_type), BLOCK_SIZE,
+      file_) != BLOCK_SIZE) {
+    DARTS_THROW("failed to build double-array: failed to write units");
+  }
+  units_begin_ += BLOCK_SIZE;
+  num_spilled_units_ += BLOCK_SIZE;
+
+  std::size_t num_kept_units = units_.size() - units_begin_;
+  if (units_begin_ >= num_kept_units) {
+    for (std::size_t i = 0; i < num_kept_units; ++i) {
+      units_[i] = units_[units_begin_ + i];
+    }
+    units_.resize(num_kept_units);
+    units_begin_ = 0;
+  }
+}
 
-  std::size_t size = 0;
-  unit_type *buf = NULL;
-  builder.copy(&size, &buf);
+inline void DoubleArrayBuilder::seek_unit(id_type id) {
+  long long position = file_offset_ +
+      static_cast<long long>(sizeof(unit_type)) * id;
+#if defined(_WIN32)
+  int result = ::_fseeki64(file_, position, SEEK_SET);
+#else  // defined(_WIN32)
+  int result = ::fseeko(file_, static_cast<off_t>(position), SEEK_SET);
+#endif  // defined(_WIN32)
+  if (result != 0) {
+    DARTS_THROW("failed to build double-array: failed to seek file");
+  }
+}
 
+inline void DoubleArrayBuilder::open_stream(std::FILE *file,
+    std::size_t max_num_buffered_keys) {
   clear();
 
-  size_ = size;
-  array_ = buf;
-  buf_ = buf;
-
-  if (progress_func != NULL) {
-    progress_func(num_keys + 1, num_keys + 1);
+  file_ = file;
+#if defined(_WIN32)
+  file_offset_ = ::_ftelli64(file);
+#else  // defined(_WIN32)
+  file_offset_ = static_cast<long long>(::ftello(file));
+#endif  // defined(_WIN32)
+  if (file_offset_ < 0) {
+    DARTS_THROW("failed to build double-array: failed to tell position");
   }
+  max_num_stream_keys_ = std::max(max_num_buffered_keys,
+      static_cast<std::size_t>(MIN_NUM_STREAM_KEYS));
 
-  return 0;
+  extras_.reset(new extra_type[NUM_EXTRAS]);
+  extra_blocks_.reset(new extra_block_type[NUM_EXTRA_BLOCKS]);
+
+  reserve_id(0);
+  extra_blocks(0).set_is_used(0);
+  units(0).set_offset(1, extension_shift_);
+  units(0).set_label('\0');
+}
+
+// insert_into_stream() buffers a key. Before that, the nodes which the key
+// leaves are closed, that is, the buffered keys are arranged because no more
+// keys are added to their subtrees. If the buffer is full, flush_stream()
+// makes room.
+inline void DoubleArrayBuilder::insert_into_stream(const char_type *key,
+    std::size_t length, value_type value) {
+  if (value < 0) {
+    DARTS_THROW("failed to build double-array: negative value");
+  }
+  for (std::size_t i = 0; i < length; ++i) {
+    if (key[i] == '\0') {
+      DARTS_THROW("failed to build double-array: invalid null character");
+    }
+  }
+
+  if (!stream_ends_.empty()) {
+    std::size_t last_id = stream_ends_.size() - 1;
+    const char_type *last_key = stream_key(last_id);
+    std::size_t last_length = stream_length(last_id);
+    std::size_t depth = 0;
+    while (depth < length && depth < last_length &&
+        key[depth] == last_key[depth]) {
+      ++depth;
+    }
+    if (depth == length && depth == last_length) {
+      return;
+    } else if (depth == length || (depth < last_length &&
+        static_cast<uchar_type>(key[depth]) <
+        static_cast<uchar_type>(last_key[depth]))) {
+      DARTS_THROW("failed to build double-array: wrong key order");
+    }
+
+    if (stream_offsets_.size() > depth + 1) {
+      build_stream(stream_ends_.size());
+      remove_stream_keys(stream_ends_.size());
+      stream_offsets_.resize(depth + 1);
+    }
+  }
+
+  for (std::size_t i = 0; i < length; ++i) {
+    stream_keys_.append(key[i]);
+  }
+  stream_ends_.append(stream_keys_.size());
+  stream_values_.append(value);
+
+  if (stream_ends_.size() >= max_num_stream_keys_) {
+    flush_stream();
+  }
+}
+
+inline std::size_t DoubleArrayBuilder::close_stream() {
+  build_stream(stream_ends_.size());
+  fix_all_blocks();
+
+  std::size_t num_kept_units = units_.size() - units_begin_;
+  if (num_kept_units != 0) {
+    seek_unit(num_spilled_units_);
+    if (std::fwrite(&units_[units_begin_], sizeof(unit_type), num_kept_units,
+        file_) != num_kept_units) {
+      DARTS_THROW("failed to build double-array: failed to write units");
+    }
+  }
+  write_spilled_unit();
+
+  std::size_t size = num_units();
+  clear();
+  return size;
+}
+
+// flush_stream() arranges the buffered keys except the last group, which
+// shares the label of the last key and may get more keys. If the last group
+// still fills half the buffer, its node is opened, that is, the node gets a
+// whole block for its children so that the keys can be arranged before all
+// the labels of the children are known, and then the keys are flushed again
+// at the next depth. The root is opened first.
+inline void DoubleArrayBuilder::flush_stream() {
+  for ( ; ; ) {
+    if (stream_offsets_.empty()) {
+      open_stream_node(0);
+    }
+    std::size_t depth = stream_offsets_.size() - 1;
+    std::size_t num_keys = stream_ends_.size();
+    uchar_type label = stream_label(num_keys - 1, depth);
+    std::size_t begin = num_keys - 1;
+    while (begin > 0 && stream_label(begin - 1, depth) == label) {
+      --begin;
+    }
+    build_stream(begin);
+    remove_stream_keys(begin);
+
+    if (label == '\0' || stream_ends_.size() * 2 < max_num_stream_keys_) {
+      break;
+    }
+    id_type id = stream_offsets_[depth] ^ label;
+    units(id).set_label(label);
+    open_stream_node(id);
+  }
+}
+
+// build_stream() arranges the first `num_keys' buffered keys. They are
+// arranged as the subtrees of the children of the deepest open node, or as
+// the whole trie if the root has not been opened.
+inline void DoubleArrayBuilder::build_stream(std::size_t num_keys) {
+  if (num_keys == 0) {
+    return;
+  }
+
+  AutoPool<const char_type *> keys;
+  AutoPool<std::size_t> lengths;
+  for (std::size_t i = 0; i < num_keys; ++i) {
+    keys.append(stream_key(i));
+    lengths.append(stream_length(i));
+  }
+  Keyset<value_type> keyset(num_keys, &keys[0], &lengths[0],
+      &stream_values_[0]);
+
+  if (stream_offsets_.empty()) {
+    build_from_keyset(keyset, 0, num_keys, 0, 0);
+    return;
+  }
+
+  std::size_t depth = stream_offsets_.size() - 1;
+  id_type offset = stream_offsets_[depth];
+  id_type node_id = (depth == 0) ? 0 :
+      (stream_offsets_[depth - 1] ^ keyset.keys(0, depth - 1));
+  std::size_t begin = 0;
+  while (begin < num_keys) {
+    uchar_type label = keyset.keys(begin, depth);
+    std::size_t end = begin + 1;
+    while (end < num_keys && keyset.keys(end, depth) == label) {
+      ++end;
+    }
+    id_type id = offset ^ label;
+    if (label == '\0') {
+      units(node_id).set_has_leaf(true);
+      units(id).set_value(keyset.values(begin));
+    } else {
+      units(id).set_label(label);
+      build_from_keyset(keyset, begin, end, depth + 1, id);
+    }
+    begin = end;
+  }
+}
+
+// open_stream_node() reserves a new block for the children of a node. The
+// units which are not used by the children get labels which never match.
+inline void DoubleArrayBuilder::open_stream_node(id_type id) {
+  id_type offset = find_new_offset(id);
+  for (id_type label = 0; label < BLOCK_SIZE; ++label) {
+    reserve_id(offset ^ label);
+    units(offset ^ label).set_label(static_cast<uchar_type>(~label));
+  }
+  extra_blocks(offset).set_is_used(offset);
+  units(id).set_offset(id ^ offset, extension_shift_);
+  stream_offsets_.append(offset);
+}
+
+inline void DoubleArrayBuilder::remove_stream_keys(std::size_t num_keys) {
+  if (num_keys == 0) {
+    return;
+  }
+  std::size_t num_chars = stream_ends_[num_keys - 1];
+  for (std::size_t i = num_chars; i < stream_keys_.size(); ++i) {
+    stream_keys_[i - num_chars] = stream_keys_[i];
+  }
+  stream_keys_.resize(stream_keys_.size() - num_chars);
+  for (std::size_t i = num_keys; i < stream_ends_.size(); ++i) {
+    stream_ends_[i - num_keys] = stream_ends_[i] - num_chars;
+    stream_values_[i - num_keys] = stream_values_[i];
+  }
+  stream_ends_.resize(stream_ends_.size() - num_keys);
+  stream_values_.resize(stream_values_.size() - num_keys);
+}
+
+}  // namespace Details
+
+//
+// Predictive search of DoubleArrayImpl.
+//
+
+// <PredictiveCursor> walks the subtree below the prefix in depth-first order.
+// `ids_' keeps the path from the prefix node to the current node, `key_'
+// keeps the key of the current node followed by a '\0', and `label_' is the
+// next label to be tested at the current node, where 0 stands for the leaf.
+template <typename A, typename B, typename T, typename C>
+class DoubleArrayImpl<A, B, T, C>::PredictiveCursor {
+ public:
+  PredictiveCursor() : dic_(NULL), ids_(), key_(), label_(0), value_(0) {}
+  PredictiveCursor(const DoubleArrayImpl &dic, const key_type *key,
+      std::size_t length = 0, std::size_t node_pos = 0)
+      : dic_(NULL), ids_(), key_(), label_(0), value_(0) {
+    reset(dic, key, length, node_pos);
+  }
+
+  // reset() starts a new enumeration. If there is no key which starts with
+  // the given key, the following next() returns false.
+  void reset(const DoubleArrayImpl &dic, const key_type *key,
+      std::size_t length = 0, std::size_t node_pos = 0);
+
+  // next() moves the cursor to the next key and returns true, or returns
+  // false if there are no more keys.
+  bool next();
+
+  // key() returns the current key, which is terminated by a '\0'.
+  const key_type *key() const {
+    return &key_[0];
+  }
+  std::size_t length() const {
+    return key_.size() - 1;
+  }
+  value_type value() const {
+    return value_;
+  }
+
+ private:
+  const DoubleArrayImpl *dic_;
+  Details::AutoPool<id_type> ids_;
+  Details::AutoPool<key_type> key_;
+  id_type label_;
+  value_type value_;
+
+  // Disallows copy and assignment.
+  PredictiveCursor(const PredictiveCursor &);
+  PredictiveCursor &operator=(const PredictiveCursor &);
+};
+
+template <typename A, typename B, typename T, typename C>
+void DoubleArrayImpl<A, B, T, C>::PredictiveCursor::reset(
+    const DoubleArrayImpl &dic, const key_type *key, std::size_t length,
+    std::size_t node_pos) {
+  dic_ = &dic;
+  ids_.resize(0);
+  key_.resize(0);
+  label_ = 0;
+  value_ = 0;
+
+  std::size_t key_pos = 0;
+  if (dic.traverse(key, node_pos, key_pos, length) ==
+      static_cast<value_type>(-2)) {
+    key_.append(static_cast<key_type>('\0'));
+    return;
+  }
+
+  for (std::size_t i = 0; i < key_pos; ++i) {
+    key_.append(key[i]);
+  }
+  key_.append(static_cast<key_type>('\0'));
+  ids_.append(static_cast<id_type>(node_pos));
+}
+
+template <typename A, typename B, typename T, typename C>
+bool DoubleArrayImpl<A, B, T, C>::PredictiveCursor::next() {
+  while (!ids_.empty()) {
+    id_type id = ids_[ids_.size() - 1];
+    unit_type unit = dic_->array_[id];
+    id_type base = id ^ unit.offset();
+
+    if (label_ == 0) {
+      label_ = 1;
+      if (unit.has_leaf()) {
+        value_ = dic_->leaf_value(dic_->array_[base]);
+        return true;
+      }
+    }
+
+    while (label_ <= 0xFF && dic_->array_[base ^ label_].label() != label_) {
+      ++label_;
+    }
+
+    if (label_ <= 0xFF) {
+      key_[key_.size() - 1] = static_cast<key_type>(label_);
+      key_.append(static_cast<key_type>('\0'));
+      ids_.append(base ^ label_);
+      label_ = 0;
+    } else {
+      ids_.pop_back();
+      if (!ids_.empty()) {
+        key_.pop_back();
+        label_ = static_cast<uchar_type>(key_[key_.size() - 1]) + 1;
+        key_[key_.size() - 1] = static_cast<key_type>('\0');
+      }
+    }
+  }
+  return false;
+}
+
+template <typename A, typename B, typename T, typename C>
+template <typename F>
+inline std::size_t DoubleArrayImpl<A, B, T, C>::predictiveSearch(
+    const key_type *key, F callback, std::size_t length,
+    std::size_t node_pos) const {
+  PredictiveCursor cursor(*this, key, length, node_pos);
+  std::size_t num_keys = 0;
+  while (cursor.next()) {
+    ++num_keys;
+    if (!callback(cursor.key(), cursor.length(), cursor.value())) {
+      break;
+    }
+  }
+  return num_keys;
+}
+
+//
+// Stream builder of DoubleArrayImpl.
+//
+
+template <typename A, typename B, typename T, typename C>
+class DoubleArrayImpl<A, B, T, C>::StreamBuilder {
+ public:
+  enum { DEFAULT_NUM_BUFFERED_KEYS = 1 << 16 };
+
+  StreamBuilder()
+      : builder_(NULL, 1, unit_type::EXTENSION_SHIFT), file_(NULL),
+        has_header_(false), num_keys_(0), size_(0) {}
+  ~StreamBuilder() {
+    if (file_ != NULL) {
+      std::fclose(file_);
+    }
+  }
+
+  // open() creates a file and starts a new dictionary. `with_header' works
+  // as well as in save(). At most `max_num_buffered_keys' keys are buffered
+  // in memory, but at least 1024 keys are buffered. A smaller buffer makes a
+  // larger array because the nodes whose subtrees do not fit into the buffer
+  // take a whole block of 256 units for their children. For 300k random
+  // keys, a buffer of 256 keys made the array 15% larger than build(), and a
+  // buffer of 1024 keys made it 0.6% larger. open() returns 0 iff it
+  // succeeds.
+  int open(const char *file_name, bool with_header = false,
+      std::size_t max_num_buffered_keys = DEFAULT_NUM_BUFFERED_KEYS);
+
+  // insert() adds a key. If `length' is 0, `key' is handled as a
+  // zero-terminated string. The keys must be given in order and the values
+  // must not be negative, and otherwise insert() throws a <Darts::Exception>.
+  // If there are duplicate keys, only the first one is stored. If `value' is
+  // omitted, the number of keys given so far is associated with the key as
+  // build() does.
+  void insert(const key_type *key, std::size_t length, value_type value);
+  void insert(const key_type *key, std::size_t length = 0) {
+    insert(key, length, static_cast<value_type>(num_keys_));
+  }
+
+  // close() arranges the rest of the keys and completes the file. It returns
+  // 0 iff it succeeds.
+  int close();
+
+  // num_keys() returns the number of keys given to insert(). size() and
+  // total_size() return the number of units and bytes written by close(),
+  // not including the header.
+  std::size_t num_keys() const {
+    return num_keys_;
+  }
+  std::size_t size() const {
+    return size_;
+  }
+  std::size_t total_size() const {
+    return sizeof(unit_type) * size_;
+  }
+
+ private:
+  Details::DoubleArrayBuilder builder_;
+  std::FILE *file_;
+  bool has_header_;
+  std::size_t num_keys_;
+  std::size_t size_;
+
+  // Disallows copy and assignment.
+  StreamBuilder(const StreamBuilder &);
+  StreamBuilder &operator=(const StreamBuilder &);
+
+  int write_header();
+};
+
+template <typename A, typename B, typename T, typename C>
+int DoubleArrayImpl<A, B, T, C>::StreamBuilder::open(const char *file_name,
+    bool with_header, std::size_t max_num_buffered_keys) {
+  if (has_value_table()) {
+    return -1;
+  }
+  if (file_ != NULL) {
+    std::fclose(file_);
+    file_ = NULL;
+  }
+  num_keys_ = 0;
+  size_ = 0;
+
+#ifdef _MSC_VER
+  if (::fopen_s(&file_, file_name, "w+b") != 0) {
+    file_ = NULL;
+    return -1;
+  }
+#else
+  file_ = std::fopen(file_name, "w+b");
+  if (file_ == NULL) {
+    return -1;
+  }
+#endif
+
+  // The header is written by close() because it has the checksum.
+  has_header_ = with_header || format_flags() != 0;
+  if (has_header_) {
+    Details::DoubleArrayHeader header;
+    if (std::fwrite(header.data(), 1, header.size(), file_) !=
+        header.size()) {
+      std::fclose(file_);
+      file_ = NULL;
+      return -1;
+    }
+  }
+
+  builder_.open_stream(file_, max_num_buffered_keys);
+  return 0;
+}
+
+template <typename A, typename B, typename T, typename C>
+void DoubleArrayImpl<A, B, T, C>::StreamBuilder::insert(const key_type *key,
+    std::size_t length, value_type value) {
+  if (file_ == NULL) {
+    DARTS_THROW("failed to insert key: no file");
+  }
+  if (length == 0) {
+    while (key[length] != '\0') {
+      ++length;
+    }
+  }
+  builder_.insert_into_stream(key, length,
+      static_cast<Details::value_type>(value));
+  ++num_keys_;
+}
+
+template <typename A, typename B, typename T, typename C>
+int DoubleArrayImpl<A, B, T, C>::StreamBuilder::close() {
+  if (file_ == NULL) {
+    return -1;
+  }
+  size_ = builder_.close_stream();
+
+  int result = has_header_ ? write_header() : 0;
+  if (std::fclose(file_) != 0) {
+    result = -1;
+  }
+  file_ = NULL;
+  return result;
+}
+
+// write_header() reads the units back from the file to compute the checksum,
+// and then writes the header at the beginning of the file.
+template <typename A, typename B, typename T, typename C>
+int DoubleArrayImpl<A, B, T, C>::StreamBuilder::write_header() {
+  Details::DoubleArrayHeader header;
+  if (std::fseek(file_, static_cast<long>(header.size()), SEEK_SET) != 0) {
+    return -1;
+  }
+
+  id_type lanes[Details::Checksum::NUM_LANES];
+  Details::Checksum::init(lanes);
+  id_type buf[1 << 12];
+  for (std::size_t i = 0; i < size_; ) {
+    std::size_t num_units = size_ - i;
+    if (num_units > sizeof(buf) / sizeof(buf[0])) {
+      num_units = sizeof(buf) / sizeof(buf[0]);
+    }
+    if (std::fread(buf, sizeof(unit_type), num_units, file_) != num_units) {
+      return -1;
+    }
+    Details::Checksum::update(lanes, buf, sizeof(unit_type) * num_units);
+    i += num_units;
+  }
+
+  header.init(size_, num_keys_, Details::Checksum::finish(lanes, NULL,
+      sizeof(unit_type) * size_), format_flags(), value_size(), 0);
+  if (std::fseek(file_, 0, SEEK_SET) != 0 ||
+      std::fwrite(header.data(), 1, header.size(), file_) != header.size()) {
+    return -1;
+  }
+  return 0;
+}
+
+//
+// Member function build() of DoubleArrayImpl.
+//
+
+template <typename A, typename B, typename T, typename C>
+int DoubleArrayImpl<A, B, T, C>::build(std::size_t num_keys,
+    const key_type * const *keys, const std::size_t *lengths,
+    const value_type *values, Details::progress_func_type progress_func,
+    std::size_t num_threads) {
+  // If there is a value table, the values are not given to the builder, and
+  // then leaf units keep the IDs of keys.
+  Details::Keyset<value_type> keyset(num_keys, keys, lengths,
+      has_value_table() ? NULL : values);
+
+  if (has_value_table() && values != NULL) {
+    for (std::size_t i = 0; i < num_keys; ++i) {
+      if (values[i] < 0) {
+        DARTS_THROW("failed to build double-array: negative value");
+      }
+    }
+  }
+
+  Details::DoubleArrayBuilder builder(progress_func, num_threads,
+      unit_type::EXTENSION_SHIFT);
+  builder.build(keyset);
+
+  std::size_t size = 0;
+  unit_type *buf = NULL;
+  builder.copy(&size, &buf);
+
+  value_type *value_buf = NULL;
+  if (has_value_table()) {
+    try {
+      value_buf = new value_type[num_keys];
+    } catch (const std::bad_alloc &) {
+      delete[] buf;
+      DARTS_THROW("failed to build double-array: std::bad_alloc");
+    }
+    for (std::size_t i = 0; i < num_keys; ++i) {
+      value_buf[i] = (values != NULL) ? values[i] :
+          static_cast<value_type>(i);
+    }
+  }
+
+  clear();
+
+  size_ = size;
+  array_ = buf;
+  buf_ = buf;
+  num_keys_ = num_keys;
+  values_ = value_buf;
+  values_buf_ = value_buf;
+
+  if (progress_func != NULL) {
+    progress_func(num_keys + 1, num_keys + 1);
+  }
+
+  return 0;
+}
+
+//
+// Member function relayout() of DoubleArrayImpl.
+//
+
+template <typename A, typename B, typename T, typename C>
+int DoubleArrayImpl<A, B, T, C>::relayout(std::size_t num_queries,
+    const key_type * const *queries, const std::size_t *lengths,
+    const std::size_t *frequencies) {
+  if (size_ == 0) {
+    return -1;
+  }
+
+  // Counts saturate at the maximum of <id_type>.
+  static const id_type MAX_COUNT = static_cast<id_type>(~0U);
+  Details::AutoArray<id_type> counts;
+  try {
+    counts.reset(new id_type[size_]);
+  } catch (const std::bad_alloc &) {
+    DARTS_THROW("failed to relayout double-array: std::bad_alloc");
+  }
+  for (std::size_t i = 0; i < size_; ++i) {
+    counts[i] = 0;
+  }
+
+  Details::Keyset<value_type> keyset(num_queries, queries, lengths, NULL);
+  for (std::size_t i = 0; i < num_queries; ++i) {
+    id_type frequency = 1;
+    if (frequencies != NULL) {
+      frequency = (frequencies[i] < MAX_COUNT) ?
+          static_cast<id_type>(frequencies[i]) : MAX_COUNT;
+    }
+
+    const key_type *query = keyset.keys(i);
+    std::size_t length = keyset.lengths(i);
+    id_type id = 0;
+    for (std::size_t j = 0; ; ++j) {
+      counts[id] = (counts[id] < MAX_COUNT - frequency) ?
+          (counts[id] + frequency) : MAX_COUNT;
+      if (j == length) {
+        break;
+      }
+      id ^= array_[id].offset() ^ static_cast<uchar_type>(query[j]);
+      if (array_[id].label() != static_cast<uchar_type>(query[j])) {
+        break;
+      }
+    }
+  }
+
+  Details::DoubleArrayBuilder builder(NULL, 1, unit_type::EXTENSION_SHIFT);
+  builder.build_from_array(array_, size_, &counts[0], true);
+  counts.clear();
+
+  std::size_t size = 0;
+  unit_type *buf = NULL;
+  builder.copy(&size, &buf);
+
+  // The value table is not changed, but it is copied into memory if it is in
+  // a mapped file, which is unmapped by clear().
+  const value_type *values = values_;
+  value_type *values_buf = values_buf_;
+  if (map_ != NULL && values != NULL) {
+    try {
+      values_buf = new value_type[num_keys_];
+    } catch (const std::bad_alloc &) {
+      delete[] buf;
+      DARTS_THROW("failed to relayout double-array: std::bad_alloc");
+    }
+    for (std::size_t i = 0; i < num_keys_; ++i) {
+      values_buf[i] = values[i];
+    }
+    values = values_buf;
+  }
+  values_buf_ = NULL;
+
+  std::size_t num_keys = num_keys_;
+  clear();
+
+  size_ = size;
+  array_ = buf;
+  buf_ = buf;
+  num_keys_ = num_keys;
+  values_ = values;
+  values_buf_ = values_buf;
+
+  return 0;
+}
+
+namespace Details {
+
+//
+// Node of Aho-Corasick automaton.
+//
+
+// <AhoCorasickNode> keeps a unit of the trie together with its failure link,
+// which points to the node of the longest proper suffix of the node's string,
+// so that both are read from the same cache line. The MSB of the
+// failure link tells whether the node or a node on its chain of failure links
+// has a leaf. Only such nodes need <AhoCorasickOutput>s. The failure link
+// keeps the lower 31 bits, and so the trie must have at most 2^31 units.
+template <typename U>
+class AhoCorasickNode {
+ public:
+  AhoCorasickNode() : unit_(), failure_(0) {}
+
+  void set_unit(const U &unit) {
+    unit_ = unit;
+  }
+  void set_failure(id_type failure, bool has_output) {
+    failure_ = failure | (has_output ? (1U << 31) : 0);
+  }
+
+  const U &unit() const {
+    return unit_;
+  }
+  id_type failure() const {
+    return failure_ & ((1U << 31) - 1);
+  }
+  bool has_output() const {
+    return (failure_ >> 31) == 1;
+  }
+
+ private:
+  U unit_;
+  id_type failure_;
+
+  // Copyable.
+};
+
+// <AhoCorasickOutput> keeps the output link of a node, which points to the
+// nearest node that has a leaf on the chain of failure links, or 0 if there
+// is no such node, and the depth of the node, which is the length of its key.
+class AhoCorasickOutput {
+ public:
+  AhoCorasickOutput() : output_(0), depth_(0) {}
+
+  void set_output(id_type output) {
+    output_ = output;
+  }
+  void set_depth(id_type depth) {
+    depth_ = depth;
+  }
+
+  id_type output() const {
+    return output_;
+  }
+  id_type depth() const {
+    return depth_;
+  }
+
+ private:
+  id_type output_;
+  id_type depth_;
+
+  // Copyable.
+};
+
+}  // namespace Details
+
+//
+// Aho-Corasick automaton.
+//
+
+// <AhoCorasickImpl> adds failure links to a trie in the form of a
+// double-array, so that scan() reports every occurrence of the keys in a text
+// while reading each byte of the text once. A dictionary built with values
+// is a DAWG, whose nodes may be shared by strings that need different failure
+// links, and so build() makes its own trie from the dictionary. The
+// automaton takes 16 bytes per unit of the trie, but scan() usually touches
+// only the first 8 bytes.
+template <typename A, typename B, typename T, typename C>
+class AhoCorasickImpl {
+ public:
+  typedef DoubleArrayImpl<A, B, T, C> dic_type;
+  typedef typename dic_type::value_type value_type;
+  typedef typename dic_type::key_type key_type;
+
+  AhoCorasickImpl() : nodes_(), outputs_(), values_(), num_values_(0),
+      size_(0) {}
+
+  // build() makes an automaton for the keys of `dic'. `dic' is not used after
+  // build(). build() returns 0 iff it succeeds, and it returns a non-zero
+  // value if dic.size() is 0. It throws a <Darts::Exception> if a memory
+  // allocation fails or the trie has more than 2^31 units.
+  int build(const dic_type &dic);
+
+  // size() returns the number of units of the trie.
+  std::size_t size() const {
+    return size_;
+  }
+  // total_size() returns the number of bytes allocated to the automaton.
+  std::size_t total_size() const {
+    return (size_ * (sizeof(node_type) + sizeof(output_type))) +
+        (num_values_ * sizeof(value_type));
+  }
+
+  void clear() {
+    nodes_.clear();
+    outputs_.clear();
+    values_.clear();
+    num_values_ = 0;
+    size_ = 0;
+  }
+
+  // scan() calls `callback(begin, length, value)' for each occurrence of the
+  // keys in `text', where `begin' and `length' give the position of the
+  // occurrence. Occurrences are reported in order of their ends, and the
+  // occurrences with the same end are reported from the longest. If `length'
+  // is 0, `text' is handled as a zero-terminated string.
+  template <class F>
+  void scan(const key_type *text, F callback, std::size_t length = 0) const {
+    std::size_t node_pos = 0;
+    std::size_t text_pos = 0;
+    scan(text, callback, node_pos, text_pos, length);
+  }
+  // The streaming scan() continues a scan from `node_pos' and `text_pos',
+  // which must be 0 at the beginning of a text and are updated at the end of
+  // each chunk. `text_pos' is the position of the chunk in the whole text,
+  // and `begin's given to `callback' are positions in the whole text, so an
+  // occurrence across chunks is reported as well.
+  template <class F>
+  void scan(const key_type *text, F callback, std::size_t &node_pos,
+      std::size_t &text_pos, std::size_t length = 0) const;
+
+ private:
+  typedef Details::uchar_type uchar_type;
+  typedef Details::id_type id_type;
+  typedef typename Details::UnitTraits<B>::unit_type unit_type;
+  typedef Details::AhoCorasickNode<unit_type> node_type;
+  typedef Details::AhoCorasickOutput output_type;
+
+  // MAX_SIZE is the largest number of units whose IDs fit in failure links.
+  static const std::size_t MAX_SIZE = static_cast<std::size_t>(1) << 31;
+
+  Details::AutoArray<node_type> nodes_;
+  Details::AutoArray<output_type> outputs_;
+  Details::AutoArray<value_type> values_;
+  std::size_t num_values_;
+  std::size_t size_;
+
+  // Disallows copy and assignment.
+  AhoCorasickImpl(const AhoCorasickImpl &);
+  AhoCorasickImpl &operator=(const AhoCorasickImpl &);
+
+  // child() returns the child of `id' labeled `label', or 0 if there is no
+  // such child.
+  id_type child(id_type id, uchar_type label) const {
+    id_type child_id = id ^ nodes_[id].unit().offset() ^ label;
+    return (nodes_[child_id].unit().label() == label) ? child_id : 0;
+  }
+  // leaf_value() works as well as that of <DoubleArrayImpl>, and `values_' is
+  // a copy of the value table of the dictionary.
+  value_type leaf_value(const unit_type &unit) const {
+    if (num_values_ != 0) {
+      return values_[unit.value()];
+    }
+    return static_cast<value_type>(unit.value());
+  }
+};
+
+// build() visits the nodes of the trie in breadth-first order, and so the
+// links of a node are given after those of shorter strings. The children of
+// a node are found by reading the block of its offset in order.
+template <typename A, typename B, typename T, typename C>
+int AhoCorasickImpl<A, B, T, C>::build(const dic_type &dic) {
+  if (dic.size() == 0) {
+    return -1;
+  } else if (dic.size() > MAX_SIZE) {
+    DARTS_THROW("failed to build Aho-Corasick automaton: too many units");
+  }
+
+  std::size_t size = 0;
+  unit_type *buf = NULL;
+  {
+    Details::DoubleArrayBuilder builder(NULL, 1, unit_type::EXTENSION_SHIFT);
+    builder.build_from_array(static_cast<const unit_type *>(dic.array()),
+        dic.size(), NULL, false);
+    builder.copy(&size, &buf);
+  }
+  Details::AutoArray<unit_type> units(buf);
+
+  // The trie of a DAWG may be larger than the DAWG.
+  if (size > MAX_SIZE) {
+    DARTS_THROW("failed to build Aho-Corasick automaton: too many units");
+  }
+
+  clear();
+  try {
+    nodes_.reset(new node_type[size]);
+    outputs_.reset(new output_type[size]);
+  } catch (const std::bad_alloc &) {
+    clear();
+    DARTS_THROW("failed to build Aho-Corasick automaton: std::bad_alloc");
+  }
+  size_ = size;
+  for (std::size_t i = 0; i < size; ++i) {
+    nodes_[i].set_unit(units[i]);
+  }
+
+  // A dictionary built by itself keeps num_keys() values, but that given by
+  // set_array() does not know the number, and so the table is copied up to
+  // the largest key ID.
+  if (dic.value_table() != NULL) {
+    std::size_t num_values = 0;
+    for (std::size_t i = 0; i < size; ++i) {
+      if (units[i].label() <= 0xFF && units[i].has_leaf()) {
+        std::size_t id = units[i ^ units[i].offset()].value();
+        num_values = (id >= num_values) ? (id + 1) : num_values;
+      }
+    }
+    try {
+      values_.reset(new value_type[num_values]);
+    } catch (const std::bad_alloc &) {
+      clear();
+      DARTS_THROW("failed to build Aho-Corasick automaton: std::bad_alloc");
+    }
+    num_values_ = num_values;
+    for (std::size_t i = 0; i < num_values; ++i) {
+      values_[i] = dic.value_table()[i];
+    }
+  }
+  units.clear();
+
+  Details::AutoPool<id_type> queue;
+  queue.append(0);
+  for (std::size_t i = 0; i < queue.size(); ++i) {
+    id_type id = queue[i];
+    id_type offset = id ^ nodes_[id].unit().offset();
+    id_type block = offset & ~static_cast<id_type>(0xFF);
+    for (id_type j = 0; j < 256; ++j) {
+      id_type label = j ^ (offset & 0xFF);
+      if (label == 0 || nodes_[block | j].unit().label() != label) {
+        continue;
+      }
+      id_type child_id = block | j;
+
+      id_type failure = 0;
+      if (id != 0) {
+        failure = nodes_[id].failure();
+        for ( ; ; ) {
+          id_type next = child(failure, static_cast<uchar_type>(label));
+          if (next != 0) {
+            failure = next;
+            break;
+          } else if (failure == 0) {
+            break;
+          }
+          failure = nodes_[failure].failure();
+        }
+      }
+
+      id_type output = nodes_[failure].unit().has_leaf() ? failure :
+          outputs_[failure].output();
+      nodes_[child_id].set_failure(failure,
+          nodes_[child_id].unit().has_leaf() || output != 0);
+      outputs_[child_id].set_output(output);
+      outputs_[child_id].set_depth(outputs_[id].depth() + 1);
+      queue.append(child_id);
+    }
+  }
+  return 0;
+}
+
+template <typename A, typename B, typename T, typename C>
+template <typename F>
+void AhoCorasickImpl<A, B, T, C>::scan(const key_type *text, F callback,
+    std::size_t &node_pos, std::size_t &text_pos, std::size_t length) const {
+  if (length == 0) {
+    while (text[length] != '\0') {
+      ++length;
+    }
+  }
+
+  id_type id = static_cast<id_type>(node_pos);
+  for (std::size_t i = 0; i < length; ++i) {
+    uchar_type label = static_cast<uchar_type>(text[i]);
+    id_type child_id;
+    while ((child_id = child(id, label)) == 0 && id != 0) {
+      id = nodes_[id].failure();
+    }
+    id = child_id;
+    if (!nodes_[id].has_output()) {
+      continue;
+    }
+
+    id_type output = nodes_[id].unit().has_leaf() ? id :
+        outputs_[id].output();
+    while (output != 0) {
+      const unit_type &unit = nodes_[output].unit();
+      std::size_t depth = outputs_[output].depth();
+      callback(text_pos + i + 1 - depth, depth,
+          leaf_value(nodes_[output ^ unit.offset()].unit()));
+      output = outputs_[output].output();
+    }
+  }
+
+  node_pos = id;
+  text_pos += length;
+}
+
+//
+// Key index.
+//
+
+// <KeyIndexImpl> keeps the parent of each node of a dictionary, so that
+// restore_key() gives the key of a node by following the parents to the root
+// and reading their labels in O(key length). With key IDs, it also keeps the
+// node of each key ID, so that applications can keep only key IDs instead of
+// a separate table of key strings. The key ID of a key is the value of its
+// leaf unit, which is the index of the key in build() if the dictionary was
+// built without values or with <WideValues>. A node of a DAWG may have more
+// than one parent, and so build() fails if the dictionary has shared nodes,
+// which it does not if the values of the keys are distinct. The index takes
+// 4 bytes per unit and 4 bytes per key ID, and it refers to the dictionary,
+// so the dictionary must not be modified or freed while the index is used.
+template <typename A, typename B, typename T, typename C>
+class KeyIndexImpl {
+ public:
+  typedef DoubleArrayImpl<A, B, T, C> dic_type;
+  typedef typename dic_type::key_type key_type;
+
+  KeyIndexImpl() : dic_(NULL), parents_(), key_nodes_(), size_(0),
+      num_key_ids_(0) {}
+
+  // build() makes an index of `dic'. If `with_key_ids' is true, the nodes of
+  // the keys are kept for key IDs from 0 to the largest one, and so the key
+  // IDs should be dense. build() returns 0 iff it succeeds, and it returns a
+  // non-zero value if dic.size() is 0 or `dic' has shared nodes. It throws a
+  // <Darts::Exception> if a memory allocation fails.
+  int build(const dic_type &dic, bool with_key_ids = false);
+
+  // restore_key() writes the key of `node_pos' and a null character to `key'
+  // if the key is shorter than `max_length', and returns the length of the
+  // key. `node_pos' is a node given by traverse() or commonPrefixSearch(),
+  // and it must be a node of the dictionary.
+  std::size_t restore_key(std::size_t node_pos, key_type *key,
+      std::size_t max_length) const;
+  // key_node() returns the node of the key whose key ID is `key_id', or 0 if
+  // there is no such key or the index has no key IDs.
+  std::size_t key_node(std::size_t key_id) const {
+    return (key_id < num_key_ids_) ? key_nodes_[key_id] : 0;
+  }
+  // restore_key_by_id() works as well as restore_key() for the key whose key
+  // ID is `key_id', and it returns 0 if there is no such key.
+  std::size_t restore_key_by_id(std::size_t key_id, key_type *key,
+      std::size_t max_length) const {
+    std::size_t node_pos = key_node(key_id);
+    return (node_pos != 0) ? restore_key(node_pos, key, max_length) : 0;
+  }
+
+  // size() returns the number of units of the dictionary.
+  std::size_t size() const {
+    return size_;
+  }
+  // num_key_ids() returns the number of entries of the key ID table, which is
+  // 0 if the index has no key IDs.
+  std::size_t num_key_ids() const {
+    return num_key_ids_;
+  }
+  // total_size() returns the number of bytes written by save().
+  std::size_t total_size() const {
+    return sizeof(id_type) * (NUM_SIZE_WORDS + size_ + num_key_ids_);
+  }
+
+  void clear() {
+    dic_ = NULL;
+    parents_.clear();
+    key_nodes_.clear();
+    size_ = 0;
+    num_key_ids_ = 0;
+  }
+
+  // save() writes the index to a file, and open() reads it for `dic', which
+  // must be the dictionary of the index. `mode' and `offset' work as well as
+  // in DoubleArrayImpl::save() and DoubleArrayImpl::open(), so the index can
+  // be saved after the dictionary in the same file. They return 0 iff they
+  // succeed, and open() fails if the index is not of the size of `dic' or has
+  // a node which is not in `dic' or not a child of its parent.
+  int save(const char *file_name, const char *mode = "wb",
+      std::size_t offset = 0) const;
+  int open(const dic_type &dic, const char *file_name,
+      const char *mode = "rb", std::size_t offset = 0);
+
+ private:
+  typedef Details::uchar_type uchar_type;
+  typedef Details::id_type id_type;
+  typedef typename Details::UnitTraits<B>::unit_type unit_type;
+
+  // A file starts with the number of units and the number of key IDs, and
+  // each of them is given as the lower and upper 32 bits.
+  enum { NUM_SIZE_WORDS = 4 };
+
+  const dic_type *dic_;
+  Details::AutoArray<id_type> parents_;
+  Details::AutoArray<id_type> key_nodes_;
+  std::size_t size_;
+  std::size_t num_key_ids_;
+
+  // Disallows copy and assignment.
+  KeyIndexImpl(const KeyIndexImpl &);
+  KeyIndexImpl &operator=(const KeyIndexImpl &);
+};
+
+// build() groups the units by (id ^ label), which is the offset of the
+// parent of a node at `id', and then follows the nodes from the root, so that
+// the units which are not reachable are never taken as children. Each offset
+// must be reached only once, or the nodes at the offset are shared.
+template <typename A, typename B, typename T, typename C>
+int KeyIndexImpl<A, B, T, C>::build(const dic_type &dic, bool with_key_ids) {
+  if (dic.size() == 0) {
+    return -1;
+  }
+  const unit_type *units = static_cast<const unit_type *>(dic.array());
+  std::size_t size = dic.size();
+
+  Details::AutoArray<id_type> begins;
+  Details::AutoArray<id_type> children;
+  Details::AutoArray<id_type> parents;
+  try {
+    begins.reset(new id_type[size + 1]);
+    children.reset(new id_type[size]);
+    parents.reset(new id_type[size]);
+  } catch (const std::bad_alloc &) {
+    DARTS_THROW("failed to build key index: std::bad_alloc");
+  }
+  for (std::size_t i = 0; i <= size; ++i) {
+    begins[i] = 0;
+  }
+  for (std::size_t id = 1; id < size; ++id) {
+    std::size_t label = units[id].label();
+    if (label != 0 && label <= 0xFF && (id ^ label) < size) {
+      ++begins[(id ^ label) + 1];
+    }
+  }
+  for (std::size_t i = 1; i <= size; ++i) {
+    begins[i] += begins[i - 1];
+  }
+  for (std::size_t id = 1; id < size; ++id) {
+    std::size_t label = units[id].label();
+    if (label != 0 && label <= 0xFF && (id ^ label) < size) {
+      children[begins[id ^ label]++] = static_cast<id_type>(id);
+    }
+  }
+  for (std::size_t i = size; i > 0; --i) {
+    begins[i] = begins[i - 1];
+  }
+  begins[0] = 0;
+
+  for (std::size_t i = 0; i < size; ++i) {
+    parents[i] = 0;
+  }
+  Details::AutoPool<id_type> leaf_nodes;
+  Details::AutoPool<id_type> stack;
+  stack.push_back(0);
+  while (!stack.empty()) {
+    id_type id = stack[stack.size() - 1];
+    stack.pop_back();
+    std::size_t offset = id ^ units[id].offset();
+    if (units[id].has_leaf()) {
+      leaf_nodes.push_back(id);
+    }
+    if (offset >= size || begins[offset] == begins[offset + 1]) {
+      continue;
+    }
+    // The first child is cleared when the children are visited, and the
+    // root is never a child.
+    if (children[begins[offset]] == 0) {
+      return -1;
+    }
+    for (id_type i = begins[offset]; i < begins[offset + 1]; ++i) {
+      parents[children[i]] = id;
+      stack.push_back(children[i]);
+    }
+    children[begins[offset]] = 0;
+  }
+  begins.clear();
+  children.clear();
+
+  Details::AutoArray<id_type> key_nodes;
+  std::size_t num_key_ids = 0;
+  if (with_key_ids) {
+    for (std::size_t i = 0; i < leaf_nodes.size(); ++i) {
+      id_type id = leaf_nodes[i];
+      std::size_t key_id = static_cast<std::size_t>(
+          units[id ^ units[id].offset()].value());
+      num_key_ids = (key_id >= num_key_ids) ? (key_id + 1) : num_key_ids;
+    }
+    try {
+      key_nodes.reset(new id_type[num_key_ids]);
+    } catch (const std::bad_alloc &) {
+      DARTS_THROW("failed to build key index: std::bad_alloc");
+    }
+    for (std::size_t i = 0; i < num_key_ids; ++i) {
+      key_nodes[i] = 0;
+    }
+    for (std::size_t i = 0; i < leaf_nodes.size(); ++i) {
+      id_type id = leaf_nodes[i];
+      std::size_t key_id = static_cast<std::size_t>(
+          units[id ^ units[id].offset()].value());
+      if (key_nodes[key_id] != 0) {
+        return -1;
+      }
+      key_nodes[key_id] = id;
+    }
+  }
+
+  clear();
+  dic_ = &dic;
+  parents_.swap(&parents);
+  key_nodes_.swap(&key_nodes);
+  size_ = size;
+  num_key_ids_ = num_key_ids;
+  return 0;
+}
+
+template <typename A, typename B, typename T, typename C>
+std::size_t KeyIndexImpl<A, B, T, C>::restore_key(std::size_t node_pos,
+    key_type *key, std::size_t max_length) const {
+  std::size_t length = 0;
+  for (std::size_t id = node_pos; id != 0; id = parents_[id]) {
+    ++length;
+  }
+  if (length >= max_length) {
+    return length;
+  }
+
+  const unit_type *units = static_cast<const unit_type *>(dic_->array());
+  key[length] = '\0';
+  std::size_t i = length;
+  for (std::size_t id = node_pos; id != 0; id = parents_[id]) {
+    key[--i] = static_cast<key_type>(units[id].label());
+  }
+  return length;
+}
+
+template <typename A, typename B, typename T, typename C>
+int KeyIndexImpl<A, B, T, C>::save(const char *file_name, const char *mode,
+    std::size_t offset) const {
+  if (size_ == 0) {
+    return -1;
+  }
+
+#ifdef _MSC_VER
+  std::FILE *file;
+  if (::fopen_s(&file, file_name, mode) != 0) {
+    return -1;
+  }
+#else
+  std::FILE *file = std::fopen(file_name, mode);
+  if (file == NULL) {
+    return -1;
+  }
+#endif
+
+  if (std::fseek(file, offset, SEEK_SET) != 0) {
+    std::fclose(file);
+    return -1;
+  }
+
+  id_type sizes[NUM_SIZE_WORDS] = {
+    static_cast<id_type>(size_),
+    static_cast<id_type>((size_ >> 16) >> 16),
+    static_cast<id_type>(num_key_ids_),
+    static_cast<id_type>((num_key_ids_ >> 16) >> 16)
+  };
+  if (std::fwrite(sizes, sizeof(id_type), NUM_SIZE_WORDS, file) !=
+      NUM_SIZE_WORDS ||
+      std::fwrite(&parents_[0], sizeof(id_type), size_, file) != size_ ||
+      (num_key_ids_ != 0 && std::fwrite(&key_nodes_[0], sizeof(id_type),
+      num_key_ids_, file) != num_key_ids_)) {
+    std::fclose(file);
+    return -1;
+  }
+  std::fclose(file);
+  return 0;
+}
+
+template <typename A, typename B, typename T, typename C>
+int KeyIndexImpl<A, B, T, C>::open(const dic_type &dic, const char *file_name,
+    const char *mode, std::size_t offset) {
+#ifdef _MSC_VER
+  std::FILE *file;
+  if (::fopen_s(&file, file_name, mode) != 0) {
+    return -1;
+  }
+#else
+  std::FILE *file = std::fopen(file_name, mode);
+  if (file == NULL) {
+    return -1;
+  }
+#endif
+
+  id_type sizes[NUM_SIZE_WORDS];
+  if (std::fseek(file, offset, SEEK_SET) != 0 ||
+      std::fread(sizes, sizeof(id_type), NUM_SIZE_WORDS, file) !=
+      NUM_SIZE_WORDS) {
+    std::fclose(file);
+    return -1;
+  }
+  std::size_t upper_size = sizes[1];
+  std::size_t upper_num_key_ids = sizes[3];
+  std::size_t size = sizes[0] | ((upper_size << 16) << 16);
+  std::size_t num_key_ids = sizes[2] | ((upper_num_key_ids << 16) << 16);
+  if (size == 0 || size != dic.size() || (sizeof(std::size_t) < 8 &&
+      (sizes[1] != 0 || sizes[3] != 0))) {
+    std::fclose(file);
+    return -1;
+  }
+
+  Details::AutoArray<id_type> parents;
+  Details::AutoArray<id_type> key_nodes;
+  try {
+    parents.reset(new id_type[size]);
+    if (num_key_ids != 0) {
+      key_nodes.reset(new id_type[num_key_ids]);
+    }
+  } catch (const std::bad_alloc &) {
+    std::fclose(file);
+    DARTS_THROW("failed to open key index: std::bad_alloc");
+  }
+  if (std::fread(&parents[0], sizeof(id_type), size, file) != size ||
+      (num_key_ids != 0 && std::fread(&key_nodes[0], sizeof(id_type),
+      num_key_ids, file) != num_key_ids)) {
+    std::fclose(file);
+    return -1;
+  }
+  std::fclose(file);
+
+  // Each parent must be in the dictionary and have the node as its child,
+  // and each key node must be in the dictionary, so that restore_key() never
+  // reads out of bounds.
+  const unit_type *units = static_cast<const unit_type *>(dic.array());
+  for (std::size_t id = 0; id < size; ++id) {
+    std::size_t parent = parents[id];
+    if (parent >= size || (parent != 0 &&
+        (parent ^ units[parent].offset() ^ units[id].label()) != id)) {
+      return -1;
+    }
+  }
+  for (std::size_t i = 0; i < num_key_ids; ++i) {
+    if (key_nodes[i] >= size) {
+      return -1;
+    }
+  }
+
+  clear();
+  dic_ = &dic;
+  parents_.swap(&parents);
+  key_nodes_.swap(&key_nodes);
+  size_ = size;
+  num_key_ids_ = num_key_ids;
+  return 0;
+}
+
+//
+// Double-array with tails.
+//
+
+// <TailDoubleArrayImpl> keeps each key in a double-array only up to the
+// shortest prefix which no other key has, and the rest of the key, a tail, is
+// kept in a pool of tails with the value of the key. So, the unique part of
+// a long key takes a byte instead of a unit per character, and a search
+// compares it with a single sequential read instead of a unit per character.
+// The double-array is a <DoubleArrayImpl> whose leaf units keep the positions
+// of the tails, and each tail is followed by a null character and the value.
+// A key which ends at a node with children has an empty tail. <WideValues>
+// is not supported.
+template <typename A, typename B, typename T, typename C>
+class TailDoubleArrayImpl {
+ public:
+  typedef DoubleArrayImpl<A, B, T, C> dic_type;
+  typedef typename dic_type::value_type value_type;
+  typedef typename dic_type::key_type key_type;
+  typedef typename dic_type::result_pair_type result_pair_type;
+
+  TailDoubleArrayImpl() : dic_(), tails_() {}
+
+  // build() works as well as DoubleArrayImpl::build() except that the keys
+  // are given to a single thread. It throws a <Darts::Exception> if the keys
+  // are not in order, or if the tails take 2GB or more.
+  int build(std::size_t num_keys, const key_type * const *keys,
+      const std::size_t *lengths = NULL, const value_type *values = NULL,
+      Details::progress_func_type progress_func = NULL);
+
+  // size() returns the number of units of the double-array.
+  std::size_t size() const {
+    return dic_.size();
+  }
+  // tail_size() returns the number of bytes of the tails.
+  std::size_t tail_size() const {
+    return tails_.size();
+  }
+  // total_size() returns the number of bytes allocated to the dictionary.
+  std::size_t total_size() const {
+    return dic_.total_size() + tail_size();
+  }
+  // num_keys() returns the number of distinct keys.
+  std::size_t num_keys() const {
+    return dic_.num_keys();
+  }
+
+  void clear() {
+    dic_.clear();
+    tails_.clear();
+  }
+
+  // exactMatchSearch(), commonPrefixSearch() and traverse() work as well as
+  // those of <DoubleArrayImpl>, except that they start at the root. A node
+  // given by traverse() is a position in the tails if it is not less than
+  // size().
+  template <class U>
+  void exactMatchSearch(const key_type *key, U &result,
+      std::size_t length = 0) const {
+    result = exactMatchSearch<U>(key, length);
+  }
+  template <class U>
+  inline U exactMatchSearch(const key_type *key,
+      std::size_t length = 0) const;
+
+  template <class U>
+  inline std::size_t commonPrefixSearch(const key_type *key, U *results,
+      std::size_t max_num_results, std::size_t length = 0) const;
+
+  inline value_type traverse(const key_type *key, std::size_t &node_pos,
+      std::size_t &key_pos, std::size_t length = 0) const;
+
+  // save() writes the double-array with a header and then the tails, and
+  // open() reads them. `mode' and `offset' work as well as in
+  // DoubleArrayImpl::save() and DoubleArrayImpl::open(). They return 0 iff
+  // they succeed, and open() throws a <Darts::Exception> if a memory
+  // allocation fails.
+  int save(const char *file_name, const char *mode = "wb",
+      std::size_t offset = 0) const;
+  int open(const char *file_name, const char *mode = "rb",
+      std::size_t offset = 0);
+
+ private:
+  typedef Details::uchar_type uchar_type;
+  typedef Details::id_type id_type;
+  typedef typename Details::UnitTraits<B>::unit_type unit_type;
+
+  dic_type dic_;
+  Details::AutoPool<char> tails_;
+
+  // Disallows copy and assignment.
+  TailDoubleArrayImpl(const TailDoubleArrayImpl &);
+  TailDoubleArrayImpl &operator=(const TailDoubleArrayImpl &);
+
+  const unit_type *units() const {
+    return static_cast<const unit_type *>(dic_.array());
+  }
+  // tail_pos() returns the position of the tail of a node which has a leaf.
+  std::size_t tail_pos(const unit_type *units, std::size_t node_pos) const {
+    return static_cast<std::size_t>(
+        units[node_pos ^ units[node_pos].offset()].value());
+  }
+  // tail_value() returns the value which follows the null character at
+  // `pos'.
+  value_type tail_value(std::size_t pos) const {
+    Details::value_type value;
+    std::memcpy(&value, &tails_[pos + 1], sizeof(value));
+    return static_cast<value_type>(value);
+  }
+};
+
+// build() gives the shortest unique prefix of each key to the double-array.
+// A key must keep one more character than it shares with the previous key
+// and with the next key, and duplicate keys are given only once.
+template <typename A, typename B, typename T, typename C>
+int TailDoubleArrayImpl<A, B, T, C>::build(std::size_t num_keys,
+    const key_type * const *keys, const std::size_t *lengths,
+    const value_type *values, Details::progress_func_type progress_func) {
+  Details::Keyset<value_type> keyset(num_keys, keys, lengths, values);
+
+  // `prefix_lengths' is first the number of characters which each distinct
+  // key shares with the previous one.
+  Details::AutoPool<std::size_t> key_ids;
+  Details::AutoPool<std::size_t> key_lengths;
+  Details::AutoPool<std::size_t> prefix_lengths;
+  for (std::size_t i = 0; i < num_keys; ++i) {
+    std::size_t length = keyset.lengths(i);
+    std::size_t prefix_length = 0;
+    if (!key_ids.empty()) {
+      std::size_t prev_id = key_ids[key_ids.size() - 1];
+      std::size_t prev_length = key_lengths[key_lengths.size() - 1];
+      while (prefix_length < length && prefix_length < prev_length &&
+          keyset.keys(i, prefix_length) ==
+          keyset.keys(prev_id, prefix_length)) {
+        ++prefix_length;
+      }
+      if (prefix_length == length) {
+        if (length == prev_length) {
+          continue;
+        }
+        DARTS_THROW("failed to build double-array: wrong key order");
+      } else if (prefix_length < prev_length &&
+          keyset.keys(i, prefix_length) <
+          keyset.keys(prev_id, prefix_length)) {
+        DARTS_THROW("failed to build double-array: wrong key order");
+      }
+    }
+    if (keyset.values(i) < 0) {
+      DARTS_THROW("failed to build double-array: negative value");
+    }
+    key_ids.append(i);
+    key_lengths.append(length);
+    prefix_lengths.append(prefix_length);
+  }
+
+  Details::AutoPool<const key_type *> prefixes;
+  Details::AutoPool<value_type> positions;
+  Details::AutoPool<char> tails;
+  for (std::size_t i = 0; i < key_ids.size(); ++i) {
+    std::size_t prefix_length = prefix_lengths[i];
+    if (i + 1 < key_ids.size() && prefix_lengths[i + 1] > prefix_length) {
+      prefix_length = prefix_lengths[i + 1];
+    }
+    if (prefix_length < key_lengths[i]) {
+      ++prefix_length;
+    }
+    prefix_lengths[i] = prefix_length;
+
+    if (tails.size() > 0x7FFFFFFF) {
+      DARTS_THROW("failed to build double-array: too large tails");
+    }
+    prefixes.append(keyset.keys(key_ids[i]));
+    positions.append(static_cast<value_type>(tails.size()));
+    for (std::size_t j = prefix_length; j < key_lengths[i]; ++j) {
+      uchar_type label = keyset.keys(key_ids[i], j);
+      if (label == '\0') {
+        DARTS_THROW("failed to build double-array: invalid null character");
+      }
+      tails.append(static_cast<char>(label));
+    }
+    tails.append('\0');
+    Details::value_type value = keyset.values(key_ids[i]);
+    for (std::size_t j = 0; j < sizeof(value); ++j) {
+      tails.append(reinterpret_cast<const char *>(&value)[j]);
+    }
+  }
+  key_lengths.clear();
+
+  dic_.build(prefixes.size(), prefixes.empty() ? NULL : &prefixes[0],
+      prefix_lengths.empty() ? NULL : &prefix_lengths[0],
+      positions.empty() ? NULL : &positions[0], progress_func);
+  tails_.swap(&tails);
+  return 0;
+}
+
+template <typename A, typename B, typename T, typename C>
+template <typename U>
+inline U TailDoubleArrayImpl<A, B, T, C>::exactMatchSearch(
+    const key_type *key, std::size_t length) const {
+  U result;
+  dic_.set_result(&result, static_cast<value_type>(-1), 0);
+  if (tails_.empty()) {
+    return result;
+  }
+
+  if (length == 0) {
+    while (key[length] != '\0') {
+      ++length;
+    }
+  }
+
+  const unit_type *units = this->units();
+  std::size_t node_pos = 0;
+  std::size_t i = 0;
+  for ( ; i < length; ++i) {
+    std::size_t child_pos = node_pos ^ units[node_pos].offset() ^
+        static_cast<uchar_type>(key[i]);
+    if (units[child_pos].label() != static_cast<uchar_type>(key[i])) {
+      break;
+    }
+    node_pos = child_pos;
+  }
+  if (!units[node_pos].has_leaf()) {
+    return result;
+  }
+
+  // The rest of the key must be the tail, which is followed by a null
+  // character.
+  std::size_t pos = tail_pos(units, node_pos);
+  std::size_t tail_length = length - i;
+  if (tail_length >= tails_.size() - pos ||
+      std::memcmp(&tails_[pos], key + i, tail_length) != 0 ||
+      tails_[pos + tail_length] != '\0') {
+    return result;
+  }
+  dic_.set_result(&result, tail_value(pos + tail_length), length);
+  return result;
+}
+
+template <typename A, typename B, typename T, typename C>
+template <typename U>
+inline std::size_t TailDoubleArrayImpl<A, B, T, C>::commonPrefixSearch(
+    const key_type *key, U *results, std::size_t max_num_results,
+    std::size_t length) const {
+  std::size_t num_results = 0;
+  if (tails_.empty()) {
+    return num_results;
+  }
+
+  const unit_type *units = this->units();
+  std::size_t node_pos = 0;
+  for (std::size_t i = 0; ; ++i) {
+    if (units[node_pos].has_leaf()) {
+      // Only a node without children has a non-empty tail.
+      std::size_t pos = tail_pos(units, node_pos);
+      const char *tail = &tails_[pos];
+      std::size_t tail_length = std::strlen(tail);
+      if ((length != 0) ? (tail_length <= length - i &&
+          std::memcmp(tail, key + i, tail_length) == 0) :
+          (std::strncmp(tail, key + i, tail_length) == 0)) {
+        if (num_results < max_num_results) {
+          dic_.set_result(&results[num_results],
+              tail_value(pos + tail_length), i + tail_length);
+        }
+        ++num_results;
+      }
+    }
+
+    if ((length != 0) ? (i >= length) : (key[i] == '\0')) {
+      break;
+    }
+    std::size_t child_pos = node_pos ^ units[node_pos].offset() ^
+        static_cast<uchar_type>(key[i]);
+    if (units[child_pos].label() != static_cast<uchar_type>(key[i])) {
+      break;
+    }
+    node_pos = child_pos;
+  }
+  return num_results;
+}
+
+// traverse() follows a tail byte by byte after the transition from its node
+// fails, and then `node_pos' is (size() + position in the tails).
+template <typename A, typename B, typename T, typename C>
+inline typename TailDoubleArrayImpl<A, B, T, C>::value_type
+TailDoubleArrayImpl<A, B, T, C>::traverse(const key_type *key,
+    std::size_t &node_pos, std::size_t &key_pos, std::size_t length) const {
+  const unit_type *units = this->units();
+  std::size_t size = dic_.size();
+  for ( ; (length != 0) ? (key_pos < length) : (key[key_pos] != '\0');
+      ++key_pos) {
+    if (node_pos >= size) {
+      if (tails_[node_pos - size] != key[key_pos]) {
+        return -2;
+      }
+      ++node_pos;
+      continue;
+    }
+
+    std::size_t child_pos = node_pos ^ units[node_pos].offset() ^
+        static_cast<uchar_type>(key[key_pos]);
+    if (units[child_pos].label() == static_cast<uchar_type>(key[key_pos])) {
+      node_pos = child_pos;
+    } else if (units[node_pos].has_leaf() &&
+        tails_[tail_pos(units, node_pos)] == key[key_pos]) {
+      node_pos = size + tail_pos(units, node_pos) + 1;
+    } else {
+      return -2;
+    }
+  }
+
+  std::size_t pos;
+  if (node_pos >= size) {
+    pos = node_pos - size;
+  } else if (units[node_pos].has_leaf()) {
+    pos = tail_pos(units, node_pos);
+  } else {
+    return -1;
+  }
+  return (tails_[pos] == '\0') ? tail_value(pos) : -1;
+}
+
+template <typename A, typename B, typename T, typename C>
+int TailDoubleArrayImpl<A, B, T, C>::save(const char *file_name,
+    const char *mode, std::size_t offset) const {
+  if (dic_.save(file_name, mode, offset, true) != 0) {
+    return -1;
+  }
+
+#ifdef _MSC_VER
+  std::FILE *file;
+  if (::fopen_s(&file, file_name, "r+b") != 0) {
+    return -1;
+  }
+#else
+  std::FILE *file = std::fopen(file_name, "r+b");
+  if (file == NULL) {
+    return -1;
+  }
+#endif
+
+  std::size_t size = tails_.size();
+  id_type sizes[2] = {
+    static_cast<id_type>(size),
+    static_cast<id_type>((size >> 16) >> 16)
+  };
+  if (std::fseek(file, offset + Details::DoubleArrayHeader::size() +
+      dic_.total_size(), SEEK_SET) != 0 ||
+      std::fwrite(sizes, sizeof(id_type), 2, file) != 2 ||
+      std::fwrite(&tails_[0], 1, size, file) != size) {
+    std::fclose(file);
+    return -1;
+  }
+  std::fclose(file);
+  return 0;
+}
+
+// open() reads the tails first, which follow the units given by the header,
+// and then the double-array.
+template <typename A, typename B, typename T, typename C>
+int TailDoubleArrayImpl<A, B, T, C>::open(const char *file_name,
+    const char *mode, std::size_t offset) {
+#ifdef _MSC_VER
+  std::FILE *file;
+  if (::fopen_s(&file, file_name, mode) != 0) {
+    return -1;
+  }
+#else
+  std::FILE *file = std::fopen(file_name, mode);
+  if (file == NULL) {
+    return -1;
+  }
+#endif
+
+  Details::DoubleArrayHeader header;
+  id_type sizes[2];
+  if (std::fseek(file, offset, SEEK_SET) != 0 ||
+      std::fread(header.data(), 1, header.size(), file) != header.size() ||
+      !Details::DoubleArrayHeader::has_magic(header.data()) ||
+      std::fseek(file, offset + header.size() +
+      (sizeof(unit_type) * header.num_units()), SEEK_SET) != 0 ||
+      std::fread(sizes, sizeof(id_type), 2, file) != 2) {
+    std::fclose(file);
+    return -1;
+  }
+  std::size_t upper_size = sizes[1];
+  std::size_t size = sizes[0] | ((upper_size << 16) << 16);
+  if (size == 0 || (sizeof(std::size_t) < 8 && sizes[1] != 0)) {
+    std::fclose(file);
+    return -1;
+  }
+
+  Details::AutoPool<char> tails;
+  try {
+    tails.resize(size);
+  } catch (const Details::Exception &) {
+    std::fclose(file);
+    throw;
+  }
+  if (std::fread(&tails[0], 1, size, file) != size) {
+    std::fclose(file);
+    return -1;
+  }
+  std::fclose(file);
+
+  if (dic_.open(file_name, mode, offset) != 0) {
+    return -1;
+  }
+  tails_.swap(&tails);
+  return 0;
+}
+
+namespace Details {
+
+//
+// Node of path-compressed double-array.
+//
+
+// <DoubleArrayPathNode> keeps a unit together with the labels of its run, so
+// that both are read from the same cache line. A run is a chain of 2 to 4
+// labels, which starts with the label of the unit, and the labels are kept
+// in the order of memory and padded with 0s, so a run is compared with a key
+// as a 32-bit word. The run of a unit with a single label is 0.
+template <typename U>
+class DoubleArrayPathNode {
+ public:
+  DoubleArrayPathNode() : unit_(), run_(0) {}
+
+  void set_unit(const U &unit) {
+    unit_ = unit;
+  }
+  void set_run(id_type run) {
+    run_ = run;
+  }
+
+  const U &unit() const {
+    return unit_;
+  }
+  id_type run() const {
+    return run_;
+  }
+  // run_labels() returns the labels of the run.
+  const uchar_type *run_labels() const {
+    return reinterpret_cast<const uchar_type *>(&run_);
+  }
+  // run_length() returns the number of labels of the run, which is 2 or more
+  // if run() is not 0.
+  std::size_t run_length() const {
+    const uchar_type *labels = run_labels();
+    return 2 + (labels[2] != 0) + (labels[3] != 0);
+  }
+  // run_mask() returns a mask which has 0xFF in each byte of the run. A byte
+  // has its MSB set iff it is not 0, and then the MSBs are spread over the
+  // bytes without carries, so the mask does not depend on the byte order.
+  id_type run_mask() const {
+    id_type msbs = (((run_ & 0x7F7F7F7FU) + 0x7F7F7F7FU) | run_) &
+        0x80808080U;
+    return (msbs >> 7) * 0xFF;
+  }
+
+ private:
+  U unit_;
+  id_type run_;
+
+  // Copyable.
+};
+
+}  // namespace Details
+
+//
+// Path-compressed double-array.
+//
+
+// <PathDoubleArrayImpl> is a double-array in which a chain of nodes which
+// have a single child and no leaf is merged into the unit of its first
+// label, such as the bytes of a UTF-8 character after the first one. The
+// unit keeps the labels of the chain, a run, and a search compares the run
+// with the key by a single 32-bit compare, so a run of up to 4 labels costs
+// one dependent load instead of one per label. The array is made by a pass
+// of <DoubleArrayBuilder> over a built dictionary, which keeps the blocks
+// shared by a DAWG, and each unit takes 8 bytes. <WideValues> is not
+// supported.
+template <typename A, typename B, typename T, typename C>
+class PathDoubleArrayImpl {
+ public:
+  typedef DoubleArrayImpl<A, B, T, C> dic_type;
+  typedef typename dic_type::value_type value_type;
+  typedef typename dic_type::key_type key_type;
+  typedef typename dic_type::result_pair_type result_pair_type;
+
+  PathDoubleArrayImpl() : nodes_(), size_(0), num_keys_(0) {}
+
+  // build() makes a path-compressed double-array from the units of `dic'.
+  // `dic' is not used after build(). build() returns 0 iff it succeeds, and
+  // it returns a non-zero value if dic.size() is 0 or the 4th template
+  // argument is <WideValues>. It throws a <Darts::Exception> if a memory
+  // allocation fails.
+  int build(const dic_type &dic);
+
+  // size() returns the number of units.
+  std::size_t size() const {
+    return size_;
+  }
+  // total_size() returns the number of bytes allocated to the units.
+  std::size_t total_size() const {
+    return sizeof(node_type) * size_;
+  }
+  // num_keys() returns the number of keys of the dictionary given to
+  // build().
+  std::size_t num_keys() const {
+    return num_keys_;
+  }
+
+  void clear() {
+    nodes_.clear();
+    size_ = 0;
+    num_keys_ = 0;
+  }
+
+  // exactMatchSearch() and commonPrefixSearch() work as well as those of
+  // <DoubleArrayImpl>, except that they start at the root.
+  template <class U>
+  void exactMatchSearch(const key_type *key, U &result,
+      std::size_t length = 0) const {
+    result = exactMatchSearch<U>(key, length);
+  }
+  template <class U>
+  inline U exactMatchSearch(const key_type *key,
+      std::size_t length = 0) const;
+
+  template <class U>
+  inline std::size_t commonPrefixSearch(const key_type *key, U *results,
+      std::size_t max_num_results, std::size_t length = 0) const;
+
+  // traverse() works as well as that of <DoubleArrayImpl>, but it follows a
+  // run label by label, and a node in the middle of a run is given as
+  // (size() * (the number of matched labels of the run) + unit ID). So,
+  // `node_pos' can be up to 4 * size().
+  inline value_type traverse(const key_type *key, std::size_t &node_pos,
+      std::size_t &key_pos, std::size_t length = 0) const;
+
+ private:
+  typedef Details::uchar_type uchar_type;
+  typedef Details::id_type id_type;
+  typedef typename Details::UnitTraits<B>::unit_type unit_type;
+  typedef Details::DoubleArrayPathNode<unit_type> node_type;
+
+  Details::AutoArray<node_type> nodes_;
+  std::size_t size_;
+  std::size_t num_keys_;
+
+  // Disallows copy and assignment.
+  PathDoubleArrayImpl(const PathDoubleArrayImpl &);
+  PathDoubleArrayImpl &operator=(const PathDoubleArrayImpl &);
+
+  static void set_result(value_type *result, value_type value,
+      std::size_t) {
+    *result = value;
+  }
+  static void set_result(result_pair_type *result, value_type value,
+      std::size_t length) {
+    result->value = value;
+    result->length = length;
+  }
+  // leaf_value() returns the value of the leaf of `id'.
+  value_type leaf_value(id_type id) const {
+    return static_cast<value_type>(
+        nodes_[id ^ nodes_[id].unit().offset()].unit().value());
+  }
+
+  static inline std::size_t match_run(const node_type &node,
+      const key_type *key, std::size_t length);
+};
+
+template <typename A, typename B, typename T, typename C>
+int PathDoubleArrayImpl<A, B, T, C>::build(const dic_type &dic) {
+  if (Details::ValueTraits<C>::HAS_VALUE_TABLE || dic.size() == 0) {
+    return -1;
+  }
+
+  std::size_t size = 0;
+  unit_type *buf = NULL;
+  Details::AutoPool<id_type> runs;
+  {
+    Details::DoubleArrayBuilder builder(NULL, 1, unit_type::EXTENSION_SHIFT);
+    builder.build_from_array(static_cast<const unit_type *>(dic.array()),
+        dic.size(), NULL, true, &runs);
+    builder.copy(&size, &buf);
+  }
+  Details::AutoArray<unit_type> units(buf);
+
+  clear();
+  try {
+    nodes_.reset(new node_type[size]);
+  } catch (const std::bad_alloc &) {
+    DARTS_THROW("failed to build path double-array: std::bad_alloc");
+  }
+  size_ = size;
+  num_keys_ = dic.num_keys();
+  for (std::size_t i = 0; i < size; ++i) {
+    nodes_[i].set_unit(units[i]);
+    if (i < runs.size()) {
+      nodes_[i].set_run(runs[i]);
+    }
+  }
+  return 0;
+}
+
+// match_run() returns the length of the run of `node' if `key' starts with
+// it, or 0 otherwise. `length' is the number of the rest of the labels, or 0
+// if `key' is a zero-terminated string. If there are at least 4 labels, they
+// are compared with the run at once, and otherwise they are compared one by
+// one, where the null character or the end of `key' does not match.
+template <typename A, typename B, typename T, typename C>
+inline std::size_t PathDoubleArrayImpl<A, B, T, C>::match_run(
+    const node_type &node, const key_type *key, std::size_t length) {
+  if (length >= sizeof(id_type)) {
+    id_type labels;
+    std::memcpy(&labels, key, sizeof(id_type));
+    return ((labels & node.run_mask()) == node.run()) ?
+        node.run_length() : 0;
+  }
+
+  std::size_t run_length = node.run_length();
+  const uchar_type *run_labels = node.run_labels();
+  for (std::size_t i = 1; i < run_length; ++i) {
+    if ((length != 0 && i >= length) ||
+        static_cast<uchar_type>(key[i]) != run_labels[i]) {
+      return 0;
+    }
+  }
+  return run_length;
+}
+
+template <typename A, typename B, typename T, typename C>
+template <typename U>
+inline U PathDoubleArrayImpl<A, B, T, C>::exactMatchSearch(
+    const key_type *key, std::size_t length) const {
+  U result;
+  set_result(&result, static_cast<value_type>(-1), 0);
+  if (size_ == 0) {
+    return result;
+  }
+
+  if (length == 0) {
+    while (key[length] != '\0') {
+      ++length;
+    }
+  }
+
+  id_type id = 0;
+  for (std::size_t i = 0; i < length; ) {
+    uchar_type label = static_cast<uchar_type>(key[i]);
+    id ^= nodes_[id].unit().offset() ^ label;
+    const node_type &node = nodes_[id];
+    if (node.unit().label() != label) {
+      return result;
+    }
+    if (node.run() == 0) {
+      ++i;
+    } else {
+      std::size_t run_length = match_run(node, key + i, length - i);
+      if (run_length == 0) {
+        return result;
+      }
+      i += run_length;
+    }
+  }
+
+  if (!nodes_[id].unit().has_leaf()) {
+    return result;
+  }
+  set_result(&result, leaf_value(id), length);
+  return result;
+}
+
+template <typename A, typename B, typename T, typename C>
+template <typename U>
+inline std::size_t PathDoubleArrayImpl<A, B, T, C>::commonPrefixSearch(
+    const key_type *key, U *results, std::size_t max_num_results,
+    std::size_t length) const {
+  std::size_t num_results = 0;
+  if (size_ == 0) {
+    return num_results;
+  }
+
+  id_type id = 0;
+  for (std::size_t i = 0; (length != 0) ? (i < length) : (key[i] != '\0'); ) {
+    uchar_type label = static_cast<uchar_type>(key[i]);
+    id ^= nodes_[id].unit().offset() ^ label;
+    const node_type &node = nodes_[id];
+    if (node.unit().label() != label) {
+      return num_results;
+    }
+    if (node.run() == 0) {
+      ++i;
+    } else {
+      std::size_t run_length = match_run(node, key + i,
+          (length != 0) ? (length - i) : 0);
+      if (run_length == 0) {
+        return num_results;
+      }
+      i += run_length;
+    }
+
+    if (node.unit().has_leaf()) {
+      if (num_results < max_num_results) {
+        set_result(&results[num_results], leaf_value(id), i);
+      }
+      ++num_results;
+    }
+  }
+  return num_results;
+}
+
+template <typename A, typename B, typename T, typename C>
+inline typename PathDoubleArrayImpl<A, B, T, C>::value_type
+PathDoubleArrayImpl<A, B, T, C>::traverse(const key_type *key,
+    std::size_t &node_pos, std::size_t &key_pos, std::size_t length) const {
+  id_type id = static_cast<id_type>(node_pos % size_);
+  std::size_t run_pos = node_pos / size_;
+
+  for ( ; (length != 0) ? (key_pos < length) : (key[key_pos] != '\0');
+      ++key_pos) {
+    uchar_type label = static_cast<uchar_type>(key[key_pos]);
+    if (run_pos != 0) {
+      if (nodes_[id].run_labels()[run_pos] != label) {
+        return static_cast<value_type>(-2);
+      }
+      ++run_pos;
+    } else {
+      id_type child_id = id ^ nodes_[id].unit().offset() ^ label;
+      if (nodes_[child_id].unit().label() != label) {
+        return static_cast<value_type>(-2);
+      }
+      id = child_id;
+      run_pos = (nodes_[id].run() != 0) ? 1 : 0;
+    }
+    if (run_pos != 0 && run_pos == nodes_[id].run_length()) {
+      run_pos = 0;
+    }
+    node_pos = (size_ * run_pos) + id;
+  }
+
+  if (run_pos != 0 || !nodes_[id].unit().has_leaf()) {
+    return static_cast<value_type>(-1);
+  }
+  return leaf_value(id);
+}
+
+//
+// Succinct trie.
+//
+
+// <LoudsTrieImpl> keeps a trie in the level-order unary degree sequence
+// (LOUDS) form. The edges of the trie are numbered in level order, and the
+// labels of the edges from each node are kept in order. Each edge has 3 bits:
+// whether it is the first edge of its node, whether its child has children,
+// and whether a key ends at its child. The nodes which have children are
+// numbered in level order from the root, and so the child of an edge is the
+// rank of the edge in the 2nd bits, and the first edge of a node is given by
+// selecting the node in the 1st bits. The values of the keys are kept in the
+// order of the edges where they end. So, the trie takes a byte and a few bits
+// per edge and a value per key, without the empty units of a double-array,
+// but a transition costs a select() instead of a load. The trie is built
+// from a dictionary and it does not share nodes as a DAWG does.
+template <typename A, typename B, typename T, typename C>
+class LoudsTrieImpl {
+ public:
+  typedef DoubleArrayImpl<A, B, T, C> dic_type;
+  typedef typename dic_type::value_type value_type;
+  typedef typename dic_type::key_type key_type;
+  typedef typename dic_type::result_pair_type result_pair_type;
+
+  LoudsTrieImpl() : labels_(), is_firsts_(), has_children_(),
+      is_terminals_(), values_() {}
+
+  // build() makes a trie of the keys of `dic'. `dic' is not used after
+  // build(). build() returns 0 iff it succeeds, and it returns a non-zero
+  // value if dic.size() is 0. It throws a <Darts::Exception> if a memory
+  // allocation fails.
+  int build(const dic_type &dic);
+
+  // num_edges() returns the number of edges, that is the number of nodes
+  // except the root.
+  std::size_t num_edges() const {
+    return labels_.size();
+  }
+  // num_keys() returns the number of keys.
+  std::size_t num_keys() const {
+    return values_.size();
+  }
+  // total_size() returns the number of bytes allocated to the trie.
+  std::size_t total_size() const {
+    return labels_.size() + is_firsts_.total_size() +
+        has_children_.total_size() + is_terminals_.total_size() +
+        (sizeof(value_type) * values_.size());
+  }
+
+  void clear() {
+    labels_.clear();
+    is_firsts_.clear();
+    has_children_.clear();
+    is_terminals_.clear();
+    values_.clear();
+  }
+
+  // exactMatchSearch(), commonPrefixSearch() and traverse() work as well as
+  // those of <DoubleArrayImpl>, except that they start at the root. A node
+  // given by traverse() is (the number of its edge + 1), or 0 for the root.
+  template <class U>
+  void exactMatchSearch(const key_type *key, U &result,
+      std::size_t length = 0) const {
+    result = exactMatchSearch<U>(key, length);
+  }
+  template <class U>
+  inline U exactMatchSearch(const key_type *key,
+      std::size_t length = 0) const;
+
+  template <class U>
+  inline std::size_t commonPrefixSearch(const key_type *key, U *results,
+      std::size_t max_num_results, std::size_t length = 0) const;
+
+  inline value_type traverse(const key_type *key, std::size_t &node_pos,
+      std::size_t &key_pos, std::size_t length = 0) const;
+
+  // save() writes the trie into a file, and open() reads it. `mode' and
+  // `offset' work as well as in DoubleArrayImpl::save() and
+  // DoubleArrayImpl::open(). They return 0 iff they succeed, and open()
+  // throws a <Darts::Exception> if a memory allocation fails.
+  int save(const char *file_name, const char *mode = "wb",
+      std::size_t offset = 0) const;
+  int open(const char *file_name, const char *mode = "rb",
+      std::size_t offset = 0);
+
+ private:
+  typedef Details::uchar_type uchar_type;
+  typedef Details::id_type id_type;
+  typedef typename Details::UnitTraits<B>::unit_type unit_type;
+
+  // NO_EDGE is returned by find_edge() if there is no such edge.
+  static const std::size_t NO_EDGE = static_cast<std::size_t>(-1);
+
+  Details::AutoPool<uchar_type> labels_;
+  Details::BitVector is_firsts_;
+  Details::BitVector has_children_;
+  Details::BitVector is_terminals_;
+  Details::AutoPool<value_type> values_;
+
+  // Disallows copy and assignment.
+  LoudsTrieImpl(const LoudsTrieImpl &);
+  LoudsTrieImpl &operator=(const LoudsTrieImpl &);
+
+  static void set_result(value_type *result, value_type value,
+      std::size_t) {
+    *result = value;
+  }
+  static void set_result(result_pair_type *result, value_type value,
+      std::size_t length) {
+    result->value = value;
+    result->length = length;
+  }
+
+  // find_edge() returns the edge labeled `label' from the child of `edge',
+  // or from the root if `edge' is NO_EDGE. It returns NO_EDGE if there is no
+  // such edge. The edges of a node are scanned from the first one until a
+  // label is not less than `label', because a node has only a few edges in
+  // most cases.
+  std::size_t find_edge(std::size_t edge, uchar_type label) const {
+    id_type node = 0;
+    if (edge != NO_EDGE) {
+      if (!has_children_[edge]) {
+        return NO_EDGE;
+      }
+      node = has_children_.rank(edge);
+    } else if (labels_.empty()) {
+      return NO_EDGE;
+    }
+    std::size_t id = is_firsts_.select(node + 1);
+    do {
+      if (labels_[id] >= label) {
+        return (labels_[id] == label) ? id : NO_EDGE;
+      }
+      ++id;
+    } while (id < labels_.size() && !is_firsts_[id]);
+    return NO_EDGE;
+  }
+  // value() returns the value of the key which ends at the child of `edge'.
+  value_type value(std::size_t edge) const {
+    return values_[is_terminals_.rank(edge) - 1];
+  }
+
+  static std::size_t num_bytes(std::size_t num_bits) {
+    return (num_bits + 7) / 8;
+  }
+  static void pack_bits(const Details::BitVector &bits, std::size_t size,
+      Details::AutoPool<uchar_type> *bytes);
+  static void unpack_bits(const uchar_type *bytes, std::size_t size,
+      Details::BitVector *bits);
+};
+
+template <typename A, typename B, typename T, typename C>
+const std::size_t LoudsTrieImpl<A, B, T, C>::NO_EDGE;
+
+// build() visits the nodes of the dictionary in breadth-first order. A node
+// shared by keys in a DAWG is visited once for each of its parents, and so
+// the trie has a node for each distinct prefix.
+template <typename A, typename B, typename T, typename C>
+int LoudsTrieImpl<A, B, T, C>::build(const dic_type &dic) {
+  if (dic.size() == 0) {
+    return -1;
+  }
+  clear();
+
+  const unit_type *units = static_cast<const unit_type *>(dic.array());
+  const value_type *value_table = dic.value_table();
+  Details::AutoPool<id_type> queue;
+  queue.append(0);
+  for (std::size_t i = 0; i < queue.size(); ++i) {
+    id_type offset = queue[i] ^ units[queue[i]].offset();
+    bool is_first = true;
+    for (id_type label = 1; label < 256; ++label) {
+      id_type child_id = offset ^ label;
+      if (units[child_id].label() != label) {
+        continue;
+      }
+      id_type child_offset = child_id ^ units[child_id].offset();
+      bool has_children = false;
+      for (id_type child_label = 1; child_label < 256; ++child_label) {
+        if (units[child_offset ^ child_label].label() == child_label) {
+          has_children = true;
+          break;
+        }
+      }
+
+      labels_.append(static_cast<uchar_type>(label));
+      is_firsts_.append();
+      is_firsts_.set(labels_.size() - 1, is_first);
+      has_children_.append();
+      has_children_.set(labels_.size() - 1, has_children);
+      is_terminals_.append();
+      if (units[child_id].has_leaf()) {
+        is_terminals_.set(labels_.size() - 1, true);
+        const unit_type &leaf = units[child_offset];
+        values_.append((value_table != NULL) ? value_table[leaf.value()] :
+            static_cast<value_type>(leaf.value()));
+      }
+      if (has_children) {
+        queue.append(child_id);
+      }
+      is_first = false;
+    }
+  }
+
+  is_firsts_.build();
+  has_children_.build();
+  is_terminals_.build();
+  return 0;
+}
+
+template <typename A, typename B, typename T, typename C>
+template <typename U>
+inline U LoudsTrieImpl<A, B, T, C>::exactMatchSearch(const key_type *key,
+    std::size_t length) const {
+  U result;
+  set_result(&result, static_cast<value_type>(-1), 0);
+
+  std::size_t edge = NO_EDGE;
+  std::size_t i = 0;
+  for ( ; (length != 0) ? (i < length) : (key[i] != '\0'); ++i) {
+    edge = find_edge(edge, static_cast<uchar_type>(key[i]));
+    if (edge == NO_EDGE) {
+      return result;
+    }
+  }
+  if (edge != NO_EDGE && is_terminals_[edge]) {
+    set_result(&result, value(edge), i);
+  }
+  return result;
+}
+
+template <typename A, typename B, typename T, typename C>
+template <typename U>
+inline std::size_t LoudsTrieImpl<A, B, T, C>::commonPrefixSearch(
+    const key_type *key, U *results, std::size_t max_num_results,
+    std::size_t length) const {
+  std::size_t num_results = 0;
+
+  std::size_t edge = NO_EDGE;
+  for (std::size_t i = 0; (length != 0) ? (i < length) : (key[i] != '\0');
+      ++i) {
+    edge = find_edge(edge, static_cast<uchar_type>(key[i]));
+    if (edge == NO_EDGE) {
+      break;
+    }
+    if (is_terminals_[edge]) {
+      if (num_results < max_num_results) {
+        set_result(&results[num_results], value(edge), i + 1);
+      }
+      ++num_results;
+    }
+  }
+  return num_results;
+}
+
+template <typename A, typename B, typename T, typename C>
+inline typename LoudsTrieImpl<A, B, T, C>::value_type
+LoudsTrieImpl<A, B, T, C>::traverse(const key_type *key,
+    std::size_t &node_pos, std::size_t &key_pos, std::size_t length) const {
+  for ( ; (length != 0) ? (key_pos < length) : (key[key_pos] != '\0');
+      ++key_pos) {
+    std::size_t edge = find_edge((node_pos != 0) ? (node_pos - 1) : NO_EDGE,
+        static_cast<uchar_type>(key[key_pos]));
+    if (edge == NO_EDGE) {
+      return static_cast<value_type>(-2);
+    }
+    node_pos = edge + 1;
+  }
+
+  if (node_pos == 0 || !is_terminals_[node_pos - 1]) {
+    return static_cast<value_type>(-1);
+  }
+  return value(node_pos - 1);
+}
+
+// pack_bits() appends the first `size' bits to `bytes', 8 bits per byte
+// from the lowest bit.
+template <typename A, typename B, typename T, typename C>
+void LoudsTrieImpl<A, B, T, C>::pack_bits(const Details::BitVector &bits,
+    std::size_t size, Details::AutoPool<uchar_type> *bytes) {
+  for (std::size_t i = 0; i < size; i += 8) {
+    uchar_type byte = 0;
+    for (std::size_t j = i; j < i + 8 && j < size; ++j) {
+      if (bits[j]) {
+        byte |= static_cast<uchar_type>(1 << (j - i));
+      }
+    }
+    bytes->append(byte);
+  }
+}
+
+template <typename A, typename B, typename T, typename C>
+void LoudsTrieImpl<A, B, T, C>::unpack_bits(const uchar_type *bytes,
+    std::size_t size, Details::BitVector *bits) {
+  for (std::size_t i = 0; i < size; ++i) {
+    bits->append();
+    if ((bytes[i / 8] >> (i % 8)) & 1) {
+      bits->set(i, true);
+    }
+  }
+  bits->build();
+}
+
+// save() writes the number of edges and the number of keys as pairs of
+// 32-bit words, and then the labels, the 3 kinds of bits packed into bytes,
+// and the values.
+template <typename A, typename B, typename T, typename C>
+int LoudsTrieImpl<A, B, T, C>::save(const char *file_name,
+    const char *mode, std::size_t offset) const {
+  if (labels_.empty()) {
+    return -1;
+  }
+
+  Details::AutoPool<uchar_type> bytes;
+  pack_bits(is_firsts_, labels_.size(), &bytes);
+  pack_bits(has_children_, labels_.size(), &bytes);
+  pack_bits(is_terminals_, labels_.size(), &bytes);
+
+#ifdef _MSC_VER
+  std::FILE *file;
+  if (::fopen_s(&file, file_name, mode) != 0) {
+    return -1;
+  }
+#else
+  std::FILE *file = std::fopen(file_name, mode);
+  if (file == NULL) {
+    return -1;
+  }
+#endif
+
+  id_type sizes[4] = {
+    static_cast<id_type>(labels_.size()),
+    static_cast<id_type>((labels_.size() >> 16) >> 16),
+    static_cast<id_type>(values_.size()),
+    static_cast<id_type>((values_.size() >> 16) >> 16)
+  };
+  if (std::fseek(file, offset, SEEK_SET) != 0 ||
+      std::fwrite(sizes, sizeof(id_type), 4, file) != 4 ||
+      std::fwrite(&labels_[0], 1, labels_.size(), file) != labels_.size() ||
+      std::fwrite(&bytes[0], 1, bytes.size(), file) != bytes.size() ||
+      (!values_.empty() && std::fwrite(&values_[0], sizeof(value_type),
+      values_.size(), file) != values_.size())) {
+    std::fclose(file);
+    return -1;
+  }
+  std::fclose(file);
+  return 0;
+}
+
+template <typename A, typename B, typename T, typename C>
+int LoudsTrieImpl<A, B, T, C>::open(const char *file_name,
+    const char *mode, std::size_t offset) {
+#ifdef _MSC_VER
+  std::FILE *file;
+  if (::fopen_s(&file, file_name, mode) != 0) {
+    return -1;
+  }
+#else
+  std::FILE *file = std::fopen(file_name, mode);
+  if (file == NULL) {
+    return -1;
+  }
+#endif
+
+  id_type sizes[4];
+  if (std::fseek(file, offset, SEEK_SET) != 0 ||
+      std::fread(sizes, sizeof(id_type), 4, file) != 4) {
+    std::fclose(file);
+    return -1;
+  }
+  std::size_t upper_num_edges = sizes[1];
+  std::size_t upper_num_keys = sizes[3];
+  std::size_t num_edges = sizes[0] | ((upper_num_edges << 16) << 16);
+  std::size_t num_keys = sizes[2] | ((upper_num_keys << 16) << 16);
+  if (num_edges == 0 || num_keys > num_edges ||
+      (sizeof(std::size_t) < 8 && (sizes[1] != 0 || sizes[3] != 0))) {
+    std::fclose(file);
+    return -1;
+  }
+
+  Details::AutoPool<uchar_type> labels;
+  Details::AutoPool<uchar_type> bytes;
+  Details::AutoPool<value_type> values;
+  try {
+    labels.resize(num_edges);
+    bytes.resize(num_bytes(num_edges) * 3);
+    values.resize(num_keys);
+  } catch (const Details::Exception &) {
+    std::fclose(file);
+    throw;
+  }
+  if (std::fread(&labels[0], 1, num_edges, file) != num_edges ||
+      std::fread(&bytes[0], 1, bytes.size(), file) != bytes.size() ||
+      (num_keys != 0 && std::fread(&values[0], sizeof(value_type), num_keys,
+      file) != num_keys)) {
+    std::fclose(file);
+    return -1;
+  }
+  std::fclose(file);
+
+  clear();
+  labels_.swap(&labels);
+  unpack_bits(&bytes[0], num_edges, &is_firsts_);
+  unpack_bits(&bytes[num_bytes(num_edges)], num_edges, &has_children_);
+  unpack_bits(&bytes[num_bytes(num_edges) * 2], num_edges, &is_terminals_);
+  values_.swap(&values);
+  if (!is_firsts_[0] ||
+      is_firsts_.num_ones() != has_children_.num_ones() + 1 ||
+      is_terminals_.num_ones() != num_keys) {
+    clear();
+    return -1;
+  }
+  return 0;
+}
+
+//
+// Mutable double-array.
+//
+
+// <MutableDoubleArrayImpl> keeps a trie in the form of a double-array and
+// inserts keys into it one by one, which is the classic dynamic double-array.
+// If the unit for a new child is taken, the children of the node are moved
+// to another offset, and the children of a moved node are moved as well if
+// its relative offset becomes invalid. Free units are found in a ring of the
+// blocks which have free units, as <DoubleArrayBuilder> finds them in its
+// extras window, and moved children and erased keys leave free units behind,
+// which compact() reclaims by rebuilding the array. A dictionary built with
+// values is a DAWG, whose nodes may be shared by keys, and so assign() copies
+// the shared nodes to make a trie from it, where erase() and update_value()
+// change only the given key. <WideValues> is not supported.
+template <typename A, typename B, typename T, typename C>
+class MutableDoubleArrayImpl {
+ public:
+  typedef DoubleArrayImpl<A, B, T, C> dic_type;
+  typedef typename dic_type::value_type value_type;
+  typedef typename dic_type::key_type key_type;
+
+  // The constructor makes an empty dictionary.
+  MutableDoubleArrayImpl() : units_(), blocks_(), links_(), parents_(),
+      head_(NO_ID), num_free_units_(0), num_keys_(0), is_compact_(true),
+      dic_() {
+    clear();
+  }
+
+  // assign() replaces the keys with those of `dic'. `dic' is not used after
+  // assign(). assign() returns 0 iff it succeeds, and it returns a non-zero
+  // value if dic.size() is 0 or the 4th template argument is <WideValues>.
+  int assign(const dic_type &dic);
+
+  // insert() adds a key and returns true iff the key is new. If the key
+  // exists, its value is not changed. If `length' is 0, `key' is handled as a
+  // zero-terminated string. insert() throws a <Darts::Exception> if the key
+  // is empty or has a null character, or if the value is negative.
+  bool insert(const key_type *key, value_type value, std::size_t length = 0);
+  // erase() removes a key and the nodes which are left without children, and
+  // returns true iff the key existed.
+  bool erase(const key_type *key, std::size_t length = 0);
+  // update_value() overwrites the value of a key and returns true iff the key
+  // exists. It throws a <Darts::Exception> if the value is negative.
+  bool update_value(const key_type *key, value_type value,
+      std::size_t length = 0);
+
+  // compact() rebuilds the array in depth-first order, and then there are
+  // free units only at the ends of blocks.
+  void compact();
+  // save() compacts the array if keys have been inserted or erased since the
+  // last compact() or assign(), and then saves it as DoubleArrayImpl::save()
+  // does. The free units of erased keys are not saved.
+  int save(const char *file_name, const char *mode = "wb",
+      std::size_t offset = 0, bool with_header = false);
+
+  // dic() returns the dictionary for searching or saving the array. It is
+  // valid until the next call of a non-const member function.
+  const dic_type &dic() const {
+    return dic_;
+  }
+
+  // size() returns the number of units.
+  std::size_t size() const {
+    return units_.size();
+  }
+  // num_free_units() returns the number of units which are not used by any
+  // node. compact() is worth calling if it is a large part of size().
+  std::size_t num_free_units() const {
+    return num_free_units_;
+  }
+  // num_keys() returns the number of keys.
+  std::size_t num_keys() const {
+    return num_keys_;
+  }
+  // total_size() returns the number of bytes allocated to the array and its
+  // bookkeeping.
+  std::size_t total_size() const {
+    return ((sizeof(unit_type) + sizeof(id_type)) * units_.size()) +
+        ((sizeof(block_type) + sizeof(link_type)) * blocks_.size());
+  }
+
+  // clear() makes the dictionary empty.
+  void clear();
+
+ private:
+  typedef Details::uchar_type uchar_type;
+  typedef Details::id_type id_type;
+  typedef typename Details::UnitTraits<B>::unit_type dic_unit_type;
+  typedef Details::DoubleArrayBuilderUnit unit_type;
+  typedef Details::DoubleArrayBuilderExtraUnit link_type;
+  typedef Details::DoubleArrayBuilderExtraBlock block_type;
+
+  enum { BLOCK_SIZE = 256 };
+  enum { EXTENSION_SHIFT = dic_unit_type::EXTENSION_SHIFT };
+
+  // find_offset() tests at most NUM_SCANNED_BLOCKS blocks in the ring before
+  // it appends a new block.
+  enum { NUM_SCANNED_BLOCKS = 16 };
+
+  // NO_ID is never a unit ID, and it is also used as "no label" and "no
+  // offset".
+  enum { NO_ID = 0xFFFFFFFFU };
+
+  // units_[i] is free iff it is not fixed in blocks_[i / BLOCK_SIZE], and a
+  // free unit is a leaf so as not to match any label. parents_[i] is the node
+  // whose children are at offset `i' if the offset is used. links_ makes a
+  // ring of the blocks which have free units, and `head_' is NO_ID if there
+  // is no such block. `is_compact_' is false iff keys have been inserted or
+  // erased since the array was last rebuilt.
+  Details::AutoPool<unit_type> units_;
+  Details::AutoPool<block_type> blocks_;
+  Details::AutoPool<link_type> links_;
+  Details::AutoPool<id_type> parents_;
+  id_type head_;
+  std::size_t num_free_units_;
+  std::size_t num_keys_;
+  bool is_compact_;
+  dic_type dic_;
+
+  // Disallows copy and assignment.
+  MutableDoubleArrayImpl(const MutableDoubleArrayImpl &);
+  MutableDoubleArrayImpl &operator=(const MutableDoubleArrayImpl &);
+
+  // offset() returns the offset of the children of `id'.
+  id_type offset(id_type id) const {
+    return id ^ units_[id].offset(EXTENSION_SHIFT);
+  }
+  bool is_fixed(id_type id) const {
+    return blocks_[id / BLOCK_SIZE].is_fixed(id);
+  }
+  static bool is_valid_rel_offset(id_type rel_offset) {
+    return !(rel_offset & ((1U << EXTENSION_SHIFT) - 1)) ||
+        rel_offset < 1U << 21;
+  }
+  bool is_root_child(id_type id) const {
+    return units_[id].label() == (id ^ offset(0));
+  }
+  static unit_type make_free_unit() {
+    unit_type unit;
+    unit.set_value(0);
+    return unit;
+  }
+
+  void load(const dic_unit_type *units, std::size_t size);
+  id_type find_node(const key_type *key, std::size_t length) const;
+  bool has_children(id_type offset) const;
+
+  std::size_t list_children(id_type id, id_type offset, id_type *labels,
+      id_type *offsets) const;
+  id_type find_offset(id_type id, const id_type *labels,
+      const id_type *offsets, std::size_t num_labels);
+  id_type find_offset(id_type id, id_type block_id, const id_type *labels,
+      const id_type *offsets, std::size_t num_labels) const;
+  id_type move_children(id_type id, id_type src_offset, id_type label);
+  id_type move_root_children(id_type label);
+  void move_siblings(id_type id);
+  void move_units(id_type src_offset, id_type dest_offset,
+      const id_type *labels, const id_type *offsets, std::size_t num_labels);
+  void set_offset(id_type id, id_type offset);
+
+  void fix_unit(id_type id);
+  void free_unit(id_type id);
+  void expand_units();
+  void link_block(id_type block_id);
+  void unlink_block(id_type block_id);
+};
+
+template <typename A, typename B, typename T, typename C>
+int MutableDoubleArrayImpl<A, B, T, C>::assign(const dic_type &dic) {
+  if (Details::ValueTraits<C>::HAS_VALUE_TABLE || dic.size() == 0) {
+    return -1;
+  }
+
+  std::size_t size = 0;
+  dic_unit_type *buf = NULL;
+  {
+    Details::DoubleArrayBuilder builder(NULL, 1, EXTENSION_SHIFT);
+    builder.build_from_array(static_cast<const dic_unit_type *>(dic.array()),
+        dic.size(), NULL, false);
+    builder.copy(&size, &buf);
+  }
+  Details::AutoArray<dic_unit_type> units(buf);
+  load(&units[0], size);
+  return 0;
+}
+
+// insert() follows the key as far as it exists, and then adds a node for
+// each remaining label and a leaf for the value. A new node has no children,
+// and so its offset is found for its only child.
+template <typename A, typename B, typename T, typename C>
+bool MutableDoubleArrayImpl<A, B, T, C>::insert(const key_type *key,
+    value_type value, std::size_t length) {
+  if (Details::ValueTraits<C>::HAS_VALUE_TABLE) {
+    DARTS_THROW("failed to insert key: WideValues is not supported");
+  }
+  if (length == 0) {
+    while (key[length] != '\0') {
+      ++length;
+    }
+  }
+  if (length == 0) {
+    DARTS_THROW("failed to insert key: zero-length key");
+  } else if (value < 0) {
+    DARTS_THROW("failed to insert key: negative value");
+  }
+
+  id_type id = 0;
+  std::size_t i = 0;
+  for ( ; i < length; ++i) {
+    id_type child_id = offset(id) ^ static_cast<uchar_type>(key[i]);
+    if (units_[child_id].label() != static_cast<uchar_type>(key[i])) {
+      break;
+    }
+    id = child_id;
+  }
+  if (i == length && units_[id].has_leaf()) {
+    return false;
+  }
+  for (std::size_t j = i; j < length; ++j) {
+    if (key[j] == '\0') {
+      DARTS_THROW("failed to insert key: invalid null character");
+    }
+  }
+
+  for (bool is_new = false; ; ++i) {
+    id_type label = (i < length) ? static_cast<uchar_type>(key[i]) : 0;
+    id_type child_id;
+    if (is_new) {
+      id_type no_offset = NO_ID;
+      id_type child_offset = find_offset(id, &label, &no_offset, 1);
+      set_offset(id, child_offset);
+      child_id = child_offset ^ label;
+      fix_unit(child_id);
+    } else {
+      child_id = offset(id) ^ label;
+      if (!is_fixed(child_id)) {
+        fix_unit(child_id);
+      } else if (id == 0) {
+        child_id = move_root_children(label) ^ label;
+      } else {
+        child_id = move_children(id, offset(id), label) ^ label;
+      }
+    }
+
+    units_[child_id] = unit_type();
+    if (i == length) {
+      units_[child_id].set_value(static_cast<Details::value_type>(value));
+      units_[id].set_has_leaf(true);
+      break;
+    }
+    units_[child_id].set_label(static_cast<uchar_type>(label));
+    id = child_id;
+    is_new = true;
+  }
+
+  ++num_keys_;
+  is_compact_ = false;
+  dic_.set_array(&units_[0], units_.size());
+  return true;
+}
+
+// erase() frees the leaf of the key, and then frees the nodes on the path
+// from the bottom while they have no children. The offset of a freed node is
+// no longer used, and its unit must be freed rather than left as a childless
+// node because another node may put a child with a matching label at the
+// offset.
+template <typename A, typename B, typename T, typename C>
+bool MutableDoubleArrayImpl<A, B, T, C>::erase(const key_type *key,
+    std::size_t length) {
+  id_type id = find_node(key, length);
+  if (id == NO_ID || !units_[id].has_leaf()) {
+    return false;
+  }
+
+  id_type offset = this->offset(id);
+  free_unit(offset);
+  units_[id].set_has_leaf(false);
+  while (id != 0 && !units_[id].has_leaf() && !has_children(offset)) {
+    blocks_[offset / BLOCK_SIZE].clear_is_used(offset);
+    offset = id ^ units_[id].label();
+    id_type parent_id = parents_[offset];
+    free_unit(id);
+    id = parent_id;
+  }
+
+  --num_keys_;
+  is_compact_ = false;
+  return true;
+}
+
+template <typename A, typename B, typename T, typename C>
+bool MutableDoubleArrayImpl<A, B, T, C>::update_value(const key_type *key,
+    value_type value, std::size_t length) {
+  if (value < 0) {
+    DARTS_THROW("failed to update value: negative value");
+  }
+  id_type id = find_node(key, length);
+  if (id == NO_ID || !units_[id].has_leaf()) {
+    return false;
+  }
+  units_[offset(id)].set_value(static_cast<Details::value_type>(value));
+  return true;
+}
+
+template <typename A, typename B, typename T, typename C>
+void MutableDoubleArrayImpl<A, B, T, C>::compact() {
+  std::size_t size = 0;
+  dic_unit_type *buf = NULL;
+  {
+    Details::DoubleArrayBuilder builder(NULL, 1, EXTENSION_SHIFT);
+    builder.build_from_array(
+        reinterpret_cast<const dic_unit_type *>(&units_[0]), units_.size(),
+        NULL, false);
+    builder.copy(&size, &buf);
+  }
+  Details::AutoArray<dic_unit_type> units(buf);
+  load(&units[0], size);
+}
+
+template <typename A, typename B, typename T, typename C>
+int MutableDoubleArrayImpl<A, B, T, C>::save(const char *file_name,
+    const char *mode, std::size_t offset, bool with_header) {
+  if (!is_compact_) {
+    compact();
+  }
+  return dic_.save(file_name, mode, offset, with_header);
+}
+
+template <typename A, typename B, typename T, typename C>
+void MutableDoubleArrayImpl<A, B, T, C>::clear() {
+  dic_.clear();
+  units_.clear();
+  blocks_.clear();
+  links_.clear();
+  parents_.clear();
+  head_ = NO_ID;
+  num_free_units_ = 0;
+  num_keys_ = 0;
+  is_compact_ = true;
+
+  expand_units();
+  fix_unit(0);
+  units_[0] = unit_type();
+  set_offset(0, 1);
+  dic_.set_array(&units_[0], units_.size());
+}
+
+// load() copies a trie made by <DoubleArrayBuilder> and visits its nodes to
+// find the units and offsets in use. The other units are made free because
+// their labels may match the children of an offset which is used later.
+template <typename A, typename B, typename T, typename C>
+void MutableDoubleArrayImpl<A, B, T, C>::load(const dic_unit_type *units,
+    std::size_t size) {
+  dic_.clear();
+  units_.clear();
+  blocks_.clear();
+  links_.clear();
+  parents_.clear();
+  head_ = NO_ID;
+
+  units_.resize(size);
+  const unit_type *src = reinterpret_cast<const unit_type *>(units);
+  for (std::size_t i = 0; i < size; ++i) {
+    units_[i] = src[i];
+  }
+  blocks_.resize(size / BLOCK_SIZE);
+  links_.resize(size / BLOCK_SIZE);
+  parents_.resize(size);
+  num_free_units_ = size;
+  num_keys_ = 0;
+  is_compact_ = true;
+
+  Details::AutoStack<id_type> ids;
+  blocks_[0].set_is_fixed(0);
+  --num_free_units_;
+  ids.push(0);
+  while (!ids.empty()) {
+    id_type id = ids.top();
+    ids.pop();
+    id_type offset = this->offset(id);
+    blocks_[offset / BLOCK_SIZE].set_is_used(offset);
+    parents_[offset] = id;
+    if (units_[id].has_leaf()) {
+      blocks_[offset / BLOCK_SIZE].set_is_fixed(offset);
+      --num_free_units_;
+      ++num_keys_;
+    }
+    for (id_type label = 1; label < 256; ++label) {
+      id_type child_id = offset ^ label;
+      if (units_[child_id].label() == label) {
+        blocks_[child_id / BLOCK_SIZE].set_is_fixed(child_id);
+        --num_free_units_;
+        ids.push(child_id);
+      }
+    }
+  }
+
+  // The builder does not reserve the offset of a root without children, and
+  // so the units filled in by DoubleArrayBuilder::fix_block() look like its
+  // children.
+  if (num_keys_ == 0) {
+    clear();
+    return;
+  }
+
+  for (id_type block_id = 0; block_id < blocks_.size(); ++block_id) {
+    id_type begin = block_id * BLOCK_SIZE;
+    for (id_type id = begin; id < begin + BLOCK_SIZE; ++id) {
+      if (!is_fixed(id)) {
+        units_[id] = make_free_unit();
+      }
+    }
+    if (blocks_[block_id].num_fixed() < BLOCK_SIZE) {
+      link_block(block_id);
+    }
+  }
+  dic_.set_array(&units_[0], units_.size());
+}
+
+// find_node() returns the node of a key, or NO_ID if there is no such node.
+template <typename A, typename B, typename T, typename C>
+Details::id_type MutableDoubleArrayImpl<A, B, T, C>::find_node(
+    const key_type *key, std::size_t length) const {
+  if (length == 0) {
+    while (key[length] != '\0') {
+      ++length;
+    }
+  }
+  id_type id = 0;
+  for (std::size_t i = 0; i < length; ++i) {
+    id_type child_id = offset(id) ^ static_cast<uchar_type>(key[i]);
+    if (units_[child_id].label() != static_cast<uchar_type>(key[i])) {
+      return NO_ID;
+    }
+    id = child_id;
+  }
+  return id;
+}
+
+// has_children() returns whether there is a child other than the leaf at
+// `offset'.
+template <typename A, typename B, typename T, typename C>
+bool MutableDoubleArrayImpl<A, B, T, C>::has_children(id_type offset) const {
+  for (id_type label = 1; label < 256; ++label) {
+    if (units_[offset ^ label].label() == label) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// list_children() lists the labels of the children at `offset' and the
+// offsets of their own children, or NO_ID for the leaf.
+template <typename A, typename B, typename T, typename C>
+std::size_t MutableDoubleArrayImpl<A, B, T, C>::list_children(id_type id,
+    id_type offset, id_type *labels, id_type *offsets) const {
+  std::size_t num_labels = 0;
+  if (units_[id].has_leaf()) {
+    labels[num_labels] = 0;
+    offsets[num_labels] = NO_ID;
+    ++num_labels;
+  }
+  for (id_type label = 1; label < 256; ++label) {
+    id_type child_id = offset ^ label;
+    if (units_[child_id].label() == label) {
+      labels[num_labels] = label;
+      offsets[num_labels] = this->offset(child_id);
+      ++num_labels;
+    }
+  }
+  return num_labels;
+}
+
+// find_offset() returns the first valid offset in the blocks of the ring,
+// starting from `head_'. If there is no such offset, the scanned blocks are
+// moved to the end of the ring, and then find_offset() tests the blocks
+// around `id' without the relative offsets of the children, so that new
+// nodes at the end of the array fill up the blocks there. At last, a new
+// offset is taken from new blocks as DoubleArrayBuilder::find_new_offset()
+// does. In the latter cases, the relative offsets of the children may be
+// invalid.
+template <typename A, typename B, typename T, typename C>
+Details::id_type MutableDoubleArrayImpl<A, B, T, C>::find_offset(
+    id_type id, const id_type *labels, const id_type *offsets,
+    std::size_t num_labels) {
+  if (head_ != NO_ID) {
+    id_type block_id = head_;
+    for (std::size_t i = 0; i < NUM_SCANNED_BLOCKS; ++i) {
+      id_type offset = find_offset(id, block_id, labels, offsets,
+          num_labels);
+      if (offset != NO_ID) {
+        head_ = block_id;
+        return offset;
+      }
+      block_id = links_[block_id].next();
+      if (block_id == head_) {
+        break;
+      }
+    }
+    head_ = block_id;
+  }
+
+  id_type num_blocks = static_cast<id_type>(blocks_.size());
+  for (id_type i = 0; i < NUM_SCANNED_BLOCKS * 2; ++i) {
+    id_type block_id = num_blocks - 1 - (i - NUM_SCANNED_BLOCKS);
+    if (i < NUM_SCANNED_BLOCKS) {
+      block_id = (i & 1) ? ((id / BLOCK_SIZE) - ((i + 1) / 2)) :
+          ((id / BLOCK_SIZE) + (i / 2));
+    }
+    if (block_id < num_blocks) {
+      id_type offset = find_offset(id, block_id, labels, NULL, num_labels);
+      if (offset != NO_ID) {
+        return offset;
+      }
+    }
+  }
+
+  std::size_t offset = units_.size() | (id & 0xFF);
+  if (!is_valid_rel_offset(id ^ static_cast<id_type>(offset))) {
+    id_type mask = (1U << EXTENSION_SHIFT) - 1;
+    offset = (units_.size() & ~static_cast<std::size_t>(mask)) | (id & mask);
+    if (offset < units_.size()) {
+      offset += mask + 1;
+    }
+  }
+  if (static_cast<id_type>(offset) != offset) {
+    DARTS_THROW("failed to insert key: too many units");
+  }
+  while (offset >= units_.size()) {
+    expand_units();
+  }
+  return static_cast<id_type>(offset);
+}
+
+// This find_offset() returns the first valid offset in a block, or NO_ID if
+// there is no such offset. Candidates are the offsets which put labels[0] on
+// free units. If `offsets' is NULL, the relative offsets of the children are
+// not tested.
+template <typename A, typename B, typename T, typename C>
+Details::id_type MutableDoubleArrayImpl<A, B, T, C>::find_offset(
+    id_type id, id_type block_id, const id_type *labels,
+    const id_type *offsets, std::size_t num_labels) const {
+  const block_type &block = blocks_[block_id];
+  if (BLOCK_SIZE - block.num_fixed() < num_labels) {
+    return NO_ID;
+  }
+
+  id_type begin = block_id * BLOCK_SIZE;
+  for (id_type words = block.unfixed_words(); words != 0;
+      words &= words - 1) {
+    id_type i = block_type::lowest_bit(words);
+    for (id_type bits = block.unfixed_bits(i); bits != 0; bits &= bits - 1) {
+      id_type offset = (begin + (32 * i) + block_type::lowest_bit(bits)) ^
+          labels[0];
+      if (block.is_used(offset) || !is_valid_rel_offset(id ^ offset)) {
+        continue;
+      }
+      std::size_t j = 1;
+      while (j < num_labels && !block.is_fixed(offset ^ labels[j]) &&
+          (offsets == NULL || offsets[j] == NO_ID ||
+          is_valid_rel_offset(offset ^ labels[j] ^ offsets[j]))) {
+        ++j;
+      }
+      if (j == num_labels && (offsets == NULL || offsets[0] == NO_ID ||
+          is_valid_rel_offset(offset ^ labels[0] ^ offsets[0]))) {
+        return offset;
+      }
+    }
+  }
+  return NO_ID;
+}
+
+// move_children() moves the children of `id' from `src_offset' to a new
+// offset, which also has a unit for `label' unless it is NO_ID, and returns
+// the new offset.
+template <typename A, typename B, typename T, typename C>
+Details::id_type MutableDoubleArrayImpl<A, B, T, C>::move_children(
+    id_type id, id_type src_offset, id_type label) {
+  id_type labels[257];
+  id_type offsets[257];
+  std::size_t num_labels = list_children(id, src_offset, labels, offsets);
+  std::size_t num_moved_labels = num_labels;
+  if (label != NO_ID) {
+    labels[num_labels] = label;
+    offsets[num_labels] = NO_ID;
+    ++num_labels;
+  }
+
+  id_type dest_offset = find_offset(id, labels, offsets, num_labels);
+  for (std::size_t i = 0; i < num_labels; ++i) {
+    fix_unit(dest_offset ^ labels[i]);
+  }
+  set_offset(id, dest_offset);
+  move_units(src_offset, dest_offset, labels, offsets, num_moved_labels);
+  return dest_offset;
+}
+
+// The offset of the root must be less than 512, and so a new child of the
+// root takes its unit from another node by moving the siblings of the node.
+// The root keeps its offset unless `label' is equal to it, which would put
+// the child on the root. Then, the children are moved to a new offset in the
+// first 2 blocks, which must not put a child on the units of the current
+// children, and the offset is reserved before moving the siblings of others.
+template <typename A, typename B, typename T, typename C>
+Details::id_type MutableDoubleArrayImpl<A, B, T, C>::move_root_children(
+    id_type label) {
+  while (units_.size() < BLOCK_SIZE * 2) {
+    expand_units();
+  }
+
+  id_type labels[257];
+  id_type offsets[257];
+  id_type src_offset = offset(0);
+  std::size_t num_labels = list_children(0, src_offset, labels, offsets);
+  labels[num_labels] = label;
+  offsets[num_labels] = NO_ID;
+
+  id_type dest_offset = src_offset;
+  std::size_t begin = num_labels;
+  if (label == src_offset) {
+    dest_offset = NO_ID;
+    begin = 0;
+    for (id_type offset = 1; offset < BLOCK_SIZE * 2; ++offset) {
+      if (blocks_[offset / BLOCK_SIZE].is_used(offset)) {
+        continue;
+      }
+      std::size_t i = 0;
+      while (i <= num_labels && labels[i] != offset &&
+          !is_root_child(offset ^ labels[i])) {
+        ++i;
+      }
+      if (i > num_labels) {
+        dest_offset = offset;
+        break;
+      }
+    }
+    if (dest_offset == NO_ID) {
+      DARTS_THROW("failed to insert key: too many children of the root");
+    }
+    set_offset(0, dest_offset);
+  }
+
+  bool is_taken[257];
+  for (std::size_t i = begin; i <= num_labels; ++i) {
+    is_taken[i] = false;
+  }
+  for ( ; ; ) {
+    id_type taken_id = NO_ID;
+    for (std::size_t i = begin; i <= num_labels; ++i) {
+      if (!is_taken[i] && !is_fixed(dest_offset ^ labels[i])) {
+        fix_unit(dest_offset ^ labels[i]);
+        is_taken[i] = true;
+      }
+      if (!is_taken[i] && taken_id == NO_ID) {
+        taken_id = dest_offset ^ labels[i];
+      }
+    }
+    if (taken_id == NO_ID) {
+      break;
+    }
+    move_siblings(taken_id);
+  }
+
+  // The offsets of the children are listed again because move_siblings() may
+  // have moved their children.
+  if (dest_offset != src_offset) {
+    list_children(0, src_offset, labels, offsets);
+    move_units(src_offset, dest_offset, labels, offsets, num_labels);
+  }
+  return dest_offset;
+}
+
+// move_siblings() frees `id' by moving the children of its parent.
+template <typename A, typename B, typename T, typename C>
+void MutableDoubleArrayImpl<A, B, T, C>::move_siblings(id_type id) {
+  id_type offset = units_[id].is_leaf() ? id : (id ^ units_[id].label());
+  move_children(parents_[offset], offset, NO_ID);
+}
+
+// move_units() moves the children to the units which have been fixed, and
+// then frees the old units. If the relative offset of a moved child becomes
+// invalid, its children are moved too.
+template <typename A, typename B, typename T, typename C>
+void MutableDoubleArrayImpl<A, B, T, C>::move_units(id_type src_offset,
+    id_type dest_offset, const id_type *labels, const id_type *offsets,
+    std::size_t num_labels) {
+  std::size_t invalid_ids[256];
+  std::size_t num_invalid_ids = 0;
+  for (std::size_t i = 0; i < num_labels; ++i) {
+    id_type src_id = src_offset ^ labels[i];
+    id_type dest_id = dest_offset ^ labels[i];
+    units_[dest_id] = units_[src_id];
+    free_unit(src_id);
+    if (offsets[i] == NO_ID) {
+      continue;
+    }
+    parents_[offsets[i]] = dest_id;
+    if (is_valid_rel_offset(dest_id ^ offsets[i])) {
+      units_[dest_id].set_offset(dest_id ^ offsets[i], EXTENSION_SHIFT);
+    } else {
+      invalid_ids[num_invalid_ids++] = i;
+    }
+  }
+  blocks_[src_offset / BLOCK_SIZE].clear_is_used(src_offset);
+
+  for (std::size_t i = 0; i < num_invalid_ids; ++i) {
+    std::size_t j = invalid_ids[i];
+    move_children(dest_offset ^ labels[j], offsets[j], NO_ID);
+  }
+}
+
+template <typename A, typename B, typename T, typename C>
+void MutableDoubleArrayImpl<A, B, T, C>::set_offset(id_type id,
+    id_type offset) {
+  units_[id].set_offset(id ^ offset, EXTENSION_SHIFT);
+  blocks_[offset / BLOCK_SIZE].set_is_used(offset);
+  parents_[offset] = id;
+}
+
+template <typename A, typename B, typename T, typename C>
+void MutableDoubleArrayImpl<A, B, T, C>::fix_unit(id_type id) {
+  block_type &block = blocks_[id / BLOCK_SIZE];
+  block.set_is_fixed(id);
+  --num_free_units_;
+  if (block.num_fixed() == BLOCK_SIZE) {
+    unlink_block(id / BLOCK_SIZE);
+  }
+}
+
+template <typename A, typename B, typename T, typename C>
+void MutableDoubleArrayImpl<A, B, T, C>::free_unit(id_type id) {
+  block_type &block = blocks_[id / BLOCK_SIZE];
+  if (block.num_fixed() == BLOCK_SIZE) {
+    link_block(id / BLOCK_SIZE);
+  }
+  block.clear_is_fixed(id);
+  ++num_free_units_;
+  units_[id] = make_free_unit();
+}
+
+template <typename A, typename B, typename T, typename C>
+void MutableDoubleArrayImpl<A, B, T, C>::expand_units() {
+  std::size_t num_units = units_.size() + BLOCK_SIZE;
+  if (static_cast<id_type>(num_units) != num_units) {
+    DARTS_THROW("failed to insert key: too many units");
+  }
+  units_.resize(num_units, make_free_unit());
+  parents_.resize(num_units);
+  blocks_.append();
+  links_.append();
+  num_free_units_ += BLOCK_SIZE;
+  link_block(static_cast<id_type>(blocks_.size() - 1));
+}
+
+// link_block() puts a block at the end of the ring, which is just before
+// `head_'.
+template <typename A, typename B, typename T, typename C>
+void MutableDoubleArrayImpl<A, B, T, C>::link_block(id_type block_id) {
+  if (head_ == NO_ID) {
+    links_[block_id].set_prev(block_id);
+    links_[block_id].set_next(block_id);
+    head_ = block_id;
+    return;
+  }
+  id_type prev = links_[head_].prev();
+  links_[block_id].set_prev(prev);
+  links_[block_id].set_next(head_);
+  links_[prev].set_next(block_id);
+  links_[head_].set_prev(block_id);
+}
+
+template <typename A, typename B, typename T, typename C>
+void MutableDoubleArrayImpl<A, B, T, C>::unlink_block(id_type block_id) {
+  if (block_id == head_) {
+    head_ = links_[block_id].next();
+    if (head_ == block_id) {
+      head_ = NO_ID;
+      return;
+    }
+  }
+  links_[links_[block_id].prev()].set_next(links_[block_id].next());
+  links_[links_[block_id].next()].set_prev(links_[block_id].prev());
+}
+
+//
+// Overlay double-array.
+//
+
+// <OverlayDoubleArrayImpl> puts a small overlay of updates on an immutable
+// base dictionary, which is typically mapped by mmap(). Inserted keys and
+// overridden values are kept in one <MutableDoubleArrayImpl> and erased keys
+// are kept in another, and the search functions merge them with the base.
+// An erased key is kept even if it is not in the base, because it may be in
+// the next base made by merge(). The keys in the overlays are also put into
+// a Bloom filter, and exactMatchSearch() skips the overlays for the other
+// keys, so that a search costs only a hash more than a search in the base.
+// merge() writes the merged keys into a new dictionary, which then replaces
+// the base by set_base(). The base must not be modified or freed while it is
+// used by the overlay.
+// <WideValues> is not supported by the updates.
+template <typename A, typename B, typename T, typename C>
+class OverlayDoubleArrayImpl {
+ public:
+  typedef DoubleArrayImpl<A, B, T, C> dic_type;
+  typedef MutableDoubleArrayImpl<A, B, T, C> overlay_type;
+  typedef typename dic_type::value_type value_type;
+  typedef typename dic_type::key_type key_type;
+  typedef typename dic_type::result_pair_type result_pair_type;
+
+  // <node_pos_type> is the state of traverse(), which consists of the states
+  // of the base and the overlays. The default state is the root.
+  struct node_pos_type {
+    std::size_t base;
+    std::size_t added;
+    std::size_t erased;
+
+    node_pos_type() : base(0), added(0), erased(0) {}
+  };
+
+  // The constructor makes an empty dictionary without a base.
+  OverlayDoubleArrayImpl() : base_(NULL), added_(), erased_(), filter_() {}
+
+  // set_base() replaces the base with `base'. The updates which are already
+  // in `base' are removed from the overlays and the others are kept, so that
+  // updates made after merge() are not lost.
+  void set_base(const dic_type &base);
+  const dic_type *base() const {
+    return base_;
+  }
+
+  // insert() adds a key and returns true iff the key is new. If the key
+  // exists, its value is not changed. erase() removes a key and returns true
+  // iff the key existed. update_value() overwrites the value of a key and
+  // returns true iff the key exists. They throw a <Darts::Exception> in the
+  // same cases as the member functions of <MutableDoubleArrayImpl>.
+  bool insert(const key_type *key, value_type value, std::size_t length = 0);
+  bool erase(const key_type *key, std::size_t length = 0);
+  bool update_value(const key_type *key, value_type value,
+      std::size_t length = 0);
+
+  // exactMatchSearch() and commonPrefixSearch() work as well as those of
+  // <DoubleArrayImpl>, but they always start at the root.
+  template <class U>
+  void exactMatchSearch(const key_type *key, U &result,
+      std::size_t length = 0) const {
+    result = exactMatchSearch<U>(key, length);
+  }
+  template <class U>
+  inline U exactMatchSearch(const key_type *key,
+      std::size_t length = 0) const;
+  template <class U>
+  inline std::size_t commonPrefixSearch(const key_type *key, U *results,
+      std::size_t max_num_results, std::size_t length = 0) const;
+
+  // traverse() works as well as that of <DoubleArrayImpl>. Note that a
+  // transition is found if it leads to a key of the base, even if the key
+  // has been erased.
+  inline value_type traverse(const key_type *key, node_pos_type &node_pos,
+      std::size_t &key_pos, std::size_t length = 0) const;
+
+  // merge() gives the merged keys in order to a <StreamBuilder>, which has
+  // been opened by the caller. merge() does not modify the dictionary, and
+  // so it can run in another thread while searches run, but updates must
+  // wait for it. merge() returns 0 iff it succeeds, and it returns a non-zero
+  // value if the 4th template argument is <WideValues>.
+  int merge(typename dic_type::StreamBuilder *builder) const;
+
+  // num_updates() returns the number of keys in the overlays. merge() is
+  // worth calling if it becomes large.
+  std::size_t num_updates() const {
+    return added_.num_keys() + erased_.num_keys();
+  }
+
+  // clear() removes the base and the overlays.
+  void clear() {
+    base_ = NULL;
+    added_.clear();
+    erased_.clear();
+    filter_.clear();
+  }
+
+ private:
+  typedef Details::uchar_type uchar_type;
+  typedef Details::id_type id_type;
+
+  // The Bloom filter has at least FILTER_BITS_PER_KEY bits per key in the
+  // overlays, and each key sets 2 bits.
+  enum { FILTER_BITS_PER_KEY = 16 };
+  enum { FILTER_UNIT_SIZE = sizeof(id_type) * 8 };
+
+  const dic_type *base_;
+  overlay_type added_;
+  overlay_type erased_;
+  Details::AutoPool<id_type> filter_;
+
+  // Disallows copy and assignment.
+  OverlayDoubleArrayImpl(const OverlayDoubleArrayImpl &);
+  OverlayDoubleArrayImpl &operator=(const OverlayDoubleArrayImpl &);
+
+  // no_pos() is the state of a dictionary which has no transitions for the
+  // key.
+  static std::size_t no_pos() {
+    return ~static_cast<std::size_t>(0);
+  }
+  static value_type result_value(const value_type &result) {
+    return result;
+  }
+  static value_type result_value(const result_pair_type &result) {
+    return result.value;
+  }
+  static void add_length(value_type *, std::size_t) {}
+  static void add_length(result_pair_type *result, std::size_t length) {
+    result->length += length;
+  }
+
+  bool has_key(const key_type *key, std::size_t length) const {
+    return exactMatchSearch<value_type>(key, length) >= 0;
+  }
+
+  inline bool may_have_update(const key_type *key, std::size_t length) const;
+  void add_to_filter(const key_type *key, std::size_t length);
+  void build_filter();
+  void set_filter_bits(id_type hash_value);
+  static inline id_type hash(const key_type *key, std::size_t length);
+
+  inline value_type step(const key_type *key, std::size_t key_pos,
+      std::size_t length, node_pos_type *node_pos) const;
+  static inline value_type step(const dic_type &dic, const key_type *key,
+      std::size_t key_pos, std::size_t length, std::size_t *node_pos);
+  void list_keys(const dic_type &dic, const dic_type *other,
+      bool is_kept_if_found, Details::AutoPool<key_type> *keys,
+      Details::AutoPool<std::size_t> *ends) const;
+};
+
+template <typename A, typename B, typename T, typename C>
+void OverlayDoubleArrayImpl<A, B, T, C>::set_base(const dic_type &base) {
+  base_ = &base;
+
+  // Overridden values which are equal to those of the base, and erased keys
+  // which are not in the base, are no longer needed.
+  Details::AutoPool<key_type> keys;
+  Details::AutoPool<std::size_t> ends;
+  list_keys(added_.dic(), base_, false, &keys, &ends);
+  for (std::size_t i = 0, begin = 0; i < ends.size(); begin = ends[i++]) {
+    added_.erase(&keys[begin], ends[i] - begin);
+  }
+  keys.clear();
+  ends.clear();
+  list_keys(erased_.dic(), base_, true, &keys, &ends);
+  for (std::size_t i = 0, begin = 0; i < ends.size(); begin = ends[i++]) {
+    erased_.erase(&keys[begin], ends[i] - begin);
+  }
+  added_.compact();
+  erased_.compact();
+  build_filter();
+}
+
+template <typename A, typename B, typename T, typename C>
+bool OverlayDoubleArrayImpl<A, B, T, C>::insert(const key_type *key,
+    value_type value, std::size_t length) {
+  if (has_key(key, length)) {
+    return false;
+  }
+  added_.insert(key, value, length);
+  erased_.erase(key, length);
+  add_to_filter(key, length);
+  return true;
+}
+
+template <typename A, typename B, typename T, typename C>
+bool OverlayDoubleArrayImpl<A, B, T, C>::erase(const key_type *key,
+    std::size_t length) {
+  if (!has_key(key, length)) {
+    return false;
+  }
+  added_.erase(key, length);
+  erased_.insert(key, 0, length);
+  add_to_filter(key, length);
+  return true;
+}
+
+template <typename A, typename B, typename T, typename C>
+bool OverlayDoubleArrayImpl<A, B, T, C>::update_value(const key_type *key,
+    value_type value, std::size_t length) {
+  if (added_.update_value(key, value, length)) {
+    return true;
+  } else if (!has_key(key, length)) {
+    return false;
+  }
+  added_.insert(key, value, length);
+  add_to_filter(key, length);
+  return true;
+}
+
+template <typename A, typename B, typename T, typename C>
+template <typename U>
+inline U OverlayDoubleArrayImpl<A, B, T, C>::exactMatchSearch(
+    const key_type *key, std::size_t length) const {
+  U result;
+  if (!may_have_update(key, length)) {
+    if (base_ == NULL) {
+      added_.dic().set_result(&result, static_cast<value_type>(-1), 0);
+      return result;
+    }
+    return base_->template exactMatchSearch<U>(key, length);
+  }
+
+  result = added_.dic().template exactMatchSearch<U>(key, length);
+  if (result_value(result) >= 0) {
+    return result;
+  } else if (base_ == NULL) {
+    return result;
+  }
+  result = base_->template exactMatchSearch<U>(key, length);
+  if (result_value(result) >= 0 &&
+      erased_.dic().template exactMatchSearch<value_type>(key, length) >= 0) {
+    base_->set_result(&result, static_cast<value_type>(-1), 0);
+  }
+  return result;
+}
+
+template <typename A, typename B, typename T, typename C>
+inline bool OverlayDoubleArrayImpl<A, B, T, C>::may_have_update(
+    const key_type *key, std::size_t length) const {
+  if (filter_.empty()) {
+    return false;
+  }
+  id_type hash_value = hash(key, length);
+  std::size_t mask = (filter_.size() * FILTER_UNIT_SIZE) - 1;
+  std::size_t first = hash_value & mask;
+  std::size_t second = ((hash_value >> 17) | (hash_value << 15)) & mask;
+  return ((filter_[first / FILTER_UNIT_SIZE] >>
+      (first % FILTER_UNIT_SIZE)) & 1) != 0 &&
+      ((filter_[second / FILTER_UNIT_SIZE] >>
+      (second % FILTER_UNIT_SIZE)) & 1) != 0;
+}
+
+// add_to_filter() builds the filter again when it becomes too small. The
+// bits of the keys which have left the overlays are cleared at the same
+// time.
+template <typename A, typename B, typename T, typename C>
+void OverlayDoubleArrayImpl<A, B, T, C>::add_to_filter(const key_type *key,
+    std::size_t length) {
+  if (num_updates() * FILTER_BITS_PER_KEY >
+      filter_.size() * FILTER_UNIT_SIZE) {
+    build_filter();
+  } else {
+    set_filter_bits(hash(key, length));
+  }
+}
+
+template <typename A, typename B, typename T, typename C>
+void OverlayDoubleArrayImpl<A, B, T, C>::build_filter() {
+  filter_.clear();
+  if (num_updates() == 0) {
+    return;
+  }
+  std::size_t num_units = 1;
+  while (num_units * FILTER_UNIT_SIZE < num_updates() * FILTER_BITS_PER_KEY *
+      2) {
+    num_units <<= 1;
+  }
+  filter_.resize(num_units, 0);
+
+  const overlay_type *overlays[] = { &added_, &erased_ };
+  for (std::size_t i = 0; i < 2; ++i) {
+    typename dic_type::PredictiveCursor cursor(overlays[i]->dic(), "");
+    while (cursor.next()) {
+      set_filter_bits(hash(cursor.key(), cursor.length()));
+    }
+  }
+}
+
+template <typename A, typename B, typename T, typename C>
+void OverlayDoubleArrayImpl<A, B, T, C>::set_filter_bits(
+    id_type hash_value) {
+  std::size_t mask = (filter_.size() * FILTER_UNIT_SIZE) - 1;
+  std::size_t first = hash_value & mask;
+  std::size_t second = ((hash_value >> 17) | (hash_value << 15)) & mask;
+  filter_[first / FILTER_UNIT_SIZE] |= 1U << (first % FILTER_UNIT_SIZE);
+  filter_[second / FILTER_UNIT_SIZE] |= 1U << (second % FILTER_UNIT_SIZE);
+}
+
+// hash() is the 32-bit FNV-1a hash of a key.
+template <typename A, typename B, typename T, typename C>
+inline Details::id_type OverlayDoubleArrayImpl<A, B, T, C>::hash(
+    const key_type *key, std::size_t length) {
+  id_type hash_value = 2166136261U;
+  if (length != 0) {
+    for (std::size_t i = 0; i < length; ++i) {
+      hash_value = (hash_value ^ static_cast<uchar_type>(key[i])) * 16777619U;
+    }
+  } else {
+    for ( ; key[length] != '\0'; ++length) {
+      hash_value = (hash_value ^ static_cast<uchar_type>(key[length])) *
+          16777619U;
+    }
+  }
+  return hash_value;
+}
+
+// commonPrefixSearch() moves the base and the overlays together while the
+// overlays have the prefix, and then leaves the rest to the base.
+template <typename A, typename B, typename T, typename C>
+template <typename U>
+inline std::size_t OverlayDoubleArrayImpl<A, B, T, C>::commonPrefixSearch(
+    const key_type *key, U *results, std::size_t max_num_results,
+    std::size_t length) const {
+  if (length == 0) {
+    while (key[length] != '\0') {
+      ++length;
+    }
+  }
+
+  std::size_t num_results = 0;
+  node_pos_type node_pos;
+  if (base_ == NULL) {
+    node_pos.base = no_pos();
+  }
+  for (std::size_t i = 0; i < length; ++i) {
+    if (node_pos.added == no_pos() && node_pos.erased == no_pos()) {
+      if (node_pos.base != no_pos()) {
+        std::size_t begin = num_results;
+        num_results += base_->commonPrefixSearch(key + i,
+            results + (begin < max_num_results ? begin : max_num_results),
+            (begin < max_num_results) ? (max_num_results - begin) : 0,
+            length - i, node_pos.base);
+        for (std::size_t j = begin;
+            j < num_results && j < max_num_results; ++j) {
+          add_length(&results[j], i);
+        }
+      }
+      break;
+    }
+    value_type value = step(key, i, i + 1, &node_pos);
+    if (value == -2) {
+      break;
+    } else if (value >= 0) {
+      if (num_results < max_num_results) {
+        added_.dic().set_result(&results[num_results], value, i + 1);
+      }
+      ++num_results;
+    }
+  }
+  return num_results;
+}
+
+template <typename A, typename B, typename T, typename C>
+inline typename OverlayDoubleArrayImpl<A, B, T, C>::value_type
+OverlayDoubleArrayImpl<A, B, T, C>::traverse(const key_type *key,
+    node_pos_type &node_pos, std::size_t &key_pos, std::size_t length) const {
+  if (length == 0) {
+    length = key_pos;
+    while (key[length] != '\0') {
+      ++length;
+    }
+  }
+  if (base_ == NULL) {
+    node_pos.base = no_pos();
+  }
+
+  if (key_pos == length) {
+    return step(key, key_pos, length, &node_pos);
+  }
+  value_type value = static_cast<value_type>(-1);
+  for ( ; key_pos < length; ++key_pos) {
+    node_pos_type next_pos = node_pos;
+    value = step(key, key_pos, key_pos + 1, &next_pos);
+    if (value == -2) {
+      return value;
+    }
+    node_pos = next_pos;
+  }
+  return value;
+}
+
+// step() moves the base and the overlays from key[key_pos] to key[length - 1]
+// and returns the merged value at the new state. The end of the transitions
+// is no_pos() for the dictionaries which do not have them. step() returns -2
+// if neither the base nor the overlay of inserted keys have them.
+template <typename A, typename B, typename T, typename C>
+inline typename OverlayDoubleArrayImpl<A, B, T, C>::value_type
+OverlayDoubleArrayImpl<A, B, T, C>::step(const key_type *key,
+    std::size_t key_pos, std::size_t length, node_pos_type *node_pos) const {
+  value_type added_value = step(added_.dic(), key, key_pos, length,
+      &node_pos->added);
+  value_type erased_value = step(erased_.dic(), key, key_pos, length,
+      &node_pos->erased);
+  value_type base_value = static_cast<value_type>(-2);
+  if (base_ != NULL) {
+    base_value = step(*base_, key, key_pos, length, &node_pos->base);
+  }
+  if (added_value >= 0) {
+    return added_value;
+  } else if (base_value == -2 && added_value == -2) {
+    return static_cast<value_type>(-2);
+  } else if (base_value >= 0 && erased_value < 0) {
+    return base_value;
+  }
+  return static_cast<value_type>(-1);
+}
+
+template <typename A, typename B, typename T, typename C>
+inline typename OverlayDoubleArrayImpl<A, B, T, C>::value_type
+OverlayDoubleArrayImpl<A, B, T, C>::step(const dic_type &dic,
+    const key_type *key, std::size_t key_pos, std::size_t length,
+    std::size_t *node_pos) {
+  if (*node_pos == no_pos()) {
+    return static_cast<value_type>(-2);
+  }
+  value_type value = dic.traverse(key, *node_pos, key_pos, length);
+  if (value == -2) {
+    *node_pos = no_pos();
+  }
+  return value;
+}
+
+// merge() enumerates the keys of the base and the inserted keys in order,
+// and the inserted keys take precedence over the keys of the base.
+template <typename A, typename B, typename T, typename C>
+int OverlayDoubleArrayImpl<A, B, T, C>::merge(
+    typename dic_type::StreamBuilder *builder) const {
+  if (Details::ValueTraits<C>::HAS_VALUE_TABLE) {
+    return -1;
+  }
+
+  typename dic_type::PredictiveCursor added_cursor(added_.dic(), "");
+  typename dic_type::PredictiveCursor base_cursor;
+  if (base_ != NULL) {
+    base_cursor.reset(*base_, "");
+  }
+  bool has_added_key = added_cursor.next();
+  bool has_base_key = (base_ != NULL) && base_cursor.next();
+  while (has_added_key || has_base_key) {
+    int result = 1;
+    if (has_added_key && has_base_key) {
+      std::size_t length = added_cursor.length() < base_cursor.length() ?
+          added_cursor.length() : base_cursor.length();
+      result = std::memcmp(base_cursor.key(), added_cursor.key(), length);
+      if (result == 0) {
+        result = (base_cursor.length() < added_cursor.length()) ? -1 :
+            (base_cursor.length() > added_cursor.length() ? 1 : 0);
+      }
+    } else if (has_base_key) {
+      result = -1;
+    }
+
+    if (result >= 0) {
+      builder->insert(added_cursor.key(), added_cursor.length(),
+          added_cursor.value());
+      has_added_key = added_cursor.next();
+    } else if (erased_.num_keys() == 0 ||
+        erased_.dic().template exactMatchSearch<value_type>(
+        base_cursor.key(), base_cursor.length()) < 0) {
+      builder->insert(base_cursor.key(), base_cursor.length(),
+          base_cursor.value());
+    }
+    if (result <= 0) {
+      has_base_key = base_cursor.next();
+    }
+  }
+  return 0;
+}
+
+// list_keys() lists the keys of `dic' which are to be removed in the form of
+// a concatenation and the ends of the keys. If `is_kept_if_found' is true,
+// the keys found in `other' are kept. Otherwise, the keys found in `other'
+// with the same values are removed.
+template <typename A, typename B, typename T, typename C>
+void OverlayDoubleArrayImpl<A, B, T, C>::list_keys(const dic_type &dic,
+    const dic_type *other, bool is_kept_if_found,
+    Details::AutoPool<key_type> *keys,
+    Details::AutoPool<std::size_t> *ends) const {
+  typename dic_type::PredictiveCursor cursor(dic, "");
+  while (cursor.next()) {
+    value_type value = other->template exactMatchSearch<value_type>(
+        cursor.key(), cursor.length());
+    if (is_kept_if_found ? (value < 0) : (value == cursor.value())) {
+      for (std::size_t i = 0; i < cursor.length(); ++i) {
+        keys->append(cursor.key()[i]);
+      }
+      ends->append(keys->size());
+    }
+  }
+}
+
+#ifdef DARTS_HAS_THREADS
+
+//
+// Shared double-array.
+//
+
+// <SharedDoubleArrayImpl> keeps the current version of a dictionary for
+// readers in other threads, and a writer replaces it by publish() without
+// stopping the readers. Each <Reader> has a slot, which keeps the version
+// pinned by the reader as a hazard pointer, and an old version is deleted
+// when no slot keeps it. Reader::pin() returns the current version, and it
+// is just an atomic load if the version has not been changed since the
+// last pin(), so a reader can pin a version for each search.
+//
+//   Darts::SharedDoubleArray shared;
+//   shared.publish(dic);  // `dic' is allocated by new and opened.
+//
+//   // In each reader thread:
+//   Darts::SharedDoubleArray::Reader reader(shared);
+//   const Darts::DoubleArray *dic = reader.pin();
+//   if (dic != NULL) {
+//     dic->exactMatchSearch<int>(key);
+//   }
+//   reader.unpin();
+template <typename A, typename B, typename T, typename C>
+class SharedDoubleArrayImpl {
+ public:
+  typedef DoubleArrayImpl<A, B, T, C> dic_type;
+
+  enum { DEFAULT_MAX_NUM_READERS = 64 };
+
+  class Reader;
+
+  // The constructor allocates slots for at most `max_num_readers' readers.
+  explicit SharedDoubleArrayImpl(
+      std::size_t max_num_readers = DEFAULT_MAX_NUM_READERS);
+  // The destructor deletes all the versions. There must be no reader.
+  ~SharedDoubleArrayImpl();
+
+  // publish() makes `dic' the current version and takes its ownership.
+  // `dic' must be allocated by new and must not have been published, and it
+  // may be NULL. The previous version
+  // is deleted by publish() or a later reclaim() when no reader pins it.
+  // publish() and reclaim() may be called in any threads.
+  void publish(dic_type *dic);
+  // reclaim() deletes the old versions which are not pinned, and returns the
+  // number of the old versions which are still pinned.
+  std::size_t reclaim();
+
+  // current() returns the current version for the writer. Readers must use
+  // Reader::pin() instead.
+  const dic_type *current() const {
+    return current_.load();
+  }
+
+ private:
+  // Each slot has its own cache line so that readers do not share lines.
+  struct Slot {
+    std::atomic<const dic_type *> dic;
+    std::atomic<bool> is_used;
+    char padding[64];
+  };
+
+  std::atomic<dic_type *> current_;
+  Details::AutoArray<Slot> slots_;
+  std::size_t num_slots_;
+  Details::AutoPool<dic_type *> old_dics_;
+  std::mutex mutex_;
+
+  // Disallows copy and assignment.
+  SharedDoubleArrayImpl(const SharedDoubleArrayImpl &);
+  SharedDoubleArrayImpl &operator=(const SharedDoubleArrayImpl &);
+
+  std::size_t reclaim_locked();
+};
+
+// <Reader> takes a slot for a reader thread. A reader is not thread-safe,
+// and each thread should have its own reader.
+template <typename A, typename B, typename T, typename C>
+class SharedDoubleArrayImpl<A, B, T, C>::Reader {
+ public:
+  // The constructor takes a free slot, or throws a <Darts::Exception> if
+  // there is no free slot.
+  explicit Reader(SharedDoubleArrayImpl &shared);
+  // The destructor unpins the version and frees the slot.
+  ~Reader() {
+    unpin();
+    slot_->is_used.store(false);
+  }
+
+  // pin() returns the current version, which may be NULL, and keeps it from
+  // being deleted until the next pin() or unpin().
+  const dic_type *pin() {
+    const dic_type *dic = shared_->current_.load(std::memory_order_acquire);
+    if (dic == slot_->dic.load(std::memory_order_relaxed)) {
+      return dic;
+    }
+    // The version is pinned only if it is still current after it has been
+    // written into the slot, and otherwise the writer may have missed it.
+    for ( ; ; ) {
+      slot_->dic.store(dic);
+      const dic_type *current = shared_->current_.load();
+      if (current == dic) {
+        return dic;
+      }
+      dic = current;
+    }
+  }
+  // unpin() allows the writer to delete the pinned version.
+  void unpin() {
+    slot_->dic.store(NULL, std::memory_order_release);
+  }
+
+ private:
+  SharedDoubleArrayImpl *shared_;
+  Slot *slot_;
+
+  // Disallows copy and assignment.
+  Reader(const Reader &);
+  Reader &operator=(const Reader &);
+};
+
+template <typename A, typename B, typename T, typename C>
+SharedDoubleArrayImpl<A, B, T, C>::SharedDoubleArrayImpl(
+    std::size_t max_num_readers)
+    : current_(NULL), slots_(), num_slots_(max_num_readers), old_dics_(),
+      mutex_() {
+  try {
+    slots_.reset(new Slot[max_num_readers]);
+  } catch (const std::bad_alloc &) {
+    DARTS_THROW("failed to share double-array: std::bad_alloc");
+  }
+  for (std::size_t i = 0; i < max_num_readers; ++i) {
+    slots_[i].dic.store(NULL);
+    slots_[i].is_used.store(false);
+  }
+}
+
+template <typename A, typename B, typename T, typename C>
+SharedDoubleArrayImpl<A, B, T, C>::~SharedDoubleArrayImpl() {
+  for (std::size_t i = 0; i < old_dics_.size(); ++i) {
+    delete old_dics_[i];
+  }
+  delete current_.load();
+}
+
+template <typename A, typename B, typename T, typename C>
+void SharedDoubleArrayImpl<A, B, T, C>::publish(dic_type *dic) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  dic_type *old_dic = current_.exchange(dic);
+  if (old_dic != NULL) {
+    old_dics_.append(old_dic);
+  }
+  reclaim_locked();
 }
 
+template <typename A, typename B, typename T, typename C>
+std::size_t SharedDoubleArrayImpl<A, B, T, C>::reclaim() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return reclaim_locked();
+}
+
+// reclaim_locked() deletes the old versions which are not found in slots.
+// A reader may be writing an old version into its slot, but then the reader
+// finds that it is not current and does not use it.
+template <typename A, typename B, typename T, typename C>
+std::size_t SharedDoubleArrayImpl<A, B, T, C>::reclaim_locked() {
+  std::size_t num_old_dics = 0;
+  for (std::size_t i = 0; i < old_dics_.size(); ++i) {
+    bool is_pinned = false;
+    for (std::size_t j = 0; j < num_slots_ && !is_pinned; ++j) {
+      is_pinned = (slots_[j].dic.load() == old_dics_[i]);
+    }
+    if (is_pinned) {
+      old_dics_[num_old_dics++] = old_dics_[i];
+    } else {
+      delete old_dics_[i];
+    }
+  }
+  old_dics_.resize(num_old_dics);
+  return num_old_dics;
+}
+
+template <typename A, typename B, typename T, typename C>
+SharedDoubleArrayImpl<A, B, T, C>::Reader::Reader(
+    SharedDoubleArrayImpl &shared) : shared_(&shared), slot_(NULL) {
+  for (std::size_t i = 0; i < shared.num_slots_; ++i) {
+    bool is_used = false;
+    if (shared.slots_[i].is_used.compare_exchange_strong(is_used, true)) {
+      slot_ = &shared.slots_[i];
+      return;
+    }
+  }
+  DARTS_THROW("failed to read shared double-array: too many readers");
+}
+
+#endif  // DARTS_HAS_THREADS
+
 }  // namespace Darts
 
 #undef DARTS_INT_TO_STR
 #undef DARTS_LINE_TO_STR
 #undef DARTS_LINE_STR
 #undef DARTS_THROW
+#undef DARTS_PREFETCH
+#undef DARTS_X86_SIMD
+#undef DARTS_HAS_THREADS
+#undef DARTS_TRIVIALLY_COPYABLE
 
 #endif  // DARTS_H_
@@ -1,13 +1,25 @@
 #include <darts.h>
 
+#include <algorithm>
 #include <cassert>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <ctime>
 #include <iostream>
 #include <set>
 #include <string>
 #include <vector>
 
+#if !defined(_WIN32)
+#include <unistd.h>
+#endif  // !defined(_WIN32)
+
+#if __cplusplus >= 201103L
+#include <atomic>
+#include <thread>
+#endif  // __cplusplus >= 201103L
+
 void generate_valid_keys(std::size_t num_keys,
     std::set<std::string> *valid_keys) {
   std::vector<char> key;
@@ -35,6 +47,51 @@ void generate_invalid_keys(std::size_t num_keys,
   }
 }
 
+// get_keys() appends the keys of `valid_keys' to `keys' in sorted order, and
+// their lengths to `lengths' if it is not NULL.
+void get_keys(const std::set<std::string> &valid_keys,
+    std::vector<const char *> *keys,
+    std::vector<std::size_t> *lengths = NULL) {
+  for (std::set<std::string>::const_iterator it = valid_keys.begin();
+      it != valid_keys.end(); ++it) {
+    keys->push_back(it->c_str());
+    if (lengths != NULL) {
+      lengths->push_back(it->length());
+    }
+  }
+}
+
+// test_file_name() returns the path of a temporary file into which tests save
+// dictionaries. main() removes the file before returning.
+const char *test_file_name() {
+  static std::string file_name;
+  if (file_name.empty()) {
+#if defined(_WIN32)
+    char buf[L_tmpnam];
+    assert(std::tmpnam(buf) != NULL);
+    file_name = buf;
+#else  // defined(_WIN32)
+    const char *dir = std::getenv("TMPDIR");
+    file_name = std::string((dir != NULL) ? dir : "/tmp") +
+        "/test-darts-XXXXXX";
+    int fd = ::mkstemp(&file_name[0]);
+    assert(fd != -1);
+    ::close(fd);
+#endif  // defined(_WIN32)
+  }
+  return file_name.c_str();
+}
+
+std::size_t get_file_size(const char *file_name) {
+  std::FILE *file = std::fopen(file_name, "rb");
+  assert(file != NULL);
+  assert(std::fseek(file, 0, SEEK_END) == 0);
+  long size = std::ftell(file);
+  assert(size >= 0);
+  std::fclose(file);
+  return static_cast<std::size_t>(size);
+}
+
 template <typename T>
 void test_dic(const T &dic, const std::vector<const char *> &keys,
     const std::vector<std::size_t> &lengths,
@@ -77,6 +134,59 @@ void test_dic(const T &dic, const std::vector<const char *> &keys,
   std::cerr << "ok" << std::endl;
 }
 
+template <typename T>
+void test_exact_match_search_batch(const T &dic,
+    const std::vector<const char *> &keys,
+    const std::vector<std::size_t> &lengths,
+    const std::vector<typename T::value_type> &values,
+    const std::set<std::string> &invalid_keys) {
+  std::vector<typename T::value_type> batch_values(keys.size());
+  std::vector<typename T::result_pair_type> batch_results(keys.size());
+
+  dic.exactMatchSearchBatch(keys.size(), &keys[0], &batch_values[0]);
+  dic.exactMatchSearchBatch(keys.size(), &keys[0], &batch_results[0],
+      &lengths[0]);
+  for (std::size_t i = 0; i < keys.size(); ++i) {
+    assert(batch_values[i] == values[i]);
+    assert(batch_results[i].value == values[i]);
+    assert(batch_results[i].length == lengths[i]);
+  }
+
+  // A key whose length is 0 is a zero-terminated string.
+  std::vector<std::size_t> mixed_lengths(lengths);
+  for (std::size_t i = 0; i < mixed_lengths.size(); i += 2) {
+    mixed_lengths[i] = 0;
+  }
+  dic.exactMatchSearchBatch(keys.size(), &keys[0], &batch_results[0],
+      &mixed_lengths[0]);
+  for (std::size_t i = 0; i < keys.size(); ++i) {
+    assert(batch_results[i].value == values[i]);
+    assert(batch_results[i].length == lengths[i]);
+  }
+
+  std::vector<const char *> invalid_key_ptrs;
+  std::vector<std::size_t> invalid_lengths;
+  for (std::set<std::string>::const_iterator it = invalid_keys.begin();
+      it != invalid_keys.end(); ++it) {
+    invalid_key_ptrs.push_back(it->c_str());
+    invalid_lengths.push_back(it->length());
+  }
+
+  batch_values.resize(invalid_key_ptrs.size());
+  batch_results.resize(invalid_key_ptrs.size());
+
+  dic.exactMatchSearchBatch(invalid_key_ptrs.size(), &invalid_key_ptrs[0],
+      &batch_values[0]);
+  dic.exactMatchSearchBatch(invalid_key_ptrs.size(), &invalid_key_ptrs[0],
+      &batch_results[0], &invalid_lengths[0]);
+  for (std::size_t i = 0; i < invalid_key_ptrs.size(); ++i) {
+    assert(batch_values[i] == -1);
+    assert(batch_results[i].value == -1);
+  }
+
+  std::cerr << "ok" << std::endl;
+}
+
 template <typename T>
 void test_common_prefix_search(const T &dic,
     const std::vector<const char *> &keys,
@@ -132,6 +242,161 @@ void test_common_prefix_search(const T &dic,
   std::cerr << "ok" << std::endl;
 }
 
+template <typename T>
+class MatchCollector {
+ public:
+  MatchCollector(std::vector<typename T::result_pair_type> &results,
+      std::vector<std::size_t> &node_ids, std::size_t max_num_results)
+      : results_(results), node_ids_(node_ids),
+        max_num_results_(max_num_results) {}
+
+  bool operator()(typename T::value_type value, std::size_t length,
+      std::size_t node_pos) {
+    typename T::result_pair_type result;
+    result.value = value;
+    result.length = length;
+    results_.push_back(result);
+    node_ids_.push_back(node_pos);
+    return results_.size() < max_num_results_;
+  }
+
+ private:
+  std::vector<typename T::result_pair_type> &results_;
+  std::vector<std::size_t> &node_ids_;
+  std::size_t max_num_results_;
+};
+
+// test_common_prefix_search_callback() compares the results with those of
+// commonPrefixSearch() with a buffer, and checks that each given node has the
+// matched key.
+template <typename T>
+void test_common_prefix_search_callback(const T &dic,
+    const std::vector<const char *> &keys,
+    const std::vector<std::size_t> &lengths,
+    const std::set<std::string> &invalid_keys) {
+  static const std::size_t MAX_NUM_RESULTS = 16;
+  typename T::result_pair_type results[MAX_NUM_RESULTS];
+  std::vector<typename T::result_pair_type> callback_results;
+  std::vector<std::size_t> node_ids;
+
+  std::vector<std::string> queries(keys.begin(), keys.end());
+  queries.insert(queries.end(), invalid_keys.begin(), invalid_keys.end());
+  for (std::size_t i = 0; i < queries.size(); ++i) {
+    const char *query = queries[i].c_str();
+    std::size_t num_results = dic.commonPrefixSearch(
+        query, results, MAX_NUM_RESULTS);
+
+    callback_results.clear();
+    node_ids.clear();
+    assert(dic.commonPrefixSearch(query, MatchCollector<T>(
+        callback_results, node_ids, MAX_NUM_RESULTS)) == num_results);
+    assert(callback_results.size() == num_results);
+    for (std::size_t j = 0; j < num_results; ++j) {
+      assert(callback_results[j].value == results[j].value);
+      assert(callback_results[j].length == results[j].length);
+      assert(dic.template exactMatchSearch<typename T::value_type>(
+          "", 0, node_ids[j]) == results[j].value);
+    }
+
+    callback_results.clear();
+    node_ids.clear();
+    assert(dic.commonPrefixSearch(query, MatchCollector<T>(
+        callback_results, node_ids, MAX_NUM_RESULTS),
+        i < keys.size() ? lengths[i] : queries[i].length()) == num_results);
+    assert(callback_results.size() == num_results);
+
+    // The search stops when the callback returns false.
+    if (num_results > 1) {
+      callback_results.clear();
+      node_ids.clear();
+      assert(dic.commonPrefixSearch(query,
+          MatchCollector<T>(callback_results, node_ids, 1)) == 1);
+      assert(callback_results.size() == 1);
+      assert(callback_results[0].length == results[0].length);
+    }
+  }
+
+  std::cerr << "ok" << std::endl;
+}
+
+// test_longest_prefix_search() compares the results with the last results of
+// commonPrefixSearch().
+template <typename T>
+void test_longest_prefix_search(const T &dic,
+    const std::vector<const char *> &keys,
+    const std::vector<std::size_t> &lengths,
+    const std::vector<typename T::value_type> &values,
+    const std::set<std::string> &invalid_keys) {
+  static const std::size_t MAX_NUM_RESULTS = 16;
+  typename T::result_pair_type results[MAX_NUM_RESULTS];
+  typename T::result_pair_type result;
+  typename T::value_type value;
+
+  for (std::size_t i = 0; i < keys.size(); ++i) {
+    dic.longestPrefixSearch(keys[i], result);
+    assert(result.value == values[i]);
+    assert(result.length == lengths[i]);
+
+    dic.longestPrefixSearch(keys[i], value, lengths[i]);
+    assert(value == values[i]);
+  }
+
+  std::vector<const char *> query_ptrs;
+  std::vector<typename T::result_pair_type> expected_results;
+  for (std::set<std::string>::const_iterator it = invalid_keys.begin();
+      it != invalid_keys.end(); ++it) {
+    std::size_t num_results = dic.commonPrefixSearch(
+        it->c_str(), results, MAX_NUM_RESULTS);
+    if (num_results == 0) {
+      results[0].value = -1;
+      results[0].length = 0;
+      num_results = 1;
+    }
+
+    dic.longestPrefixSearch(it->c_str(), result);
+    assert(result.value == results[num_results - 1].value);
+    assert(result.length == results[num_results - 1].length);
+
+    dic.longestPrefixSearch(it->c_str(), result, it->length());
+    assert(result.value == results[num_results - 1].value);
+    assert(result.length == results[num_results - 1].length);
+
+    query_ptrs.push_back(it->c_str());
+    expected_results.push_back(results[num_results - 1]);
+  }
+
+  std::vector<typename T::result_pair_type> batch_results(
+      query_ptrs.size());
+  dic.longestPrefixSearchBatch(query_ptrs.size(), &query_ptrs[0],
+      &batch_results[0]);
+  for (std::size_t i = 0; i < query_ptrs.size(); ++i) {
+    assert(batch_results[i].value == expected_results[i].value);
+    assert(batch_results[i].length == expected_results[i].length);
+  }
+
+  std::vector<typename T::value_type> batch_values(keys.size());
+  dic.longestPrefixSearchBatch(keys.size(), &keys[0], &batch_values[0],
+      &lengths[0]);
+  for (std::size_t i = 0; i < keys.size(); ++i) {
+    assert(batch_values[i] == values[i]);
+  }
+
+  // A string whose length is 0 is a zero-terminated string.
+  std::vector<std::size_t> mixed_lengths(lengths);
+  for (std::size_t i = 0; i < mixed_lengths.size(); i += 2) {
+    mixed_lengths[i] = 0;
+  }
+  batch_results.resize(keys.size());
+  dic.longestPrefixSearchBatch(keys.size(), &keys[0], &batch_results[0],
+      &mixed_lengths[0]);
+  for (std::size_t i = 0; i < keys.size(); ++i) {
+    assert(batch_results[i].value == values[i]);
+    assert(batch_results[i].length == lengths[i]);
+  }
+
+  std::cerr << "ok" << std::endl;
+}
+
 template <typename T>
 void test_traverse(const T &dic,
     const std::vector<const char *> &keys,
@@ -168,6 +433,399 @@ void test_traverse(const T &dic,
   std::cerr << "ok" << std::endl;
 }
 
+bool is_less_key(const char *lhs, const char *rhs) {
+  return std::strcmp(lhs, rhs) < 0;
+}
+
+template <typename T>
+class KeyCollector {
+ public:
+  KeyCollector(std::vector<std::string> &keys,
+      std::vector<typename T::value_type> &values, std::size_t max_num_keys)
+      : keys_(keys), values_(values), max_num_keys_(max_num_keys) {}
+
+  bool operator()(const char *key, std::size_t length,
+      typename T::value_type value) {
+    assert(key[length] == '\0');
+    keys_.push_back(std::string(key, length));
+    values_.push_back(value);
+    return keys_.size() < max_num_keys_;
+  }
+
+ private:
+  std::vector<std::string> &keys_;
+  std::vector<typename T::value_type> &values_;
+  std::size_t max_num_keys_;
+};
+
+template <typename T>
+void test_predictive_search(const T &dic,
+    const std::vector<const char *> &keys,
+    const std::vector<std::size_t> &lengths,
+    const std::vector<typename T::value_type> &values,
+    const std::set<std::string> &invalid_keys) {
+  typename T::PredictiveCursor cursor(dic, "");
+  for (std::size_t i = 0; i < keys.size(); ++i) {
+    assert(cursor.next());
+    assert(cursor.length() == lengths[i]);
+    assert(std::strcmp(cursor.key(), keys[i]) == 0);
+    assert(cursor.value() == values[i]);
+  }
+  assert(!cursor.next());
+
+  std::vector<std::string> result_keys;
+  std::vector<typename T::value_type> result_values;
+
+  std::size_t count = 0;
+  for (std::set<std::string>::const_iterator it = invalid_keys.begin();
+      it != invalid_keys.end(); ++it) {
+    if (++count % 256 != 0) {
+      continue;
+    }
+    std::string prefix = it->substr(0, (it->length() + 1) / 2);
+    std::size_t begin = std::lower_bound(keys.begin(), keys.end(),
+        prefix.c_str(), is_less_key) - keys.begin();
+    std::size_t end = begin;
+    while (end < keys.size() &&
+        std::strncmp(keys[end], prefix.c_str(), prefix.length()) == 0) {
+      ++end;
+    }
+
+    result_keys.clear();
+    result_values.clear();
+    KeyCollector<T> collector(result_keys, result_values, keys.size());
+    assert(dic.predictiveSearch(prefix.c_str(), collector) == end - begin);
+    for (std::size_t i = begin; i < end; ++i) {
+      assert(result_keys[i - begin] == keys[i]);
+      assert(result_values[i - begin] == values[i]);
+    }
+
+    // The search is given by a node and the rest of the prefix, and it stops
+    // after 3 keys. Then, a cursor resumes it.
+    std::size_t node_pos = 0;
+    std::size_t key_pos = 0;
+    dic.traverse(prefix.c_str(), node_pos, key_pos, 1);
+    result_keys.clear();
+    result_values.clear();
+    KeyCollector<T> limited_collector(result_keys, result_values, 3);
+    std::size_t num_keys = dic.predictiveSearch(prefix.c_str() + 1,
+        limited_collector, prefix.length() - 1, node_pos);
+    assert(num_keys == std::min(end - begin, static_cast<std::size_t>(3)));
+
+    cursor.reset(dic, prefix.c_str(), prefix.length());
+    for (std::size_t i = begin; i < end; ++i) {
+      assert(cursor.next());
+      if (i - begin < num_keys) {
+        assert(result_keys[i - begin] == cursor.key() + 1);
+      }
+      assert(std::strcmp(cursor.key(), keys[i]) == 0);
+      assert(cursor.value() == values[i]);
+    }
+    assert(!cursor.next());
+  }
+
+  cursor.reset(dic, invalid_keys.begin()->c_str());
+  assert(!cursor.next() ||
+      std::strcmp(cursor.key(), invalid_keys.begin()->c_str()) > 0);
+
+  std::cerr << "ok" << std::endl;
+}
+
+template <typename T>
+class Occurrence {
+ public:
+  Occurrence(std::size_t begin, std::size_t length,
+      typename T::value_type value)
+      : begin_(begin), length_(length), value_(value) {}
+
+  bool operator<(const Occurrence &rhs) const {
+    if (begin_ != rhs.begin_) {
+      return begin_ < rhs.begin_;
+    }
+    return length_ < rhs.length_;
+  }
+  bool operator==(const Occurrence &rhs) const {
+    return begin_ == rhs.begin_ && length_ == rhs.length_ &&
+        value_ == rhs.value_;
+  }
+
+ private:
+  std::size_t begin_;
+  std::size_t length_;
+  typename T::value_type value_;
+};
+
+template <typename T>
+class OccurrenceCollector {
+ public:
+  explicit OccurrenceCollector(std::vector<Occurrence<T> > &occurrences)
+      : occurrences_(occurrences) {}
+
+  void operator()(std::size_t begin, std::size_t length,
+      typename T::value_type value) {
+    occurrences_.push_back(Occurrence<T>(begin, length, value));
+  }
+
+ private:
+  std::vector<Occurrence<T> > &occurrences_;
+};
+
+template <typename A, typename B, typename V, typename C>
+void test_aho_corasick(const Darts::DoubleArrayImpl<A, B, V, C> &dic) {
+  typedef Darts::DoubleArrayImpl<A, B, V, C> T;
+
+  static const std::size_t TEXT_LENGTH = 1 << 16;
+  static const std::size_t MAX_NUM_RESULTS = 16;
+
+  std::string text;
+  for (std::size_t i = 0; i < TEXT_LENGTH; ++i) {
+    text += static_cast<char>('A' + (std::rand() % 26));
+  }
+
+  std::vector<Occurrence<T> > expected;
+  typename T::result_pair_type results[MAX_NUM_RESULTS];
+  for (std::size_t i = 0; i < text.length(); ++i) {
+    std::size_t num_results = dic.commonPrefixSearch(text.c_str() + i,
+        results, MAX_NUM_RESULTS, text.length() - i);
+    assert(num_results <= MAX_NUM_RESULTS);
+    for (std::size_t j = 0; j < num_results; ++j) {
+      expected.push_back(Occurrence<T>(i, results[j].length,
+          results[j].value));
+    }
+  }
+  std::sort(expected.begin(), expected.end());
+
+  Darts::AhoCorasickImpl<A, B, V, C> matcher;
+  assert(matcher.build(dic) == 0);
+
+  std::vector<Occurrence<T> > occurrences;
+  matcher.scan(text.c_str(), OccurrenceCollector<T>(occurrences));
+  std::sort(occurrences.begin(), occurrences.end());
+  assert(occurrences == expected);
+
+  // The same text is given in chunks of random lengths.
+  occurrences.clear();
+  std::size_t node_pos = 0;
+  std::size_t text_pos = 0;
+  while (text_pos < text.length()) {
+    std::size_t length = 1 + (std::rand() % 16);
+    if (length > text.length() - text_pos) {
+      length = text.length() - text_pos;
+    }
+    matcher.scan(text.c_str() + text_pos,
+        OccurrenceCollector<T>(occurrences), node_pos, text_pos, length);
+  }
+  assert(text_pos == text.length());
+  std::sort(occurrences.begin(), occurrences.end());
+  assert(occurrences == expected);
+
+  // build() rejects more than 2^31 units, whose IDs do not fit in failure
+  // links. The size is given by set_array() and the units are not read.
+  T dic_too_large;
+  dic_too_large.set_array(dic.array(),
+      (static_cast<std::size_t>(1) << 31) + 1);
+  bool is_thrown = false;
+  try {
+    matcher.build(dic_too_large);
+  } catch (const Darts::Details::Exception &) {
+    is_thrown = true;
+  }
+  assert(is_thrown);
+
+  std::cerr << "ok" << std::endl;
+}
+
+// test_key_index() restores the keys from their nodes and key IDs, where the
+// ith key has i as its key ID. If `has_distinct_ids' is false, some keys
+// share a key ID and build() must fail.
+template <typename A, typename B, typename V, typename C>
+void test_key_index(const Darts::DoubleArrayImpl<A, B, V, C> &dic,
+    const std::vector<const char *> &keys,
+    const std::vector<std::size_t> &lengths, bool has_distinct_ids) {
+  Darts::KeyIndexImpl<A, B, V, C> index;
+  if (!has_distinct_ids) {
+    assert(index.build(dic, true) != 0);
+    std::cerr << "ok" << std::endl;
+    return;
+  }
+  assert(index.build(dic, true) == 0);
+  assert(index.size() == dic.size());
+  assert(index.num_key_ids() == keys.size());
+
+  // The index is saved after the dictionary in the same file.
+  Darts::KeyIndexImpl<A, B, V, C> index_copy;
+  assert(dic.save(test_file_name()) == 0);
+  std::size_t offset = get_file_size(test_file_name());
+  assert(index.save(test_file_name(), "ab") == 0);
+  assert(get_file_size(test_file_name()) == offset + index.total_size());
+  assert(index_copy.open(dic, test_file_name(), "rb", offset) == 0);
+  assert(index_copy.open(dic, test_file_name(), "rb", offset + 4) != 0);
+
+  // open() rejects a parent or a key node out of the dictionary.
+  Darts::KeyIndexImpl<A, B, V, C> index_corrupt;
+  Darts::Details::id_type invalid_id =
+      static_cast<Darts::Details::id_type>(dic.size());
+  std::size_t parents_offset = offset + 4 * sizeof(invalid_id);
+  std::size_t key_nodes_offset = parents_offset +
+      dic.size() * sizeof(invalid_id);
+  std::size_t positions[] = {
+    parents_offset + index.key_node(0) * sizeof(invalid_id),
+    key_nodes_offset + (keys.size() - 1) * sizeof(invalid_id)
+  };
+  for (std::size_t i = 0; i < 2; ++i) {
+    assert(index.save(test_file_name(), "r+b", offset) == 0);
+    std::FILE *file = std::fopen(test_file_name(), "r+b");
+    assert(file != NULL);
+    assert(std::fseek(file, static_cast<long>(positions[i]), SEEK_SET) == 0);
+    assert(std::fwrite(&invalid_id, sizeof(invalid_id), 1, file) == 1);
+    std::fclose(file);
+    assert(index_corrupt.open(dic, test_file_name(), "rb", offset) != 0);
+  }
+
+  char key[64];
+  for (std::size_t i = 0; i < keys.size(); ++i) {
+    std::size_t node_pos = 0;
+    std::size_t key_pos = 0;
+    assert(dic.traverse(keys[i], node_pos, key_pos, lengths[i]) >= 0);
+
+    assert(index.restore_key(node_pos, key, sizeof(key)) == lengths[i]);
+    assert(std::strcmp(key, keys[i]) == 0);
+    assert(index.key_node(i) == node_pos);
+
+    std::memset(key, 0, sizeof(key));
+    assert(index_copy.restore_key_by_id(i, key, sizeof(key)) == lengths[i]);
+    assert(std::strcmp(key, keys[i]) == 0);
+
+    // A short buffer is not written.
+    key[0] = '\0';
+    assert(index.restore_key(node_pos, key, lengths[i]) == lengths[i]);
+    assert(key[0] == '\0');
+  }
+  assert(index.key_node(keys.size()) == 0);
+  assert(index.restore_key_by_id(keys.size(), key, sizeof(key)) == 0);
+
+  std::cerr << "ok" << std::endl;
+}
+
+// count_pages() returns the number of 4KB pages touched by traverse() for
+// `queries'.
+template <typename T>
+std::size_t count_pages(const T &dic,
+    const std::vector<const char *> &queries) {
+  std::set<std::size_t> pages;
+  pages.insert(0);
+  for (std::size_t i = 0; i < queries.size(); ++i) {
+    std::size_t id = 0;
+    std::size_t key_pos = 0;
+    for (std::size_t j = 0; queries[i][j] != '\0'; ++j) {
+      if (dic.traverse(queries[i], id, key_pos, j + 1) == -2) {
+        break;
+      }
+      pages.insert(id * dic.unit_size() / 4096);
+    }
+  }
+  return pages.size();
+}
+
+// test_extended_offsets() builds an array of more than 2^21 units, where
+// some offsets are too large to be kept as they are and so they are kept
+// with the extension flag.
+template <typename T, typename U>
+void test_extended_offsets() {
+  static const std::size_t NUM_KEYS = 800000;
+
+  std::set<std::string> key_set;
+  std::vector<char> key;
+  while (key_set.size() < NUM_KEYS) {
+    key.resize(4 + (std::rand() % 5));
+    for (std::size_t i = 0; i < key.size(); ++i) {
+      key[i] = 'A' + (std::rand() % 26);
+    }
+    key_set.insert(std::string(&key[0], key.size()));
+  }
+  std::vector<const char *> keys;
+  for (std::set<std::string>::const_iterator it = key_set.begin();
+      it != key_set.end(); ++it) {
+    keys.push_back(it->c_str());
+  }
+
+  T dic;
+  dic.build(keys.size(), &keys[0]);
+  assert(dic.size() > (1U << 21));
+
+  std::size_t num_extended_offsets = 0;
+  const U *units = static_cast<const U *>(dic.array());
+  const Darts::Details::id_type *words =
+      static_cast<const Darts::Details::id_type *>(dic.array());
+  for (std::size_t i = 0; i < dic.size(); ++i) {
+    if (units[i].label() <= 0xFF && ((words[i] >> 9) & 1) == 1) {
+      assert(units[i].offset() % (1U << U::EXTENSION_SHIFT) == 0);
+      ++num_extended_offsets;
+    }
+  }
+  assert(num_extended_offsets != 0);
+
+  typename T::value_type value;
+  for (std::size_t i = 0; i < keys.size(); ++i) {
+    dic.exactMatchSearch(keys[i], value);
+    assert(value == static_cast<typename T::value_type>(i));
+    std::string invalid_key = std::string(keys[i]) + 'a';
+    dic.exactMatchSearch(invalid_key.c_str(), value);
+    assert(value == -1);
+  }
+
+  std::cerr << "ok" << std::endl;
+}
+
+template <typename T>
+void test_build_in_parallel() {
+  static const std::size_t NUM_KEYS = 1 << 19;
+  static const std::size_t NUM_THREADS = 4;
+
+  std::vector<std::string> key_strings(NUM_KEYS);
+  for (std::size_t i = 0; i < NUM_KEYS; ++i) {
+    char buf[16];
+    std::sprintf(buf, "%06lu", static_cast<unsigned long>(i));
+    key_strings[i] = buf;
+    for (std::size_t j = std::rand() % 4; j > 0; --j) {
+      key_strings[i] += static_cast<char>('A' + (std::rand() % 26));
+    }
+  }
+
+  std::vector<const char *> keys(NUM_KEYS);
+  std::vector<std::size_t> lengths(NUM_KEYS);
+  std::vector<typename T::value_type> values(NUM_KEYS);
+  for (std::size_t i = 0; i < NUM_KEYS; ++i) {
+    keys[i] = key_strings[i].c_str();
+    lengths[i] = key_strings[i].length();
+    values[i] = std::rand() % 10;
+  }
+
+  T dic;
+  typename T::value_type value;
+
+  dic.build(keys.size(), &keys[0], &lengths[0], NULL, NULL, NUM_THREADS);
+  for (std::size_t i = 0; i < NUM_KEYS; ++i) {
+    dic.exactMatchSearch(keys[i], value);
+    assert(value == static_cast<typename T::value_type>(i));
+    std::string invalid_key = key_strings[i] + '#';
+    dic.exactMatchSearch(invalid_key.c_str(), value);
+    assert(value == -1);
+  }
+
+  dic.build(keys.size(), &keys[0], &lengths[0], &values[0], NULL,
+      NUM_THREADS);
+  for (std::size_t i = 0; i < NUM_KEYS; ++i) {
+    dic.exactMatchSearch(keys[i], value);
+    assert(value == values[i]);
+    std::string invalid_key = key_strings[i].substr(0, 5);
+    dic.exactMatchSearch(invalid_key.c_str(), value);
+    assert(value == -1);
+  }
+
+  std::cerr << "ok" << std::endl;
+}
+
 template <typename T>
 void test_darts(const std::set<std::string> &valid_keys,
     const std::set<std::string> &invalid_keys) {
@@ -189,6 +847,9 @@ void test_darts(const std::set<std::string> &valid_keys,
   dic.build(keys.size(), &keys[0]);
   test_dic(dic, keys, lengths, values, invalid_keys);
 
+  std::cerr << "KeyIndex: ";
+  test_key_index(dic, keys, lengths, true);
+
   std::cerr << "build() with keys and lengths: ";
   dic.build(keys.size(), &keys[0], &lengths[0]);
   test_dic(dic, keys, lengths, values, invalid_keys);
@@ -197,6 +858,9 @@ void test_darts(const std::set<std::string> &valid_keys,
   dic.build(keys.size(), &keys[0], &lengths[0], &values[0]);
   test_dic(dic, keys, lengths, values, invalid_keys);
 
+  std::cerr << "KeyIndex with values: ";
+  test_key_index(dic, keys, lengths, true);
+
   for (std::size_t i = 0; i < values.size(); ++i) {
     values[i] = std::rand() % 10;
   }
@@ -205,31 +869,872 @@ void test_darts(const std::set<std::string> &valid_keys,
   dic.build(keys.size(), &keys[0], &lengths[0], &values[0]);
   test_dic(dic, keys, lengths, values, invalid_keys);
 
+  // A dictionary with <WideValues> keeps the index of each key instead of
+  // its value.
+  std::cerr << "KeyIndex with random values: ";
+  test_key_index(dic, keys, lengths, dic.value_table() != NULL);
+
   T dic_copy;
 
+  std::cerr << "build() with keys, lengths, random values and threads: ";
+  dic_copy.build(keys.size(), &keys[0], &lengths[0], &values[0], NULL, 4);
+  assert(dic_copy.size() == dic.size());
+  assert(std::memcmp(dic_copy.array(), dic.array(),
+      dic.unit_size() * dic.size()) == 0);
+  test_dic(dic_copy, keys, lengths, values, invalid_keys);
+
+  // The root has label 0 in the lowest byte of the first unit, and so a raw
+  // array never starts with the magic string of a header.
+  assert((static_cast<const unsigned char *>(dic.array())[0] == 0) ||
+      (static_cast<const unsigned char *>(dic.array())[3] == 0));
+  assert(!Darts::Details::DoubleArrayHeader::has_magic(dic.array()));
+
   std::cerr << "save() and open(): ";
-  assert(dic.save("test-darts.dic") == 0);
-  assert(dic_copy.open("test-darts.dic") == 0);
+  assert(dic.save(test_file_name()) == 0);
+  assert(dic_copy.open(test_file_name()) == 0);
   assert(dic_copy.size() == dic.size());
   test_dic(dic_copy, keys, lengths, values, invalid_keys);
 
+  std::cerr << "save() and mmap(): ";
+  assert(dic_copy.mmap(test_file_name(), 0, 0,
+      T::MMAP_SEQUENTIAL | T::MMAP_RANDOM) == 0);
+  assert(dic_copy.size() == dic.size());
+  test_dic(dic_copy, keys, lengths, values, invalid_keys);
+
+  std::cerr << "save() and mmap() with offset: ";
+  assert(dic.save(test_file_name(), "wb", 1000) == 0);
+  assert(dic_copy.mmap(test_file_name(), 1002) != 0);
+  // A dictionary with a value table or large units is always saved with a
+  // header.
+  assert(dic_copy.mmap(test_file_name(), 1000,
+      get_file_size(test_file_name()) - 1000,
+      T::MMAP_POPULATE | T::MMAP_WILLNEED) == 0);
+  assert(dic_copy.size() == dic.size());
+  test_dic(dic_copy, keys, lengths, values, invalid_keys);
+
+  std::cerr << "save() and open() with header: ";
+  assert(dic.save(test_file_name(), "wb", 0, true) == 0);
+  assert(dic_copy.open(test_file_name()) == 0);
+  assert(dic_copy.size() == dic.size());
+  assert(dic_copy.num_keys() == keys.size());
+  test_dic(dic_copy, keys, lengths, values, invalid_keys);
+
+  std::cerr << "save() and mmap() with header: ";
+  assert(dic.save(test_file_name(), "wb", 1000, true) == 0);
+  assert(dic_copy.mmap(test_file_name(), 1000, 0, T::MMAP_VERIFY) == 0);
+  assert(dic_copy.size() == dic.size());
+  assert(dic_copy.num_keys() == keys.size());
+  test_dic(dic_copy, keys, lengths, values, invalid_keys);
+
+  std::cerr << "open() with broken header: ";
+  {
+    std::FILE *file = std::fopen(test_file_name(), "r+b");
+    assert(file != NULL);
+    assert(std::fseek(file, 1000 + 64 + (dic.total_size() / 2),
+        SEEK_SET) == 0);
+    int byte = std::fgetc(file);
+    assert(std::fseek(file, -1, SEEK_CUR) == 0);
+    assert(std::fputc(byte ^ 0x10, file) != EOF);
+    std::fclose(file);
+  }
+  assert(dic_copy.open(test_file_name(), "rb", 1000) != 0);
+  assert(dic_copy.mmap(test_file_name(), 1000, 0, T::MMAP_VERIFY) != 0);
+  std::cerr << "ok" << std::endl;
+
+  std::cerr << "relayout(): ";
+  {
+    std::vector<const char *> queries;
+    std::vector<std::size_t> frequencies;
+    for (std::size_t i = 0; i < keys.size(); i += 64) {
+      queries.push_back(keys[i]);
+      frequencies.push_back(1 + (i % 3));
+    }
+    dic_copy.build(keys.size(), &keys[0], &lengths[0], &values[0]);
+    std::size_t num_pages = count_pages(dic_copy, queries);
+    assert(dic_copy.relayout(queries.size(), &queries[0], NULL,
+        &frequencies[0]) == 0);
+    assert(count_pages(dic_copy, queries) < num_pages);
+    assert(dic_copy.num_keys() == keys.size());
+  }
+  test_dic(dic_copy, keys, lengths, values, invalid_keys);
+
   std::cerr << "set_array() with array(): ";
-  dic_copy.set_array(dic.array());
+  dic_copy.set_array(dic.array(), 0, dic.value_table());
   assert(dic_copy.size() == 0);
   test_dic(dic_copy, keys, lengths, values, invalid_keys);
 
   std::cerr << "set_array() with array() and size(): ";
-  dic_copy.set_array(dic.array(), dic.size());
+  dic_copy.set_array(dic.array(), dic.size(), dic.value_table());
   assert(dic_copy.size() == dic.size());
   test_dic(dic_copy, keys, lengths, values, invalid_keys);
 
+  std::cerr << "set_array() with num_keys() and save(): ";
+  if (dic.value_table() != NULL) {
+    assert(dic_copy.save(test_file_name()) != 0);
+  }
+  dic_copy.set_array(dic.array(), dic.size(), dic.value_table(),
+      dic.num_keys());
+  assert(dic_copy.num_keys() == keys.size());
+  assert(dic_copy.save(test_file_name()) == 0);
+  {
+    T dic_loaded;
+    assert(dic_loaded.open(test_file_name()) == 0);
+    assert(dic_loaded.size() == dic.size());
+    test_dic(dic_loaded, keys, lengths, values, invalid_keys);
+  }
+
+  std::cerr << "exactMatchSearchBatch(): ";
+  test_exact_match_search_batch(dic, keys, lengths, values, invalid_keys);
+
   std::cerr << "commonPrefixSearch(): ";
   test_common_prefix_search(dic, keys, lengths, values, invalid_keys);
 
+  std::cerr << "commonPrefixSearch() with a callback: ";
+  test_common_prefix_search_callback(dic, keys, lengths, invalid_keys);
+
+  std::cerr << "longestPrefixSearch(): ";
+  test_longest_prefix_search(dic, keys, lengths, values, invalid_keys);
+
   std::cerr << "traverse(): ";
   test_traverse(dic, keys, lengths, values, invalid_keys);
+
+  std::cerr << "predictiveSearch(): ";
+  test_predictive_search(dic, keys, lengths, values, invalid_keys);
+
+  std::cerr << "AhoCorasick: ";
+  test_aho_corasick(dic);
+}
+
+// test_stream_builder() tests <StreamBuilder> with a buffer for all the keys,
+// which gives the same array as build(), and with a small buffer.
+template <typename T>
+void test_stream_builder(const std::set<std::string> &valid_keys,
+    const std::set<std::string> &invalid_keys) {
+  std::vector<const char *> keys;
+  std::vector<std::size_t> lengths;
+  get_keys(valid_keys, &keys, &lengths);
+  std::vector<typename T::value_type> values(keys.size());
+  for (std::size_t i = 0; i < keys.size(); ++i) {
+    values[i] = static_cast<typename T::value_type>(i);
+  }
+
+  T dic;
+  dic.build(keys.size(), &keys[0], &lengths[0]);
+
+  std::cerr << "StreamBuilder: ";
+  T dic_copy;
+  typename T::StreamBuilder builder;
+  assert(builder.open(test_file_name(), false, keys.size() + 1) == 0);
+  for (std::size_t i = 0; i < keys.size(); ++i) {
+    builder.insert(keys[i], lengths[i]);
+  }
+  assert(builder.close() == 0);
+  assert(builder.num_keys() == keys.size());
+  assert(dic_copy.open(test_file_name()) == 0);
+  assert(dic_copy.size() == dic.size());
+  assert(std::memcmp(dic_copy.array(), dic.array(),
+      dic.unit_size() * dic.size()) == 0);
+  test_dic(dic_copy, keys, lengths, values, invalid_keys);
+
+  for (std::size_t i = 0; i < values.size(); ++i) {
+    values[i] = std::rand() % 10;
+  }
+
+  std::cerr << "StreamBuilder with a small buffer: ";
+  assert(builder.open(test_file_name(), true, 100) == 0);
+  for (std::size_t i = 0; i < keys.size(); ++i) {
+    builder.insert(keys[i], 0, values[i]);
+    builder.insert(keys[i], 0, values[i] + 1);
+  }
+  assert(builder.close() == 0);
+  assert(dic_copy.mmap(test_file_name(), 0, 0, T::MMAP_VERIFY) == 0);
+  assert(dic_copy.size() == builder.size());
+  assert(dic_copy.num_keys() == keys.size() * 2);
+  test_dic(dic_copy, keys, lengths, values, invalid_keys);
+
+  std::cerr << "StreamBuilder with wrong key order: ";
+  assert(builder.open(test_file_name()) == 0);
+  builder.insert("b");
+  bool is_thrown = false;
+  try {
+    builder.insert("a");
+  } catch (const Darts::Details::Exception &) {
+    is_thrown = true;
+  }
+  assert(is_thrown);
+  std::cerr << "ok" << std::endl;
 }
 
+// test_wide_values() tests values which do not fit in 31 bits.
+void test_wide_values(const std::set<std::string> &valid_keys,
+    const std::set<std::string> &invalid_keys) {
+  typedef Darts::WideDoubleArray::value_type value_type;
+
+  std::vector<const char *> keys;
+  std::vector<std::size_t> lengths;
+  get_keys(valid_keys, &keys, &lengths);
+  std::vector<value_type> values(keys.size());
+  for (std::size_t i = 0; i < keys.size(); ++i) {
+    values[i] = (static_cast<value_type>(std::rand()) << 32) |
+        static_cast<value_type>(std::rand());
+  }
+
+  std::cerr << "build() with 64-bit values: ";
+  Darts::WideDoubleArray dic;
+  dic.build(keys.size(), &keys[0], &lengths[0], &values[0]);
+  test_dic(dic, keys, lengths, values, invalid_keys);
+
+  std::cerr << "save() and open() with 64-bit values: ";
+  Darts::WideDoubleArray dic_copy;
+  assert(dic.save(test_file_name()) == 0);
+  assert(dic_copy.open(test_file_name()) == 0);
+  test_dic(dic_copy, keys, lengths, values, invalid_keys);
+
+  // A file with a value table cannot be opened as <DoubleArray> and vice
+  // versa.
+  std::cerr << "open() with a wrong value size: ";
+  Darts::DoubleArray narrow_dic;
+  assert(narrow_dic.open(test_file_name()) != 0);
+  assert(narrow_dic.mmap(test_file_name()) != 0);
+  narrow_dic.build(keys.size(), &keys[0], &lengths[0]);
+  assert(narrow_dic.save(test_file_name(), "wb", 0, true) == 0);
+  assert(dic_copy.open(test_file_name()) != 0);
+  assert(dic_copy.mmap(test_file_name()) != 0);
+  std::cerr << "ok" << std::endl;
+}
+
+// test_large_units() tests that <LargeDoubleArray> files are not confused
+// with <DoubleArray> files.
+void test_large_units(const std::set<std::string> &valid_keys) {
+  std::vector<const char *> keys;
+  std::vector<std::size_t> lengths;
+  get_keys(valid_keys, &keys, &lengths);
+
+  std::cerr << "open() with a wrong unit type: ";
+  Darts::LargeDoubleArray large_dic;
+  Darts::DoubleArray dic;
+  large_dic.build(keys.size(), &keys[0], &lengths[0]);
+  assert(large_dic.save(test_file_name()) == 0);
+  assert(dic.open(test_file_name()) != 0);
+  assert(dic.mmap(test_file_name()) != 0);
+  dic.build(keys.size(), &keys[0], &lengths[0]);
+  assert(dic.save(test_file_name()) == 0);
+  assert(large_dic.open(test_file_name()) != 0);
+  assert(large_dic.mmap(test_file_name()) != 0);
+  assert(dic.save(test_file_name(), "wb", 0, true) == 0);
+  assert(large_dic.open(test_file_name()) != 0);
+  assert(large_dic.mmap(test_file_name()) != 0);
+  std::cerr << "ok" << std::endl;
+}
+
+// test_mutable_double_array() inserts keys in random order into an empty
+// dictionary and into a dictionary built with a half of the keys. Keys of
+// other bytes make the children of the root move.
+template <typename A, typename B, typename V, typename C>
+void test_mutable_double_array(const std::set<std::string> &valid_keys,
+    const std::set<std::string> &invalid_keys) {
+  typedef Darts::DoubleArrayImpl<A, B, V, C> T;
+
+  std::set<std::string> other_keys;
+  std::vector<char> key;
+  while (other_keys.size() < 1000) {
+    key.resize(1 + (std::rand() % 3));
+    for (std::size_t i = 0; i < key.size(); ++i) {
+      key[i] = static_cast<char>(1 + (std::rand() % 255));
+    }
+    if (key[0] < 'A' || key[0] > 'Z') {
+      other_keys.insert(std::string(&key[0], key.size()));
+    }
+  }
+
+  std::vector<const char *> keys;
+  std::vector<std::size_t> lengths;
+  get_keys(valid_keys, &keys, &lengths);
+  std::vector<typename T::value_type> values(keys.size());
+  for (std::size_t i = 0; i < keys.size(); ++i) {
+    values[i] = static_cast<typename T::value_type>(std::rand() % 10);
+  }
+  std::vector<std::size_t> order(keys.size());
+  for (std::size_t i = 0; i < order.size(); ++i) {
+    order[i] = i;
+  }
+  for (std::size_t i = order.size(); i > 1; --i) {
+    std::swap(order[i - 1], order[std::rand() % i]);
+  }
+
+  std::cerr << "MutableDoubleArray::insert(): ";
+  Darts::MutableDoubleArrayImpl<A, B, V, C> dic;
+  for (std::size_t i = 0; i < order.size(); ++i) {
+    std::size_t key_id = order[i];
+    assert(dic.insert(keys[key_id], values[key_id], lengths[key_id]));
+  }
+  assert(!dic.insert(keys[0], values[0] + 1, lengths[0]));
+  assert(dic.num_keys() == keys.size());
+  test_dic(dic.dic(), keys, lengths, values, invalid_keys);
+
+  std::cerr << "MutableDoubleArray::compact(): ";
+  std::size_t size = dic.size();
+  dic.compact();
+  assert(dic.size() <= size);
+  assert(dic.num_keys() == keys.size());
+  test_dic(dic.dic(), keys, lengths, values, invalid_keys);
+
+  std::cerr << "MutableDoubleArray::assign() and insert(): ";
+  std::vector<const char *> half_keys;
+  std::vector<std::size_t> half_lengths;
+  std::vector<typename T::value_type> half_values;
+  for (std::size_t i = 0; i < keys.size(); i += 2) {
+    half_keys.push_back(keys[i]);
+    half_lengths.push_back(lengths[i]);
+    half_values.push_back(values[i]);
+  }
+  T half_dic;
+  half_dic.build(half_keys.size(), &half_keys[0], &half_lengths[0],
+      &half_values[0]);
+  assert(dic.assign(half_dic) == 0);
+  assert(dic.num_keys() == half_keys.size());
+  for (std::size_t i = 0; i < order.size(); ++i) {
+    std::size_t key_id = order[i];
+    assert(dic.insert(keys[key_id], values[key_id], lengths[key_id]) ==
+        (key_id % 2 == 1));
+  }
+  for (std::set<std::string>::const_iterator it = other_keys.begin();
+      it != other_keys.end(); ++it) {
+    keys.push_back(it->c_str());
+    lengths.push_back(it->length());
+    values.push_back(static_cast<typename T::value_type>(keys.size()));
+    assert(dic.insert(keys.back(), values.back(), lengths.back()));
+  }
+  test_dic(dic.dic(), keys, lengths, values, invalid_keys);
+
+  std::cerr << "MutableDoubleArray::dic().save(): ";
+  T dic_copy;
+  assert(dic.dic().save(test_file_name(), "wb", 0, true) == 0);
+  assert(dic_copy.open(test_file_name()) == 0);
+  test_dic(dic_copy, keys, lengths, values, invalid_keys);
+
+  std::cerr << "MutableDoubleArray::erase() and update_value(): ";
+  std::size_t num_free_units = dic.num_free_units();
+  for (std::size_t i = valid_keys.size(); i < keys.size(); ++i) {
+    assert(dic.erase(keys[i], lengths[i]));
+    assert(!dic.erase(keys[i], lengths[i]));
+    assert(!dic.update_value(keys[i], 0, lengths[i]));
+    assert(dic.dic().template exactMatchSearch<typename T::value_type>(
+        keys[i], lengths[i]) == -1);
+  }
+  assert(dic.num_free_units() > num_free_units);
+  keys.resize(valid_keys.size());
+  lengths.resize(valid_keys.size());
+  values.resize(valid_keys.size());
+  for (std::size_t i = 0; i < keys.size(); i += 3) {
+    values[i] = static_cast<typename T::value_type>(std::rand() % 10);
+    assert(dic.update_value(keys[i], values[i], lengths[i]));
+  }
+  assert(dic.num_keys() == keys.size());
+  test_dic(dic.dic(), keys, lengths, values, invalid_keys);
+
+  std::cerr << "MutableDoubleArray::save(): ";
+  assert(dic.save(test_file_name(), "wb", 0, true) == 0);
+  assert(dic_copy.open(test_file_name()) == 0);
+  assert(dic_copy.size() == dic.size());
+  test_dic(dic_copy, keys, lengths, values, invalid_keys);
+  test_dic(dic.dic(), keys, lengths, values, invalid_keys);
+
+  std::cerr << "MutableDoubleArray::erase() of all keys: ";
+  for (std::size_t i = 0; i < keys.size(); ++i) {
+    assert(dic.erase(keys[i], lengths[i]));
+  }
+  assert(dic.num_keys() == 0);
+  assert(dic.num_free_units() == dic.size() - 1);
+  std::cerr << "ok" << std::endl;
+
+  std::cerr << "MutableDoubleArray::insert() with a zero-length key: ";
+  bool is_thrown = false;
+  try {
+    dic.insert("", 0);
+  } catch (const Darts::Details::Exception &) {
+    is_thrown = true;
+  }
+  assert(is_thrown);
+  std::cerr << "ok" << std::endl;
+}
+
+// test_overlay_double_array() builds a base with a half of the keys and
+// gives the other half, erasures and new values to the overlay.
+void test_overlay_double_array(const std::set<std::string> &valid_keys,
+    const std::set<std::string> &invalid_keys) {
+  std::vector<const char *> keys;
+  std::vector<std::size_t> lengths;
+  get_keys(valid_keys, &keys, &lengths);
+  std::vector<int> values(keys.size());
+  for (std::size_t i = 0; i < keys.size(); ++i) {
+    values[i] = std::rand() % 10;
+  }
+
+  std::vector<const char *> base_keys;
+  std::vector<int> base_values;
+  for (std::size_t i = 0; i < keys.size(); i += 2) {
+    base_keys.push_back(keys[i]);
+    base_values.push_back(values[i]);
+  }
+  Darts::DoubleArray base;
+  base.build(base_keys.size(), &base_keys[0], NULL, &base_values[0]);
+
+  std::cerr << "OverlayDoubleArray::insert(), erase() and update_value(): ";
+  Darts::OverlayDoubleArray dic;
+  dic.set_base(base);
+  for (std::size_t i = 0; i < keys.size(); ++i) {
+    assert(dic.insert(keys[i], values[i], lengths[i]) == (i % 2 == 1));
+  }
+
+  std::vector<const char *> new_keys;
+  std::vector<std::size_t> new_lengths;
+  std::vector<int> new_values;
+  std::set<std::string> erased_keys;
+  for (std::size_t i = 0; i < keys.size(); ++i) {
+    if (i % 4 == 0 || i % 4 == 3) {
+      assert(dic.erase(keys[i], lengths[i]));
+      assert(!dic.erase(keys[i], lengths[i]));
+      assert(!dic.update_value(keys[i], 0, lengths[i]));
+      erased_keys.insert(keys[i]);
+    } else {
+      assert(dic.update_value(keys[i], values[i] + 1, lengths[i]));
+      new_keys.push_back(keys[i]);
+      new_lengths.push_back(lengths[i]);
+      new_values.push_back(values[i] + 1);
+    }
+  }
+  test_dic(dic, new_keys, new_lengths, new_values, invalid_keys);
+
+  std::cerr << "OverlayDoubleArray with erased keys: ";
+  test_dic(dic, new_keys, new_lengths, new_values, erased_keys);
+
+  std::cerr << "OverlayDoubleArray::commonPrefixSearch(): ";
+  test_common_prefix_search(dic, new_keys, new_lengths, new_values,
+      invalid_keys);
+
+  std::cerr << "OverlayDoubleArray::traverse(): ";
+  for (std::size_t i = 0; i < new_keys.size(); ++i) {
+    Darts::OverlayDoubleArray::node_pos_type node_pos;
+    std::size_t key_pos = 0;
+    int result = 0;
+    for (std::size_t j = 0; j < new_lengths[i]; ++j) {
+      result = dic.traverse(new_keys[i], node_pos, key_pos, j + 1);
+      assert(result != -2);
+    }
+    assert(result == new_values[i]);
+  }
+  std::cerr << "ok" << std::endl;
+
+  std::cerr << "OverlayDoubleArray::merge(): ";
+  Darts::DoubleArray::StreamBuilder builder;
+  assert(builder.open(test_file_name(), true) == 0);
+  assert(dic.merge(&builder) == 0);
+  assert(builder.close() == 0);
+  assert(builder.num_keys() == new_keys.size());
+
+  Darts::DoubleArray merged_base;
+  assert(merged_base.open(test_file_name()) == 0);
+  test_dic(merged_base, new_keys, new_lengths, new_values, erased_keys);
+
+  std::cerr << "OverlayDoubleArray::set_base(): ";
+  dic.set_base(merged_base);
+  assert(dic.num_updates() == 0);
+  test_dic(dic, new_keys, new_lengths, new_values, erased_keys);
+
+  // Without a base, all the keys come from the overlays.
+  std::cerr << "OverlayDoubleArray without a base: ";
+  Darts::OverlayDoubleArray baseless_dic;
+  assert(baseless_dic.base() == NULL);
+  for (std::size_t i = 0; i < keys.size(); ++i) {
+    assert(baseless_dic.insert(keys[i], values[i], lengths[i]));
+    assert(!baseless_dic.insert(keys[i], values[i], lengths[i]));
+  }
+  for (std::size_t i = 0; i < keys.size(); ++i) {
+    if (i % 4 == 0 || i % 4 == 3) {
+      assert(baseless_dic.erase(keys[i], lengths[i]));
+      assert(!baseless_dic.erase(keys[i], lengths[i]));
+    } else {
+      assert(baseless_dic.update_value(keys[i], values[i] + 1, lengths[i]));
+    }
+  }
+  test_dic(baseless_dic, new_keys, new_lengths, new_values, erased_keys);
+
+  std::cerr << "OverlayDoubleArray::commonPrefixSearch() without a base: ";
+  test_common_prefix_search(baseless_dic, new_keys, new_lengths, new_values,
+      invalid_keys);
+
+  std::cerr << "OverlayDoubleArray::traverse() without a base: ";
+  for (std::size_t i = 0; i < new_keys.size(); ++i) {
+    Darts::OverlayDoubleArray::node_pos_type node_pos;
+    std::size_t key_pos = 0;
+    assert(baseless_dic.traverse(new_keys[i], node_pos, key_pos,
+        new_lengths[i]) == new_values[i]);
+  }
+  for (std::set<std::string>::const_iterator it = erased_keys.begin();
+      it != erased_keys.end(); ++it) {
+    Darts::OverlayDoubleArray::node_pos_type node_pos;
+    std::size_t key_pos = 0;
+    assert(baseless_dic.traverse(it->c_str(), node_pos, key_pos,
+        it->length()) < 0);
+  }
+  std::cerr << "ok" << std::endl;
+
+  std::cerr << "OverlayDoubleArray::merge() without a base: ";
+  Darts::DoubleArray::StreamBuilder baseless_builder;
+  assert(baseless_builder.open(test_file_name(), true) == 0);
+  assert(baseless_dic.merge(&baseless_builder) == 0);
+  assert(baseless_builder.close() == 0);
+  assert(baseless_builder.num_keys() == new_keys.size());
+
+  Darts::DoubleArray baseless_merged;
+  assert(baseless_merged.open(test_file_name()) == 0);
+  test_dic(baseless_merged, new_keys, new_lengths, new_values, erased_keys);
+}
+
+// test_tail_double_array() compares <TailDoubleArray> with <DoubleArray>
+// for the valid keys and for the keys extended with long suffixes.
+void test_tail_double_array(const std::set<std::string> &valid_keys,
+    const std::set<std::string> &invalid_keys) {
+  std::vector<const char *> keys;
+  std::vector<std::size_t> lengths;
+  get_keys(valid_keys, &keys, &lengths);
+  std::vector<int> values(keys.size());
+  for (std::size_t i = 0; i < keys.size(); ++i) {
+    values[i] = std::rand() % 10;
+  }
+
+  std::cerr << "TailDoubleArray: ";
+  Darts::TailDoubleArray dic;
+  dic.build(keys.size(), &keys[0], &lengths[0], &values[0]);
+  assert(dic.num_keys() == keys.size());
+  test_dic(dic, keys, lengths, values, invalid_keys);
+
+  std::cerr << "TailDoubleArray::commonPrefixSearch(): ";
+  test_common_prefix_search(dic, keys, lengths, values, invalid_keys);
+
+  std::cerr << "TailDoubleArray::traverse(): ";
+  test_traverse(dic, keys, lengths, values, invalid_keys);
+
+  std::cerr << "TailDoubleArray::save() and open(): ";
+  Darts::TailDoubleArray dic_copy;
+  assert(dic.save(test_file_name(), "wb", 1000) == 0);
+  assert(get_file_size(test_file_name()) == 1000 + dic.total_size() +
+      Darts::Details::DoubleArrayHeader::size() + 8);
+  assert(dic_copy.open(test_file_name(), "rb", 1000) == 0);
+  assert(dic_copy.size() == dic.size());
+  assert(dic_copy.tail_size() == dic.tail_size());
+  test_dic(dic_copy, keys, lengths, values, invalid_keys);
+
+  // Long random suffixes are kept in the tails, and then the shorter keys
+  // and the keys without their last characters are not found. The suffixes
+  // differ so that <DoubleArray> does not share them.
+  std::cerr << "TailDoubleArray with long keys: ";
+  std::vector<std::string> long_keys;
+  std::set<std::string> long_invalid_keys;
+  for (std::set<std::string>::const_iterator it = valid_keys.begin();
+      it != valid_keys.end(); ++it) {
+    long_keys.push_back(*it);
+    for (std::size_t i = 0; i < 32; ++i) {
+      long_keys.back() += static_cast<char>('a' + (std::rand() % 26));
+    }
+    long_invalid_keys.insert(*it);
+    long_invalid_keys.insert(long_keys.back().substr(0,
+        long_keys.back().length() - 1));
+  }
+  std::sort(long_keys.begin(), long_keys.end());
+  for (std::size_t i = 0; i < keys.size(); ++i) {
+    keys[i] = long_keys[i].c_str();
+    lengths[i] = long_keys[i].length();
+  }
+  dic.build(keys.size(), &keys[0], NULL, &values[0]);
+  test_dic(dic, keys, lengths, values, long_invalid_keys);
+  test_common_prefix_search(dic, keys, lengths, values, long_invalid_keys);
+  test_traverse(dic, keys, lengths, values, long_invalid_keys);
+
+  Darts::DoubleArray plain_dic;
+  plain_dic.build(keys.size(), &keys[0], NULL, &values[0]);
+  assert(dic.total_size() < plain_dic.total_size());
+
+  std::cerr << "TailDoubleArray with duplicate keys: ";
+  keys.insert(keys.begin() + 1, keys[0]);
+  values.insert(values.begin() + 1, values[0] + 1);
+  dic.build(keys.size(), &keys[0], NULL, &values[0]);
+  assert(dic.num_keys() == keys.size() - 1);
+  assert(dic.exactMatchSearch<int>(keys[0]) == values[0]);
+  std::cerr << "ok" << std::endl;
+
+  std::cerr << "TailDoubleArray with wrong key order: ";
+  std::swap(keys[0], keys[2]);
+  bool is_thrown = false;
+  try {
+    dic.build(keys.size(), &keys[0], NULL, &values[0]);
+  } catch (const Darts::Details::Exception &) {
+    is_thrown = true;
+  }
+  assert(is_thrown);
+  std::cerr << "ok" << std::endl;
+}
+
+// test_auto_pools() checks that AutoPool keeps its elements through realloc()
+// and that AutoChunkPool keeps them across chunks.
+void test_auto_pools() {
+  static const std::size_t NUM_VALUES = 3 << 20;
+
+  std::cerr << "AutoPool and AutoChunkPool: ";
+  Darts::Details::AutoPool<Darts::Details::id_type> pool;
+  Darts::Details::AutoPool<std::string> strings;
+  Darts::Details::AutoChunkPool<Darts::Details::id_type> chunk_pool;
+  for (std::size_t i = 0; i < NUM_VALUES; ++i) {
+    Darts::Details::id_type value = static_cast<Darts::Details::id_type>(
+        i * 2654435761U);
+    pool.append(value);
+    chunk_pool.append(value);
+    if (i < 1000) {
+      strings.append(std::string(i % 50, static_cast<char>('a' + i % 26)));
+    }
+  }
+  assert(pool.size() == NUM_VALUES);
+  assert(chunk_pool.size() == NUM_VALUES);
+  for (std::size_t i = 0; i < NUM_VALUES; ++i) {
+    Darts::Details::id_type value = static_cast<Darts::Details::id_type>(
+        i * 2654435761U);
+    assert(pool[i] == value);
+    assert(chunk_pool[i] == value);
+    if (i < 1000) {
+      assert(strings[i] == std::string(i % 50,
+          static_cast<char>('a' + i % 26)));
+    }
+  }
+
+  chunk_pool.clear();
+  assert(chunk_pool.empty());
+  chunk_pool.append(1);
+  assert(chunk_pool[0] == 1);
+  std::cerr << "ok" << std::endl;
+}
+
+// test_bit_vector() compares rank() and select() with counts of ones in bit
+// vectors of various sizes and densities, which cover several upper blocks.
+void test_bit_vector() {
+  static const std::size_t SIZES[] = { 1, 63, 64, 257, 70000, 300000 };
+  static const int DENSITIES[] = { 1, 50, 99 };
+
+  std::cerr << "BitVector::rank() and select(): ";
+  for (std::size_t i = 0; i < sizeof(SIZES) / sizeof(SIZES[0]); ++i) {
+    for (std::size_t j = 0; j < sizeof(DENSITIES) / sizeof(DENSITIES[0]);
+        ++j) {
+      Darts::Details::BitVector bits;
+      std::vector<std::size_t> ones;
+      for (std::size_t k = 0; k < SIZES[i]; ++k) {
+        bits.append();
+        if ((std::rand() % 100) < DENSITIES[j]) {
+          bits.set(k, true);
+          ones.push_back(k);
+        }
+      }
+      bits.build();
+      assert(bits.size() == SIZES[i]);
+      assert(bits.num_ones() == ones.size());
+
+      std::size_t rank = 0;
+      for (std::size_t k = 0; k < SIZES[i]; ++k) {
+        rank += bits[k] ? 1 : 0;
+        assert(bits.rank(k) == rank);
+      }
+      for (std::size_t k = 0; k < ones.size(); ++k) {
+        assert(bits.select(static_cast<Darts::Details::id_type>(k + 1)) ==
+            ones[k]);
+      }
+    }
+  }
+  std::cerr << "ok" << std::endl;
+}
+
+// test_path_double_array() compares <PathDoubleArrayImpl> with the
+// dictionary it is built from, for the valid keys and for keys of 3-byte
+// characters, in which the last 2 bytes of each character make a run.
+template <typename A, typename B, typename V, typename C>
+void test_path_double_array(const std::set<std::string> &valid_keys,
+    const std::set<std::string> &invalid_keys) {
+  typedef Darts::DoubleArrayImpl<A, B, V, C> dic_type;
+
+  std::vector<const char *> keys;
+  std::vector<std::size_t> lengths;
+  get_keys(valid_keys, &keys, &lengths);
+  std::vector<V> values(keys.size());
+  for (std::size_t i = 0; i < keys.size(); ++i) {
+    values[i] = static_cast<V>(std::rand() % 10);
+  }
+
+  std::cerr << "PathDoubleArray: ";
+  dic_type dic;
+  dic.build(keys.size(), &keys[0], &lengths[0], &values[0]);
+  Darts::PathDoubleArrayImpl<A, B, V, C> path_dic;
+  assert(path_dic.build(dic) == 0);
+  assert(path_dic.num_keys() == keys.size());
+  test_dic(path_dic, keys, lengths, values, invalid_keys);
+
+  std::cerr << "PathDoubleArray::commonPrefixSearch(): ";
+  test_common_prefix_search(path_dic, keys, lengths, values, invalid_keys);
+
+  std::cerr << "PathDoubleArray::traverse(): ";
+  test_traverse(path_dic, keys, lengths, values, invalid_keys);
+
+  // A character is given by (0xC0 + i, 0x80 + i, 0x81 + i), so only the
+  // first byte of each character branches. The keys without their last
+  // bytes end in the middle of runs.
+  std::cerr << "PathDoubleArray with 3-byte characters: ";
+  std::set<std::string> multibyte_key_set;
+  std::set<std::string> multibyte_invalid_keys;
+  for (std::set<std::string>::const_iterator it = valid_keys.begin();
+      it != valid_keys.end(); ++it) {
+    std::string key;
+    for (std::size_t i = 0; i < it->length(); ++i) {
+      char c = (*it)[i] - 'A';
+      key += static_cast<char>(0xC0 + c);
+      key += static_cast<char>(0x80 + c);
+      key += static_cast<char>(0x81 + c);
+    }
+    multibyte_key_set.insert(key);
+    multibyte_invalid_keys.insert(key.substr(0, key.length() - 1));
+    multibyte_invalid_keys.insert(key.substr(0, key.length() - 2));
+  }
+  for (std::set<std::string>::const_iterator it =
+      multibyte_key_set.begin(); it != multibyte_key_set.end(); ++it) {
+    multibyte_invalid_keys.erase(*it);
+  }
+  keys.clear();
+  lengths.clear();
+  for (std::set<std::string>::const_iterator it =
+      multibyte_key_set.begin(); it != multibyte_key_set.end(); ++it) {
+    keys.push_back(it->c_str());
+    lengths.push_back(it->length());
+  }
+  dic.build(keys.size(), &keys[0], &lengths[0], &values[0]);
+  assert(path_dic.build(dic) == 0);
+  assert(path_dic.size() < dic.size());
+  test_dic(path_dic, keys, lengths, values, multibyte_invalid_keys);
+  test_common_prefix_search(path_dic, keys, lengths, values,
+      multibyte_invalid_keys);
+  test_traverse(path_dic, keys, lengths, values, multibyte_invalid_keys);
+}
+
+// test_louds_trie() compares <LoudsTrieImpl> with the dictionary it is
+// built from, which is a trie built without values and then a DAWG built with
+// random values.
+template <typename A, typename B, typename V, typename C>
+void test_louds_trie(const std::set<std::string> &valid_keys,
+    const std::set<std::string> &invalid_keys) {
+  typedef Darts::DoubleArrayImpl<A, B, V, C> dic_type;
+
+  std::vector<const char *> keys;
+  std::vector<std::size_t> lengths;
+  get_keys(valid_keys, &keys, &lengths);
+  std::vector<V> values(keys.size());
+  for (std::size_t i = 0; i < keys.size(); ++i) {
+    values[i] = static_cast<V>(i);
+  }
+
+  std::cerr << "LoudsTrie: ";
+  dic_type dic;
+  dic.build(keys.size(), &keys[0], &lengths[0]);
+  Darts::LoudsTrieImpl<A, B, V, C> trie;
+  assert(trie.build(dic) == 0);
+  assert(trie.num_keys() == keys.size());
+  assert(trie.total_size() < dic.total_size());
+  test_dic(trie, keys, lengths, values, invalid_keys);
+
+  std::cerr << "LoudsTrie::commonPrefixSearch(): ";
+  test_common_prefix_search(trie, keys, lengths, values, invalid_keys);
+
+  std::cerr << "LoudsTrie::traverse(): ";
+  test_traverse(trie, keys, lengths, values, invalid_keys);
+
+  std::cerr << "LoudsTrie::save() and open(): ";
+  Darts::LoudsTrieImpl<A, B, V, C> trie_copy;
+  assert(trie.save(test_file_name(), "wb", 1000) == 0);
+  assert(trie_copy.open(test_file_name(), "rb", 1000) == 0);
+  assert(trie_copy.num_edges() == trie.num_edges());
+  assert(trie_copy.total_size() == trie.total_size());
+  test_dic(trie_copy, keys, lengths, values, invalid_keys);
+
+  std::cerr << "LoudsTrie with random values: ";
+  for (std::size_t i = 0; i < values.size(); ++i) {
+    values[i] = static_cast<V>(std::rand() % 10);
+  }
+  dic.build(keys.size(), &keys[0], &lengths[0], &values[0]);
+  assert(trie.build(dic) == 0);
+  assert(trie.num_edges() == trie_copy.num_edges());
+  test_dic(trie, keys, lengths, values, invalid_keys);
+}
+
+#if __cplusplus >= 201103L
+// test_shared_double_array() publishes versions of a dictionary while
+// readers search it. All the values of a version are its version number, so
+// a reader finds the same value for all the keys of a pinned version.
+void test_shared_double_array(const std::set<std::string> &valid_keys) {
+  static const std::size_t NUM_READERS = 4;
+  static const int NUM_VERSIONS = 20;
+
+  std::vector<const char *> keys;
+  get_keys(valid_keys, &keys);
+
+  std::cerr << "SharedDoubleArray: ";
+  Darts::SharedDoubleArray shared(NUM_READERS);
+  std::atomic<bool> is_stopped(false);
+  std::vector<std::thread> readers;
+  for (std::size_t i = 0; i < NUM_READERS; ++i) {
+    readers.push_back(std::thread([&shared, &keys, &is_stopped]() {
+      Darts::SharedDoubleArray::Reader reader(shared);
+      int last_version = 0;
+      while (!is_stopped.load()) {
+        const Darts::DoubleArray *dic = reader.pin();
+        if (dic == NULL) {
+          continue;
+        }
+        int version = dic->exactMatchSearch<int>(keys[0]);
+        assert(version >= last_version);
+        for (std::size_t j = 0; j < keys.size(); j += 101) {
+          assert(dic->exactMatchSearch<int>(keys[j]) == version);
+        }
+        last_version = version;
+        reader.unpin();
+      }
+    }));
+  }
+
+  for (int version = 1; version <= NUM_VERSIONS; ++version) {
+    std::vector<int> values(keys.size(), version);
+    Darts::DoubleArray *dic = new Darts::DoubleArray;
+    dic->build(keys.size(), &keys[0], NULL, &values[0]);
+    shared.publish(dic);
+  }
+  is_stopped.store(true);
+  for (std::size_t i = 0; i < readers.size(); ++i) {
+    readers[i].join();
+  }
+  assert(shared.reclaim() == 0);
+  assert(shared.current()->exactMatchSearch<int>(keys[0]) == NUM_VERSIONS);
+
+  std::vector<Darts::SharedDoubleArray::Reader *> extra_readers;
+  bool is_thrown = false;
+  try {
+    for (std::size_t i = 0; i <= NUM_READERS; ++i) {
+      extra_readers.push_back(new Darts::SharedDoubleArray::Reader(shared));
+    }
+  } catch (const Darts::Details::Exception &) {
+    is_thrown = true;
+  }
+  assert(is_thrown);
+  assert(extra_readers.size() == NUM_READERS);
+  for (std::size_t i = 0; i < extra_readers.size(); ++i) {
+    delete extra_readers[i];
+  }
+  std::cerr << "ok" << std::endl;
+}
+#endif  // __cplusplus >= 201103L
+
 int main() {
   try {
     std::srand(static_cast<unsigned int>(std::time(NULL)));
@@ -244,12 +1749,49 @@ int main() {
     generate_invalid_keys(NUM_INVALID_KEYS, valid_keys, &invalid_keys);
 
     test_darts<Darts::DoubleArray>(valid_keys, invalid_keys);
+    test_stream_builder<Darts::DoubleArray>(valid_keys, invalid_keys);
     test_darts<Darts::DoubleArrayImpl<char, unsigned char, long,
         unsigned long> >(valid_keys, invalid_keys);
+    test_darts<Darts::WideDoubleArray>(valid_keys, invalid_keys);
+    test_wide_values(valid_keys, invalid_keys);
+    test_darts<Darts::LargeDoubleArray>(valid_keys, invalid_keys);
+    test_large_units(valid_keys);
+    test_stream_builder<Darts::LargeDoubleArray>(valid_keys, invalid_keys);
+    test_mutable_double_array<void, void, int, void>(valid_keys,
+        invalid_keys);
+    test_mutable_double_array<void, Darts::LargeUnits, int, void>(valid_keys,
+        invalid_keys);
+    test_overlay_double_array(valid_keys, invalid_keys);
+    test_tail_double_array(valid_keys, invalid_keys);
+    test_path_double_array<void, void, int, void>(valid_keys, invalid_keys);
+    test_path_double_array<void, Darts::LargeUnits, int, void>(valid_keys,
+        invalid_keys);
+    test_auto_pools();
+    test_bit_vector();
+    test_louds_trie<void, void, int, void>(valid_keys, invalid_keys);
+    test_louds_trie<void, void, long long, Darts::WideValues>(valid_keys,
+        invalid_keys);
+#if __cplusplus >= 201103L
+    test_shared_double_array(valid_keys);
+#endif  // __cplusplus >= 201103L
+
+    std::cerr << "build() with more than 2^21 units: ";
+    test_extended_offsets<Darts::DoubleArray,
+        Darts::Details::DoubleArrayUnit>();
+    std::cerr << "build() with more than 2^21 units (large units): ";
+    test_extended_offsets<Darts::LargeDoubleArray,
+        Darts::Details::LargeDoubleArrayUnit>();
+
+    std::cerr << "build() with many keys and threads: ";
+    test_build_in_parallel<Darts::DoubleArray>();
+    std::cerr << "build() with many keys and threads (large units): ";
+    test_build_in_parallel<Darts::LargeDoubleArray>();
   } catch (const std::exception &ex) {
     std::cerr << "exception: " << ex.what() << std::endl;
+    std::remove(test_file_name());
     throw ex;
   }
 
+  std::remove(test_file_name());
   return 0;
 }
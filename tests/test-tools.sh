@@ -19,6 +19,22 @@ then
 fi
 
 echo "Done! $mkdarts_path"
+
+"$mkdarts_path" -e test-lexicon test-dic
+if [ $? -ne 0 ]
+then
+  echo "Error: $mkdarts_path -e failed"
+  exit 1
+fi
+
+cmp test-dic correct-dic
+if [ $? -ne 0 ]
+then
+  echo "Error: incorrect dictionary (-e)"
+  exit 1
+fi
+
+echo "Done! $mkdarts_path -e"
   
 "$darts_path" test-dic < test-text > test-result
 if [ $? -ne 0 ]
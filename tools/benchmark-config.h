@@ -10,8 +10,13 @@ namespace Darts {
 class BenchmarkConfig {
  public:
   BenchmarkConfig() : command_(NULL), has_values_(false),
+      has_value_table_(false), has_large_units_(false),
       benchmarks_exact_match_search_(false),
-      benchmarks_common_prefix_search_(false), benchmarks_traverse_(false),
+      benchmarks_exact_match_search_batch_(false),
+      benchmarks_common_prefix_search_(false),
+      benchmarks_longest_prefix_search_(false), benchmarks_traverse_(false),
+      benchmarks_build_(false), benchmarks_bit_vector_(false),
+      max_num_threads_(0),
       lexicon_file_name_(NULL), dic_file_name_(NULL) {}
 
   void parse(int argc, char **argv);
@@ -19,16 +24,45 @@ class BenchmarkConfig {
   bool has_values() const {
     return has_values_;
   }
+  // has_value_table() returns true if <WideDoubleArray> is benchmarked
+  // instead of <DoubleArray>.
+  bool has_value_table() const {
+    return has_value_table_;
+  }
+  // has_large_units() returns true if <LargeDoubleArrayUnit> is used instead
+  // of <DoubleArrayUnit>.
+  bool has_large_units() const {
+    return has_large_units_;
+  }
 
   bool benchmarks_exact_match_search() const {
     return benchmarks_exact_match_search_;
   }
+  bool benchmarks_exact_match_search_batch() const {
+    return benchmarks_exact_match_search_batch_;
+  }
   bool benchmarks_common_prefix_search() const {
     return benchmarks_common_prefix_search_;
   }
+  bool benchmarks_longest_prefix_search() const {
+    return benchmarks_longest_prefix_search_;
+  }
   bool benchmarks_traverse() const {
     return benchmarks_traverse_;
   }
+  bool benchmarks_build() const {
+    return benchmarks_build_;
+  }
+  // benchmarks_bit_vector() returns true if rank() and select() of the bit
+  // vector are benchmarked instead of dictionaries.
+  bool benchmarks_bit_vector() const {
+    return benchmarks_bit_vector_;
+  }
+
+  // max_num_threads() returns 0 if the multi-threaded benchmark is disabled.
+  std::size_t max_num_threads() const {
+    return max_num_threads_;
+  }
 
   const char *lexicon_file_name() const {
     return lexicon_file_name_;
@@ -42,17 +76,32 @@ class BenchmarkConfig {
         << " [Options...] [Lexicon] [Dictionary]\n\n"
         "  -h  display this help\n"
         "  -t  use tab separated values\n"
+        "  -w  use 64-bit values in a value table (WideDoubleArray)\n"
+        "  -L  use units for more than 2^29 units (LargeDoubleArray)\n"
         "  -E  benchmark exactMatchSearch()\n"
+        "  -B  benchmark exactMatchSearchBatch()\n"
         "  -C  benchmark commonPrefixSearch()\n"
-        "  -T  benchmark traverse()\n" << std::endl;
+        "  -P  benchmark longestPrefixSearch()\n"
+        "  -T  benchmark traverse()\n"
+        "  -M  benchmark build()\n"
+        "  -R  benchmark rank() and select() of the bit vector\n"
+        "  -j  benchmark searches on 1, 2, 4, ..., N threads (-j N)\n"
+        << std::endl;
   }
 
  private:
   const char *command_;
   bool has_values_;
+  bool has_value_table_;
+  bool has_large_units_;
   bool benchmarks_exact_match_search_;
+  bool benchmarks_exact_match_search_batch_;
   bool benchmarks_common_prefix_search_;
+  bool benchmarks_longest_prefix_search_;
   bool benchmarks_traverse_;
+  bool benchmarks_build_;
+  bool benchmarks_bit_vector_;
+  std::size_t max_num_threads_;
   const char *lexicon_file_name_;
   const char *dic_file_name_;
 
@@ -79,12 +128,34 @@ inline void BenchmarkConfig::parse(int argc, char **argv) {
       std::exit(0);
     } else if (std::strcmp(argv[i], "-t") == 0) {
       has_values_ = true;
+    } else if (std::strcmp(argv[i], "-w") == 0) {
+      has_value_table_ = true;
+    } else if (std::strcmp(argv[i], "-L") == 0) {
+      has_large_units_ = true;
     } else if (std::strcmp(argv[i], "-E") == 0) {
       benchmarks_exact_match_search_ = true;
+    } else if (std::strcmp(argv[i], "-B") == 0) {
+      benchmarks_exact_match_search_batch_ = true;
     } else if (std::strcmp(argv[i], "-C") == 0) {
       benchmarks_common_prefix_search_ = true;
+    } else if (std::strcmp(argv[i], "-P") == 0) {
+      benchmarks_longest_prefix_search_ = true;
     } else if (std::strcmp(argv[i], "-T") == 0) {
       benchmarks_traverse_ = true;
+    } else if (std::strcmp(argv[i], "-M") == 0) {
+      benchmarks_build_ = true;
+    } else if (std::strcmp(argv[i], "-R") == 0) {
+      benchmarks_bit_vector_ = true;
+    } else if (std::strcmp(argv[i], "-j") == 0) {
+      char *end = NULL;
+      long num_threads = (i + 1 < argc) ?
+          std::strtol(argv[++i], &end, 10) : 0;
+      if (end == NULL || *end != '\0' || num_threads <= 0) {
+        std::cerr << "error: invalid number of threads" << std::endl;
+        show_usage();
+        std::exit(1);
+      }
+      max_num_threads_ = static_cast<std::size_t>(num_threads);
     } else {
       std::cerr << "error: invalid option: " << argv[i] << std::endl;
       show_usage();
@@ -99,10 +170,17 @@ inline void BenchmarkConfig::parse(int argc, char **argv) {
     dic_file_name_ = "-";
   }
 
+  // build() is benchmarked only if -M is given because it takes a long time
+  // for a large lexicon.
   if (!benchmarks_exact_match_search_ &&
-      !benchmarks_common_prefix_search_ && !benchmarks_traverse_) {
+      !benchmarks_exact_match_search_batch_ &&
+      !benchmarks_common_prefix_search_ &&
+      !benchmarks_longest_prefix_search_ && !benchmarks_traverse_ &&
+      !benchmarks_build_) {
     benchmarks_exact_match_search_ = true;
+    benchmarks_exact_match_search_batch_ = true;
     benchmarks_common_prefix_search_ = true;
+    benchmarks_longest_prefix_search_ = true;
     benchmarks_traverse_ = true;
   }
 }
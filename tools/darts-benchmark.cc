@@ -3,11 +3,19 @@
 #include <cstdio>
 #include <fstream>
 #include <iostream>
+#include <vector>
 
 #include "./benchmark-config.h"
+#include "./histogram.h"
 #include "./lexicon.h"
+#include "./mersenne-twister.h"
 #include "./timer.h"
 
+#if __cplusplus >= 201103L || (defined(_MSC_VER) && _MSC_VER >= 1900)
+#include <thread>
+#define DARTS_BENCHMARK_HAS_THREADS
+#endif  // __cplusplus >= 201103L || (defined(_MSC_VER) && _MSC_VER >= 1900)
+
 namespace {
 
 int progress_bar(std::size_t current, std::size_t total) {
@@ -35,14 +43,15 @@ int progress_bar(std::size_t current, std::size_t total) {
   return 1;
 };
 
-void benchmark_exact_match_search(const Darts::DoubleArray &dic,
+template <typename T>
+void benchmark_exact_match_search(const T &dic,
     const Darts::Lexicon &lexicon) {
   Darts::Timer timer;
 
   std::size_t num_tries = 0;
   do {
     for (std::size_t i = 0; i < lexicon.size(); ++i) {
-      Darts::DoubleArray::value_type value;
+      typename T::value_type value;
       dic.exactMatchSearch(lexicon[i], value);
       if (value == -1) {
         std::cerr << "error: failed to find key: "
@@ -58,14 +67,40 @@ void benchmark_exact_match_search(const Darts::DoubleArray &dic,
   std::fflush(stdout);
 }
 
-void benchmark_common_prefix_search(const Darts::DoubleArray &dic,
+template <typename T>
+void benchmark_exact_match_search_batch(const T &dic,
+    const Darts::Lexicon &lexicon) {
+  std::vector<typename T::value_type> values(lexicon.size());
+
+  Darts::Timer timer;
+
+  std::size_t num_tries = 0;
+  do {
+    dic.exactMatchSearchBatch(lexicon.size(), lexicon.keys(), &values[0]);
+    for (std::size_t i = 0; i < lexicon.size(); ++i) {
+      if (values[i] == -1) {
+        std::cerr << "error: failed to find key: "
+            << lexicon[i] << std::endl;
+        std::exit(1);
+      }
+    }
+    ++num_tries;
+  } while (timer.elapsed() < 1.0);
+
+  std::printf(" %6.1fns", 1e+9 * timer.elapsed()
+      / (lexicon.size() * num_tries));
+  std::fflush(stdout);
+}
+
+template <typename T>
+void benchmark_common_prefix_search(const T &dic,
     const Darts::Lexicon &lexicon) {
   Darts::Timer timer;
 
   std::size_t num_tries = 0;
 
   static const std::size_t MAX_NUM_RESULTS = 256;
-  Darts::DoubleArray::value_type results[MAX_NUM_RESULTS];
+  typename T::value_type results[MAX_NUM_RESULTS];
   do {
     for (std::size_t i = 0; i < lexicon.size(); ++i) {
       std::size_t num_matches = dic.commonPrefixSearch(
@@ -84,7 +119,32 @@ void benchmark_common_prefix_search(const Darts::DoubleArray &dic,
   std::fflush(stdout);
 }
 
-void benchmark_traverse(const Darts::DoubleArray &dic,
+template <typename T>
+void benchmark_longest_prefix_search(const T &dic,
+    const Darts::Lexicon &lexicon) {
+  Darts::Timer timer;
+
+  std::size_t num_tries = 0;
+  do {
+    for (std::size_t i = 0; i < lexicon.size(); ++i) {
+      typename T::value_type value;
+      dic.longestPrefixSearch(lexicon[i], value);
+      if (value == -1) {
+        std::cerr << "error: failed to find prefix keys of: "
+            << lexicon[i] << std::endl;
+        std::exit(1);
+      }
+    }
+    ++num_tries;
+  } while (timer.elapsed() < 1.0);
+
+  std::printf(" %8.1fns", 1e+9 * timer.elapsed()
+      / (lexicon.size() * num_tries));
+  std::fflush(stdout);
+}
+
+template <typename T>
+void benchmark_traverse(const T &dic,
     const Darts::Lexicon &lexicon) {
   Darts::Timer timer;
 
@@ -95,7 +155,7 @@ void benchmark_traverse(const Darts::DoubleArray &dic,
 
       std::size_t id = 0;
       std::size_t key_pos = 0;
-      Darts::DoubleArray::value_type result = 0;
+      typename T::value_type result = 0;
       for (std::size_t j = 0; key[j] != '\0'; ++j) {
         result = dic.traverse(key, id, key_pos, j + 1);
         if (result == -2) {
@@ -117,45 +177,325 @@ void benchmark_traverse(const Darts::DoubleArray &dic,
   std::fflush(stdout);
 }
 
+// build_dic() builds a dictionary from `lexicon'. If the values of the
+// dictionary are not <int>s, the values of `lexicon' are converted.
+int build_dic(const Darts::Lexicon &lexicon, Darts::DoubleArray *dic,
+    int (*progress_func)(std::size_t, std::size_t) = NULL) {
+  return dic->build(lexicon.size(), lexicon.keys(), NULL, lexicon.values(),
+      progress_func);
+}
+
+template <typename T>
+int build_dic(const Darts::Lexicon &lexicon, T *dic,
+    int (*progress_func)(std::size_t, std::size_t) = NULL) {
+  if (lexicon.values() == NULL) {
+    return dic->build(lexicon.size(), lexicon.keys(), NULL, NULL,
+        progress_func);
+  }
+  std::vector<typename T::value_type> values(lexicon.values(),
+      lexicon.values() + lexicon.size());
+  return dic->build(lexicon.size(), lexicon.keys(), NULL, &values[0],
+      progress_func);
+}
+
+template <typename T>
+void benchmark_build(const Darts::Lexicon &lexicon) {
+  Darts::Timer timer;
+
+  std::size_t num_tries = 0;
+  do {
+    T dic;
+    if (build_dic(lexicon, &dic) != 0) {
+      std::cerr << "error: failed to build dictionary" << std::endl;
+      std::exit(1);
+    }
+    ++num_tries;
+  } while (timer.elapsed() < 1.0);
+
+  std::printf(" %7.3fs %6.0fns", timer.elapsed() / num_tries,
+      1e+9 * timer.elapsed() / (lexicon.size() * num_tries));
+  std::fflush(stdout);
+}
+
+enum SearchType {
+  EXACT_MATCH_SEARCH,
+  COMMON_PREFIX_SEARCH,
+  TRAVERSE,
+  NUM_SEARCH_TYPES
+};
+
+const char *search_name(SearchType type) {
+  switch (type) {
+    case EXACT_MATCH_SEARCH: {
+      return "exactMatchSearch";
+    }
+    case COMMON_PREFIX_SEARCH: {
+      return "commonPrefixSearch";
+    }
+    default: {
+      return "traverse";
+    }
+  }
+}
+
+bool is_enabled(const Darts::BenchmarkConfig &config, SearchType type) {
+  switch (type) {
+    case EXACT_MATCH_SEARCH: {
+      return config.benchmarks_exact_match_search();
+    }
+    case COMMON_PREFIX_SEARCH: {
+      return config.benchmarks_common_prefix_search();
+    }
+    default: {
+      return config.benchmarks_traverse();
+    }
+  }
+}
+
+// search() searches a key in the same way as the single-threaded benchmark
+// of `type' and returns false if the key is not found.
+template <typename T>
+bool search(const T &dic, SearchType type,
+    const char *key) {
+  switch (type) {
+    case EXACT_MATCH_SEARCH: {
+      typename T::value_type value;
+      dic.exactMatchSearch(key, value);
+      return value != -1;
+    }
+    case COMMON_PREFIX_SEARCH: {
+      static const std::size_t MAX_NUM_RESULTS = 256;
+      typename T::value_type results[MAX_NUM_RESULTS];
+      return dic.commonPrefixSearch(key, results, MAX_NUM_RESULTS) >= 1;
+    }
+    default: {
+      std::size_t id = 0;
+      std::size_t key_pos = 0;
+      typename T::value_type result = 0;
+      for (std::size_t j = 0; key[j] != '\0'; ++j) {
+        result = dic.traverse(key, id, key_pos, j + 1);
+        if (result == -2) {
+          return false;
+        }
+      }
+      return result >= 0;
+    }
+  }
+}
+
+#ifdef DARTS_BENCHMARK_HAS_THREADS
+
+class SearchThread {
+ public:
+  SearchThread() : num_queries_(0), elapsed_(0.0), histogram_() {}
+
+  // run() searches keys from the `first'-th key of `lexicon' for about a
+  // second. Every LATENCY_INTERVAL-th search is timed, so the latencies
+  // include the overhead of reading the clock.
+  template <typename T>
+  void run(const T *dic, const Darts::Lexicon *lexicon,
+      SearchType type, std::size_t first) {
+    Darts::Histogram histogram;
+    std::size_t num_queries = 0;
+    std::size_t key_id = first;
+
+    Darts::Timer timer;
+    do {
+      for (std::size_t i = 0; i < CHECK_INTERVAL; ++i) {
+        const char *key = (*lexicon)[key_id];
+        bool is_found;
+        if (num_queries % LATENCY_INTERVAL == 0) {
+          Darts::Timer::nanoseconds_type begin = Darts::Timer::now();
+          is_found = search(*dic, type, key);
+          histogram.add(Darts::Timer::now() - begin);
+        } else {
+          is_found = search(*dic, type, key);
+        }
+        if (!is_found) {
+          std::cerr << "error: failed to find key: " << key << std::endl;
+          std::exit(1);
+        }
+        if (++key_id == lexicon->size()) {
+          key_id = 0;
+        }
+        ++num_queries;
+      }
+    } while (timer.elapsed() < 1.0);
+
+    elapsed_ = timer.elapsed();
+    num_queries_ = num_queries;
+    histogram_ = histogram;
+  }
+
+  double qps() const {
+    return num_queries_ / elapsed_;
+  }
+  const Darts::Histogram &histogram() const {
+    return histogram_;
+  }
+
+ private:
+  enum { CHECK_INTERVAL = 256 };
+  enum { LATENCY_INTERVAL = 16 };
+
+  std::size_t num_queries_;
+  double elapsed_;
+  Darts::Histogram histogram_;
+
+  // Disallows copy and assignment.
+  SearchThread(const SearchThread &);
+  SearchThread &operator=(const SearchThread &);
+};
+
+void print_thread_separator() {
+  std::printf("+---------+--------------------+------------+---------+"
+      "----------+----------+----------+\n");
+}
+
+// benchmark_threads() runs each enabled search on 1, 2, 4, ... threads and
+// the maximum number of threads, which share `dic'. The threads start from
+// different keys of `lexicon' to avoid searching the same keys at once.
+template <typename T>
+void benchmark_threads(const Darts::BenchmarkConfig &config,
+    const T &dic, const Darts::Lexicon &lexicon) {
+  print_thread_separator();
+  std::printf(" %9s %-20s %12s %9s %10s %10s %10s\n", "threads", "search",
+      "qps", "scaling", "p50", "p99", "p99.9");
+  print_thread_separator();
+
+  double base_qps[NUM_SEARCH_TYPES] = { 0.0 };
+  for (std::size_t num_threads = 1; ; num_threads *= 2) {
+    if (num_threads > config.max_num_threads()) {
+      num_threads = config.max_num_threads();
+    }
+
+    for (int i = 0; i < NUM_SEARCH_TYPES; ++i) {
+      SearchType type = static_cast<SearchType>(i);
+      if (!is_enabled(config, type)) {
+        continue;
+      }
+
+      std::vector<SearchThread> searches(num_threads);
+      std::vector<std::thread> threads(num_threads);
+      for (std::size_t j = 0; j < num_threads; ++j) {
+        threads[j] = std::thread(&SearchThread::run<T>, &searches[j], &dic,
+            &lexicon, type, lexicon.size() * j / num_threads);
+      }
+      double qps = 0.0;
+      Darts::Histogram histogram;
+      for (std::size_t j = 0; j < num_threads; ++j) {
+        threads[j].join();
+        qps += searches[j].qps();
+        histogram.merge(searches[j].histogram());
+      }
+      if (num_threads == 1) {
+        base_qps[i] = qps;
+      }
+
+      std::printf(" %9u %-20s %12.0f %8.2fx %8lluns %8lluns %8lluns\n",
+          static_cast<unsigned int>(num_threads), search_name(type), qps,
+          qps / base_qps[i], histogram.percentile(0.5),
+          histogram.percentile(0.99), histogram.percentile(0.999));
+      std::fflush(stdout);
+    }
+
+    if (num_threads == config.max_num_threads()) {
+      break;
+    }
+  }
+  print_thread_separator();
+}
+
+#else  // DARTS_BENCHMARK_HAS_THREADS
+
+template <typename T>
+void benchmark_threads(const Darts::BenchmarkConfig &,
+    const T &, const Darts::Lexicon &) {
+  std::cerr << "error: multi-threaded benchmark is not supported"
+      << std::endl;
+  std::exit(1);
+}
+
+#endif  // DARTS_BENCHMARK_HAS_THREADS
+
+void print_separator(const Darts::BenchmarkConfig &config) {
+  std::printf("+--------+--------+");
+  if (config.benchmarks_exact_match_search()) {
+    std::printf("-----------------+");
+  }
+  if (config.benchmarks_exact_match_search_batch()) {
+    std::printf("-----------------+");
+  }
+  if (config.benchmarks_common_prefix_search()) {
+    std::printf("-------------------+");
+  }
+  if (config.benchmarks_longest_prefix_search()) {
+    std::printf("---------------------+");
+  }
+  if (config.benchmarks_traverse()) {
+    std::printf("-----------------+");
+  }
+  if (config.benchmarks_build()) {
+    std::printf("-----------------+");
+  }
+  std::printf("\n");
+}
+
+template <typename T>
 void benchmark_lexicon(const Darts::BenchmarkConfig &config,
-    const Darts::Lexicon &lexicon, Darts::DoubleArray *dic) {
+    const Darts::Lexicon &lexicon, T *dic) {
   Darts::Timer timer;
 
-  if (dic->build(lexicon.size(), lexicon.keys(), NULL,
-      lexicon.values(), progress_bar) != 0) {
+  if (build_dic(lexicon, dic, progress_bar) != 0) {
     std::cerr << "error: failed to build dictionary" << std::endl;
     std::exit(1);
   }
 
-  std::printf("+--------+--------+-----------------+-------------------+"
-      "-----------------+\n");
+  print_separator(config);
 
   std::printf(" %8s %8s", "size", "build");
   if (config.benchmarks_exact_match_search()) {
     std::printf(" %17s", "exactMatchSearch");
   }
+  if (config.benchmarks_exact_match_search_batch()) {
+    std::printf(" %17s", "exactMatchBatch");
+  }
   if (config.benchmarks_common_prefix_search()) {
     std::printf(" %19s", "commonPrefixSearch");
   }
+  if (config.benchmarks_longest_prefix_search()) {
+    std::printf(" %21s", "longestPrefixSearch");
+  }
   if (config.benchmarks_traverse()) {
     std::printf(" %17s", "traverse");
   }
+  if (config.benchmarks_build()) {
+    std::printf(" %17s", "build()");
+  }
   std::printf("\n");
 
   std::printf(" %8s %8s", "", "");
   if (config.benchmarks_exact_match_search()) {
     std::printf(" %8s %8s", "sorted", "random");
   }
+  if (config.benchmarks_exact_match_search_batch()) {
+    std::printf(" %8s %8s", "sorted", "random");
+  }
   if (config.benchmarks_common_prefix_search()) {
     std::printf(" %9s %9s", "sorted", "random");
   }
+  if (config.benchmarks_longest_prefix_search()) {
+    std::printf(" %10s %10s", "sorted", "random");
+  }
   if (config.benchmarks_traverse()) {
     std::printf(" %8s %8s", "sorted", "random");
   }
+  if (config.benchmarks_build()) {
+    std::printf(" %8s %8s", "total", "per key");
+  }
   std::printf("\n");
 
-  std::printf("+--------+--------+-----------------+-------------------+"
-      "-----------------+\n");
+  print_separator(config);
 
   Darts::Lexicon randomized_lexicon(lexicon);
   randomized_lexicon.randomize();
@@ -164,18 +504,94 @@ void benchmark_lexicon(const Darts::BenchmarkConfig &config,
   std::printf(" %6.0fns", 1e+9 * timer.elapsed() / lexicon.size());
   std::fflush(stdout);
 
-  benchmark_exact_match_search(*dic, lexicon);
-  benchmark_exact_match_search(*dic, randomized_lexicon);
+  if (config.benchmarks_exact_match_search()) {
+    benchmark_exact_match_search(*dic, lexicon);
+    benchmark_exact_match_search(*dic, randomized_lexicon);
+  }
+
+  if (config.benchmarks_exact_match_search_batch()) {
+    benchmark_exact_match_search_batch(*dic, lexicon);
+    benchmark_exact_match_search_batch(*dic, randomized_lexicon);
+  }
 
-  benchmark_common_prefix_search(*dic, lexicon);
-  benchmark_common_prefix_search(*dic, randomized_lexicon);
+  if (config.benchmarks_common_prefix_search()) {
+    benchmark_common_prefix_search(*dic, lexicon);
+    benchmark_common_prefix_search(*dic, randomized_lexicon);
+  }
 
-  benchmark_traverse(*dic, lexicon);
-  benchmark_traverse(*dic, randomized_lexicon);
+  if (config.benchmarks_longest_prefix_search()) {
+    benchmark_longest_prefix_search(*dic, lexicon);
+    benchmark_longest_prefix_search(*dic, randomized_lexicon);
+  }
+
+  if (config.benchmarks_traverse()) {
+    benchmark_traverse(*dic, lexicon);
+    benchmark_traverse(*dic, randomized_lexicon);
+  }
+
+  if (config.benchmarks_build()) {
+    benchmark_build<T>(lexicon);
+  }
 
   std::printf("\n");
-  std::printf("+--------+--------+-----------------+-------------------+"
-      "-----------------+\n");
+  print_separator(config);
+
+  if (config.max_num_threads() != 0) {
+    benchmark_threads(config, *dic, randomized_lexicon);
+  }
+}
+
+// benchmark_bit_vector() measures rank() and select() of bit vectors from
+// 2^16 to 2^28 bits, half of which are ones, with random positions, so that
+// large vectors show the cost of cache misses.
+void benchmark_bit_vector() {
+  static const std::size_t NUM_QUERIES = 1 << 20;
+
+  std::printf("+----------+----------+----------+----------+\n");
+  std::printf(" %9s %9s %9s %9s\n", "bits", "index", "rank", "select");
+  std::printf("+----------+----------+----------+----------+\n");
+
+  Darts::MersenneTwister mt;
+  for (std::size_t size = 1 << 16; size <= (1 << 28); size <<= 4) {
+    Darts::Details::BitVector bits;
+    for (std::size_t i = 0; i < size; ++i) {
+      bits.append();
+      bits.set(i, (mt.gen() & 1) != 0);
+    }
+    bits.build();
+
+    std::vector<std::size_t> ids(NUM_QUERIES);
+    std::vector<Darts::Details::id_type> counts(NUM_QUERIES);
+    for (std::size_t i = 0; i < NUM_QUERIES; ++i) {
+      ids[i] = mt(static_cast<Darts::MersenneTwister::int_type>(size));
+      counts[i] = 1 + mt(static_cast<Darts::MersenneTwister::int_type>(
+          bits.num_ones()));
+    }
+
+    // The results are summed up so that the queries are not removed.
+    std::size_t sum = 0;
+    Darts::Timer rank_timer;
+    for (std::size_t i = 0; i < NUM_QUERIES; ++i) {
+      sum += bits.rank(ids[i]);
+    }
+    double rank_time = rank_timer.elapsed();
+
+    Darts::Timer select_timer;
+    for (std::size_t i = 0; i < NUM_QUERIES; ++i) {
+      sum += bits.select(counts[i]);
+    }
+    double select_time = select_timer.elapsed();
+
+    std::printf(" %9u %8.2f%% %7.1fns %7.1fns\n",
+        static_cast<unsigned int>(size),
+        100.0 * (8 * bits.total_size() - size) / size,
+        1e+9 * rank_time / NUM_QUERIES, 1e+9 * select_time / NUM_QUERIES);
+    if (sum == 0) {
+      std::printf("\n");
+    }
+    std::fflush(stdout);
+  }
+  std::printf("+----------+----------+----------+----------+\n");
 }
 
 }  // namespace
@@ -185,6 +601,11 @@ int main(int argc, char *argv[]) {
     Darts::BenchmarkConfig config;
     config.parse(argc, argv);
 
+    if (config.benchmarks_bit_vector()) {
+      benchmark_bit_vector();
+      return 0;
+    }
+
     Darts::Lexicon lexicon;
     if (std::strcmp(config.lexicon_file_name(), "-") != 0) {
       std::ifstream file(config.lexicon_file_name());
@@ -205,8 +626,20 @@ int main(int argc, char *argv[]) {
       lexicon.split();
     }
 
-    Darts::DoubleArray dic;
-    benchmark_lexicon(config, lexicon, &dic);
+    if (config.has_value_table() && config.has_large_units()) {
+      Darts::DoubleArrayImpl<void, Darts::LargeUnits, long long,
+          Darts::WideValues> dic;
+      benchmark_lexicon(config, lexicon, &dic);
+    } else if (config.has_value_table()) {
+      Darts::WideDoubleArray dic;
+      benchmark_lexicon(config, lexicon, &dic);
+    } else if (config.has_large_units()) {
+      Darts::LargeDoubleArray dic;
+      benchmark_lexicon(config, lexicon, &dic);
+    } else {
+      Darts::DoubleArray dic;
+      benchmark_lexicon(config, lexicon, &dic);
+    }
   } catch (const std::exception &ex) {
     std::cerr << "exception: " << ex.what() << std::endl;
     throw ex;
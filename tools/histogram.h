@@ -0,0 +1,98 @@
+#ifndef DARTS_HISTOGRAM_H_
+#define DARTS_HISTOGRAM_H_
+
+#include <cstddef>
+
+namespace Darts {
+
+// <Histogram> counts latencies in nanoseconds. Latencies less than 32ns have
+// their own buckets and the other latencies are put into 16 buckets per power
+// of two, so a percentile is given with an error of less than 1/16.
+class Histogram {
+ public:
+  typedef unsigned long long value_type;
+
+  Histogram() : counts_(), num_values_(0) {}
+
+  void add(value_type value) {
+    ++counts_[bucket(value)];
+    ++num_values_;
+  }
+
+  void merge(const Histogram &histogram) {
+    for (std::size_t i = 0; i < NUM_BUCKETS; ++i) {
+      counts_[i] += histogram.counts_[i];
+    }
+    num_values_ += histogram.num_values_;
+  }
+
+  std::size_t num_values() const {
+    return num_values_;
+  }
+
+  // percentile() returns the upper bound of the bucket which contains the
+  // value at `ratio' (0.0 - 1.0) of the sorted values.
+  value_type percentile(double ratio) const {
+    std::size_t rank = static_cast<std::size_t>(ratio * num_values_);
+    if (rank >= num_values_ && num_values_ != 0) {
+      rank = num_values_ - 1;
+    }
+    std::size_t count = 0;
+    for (std::size_t i = 0; i < NUM_BUCKETS; ++i) {
+      count += counts_[i];
+      if (count > rank) {
+        return upper_bound(i);
+      }
+    }
+    return upper_bound(NUM_BUCKETS - 1);
+  }
+
+  void clear() {
+    for (std::size_t i = 0; i < NUM_BUCKETS; ++i) {
+      counts_[i] = 0;
+    }
+    num_values_ = 0;
+  }
+
+ private:
+  enum { NUM_SUB_BUCKETS = 16 };
+  enum { NUM_LINEAR_BUCKETS = 32 };
+  // Latencies of 2^40ns (about 18 minutes) or more share the last bucket.
+  enum { MAX_BITS = 40 };
+  enum { NUM_BUCKETS = NUM_LINEAR_BUCKETS + (MAX_BITS - 5) * NUM_SUB_BUCKETS };
+
+  std::size_t counts_[NUM_BUCKETS];
+  std::size_t num_values_;
+
+  static std::size_t bucket(value_type value) {
+    if (value < NUM_LINEAR_BUCKETS) {
+      return static_cast<std::size_t>(value);
+    }
+    std::size_t num_bits = 6;
+    while (num_bits < MAX_BITS && (value >> num_bits) != 0) {
+      ++num_bits;
+    }
+    if ((value >> num_bits) != 0) {
+      return NUM_BUCKETS - 1;
+    }
+    std::size_t sub_bucket = static_cast<std::size_t>(
+        (value >> (num_bits - 5)) & (NUM_SUB_BUCKETS - 1));
+    return NUM_LINEAR_BUCKETS + (num_bits - 6) * NUM_SUB_BUCKETS + sub_bucket;
+  }
+
+  static value_type upper_bound(std::size_t bucket) {
+    if (bucket < NUM_LINEAR_BUCKETS) {
+      return bucket;
+    }
+    bucket -= NUM_LINEAR_BUCKETS;
+    std::size_t num_bits = 6 + (bucket / NUM_SUB_BUCKETS);
+    value_type sub_bucket = bucket % NUM_SUB_BUCKETS;
+    return ((NUM_SUB_BUCKETS + sub_bucket + 1) << (num_bits - 5)) - 1;
+  }
+
+  // Copyable.
+};
+
+}  // namespace Darts
+
+#endif  // DARTS_HISTOGRAM_H_
@@ -64,6 +64,9 @@ class Lexicon {
   }
 
   void split();
+  // split_key() splits a key at its last tab, which is replaced with '\0',
+  // and returns the value after the tab, or 0 if there is no tab.
+  static int split_key(char *key);
 
   void clear();
 
@@ -125,42 +128,47 @@ inline void Lexicon::split() {
 
   values_.resize(keys_.size(), 0);
   for (std::size_t i = 0; i < keys_.size(); ++i) {
-    char *tab = NULL;
-    char *ptr = keys_[i];
-    while (*ptr != '\0') {
-      if (*ptr == '\t') {
-        tab = ptr;
-      }
-      ++ptr;
-    }
-    if (tab == NULL) {
-      continue;
-    }
+    std::size_t length = std::strlen(keys_[i]);
+    values_[i] = split_key(keys_[i]);
+    total_ -= length - std::strlen(keys_[i]);
+  }
+}
 
-    total_ -= ptr - tab;
-    *tab++ = '\0';
-    if (*tab == '\0') {
-      std::cerr << "error: failed to split keys: no value" << std::endl;
-      std::exit(1);
+inline int Lexicon::split_key(char *key) {
+  char *tab = NULL;
+  char *ptr = key;
+  while (*ptr != '\0') {
+    if (*ptr == '\t') {
+      tab = ptr;
     }
+    ++ptr;
+  }
+  if (tab == NULL) {
+    return 0;
+  }
 
-    char *value_end;
-    long value = std::strtol(tab, &value_end, 10);
-    if (*value_end != '\0') {
-      std::cerr << "error: failed to split keys: invalid characters: \""
-          << tab << "\" (" << value << ')' << std::endl;
-      std::exit(1);
-    } else if (value < 0) {
-      std::cerr << "error: failed to split keys: negative value: \""
-          << tab << "\" (" << value << ')' << std::endl;
-      std::exit(1);
-    } else if (value > std::numeric_limits<int>::max()) {
-      std::cerr << "error: failed to split keys: too large value: \""
-          << tab << "\" (" << value << ')' << std::endl;
-      std::exit(1);
-    }
-    values_[i] = static_cast<int>(value);
+  *tab++ = '\0';
+  if (*tab == '\0') {
+    std::cerr << "error: failed to split keys: no value" << std::endl;
+    std::exit(1);
+  }
+
+  char *value_end;
+  long value = std::strtol(tab, &value_end, 10);
+  if (*value_end != '\0') {
+    std::cerr << "error: failed to split keys: invalid characters: \""
+        << tab << "\" (" << value << ')' << std::endl;
+    std::exit(1);
+  } else if (value < 0) {
+    std::cerr << "error: failed to split keys: negative value: \""
+        << tab << "\" (" << value << ')' << std::endl;
+    std::exit(1);
+  } else if (value > std::numeric_limits<int>::max()) {
+    std::cerr << "error: failed to split keys: too large value: \""
+        << tab << "\" (" << value << ')' << std::endl;
+    std::exit(1);
   }
+  return static_cast<int>(value);
 }
 
 inline void Lexicon::clear() {
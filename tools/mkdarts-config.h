@@ -10,6 +10,8 @@ namespace Darts {
 class MkdartsConfig {
  public:
   MkdartsConfig() : command_(NULL), is_sorted_(true), has_values_(false),
+      has_header_(false), builds_out_of_core_(false), num_threads_(1),
+      query_file_name_(NULL),
       lexicon_file_name_(NULL), dic_file_name_(NULL) {}
 
   void parse(int argc, char **argv);
@@ -20,6 +22,22 @@ class MkdartsConfig {
   bool has_values() const {
     return has_values_;
   }
+  bool has_header() const {
+    return has_header_;
+  }
+  // builds_out_of_core() returns true if the dictionary is built by
+  // <DoubleArray::StreamBuilder>, which reads keys one by one and writes
+  // units into the dictionary file as they are fixed.
+  bool builds_out_of_core() const {
+    return builds_out_of_core_;
+  }
+  std::size_t num_threads() const {
+    return num_threads_;
+  }
+  // query_file_name() returns NULL if the layout is not optimized.
+  const char *query_file_name() const {
+    return query_file_name_;
+  }
   const char *lexicon_file_name() const {
     return lexicon_file_name_;
   }
@@ -31,6 +49,10 @@ class MkdartsConfig {
     std::cerr << "\nUsage: " << command_
         << " [Options...] [Lexicon] [Dictionary]\n\n"
         "  -h  display this help\n"
+        "  -H  write a header with a checksum\n"
+        "  -e  build out of core with bounded memory (sorted lexicon only)\n"
+        "  -j  number of threads (default: 1)\n"
+        "  -q  optimize layout for queries in a file (-q FILE)\n"
         "  -s  sort lexicon before insertion\n"
         "  -t  use tab separated values\n" << std::endl;
   }
@@ -39,6 +61,10 @@ class MkdartsConfig {
   const char *command_;
   bool is_sorted_;
   bool has_values_;
+  bool has_header_;
+  bool builds_out_of_core_;
+  std::size_t num_threads_;
+  const char *query_file_name_;
   const char *lexicon_file_name_;
   const char *dic_file_name_;
 
@@ -63,6 +89,27 @@ inline void MkdartsConfig::parse(int argc, char **argv) {
     } else if (std::strcmp(argv[i], "-h") == 0) {
       show_usage();
       std::exit(0);
+    } else if (std::strcmp(argv[i], "-H") == 0) {
+      has_header_ = true;
+    } else if (std::strcmp(argv[i], "-e") == 0) {
+      builds_out_of_core_ = true;
+    } else if (std::strcmp(argv[i], "-j") == 0) {
+      char *end = NULL;
+      long num_threads = (i + 1 < argc) ?
+          std::strtol(argv[++i], &end, 10) : 0;
+      if (end == NULL || *end != '\0' || num_threads <= 0) {
+        std::cerr << "error: invalid number of threads" << std::endl;
+        show_usage();
+        std::exit(1);
+      }
+      num_threads_ = static_cast<std::size_t>(num_threads);
+    } else if (std::strcmp(argv[i], "-q") == 0) {
+      if (i + 1 >= argc) {
+        std::cerr << "error: missing query file" << std::endl;
+        show_usage();
+        std::exit(1);
+      }
+      query_file_name_ = argv[++i];
     } else if (std::strcmp(argv[i], "-s") == 0) {
       is_sorted_ = false;
     } else if (std::strcmp(argv[i], "-t") == 0) {
@@ -80,6 +127,23 @@ inline void MkdartsConfig::parse(int argc, char **argv) {
   if (dic_file_name_ == NULL) {
     dic_file_name_ = "-";
   }
+  if (has_header_ && std::strcmp(dic_file_name_, "-") == 0) {
+    std::cerr << "error: -H requires a dictionary file" << std::endl;
+    show_usage();
+    std::exit(1);
+  }
+  if (builds_out_of_core_) {
+    if (std::strcmp(dic_file_name_, "-") == 0) {
+      std::cerr << "error: -e requires a dictionary file" << std::endl;
+      show_usage();
+      std::exit(1);
+    } else if (!is_sorted_ || num_threads_ != 1 ||
+        query_file_name_ != NULL) {
+      std::cerr << "error: -e cannot be used with -j, -q or -s" << std::endl;
+      show_usage();
+      std::exit(1);
+    }
+  }
 }
 
 }  // namespace Darts.
@@ -4,6 +4,8 @@
 #include <cstring>
 #include <fstream>
 #include <iostream>
+#include <string>
+#include <vector>
 
 #include "./lexicon.h"
 #include "./mkdarts-config.h"
@@ -35,6 +37,65 @@ int progress_bar(std::size_t current, std::size_t total) {
   return 1;
 }
 
+// build_out_of_core() reads keys line by line and gives them to
+// <DoubleArray::StreamBuilder>, so neither the lexicon nor the dictionary is
+// kept in memory.
+void build_out_of_core(const Darts::MkdartsConfig &config) {
+  std::ifstream file;
+  std::istream *in = &std::cin;
+  if (std::strcmp(config.lexicon_file_name(), "-") != 0) {
+    file.open(config.lexicon_file_name());
+    if (!file) {
+      std::cerr << "error: failed to open lexicon file: "
+          << config.lexicon_file_name() << std::endl;
+      std::exit(1);
+    }
+    in = &file;
+  }
+
+  Darts::DoubleArray::StreamBuilder builder;
+  if (builder.open(config.dic_file_name(), config.has_header()) != 0) {
+    std::cerr << "error: failed to open dictionary file: "
+        << config.dic_file_name() << std::endl;
+    std::exit(1);
+  }
+
+  std::string line;
+  std::vector<char> key;
+  std::size_t total = 0;
+  while (std::getline(*in, line)) {
+    if (!line.empty() && line[line.size() - 1] == '\r') {
+      line.erase(line.size() - 1);
+    }
+    if (line.empty()) {
+      continue;
+    }
+    key.assign(line.begin(), line.end());
+    key.push_back('\0');
+    if (config.has_values()) {
+      int value = Darts::Lexicon::split_key(&key[0]);
+      std::size_t length = std::strlen(&key[0]);
+      builder.insert(&key[0], length, value);
+      total += length;
+    } else {
+      builder.insert(&key[0], line.length());
+      total += line.length();
+    }
+  }
+
+  std::cerr << "keys: " << builder.num_keys() << std::endl;
+  std::cerr << "total: " << total << std::endl;
+
+  if (builder.close() != 0) {
+    std::cerr << "error: failed to write dictionary file: "
+        << config.dic_file_name() << std::endl;
+    std::exit(1);
+  }
+
+  std::cerr << "size: " << builder.size() << std::endl;
+  std::cerr << "total_size: " << builder.total_size() << std::endl;
+}
+
 }  // namespace
 
 int main(int argc, char **argv) {
@@ -42,6 +103,11 @@ int main(int argc, char **argv) {
     Darts::MkdartsConfig config;
     config.parse(argc, argv);
 
+    if (config.builds_out_of_core()) {
+      build_out_of_core(config);
+      return 0;
+    }
+
     Darts::Lexicon lexicon;
     if (std::strcmp(config.lexicon_file_name(), "-") != 0) {
       std::ifstream file(config.lexicon_file_name());
@@ -70,11 +136,29 @@ int main(int argc, char **argv) {
 
     Darts::DoubleArray dic;
     if (dic.build(lexicon.size(), lexicon.keys(), NULL,
-        lexicon.values(), progress_bar) != 0) {
+        lexicon.values(), progress_bar, config.num_threads()) != 0) {
       std::cerr << "error: failed to build dictionary" << std::endl;
       std::exit(1);
     }
 
+    // Each line of the query file is a query, so frequent queries should
+    // appear as many times as they occur.
+    if (config.query_file_name() != NULL) {
+      std::ifstream file(config.query_file_name());
+      if (!file) {
+        std::cerr << "error: failed to open query file: "
+            << config.query_file_name() << std::endl;
+        std::exit(1);
+      }
+      Darts::Lexicon queries;
+      queries.read(&file);
+      std::cerr << "queries: " << queries.size() << std::endl;
+      if (dic.relayout(queries.size(), queries.keys()) != 0) {
+        std::cerr << "error: failed to optimize layout" << std::endl;
+        std::exit(1);
+      }
+    }
+
     if (std::strcmp(config.dic_file_name(), "-") != 0) {
       std::ofstream file(config.dic_file_name(), std::ios::binary);
       if (!file) {
@@ -83,7 +167,12 @@ int main(int argc, char **argv) {
         std::exit(1);
       }
       file.close();
-      dic.save(config.dic_file_name());
+      if (dic.save(config.dic_file_name(), "wb", 0,
+          config.has_header()) != 0) {
+        std::cerr << "error: failed to write dictionary file: "
+            << config.dic_file_name() << std::endl;
+        std::exit(1);
+      }
     } else {
       std::cout.write(static_cast<const char *>(dic.array()),
           dic.total_size());
@@ -1,24 +1,45 @@
 #ifndef DARTS_TIMER_H_
 #define DARTS_TIMER_H_
 
+#if __cplusplus >= 201103L || (defined(_MSC_VER) && _MSC_VER >= 1900)
+#include <chrono>
+#define DARTS_TIMER_HAS_STEADY_CLOCK
+#else  // __cplusplus >= 201103L || (defined(_MSC_VER) && _MSC_VER >= 1900)
 #include <ctime>
+#endif  // __cplusplus >= 201103L || (defined(_MSC_VER) && _MSC_VER >= 1900)
 
 namespace Darts {
 
+// <Timer> measures wall-clock time with a monotonic clock. If the clock is
+// not available, it falls back to std::clock(), which measures CPU time.
 class Timer {
  public:
-  Timer() : cl_(std::clock()) {}
+  typedef unsigned long long nanoseconds_type;
+
+  Timer() : start_(now()) {}
 
   double elapsed() const {
-    return 1.0 * (std::clock() - cl_) / CLOCKS_PER_SEC;
+    return 1e-9 * (now() - start_);
   }
 
   void reset() {
-    cl_ = std::clock();
+    start_ = now();
+  }
+
+  // now() returns the current time in nanoseconds from an arbitrary point.
+  static nanoseconds_type now() {
+#ifdef DARTS_TIMER_HAS_STEADY_CLOCK
+    return static_cast<nanoseconds_type>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+#else  // DARTS_TIMER_HAS_STEADY_CLOCK
+    return static_cast<nanoseconds_type>(
+        1e+9 * std::clock() / CLOCKS_PER_SEC);
+#endif  // DARTS_TIMER_HAS_STEADY_CLOCK
   }
 
  private:
-  std::clock_t cl_;
+  nanoseconds_type start_;
 
   // Disallows copy and assignment.
   Timer(const Timer &);
@@ -27,4 +48,6 @@ class Timer {
 
 }  // namespace Darts
 
+#undef DARTS_TIMER_HAS_STEADY_CLOCK
+
 #endif  // DARTS_TIMER_H_